@@ -23,6 +23,9 @@
 
 #include <string>
 #include <ceres/ceres.h>
+#include <robot_calibration/cost_functions/dynamic_cost_function.hpp>
+#include <robot_calibration/cost_functions/evaluation_scratch.hpp>
+#include <robot_calibration/cost_functions/parameter_blocks.hpp>
 #include <robot_calibration/optimization/offsets.hpp>
 #include <robot_calibration/util/calibration_data.hpp>
 #include <robot_calibration/models/camera2d.hpp>
@@ -50,13 +53,22 @@ struct Chain3dToCamera2d
                     Camera2dModel* model_2d,
                     double scale,
                     OptimizationOffsets* offsets,
-                    robot_calibration_msgs::msg::CalibrationData& data)
+                    CalibrationDataConstPtr data)
   {
     model_3d_ = model_3d;
     model_2d_ = model_2d;
     scale_ = scale;
     offsets_ = offsets;
     data_ = data;
+
+    // Resolve joint and offset names once, rather than on each evaluation
+    model_3d_->compile(*data_, *offsets_, plan_3d_);
+    model_2d_->compile(*data_, *offsets_, plan_2d_);
+    parameter_blocks_.add(*offsets_, plan_3d_);
+    parameter_blocks_.add(*offsets_, plan_2d_);
+
+    // Chains from the same root usually start with the same segments
+    shareChainFK(*model_3d_, plan_3d_, *model_2d_, plan_2d_, shared_fk_);
   }
 
   virtual ~Chain3dToCamera2d() {}
@@ -66,30 +78,35 @@ struct Chain3dToCamera2d
    *  \param free_params The offsets to be applied to joints/transforms.
    *  \param residuals The residuals computed, to be returned to the optimizer.
    */
-  bool operator()(double const * const * free_params,
-                  double* residuals) const
+  template <typename T>
+  bool operator()(T const * const * free_params,
+                  T* residuals) const
   {
-    // Update calibration offsets based on free params
-    offsets_->update(free_params[0]);
+    // Get calibration offsets based on free params
+    OffsetsViewT<T> offsets(*offsets_, free_params, parameter_blocks_.index());
+    shared_fk_.reset();
 
     // Project the observations into common base frame
-    std::vector<geometry_msgs::msg::PointStamped> world_pts =
-        model_3d_->project(data_, *offsets_);
-    // Now project those 3d points into 2d pixels in the camera model
-    std::vector<geometry_msgs::msg::PointStamped> camera_error =
-        model_2d_->project_pixel_error(data_, world_pts, *offsets_);
+    Matrix3X<T>& world_pts = scratch_.points<T>(0);
+    if (!model_3d_->project(*data_, plan_3d_, offsets, world_pts))
+    {
+      std::cerr << "Unable to project observations." << std::endl;
+      return false;
+    }
 
-    if (world_pts.size() != camera_error.size())
+    // Now project those 3d points into 2d pixels in the camera model
+    Matrix2X<T>& camera_error = scratch_.pixels<T>(0);
+    if (!model_2d_->project_pixel_error(*data_, plan_2d_, world_pts, offsets, camera_error))
     {
       std::cerr << "Observations do not match in size." << std::endl;
       return false;
     }
 
     // Compute residuals
-    for (size_t i = 0; i < camera_error.size(); ++i)
+    for (int i = 0; i < camera_error.cols(); ++i)
     {
-      residuals[(2*i)+0] = camera_error[i].point.x * scale_;
-      residuals[(2*i)+1] = camera_error[i].point.y * scale_;
+      residuals[(2*i)+0] = camera_error(0, i) * scale_;
+      residuals[(2*i)+1] = camera_error(1, i) * scale_;
     }
 
     return true;  // always return true
@@ -98,14 +115,19 @@ struct Chain3dToCamera2d
   /**
    *  \brief Helper factory function to create a new error block. Parameters
    *         are described in the class constructor, which this function calls.
+   *  \param blocks Returns the blocks of the offsets which correspond to
+   *         each parameter block of the cost function.
+   *  \param numeric_diff Use numeric rather than automatic differentiation.
    */
   static ceres::CostFunction* Create(Chain3dModel* model_3d,
                                      Camera2dModel* model_2d,
                                      double scale,
                                      OptimizationOffsets* offsets,
-                                     robot_calibration_msgs::msg::CalibrationData& data)
+                                     CalibrationDataConstPtr data,
+                                     std::vector<int>& blocks,
+                                     bool numeric_diff = false)
   {
-    int index = getSensorIndex(data, model_3d->getName());
+    int index = getSensorIndex(*data, model_3d->getName());
     if (index == -1)
     {
       // In theory, we should never get here, because the optimizer does a check
@@ -113,11 +135,12 @@ struct Chain3dToCamera2d
       return 0;
     }
 
-    ceres::DynamicNumericDiffCostFunction<Chain3dToCamera2d> * func;
-    func = new ceres::DynamicNumericDiffCostFunction<Chain3dToCamera2d>(
-                    new Chain3dToCamera2d(model_3d, model_2d, scale, offsets, data));
-    func->AddParameterBlock(offsets->size());
-    func->SetNumResiduals(data.observations[index].features.size() * 2);
+    size_t num_features = data->observations[index].features.size();
+    Chain3dToCamera2d* error = new Chain3dToCamera2d(model_3d, model_2d, scale, offsets, data);
+    ceres::DynamicCostFunction* func = createDynamicCostFunction<2>(error, num_features, numeric_diff);
+    error->parameter_blocks_.setup(*offsets, func);
+    blocks = error->parameter_blocks_.blocks();
+    func->SetNumResiduals(num_features * 2);
 
     return static_cast<ceres::CostFunction*>(func);
   }
@@ -126,7 +149,12 @@ struct Chain3dToCamera2d
   Camera2dModel * model_2d_;
   double scale_;
   OptimizationOffsets * offsets_;
-  robot_calibration_msgs::msg::CalibrationData data_;
+  CalibrationDataConstPtr data_;
+  ChainPlan plan_3d_;
+  ChainPlan plan_2d_;
+  ParameterBlocks parameter_blocks_;
+  mutable EvaluationScratch scratch_;
+  mutable SharedChainFK shared_fk_;
 };
 
 }  // namespace robot_calibration
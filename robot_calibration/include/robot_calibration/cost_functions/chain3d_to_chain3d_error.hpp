@@ -23,6 +23,9 @@
 
 #include <string>
 #include <ceres/ceres.h>
+#include <robot_calibration/cost_functions/dynamic_cost_function.hpp>
+#include <robot_calibration/cost_functions/evaluation_scratch.hpp>
+#include <robot_calibration/cost_functions/parameter_blocks.hpp>
 #include <robot_calibration/optimization/offsets.hpp>
 #include <robot_calibration/util/calibration_data.hpp>
 #include <robot_calibration/models/camera3d.hpp>
@@ -49,12 +52,21 @@ struct Chain3dToChain3d
   Chain3dToChain3d(Chain3dModel* a_model,
                    Chain3dModel* b_model,
                    OptimizationOffsets* offsets,
-                   robot_calibration_msgs::msg::CalibrationData& data)
+                   CalibrationDataConstPtr data)
   {
     a_model_ = a_model;
     b_model_ = b_model;
     offsets_ = offsets;
     data_ = data;
+
+    // Resolve joint and offset names once, rather than on each evaluation
+    a_model_->compile(*data_, *offsets_, a_plan_);
+    b_model_->compile(*data_, *offsets_, b_plan_);
+    parameter_blocks_.add(*offsets_, a_plan_);
+    parameter_blocks_.add(*offsets_, b_plan_);
+
+    // Chains from the same root usually start with the same segments
+    shareChainFK(*a_model_, a_plan_, *b_model_, b_plan_, shared_fk_);
   }
 
   virtual ~Chain3dToChain3d() {}
@@ -64,47 +76,114 @@ struct Chain3dToChain3d
    *  \param free_params The offsets to be applied to joints/transforms.
    *  \param residuals The residuals computed, to be returned to the optimizer.
    */
-  bool operator()(double const * const * free_params,
-                  double* residuals) const
+  template <typename T>
+  bool operator()(T const * const * free_params,
+                  T* residuals) const
   {
-    // Update calibration offsets based on free params
-    offsets_->update(free_params[0]);
+    // Get calibration offsets based on free params
+    OffsetsViewT<T> offsets(*offsets_, free_params, parameter_blocks_.index());
+    shared_fk_.reset();
 
     // Project the observations into common base frame
-    std::vector<geometry_msgs::msg::PointStamped> a_pts =
-        a_model_->project(data_, *offsets_);
-    std::vector<geometry_msgs::msg::PointStamped> b_pts =
-        b_model_->project(data_, *offsets_);
+    Matrix3X<T>& a_pts = scratch_.points<T>(0);
+    Matrix3X<T>& b_pts = scratch_.points<T>(1);
+    if (!a_model_->project(*data_, a_plan_, offsets, a_pts) ||
+        !b_model_->project(*data_, b_plan_, offsets, b_pts))
+    {
+      std::cerr << "Unable to project observations." << std::endl;
+      return false;
+    }
 
-    if (a_pts.size() != b_pts.size())
+    if (a_pts.cols() != b_pts.cols())
     {
       std::cerr << "Observations do not match in size." << std::endl;
       return false;
     }
 
     // Compute residuals
-    for (size_t i = 0; i < a_pts.size(); ++i)
+    for (int i = 0; i < a_pts.cols(); ++i)
     {
-      if (a_pts[i].header.frame_id != b_pts[i].header.frame_id)
-        std::cerr << "Projected observation frame_ids do not match." << std::endl;
-      residuals[(3*i)+0] = a_pts[i].point.x - b_pts[i].point.x;
-      residuals[(3*i)+1] = a_pts[i].point.y - b_pts[i].point.y;
-      residuals[(3*i)+2] = a_pts[i].point.z - b_pts[i].point.z;
+      residuals[(3*i)+0] = a_pts(0, i) - b_pts(0, i);
+      residuals[(3*i)+1] = a_pts(1, i) - b_pts(1, i);
+      residuals[(3*i)+2] = a_pts(2, i) - b_pts(2, i);
     }
 
     return true;  // always return true
   }
 
+  /**
+   *  \brief Evaluate residuals and jacobians using the closed form
+   *         derivatives of the models, called by the analytic cost function.
+   */
+  bool evaluate(double const * const * free_params,
+                double* residuals,
+                double** jacobians) const
+  {
+    if (!jacobians)
+      return (*this)(free_params, residuals);
+
+    OffsetsView offsets(*offsets_, free_params, parameter_blocks_.index());
+
+    // Project the observations into common base frame
+    Matrix3X<double>& a_pts = scratch_.points<double>(0);
+    Matrix3X<double>& b_pts = scratch_.points<double>(1);
+    if (!a_model_->projectWithJacobian(*data_, a_plan_, offsets, a_pts, a_jacobian_) ||
+        !b_model_->projectWithJacobian(*data_, b_plan_, offsets, b_pts, b_jacobian_))
+    {
+      std::cerr << "Unable to project observations." << std::endl;
+      return false;
+    }
+
+    if (a_pts.cols() != b_pts.cols())
+    {
+      std::cerr << "Observations do not match in size." << std::endl;
+      return false;
+    }
+
+    // Compute residuals
+    int num_residuals = 3 * a_pts.cols();
+    for (int i = 0; i < a_pts.cols(); ++i)
+    {
+      residuals[(3*i)+0] = a_pts(0, i) - b_pts(0, i);
+      residuals[(3*i)+1] = a_pts(1, i) - b_pts(1, i);
+      residuals[(3*i)+2] = a_pts(2, i) - b_pts(2, i);
+    }
+
+    // Residuals are a - b, so the jacobian is Ja - Jb
+    parameter_blocks_.zeroJacobians(*offsets_, num_residuals, jacobians);
+    for (size_t c = 0; c < a_jacobian_.params.size(); ++c)
+    {
+      parameter_blocks_.addJacobian(*offsets_, a_jacobian_.params[c], num_residuals,
+                                    a_jacobian_.jacobian.col(c).data(), jacobians);
+    }
+    for (size_t c = 0; c < b_jacobian_.params.size(); ++c)
+    {
+      derivatives_ = -b_jacobian_.jacobian.col(c);
+      parameter_blocks_.addJacobian(*offsets_, b_jacobian_.params[c], num_residuals,
+                                    derivatives_.data(), jacobians);
+    }
+
+    return true;
+  }
+
   /**
    *  \brief Helper factory function to create a new error block. Parameters
    *         are described in the class constructor, which this function calls.
+   *  \param blocks Returns the blocks of the offsets which correspond to
+   *         each parameter block of the cost function.
+   *  \param numeric_diff Use numeric rather than automatic differentiation.
+   *  \param analytic_diff Use the closed form derivatives of the models,
+   *         if both models support them for the free parameters.
    */
   static ceres::CostFunction* Create(Chain3dModel* a_model,
                                      Chain3dModel* b_model,
                                      OptimizationOffsets* offsets,
-                                     robot_calibration_msgs::msg::CalibrationData& data)
+                                     CalibrationDataConstPtr data,
+                                     std::vector<int>& blocks,
+                                     bool numeric_diff = false,
+                                     bool analytic_diff = false)
   {
-    int index = getSensorIndex(data, a_model->getName());
+    int index = getSensorIndex(*data, a_model->getName());
     if (index == -1)
     {
       // In theory, we should never get here, because the optimizer does a check
@@ -112,11 +191,18 @@ struct Chain3dToChain3d
       return 0;
     }
 
-    ceres::DynamicNumericDiffCostFunction<Chain3dToChain3d> * func;
-    func = new ceres::DynamicNumericDiffCostFunction<Chain3dToChain3d>(
-                    new Chain3dToChain3d(a_model, b_model, offsets, data));
-    func->AddParameterBlock(offsets->size());
-    func->SetNumResiduals(data.observations[index].features.size() * 3);
+    size_t num_features = data->observations[index].features.size();
+    Chain3dToChain3d* error = new Chain3dToChain3d(a_model, b_model, offsets, data);
+    ceres::DynamicCostFunction* func;
+    if (analytic_diff &&
+        a_model->hasAnalyticJacobian(error->a_plan_, *offsets) &&
+        b_model->hasAnalyticJacobian(error->b_plan_, *offsets))
+      func = new DynamicAnalyticCostFunction<Chain3dToChain3d>(error);
+    else
+      func = createDynamicCostFunction<3>(error, num_features, numeric_diff);
+    error->parameter_blocks_.setup(*offsets, func);
+    blocks = error->parameter_blocks_.blocks();
+    func->SetNumResiduals(num_features * 3);
 
     return static_cast<ceres::CostFunction*>(func);
   }
@@ -124,7 +210,15 @@ struct Chain3dToChain3d
   Chain3dModel * a_model_;
   Chain3dModel * b_model_;
   OptimizationOffsets * offsets_;
-  robot_calibration_msgs::msg::CalibrationData data_;
+  CalibrationDataConstPtr data_;
+  ChainPlan a_plan_;
+  ChainPlan b_plan_;
+  ParameterBlocks parameter_blocks_;
+  mutable EvaluationScratch scratch_;
+  mutable SharedChainFK shared_fk_;
+  mutable ProjectionJacobian a_jacobian_;
+  mutable ProjectionJacobian b_jacobian_;
+  mutable Eigen::VectorXd derivatives_;
 };
 
 }  // namespace robot_calibration
@@ -23,11 +23,14 @@
 #include <string>
 #include <math.h>
 #include <ceres/ceres.h>
+#include <robot_calibration/cost_functions/dynamic_cost_function.hpp>
+#include <robot_calibration/cost_functions/evaluation_scratch.hpp>
+#include <robot_calibration/cost_functions/parameter_blocks.hpp>
 #include <robot_calibration/models/camera3d.hpp>
 #include <robot_calibration/models/chain3d.hpp>
 #include <robot_calibration/optimization/offsets.hpp>
 #include <robot_calibration/util/calibration_data.hpp>
-#include <robot_calibration/util/mesh_loader.hpp>
+#include <robot_calibration/util/mesh_tree.hpp>
 #include <robot_calibration_msgs/msg/calibration_data.hpp>
 
 namespace robot_calibration
@@ -41,7 +44,7 @@ namespace robot_calibration
  *
  * Based on "Real Time Collision Detection", pg 130
  */
-double distToLine(Eigen::Vector3d& a, Eigen::Vector3d& b, Eigen::Vector3d c)
+inline double distToLine(Eigen::Vector3d& a, Eigen::Vector3d& b, Eigen::Vector3d c)
 {
   Eigen::Vector3d ab = b - a;
   Eigen::Vector3d ac = c - a;
@@ -63,6 +66,33 @@ double distToLine(Eigen::Vector3d& a, Eigen::Vector3d& b, Eigen::Vector3d c)
   return ac.dot(ac) - e * e / f;
 }
 
+/**
+ * \brief Get the squared distance line segment A-B for point C, where
+ *        point C may be a Jet.
+ */
+template <typename T>
+T distToLine(const Eigen::Vector3d& a, const Eigen::Vector3d& b, const Eigen::Matrix<T, 3, 1>& c)
+{
+  Eigen::Vector3d ab = b - a;
+  Eigen::Matrix<T, 3, 1> ac = c - a.cast<T>();
+  Eigen::Matrix<T, 3, 1> bc = c - b.cast<T>();
+
+  T e = ac.dot(ab.cast<T>());
+  if (e <= 0.0)
+  {
+    // Point A is closest to C
+    return ac.dot(ac);
+  }
+  double f = ab.dot(ab);
+  if (e >= f)
+  {
+    // Point B is closest to C
+    return bc.dot(bc);
+  }
+  // C actually projects between
+  return ac.dot(ac) - e * e / f;
+}
+
 /**
  *  \brief Error block for computing the fit between a set of projected
  *         points and a mesh (usually part of the robot body). Typically used
@@ -75,55 +105,84 @@ struct Chain3dToMesh
    *  \param chain_model The model for the chain, used for reprojection.
    *  \param offsets Easy access to the free parameters.
    *  \param data The calibration data collected.
-   *  \param mesh_path Path to the mesh file to test against
+   *  \param mesh Tree of the mesh to test against.
+   *  \param point_to_triangle Use the distance to the closest triangle,
+   *         rather than to the closest triangle edge.
    */
   Chain3dToMesh(Chain3dModel* chain_model,
                 OptimizationOffsets* offsets,
-                robot_calibration_msgs::msg::CalibrationData& data,
-                MeshPtr& mesh)
+                CalibrationDataConstPtr data,
+                MeshTreePtr& mesh,
+                bool point_to_triangle)
   {
     chain_model_ = chain_model;
     offsets_ = offsets;
     data_ = data;
+
+    // Resolve joint and offset names once, rather than on each evaluation
+    chain_model_->compile(*data_, *offsets_, plan_);
+    parameter_blocks_.add(*offsets_, plan_);
     mesh_ = mesh;
+    point_to_triangle_ = point_to_triangle;
   }
 
   virtual ~Chain3dToMesh() {}
 
-  bool operator()(double const * const * free_params,
-                  double* residuals) const
+  template <typename T>
+  bool operator()(T const * const * free_params,
+                  T* residuals) const
   {
-    // Update calibration offsets based on free params
-    offsets_->update(free_params[0]);
+    using std::sqrt;
+
+    // Get calibration offsets based on free params
+    OffsetsViewT<T> offsets(*offsets_, free_params, parameter_blocks_.index());
 
     // Project the camera observations
-    std::vector<geometry_msgs::msg::PointStamped> chain_pts =
-        chain_model_->project(data_, *offsets_);
+    Matrix3X<T>& chain_pts = scratch_.points<T>(0);
+    if (!chain_model_->project(*data_, plan_, offsets, chain_pts))
+    {
+      std::cerr << "Unable to project observations." << std::endl;
+      return false;
+    }
 
     // Compute residuals
-    for (size_t pt = 0; pt < chain_pts.size() ; ++pt)
+    for (int pt = 0; pt < chain_pts.cols(); ++pt)
     {
-      Eigen::Vector3d p(chain_pts[pt].point.x, chain_pts[pt].point.y, chain_pts[pt].point.z);
+      // Derivatives are only needed for the closest feature of the mesh, so
+      // search for it using only the values of the projected point
+      Eigen::Vector3d p(getValue(chain_pts(0, pt)),
+                        getValue(chain_pts(1, pt)),
+                        getValue(chain_pts(2, pt)));
+      Eigen::Matrix<T, 3, 1> point = chain_pts.col(pt);
+
+      if (point_to_triangle_)
+      {
+        // Find shortest distance to the surface of any triangle
+        Eigen::Vector3d closest;
+        double dist = mesh_->closestPoint(p, closest);
+        if (dist <= 0.0 || dist == std::numeric_limits<double>::max())
+        {
+          // The derivative of sqrt() is undefined at zero, and an empty
+          // mesh has no closest point
+          residuals[pt] = T(0.0);
+          continue;
+        }
+        // The gradient of the distance is the same as to the fixed closest point
+        residuals[pt] = sqrt((point - closest.cast<T>()).squaredNorm());
+        continue;
+      }
 
       // Find shortest distance to any line segment forming a triangle
-      double dist = std::numeric_limits<double>::max();
-      for (size_t t = 0; t < mesh_->triangle_count; ++t)
+      Eigen::Vector3d closest_a, closest_b;
+      double dist = mesh_->closestEdge(p, closest_a, closest_b);
+      if (dist <= 0.0 || dist == std::numeric_limits<double>::max())
       {
-        // Get the index of each vertex of the triangle
-        int A_idx = mesh_->triangles[(3 * t) + 0];
-        int B_idx = mesh_->triangles[(3 * t) + 1];
-        int C_idx = mesh_->triangles[(3 * t) + 2];
-        // Get the vertices
-        Eigen::Vector3d A(mesh_->vertices[(3 * A_idx) + 0], mesh_->vertices[(3 * A_idx) + 1], mesh_->vertices[(3 * A_idx) + 2]);
-        Eigen::Vector3d B(mesh_->vertices[(3 * B_idx) + 0], mesh_->vertices[(3 * B_idx) + 1], mesh_->vertices[(3 * B_idx) + 2]);
-        Eigen::Vector3d C(mesh_->vertices[(3 * C_idx) + 0], mesh_->vertices[(3 * C_idx) + 1], mesh_->vertices[(3 * C_idx) + 2]);
-        // Compare each line segment
-        double d = distToLine(A, B, p);
-        d = std::min(d, distToLine(B, C, p));
-        d = std::min(d, distToLine(C, A, p));
-        dist = std::min(d, dist);
+        // The derivative of sqrt() is undefined at zero, and an empty
+        // mesh has no closest line segment
+        residuals[pt] = T(0.0);
+        continue;
       }
-      residuals[pt] = std::sqrt(dist);
+      residuals[pt] = sqrt(distToLine<T>(closest_a, closest_b, point));
     }
     return true;
   }
@@ -131,13 +190,19 @@ struct Chain3dToMesh
   /**
    *  \brief Helper factory function to create a new error block. Parameters
    *         are described in the class constructor, which this function calls.
+   *  \param blocks Returns the blocks of the offsets which correspond to
+   *         each parameter block of the cost function.
+   *  \param numeric_diff Use numeric rather than automatic differentiation.
    */
   static ceres::CostFunction* Create(Chain3dModel* a_model,
                                      OptimizationOffsets* offsets,
-                                     robot_calibration_msgs::msg::CalibrationData& data,
-                                     MeshPtr mesh)
+                                     CalibrationDataConstPtr data,
+                                     MeshTreePtr mesh,
+                                     bool point_to_triangle,
+                                     std::vector<int>& blocks,
+                                     bool numeric_diff = false)
   {
-    int index = getSensorIndex(data, a_model->getName());
+    int index = getSensorIndex(*data, a_model->getName());
     if (index == -1)
     {
       // In theory, we should never get here, because the optimizer does a check
@@ -145,19 +210,23 @@ struct Chain3dToMesh
       return 0;
     }
 
-    ceres::DynamicNumericDiffCostFunction<Chain3dToMesh> * func;
-    func = new ceres::DynamicNumericDiffCostFunction<Chain3dToMesh>(
-                    new Chain3dToMesh(a_model, offsets, data, mesh));
-    func->AddParameterBlock(offsets->size());
-    func->SetNumResiduals(data.observations[index].features.size());
+    Chain3dToMesh* error = new Chain3dToMesh(a_model, offsets, data, mesh, point_to_triangle);
+    ceres::DynamicCostFunction* func = createDynamicCostFunction(error, numeric_diff);
+    error->parameter_blocks_.setup(*offsets, func);
+    blocks = error->parameter_blocks_.blocks();
+    func->SetNumResiduals(data->observations[index].features.size());
 
     return static_cast<ceres::CostFunction*>(func);
   }
 
   Chain3dModel * chain_model_;
   OptimizationOffsets * offsets_;
-  robot_calibration_msgs::msg::CalibrationData data_;
-  MeshPtr mesh_;
+  CalibrationDataConstPtr data_;
+  ChainPlan plan_;
+  ParameterBlocks parameter_blocks_;
+  mutable EvaluationScratch scratch_;
+  MeshTreePtr mesh_;
+  bool point_to_triangle_;
 };
 
 }  // namespace robot_calibration
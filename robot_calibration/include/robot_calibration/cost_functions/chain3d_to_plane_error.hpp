@@ -22,6 +22,9 @@
 #include <string>
 #include <math.h>
 #include <ceres/ceres.h>
+#include <robot_calibration/cost_functions/dynamic_cost_function.hpp>
+#include <robot_calibration/cost_functions/evaluation_scratch.hpp>
+#include <robot_calibration/cost_functions/parameter_blocks.hpp>
 #include <robot_calibration/models/camera3d.hpp>
 #include <robot_calibration/models/chain3d.hpp>
 #include <robot_calibration/optimization/offsets.hpp>
@@ -52,7 +55,7 @@ struct Chain3dToPlane
    */
   Chain3dToPlane(Chain3dModel* chain_model,
                  OptimizationOffsets* offsets,
-                 robot_calibration_msgs::msg::CalibrationData& data,
+                 CalibrationDataConstPtr data,
                  double a, double b, double c, double d,
                  double scale)
   {
@@ -60,6 +63,10 @@ struct Chain3dToPlane
     offsets_ = offsets;
     data_ = data;
 
+    // Resolve joint and offset names once, rather than on each evaluation
+    chain_model_->compile(*data_, *offsets_, plan_);
+    parameter_blocks_.add(*offsets_, plan_);
+
     a_ = a;
     b_ = b;
     c_ = c;
@@ -76,22 +83,78 @@ struct Chain3dToPlane
 
   virtual ~Chain3dToPlane() {}
 
-  bool operator()(double const * const * free_params,
-                  double* residuals) const
+  template <typename T>
+  bool operator()(T const * const * free_params,
+                  T* residuals) const
   {
-    // Update calibration offsets based on free params
-    offsets_->update(free_params[0]);
+    using std::abs;
+
+    // Get calibration offsets based on free params
+    OffsetsViewT<T> offsets(*offsets_, free_params, parameter_blocks_.index());
 
     // Project the camera observations
-    std::vector<geometry_msgs::msg::PointStamped> chain_pts =
-        chain_model_->project(data_, *offsets_);
+    Matrix3X<T>& chain_pts = scratch_.points<T>(0);
+    if (!chain_model_->project(*data_, plan_, offsets, chain_pts))
+    {
+      std::cerr << "Unable to project observations." << std::endl;
+      return false;
+    }
 
     // Compute residuals
-    for (size_t i = 0; i < chain_pts.size() ; ++i)
+    for (int i = 0; i < chain_pts.cols(); ++i)
+    {
+      residuals[i] = abs((a_ * chain_pts(0, i)) +
+                         (b_ * chain_pts(1, i)) +
+                         (c_ * chain_pts(2, i)) + d_) * scale_;
+    }
+    return true;
+  }
+
+  /**
+   *  \brief Evaluate residuals and jacobians using the closed form
+   *         derivatives of the model, called by the analytic cost function.
+   */
+  bool evaluate(double const * const * free_params,
+                double* residuals,
+                double** jacobians) const
+  {
+    if (!jacobians)
+      return (*this)(free_params, residuals);
+
+    OffsetsView offsets(*offsets_, free_params, parameter_blocks_.index());
+
+    // Project the camera observations
+    Matrix3X<double>& chain_pts = scratch_.points<double>(0);
+    if (!chain_model_->projectWithJacobian(*data_, plan_, offsets, chain_pts, jacobian_))
+    {
+      std::cerr << "Unable to project observations." << std::endl;
+      return false;
+    }
+
+    // Compute residuals, and the derivative of each with respect to its point
+    int num_residuals = chain_pts.cols();
+    Eigen::Matrix3Xd gradient(3, num_residuals);
+    for (int i = 0; i < num_residuals; ++i)
+    {
+      double distance = (a_ * chain_pts(0, i)) +
+                        (b_ * chain_pts(1, i)) +
+                        (c_ * chain_pts(2, i)) + d_;
+      residuals[i] = std::abs(distance) * scale_;
+      // Same convention as the ceres jet, the derivative of abs(0) is 1
+      double sign = (distance < 0.0) ? -scale_ : scale_;
+      gradient.col(i) = Eigen::Vector3d(a_, b_, c_) * sign;
+    }
+
+    parameter_blocks_.zeroJacobians(*offsets_, num_residuals, jacobians);
+    derivatives_.resize(num_residuals);
+    for (size_t c = 0; c < jacobian_.params.size(); ++c)
     {
-      residuals[i] = abs((a_ * chain_pts[i].point.x) +
-                         (b_ * chain_pts[i].point.y) +
-                         (c_ * chain_pts[i].point.z) + d_) * scale_;
+      for (int i = 0; i < num_residuals; ++i)
+      {
+        derivatives_(i) = gradient.col(i).dot(jacobian_.jacobian.block<3, 1>(3 * i, c));
+      }
+      parameter_blocks_.addJacobian(*offsets_, jacobian_.params[c], num_residuals,
+                                    derivatives_.data(), jacobians);
     }
     return true;
   }
@@ -99,14 +162,22 @@ struct Chain3dToPlane
   /**
    *  \brief Helper factory function to create a new error block. Parameters
    *         are described in the class constructor, which this function calls.
+   *  \param blocks Returns the blocks of the offsets which correspond to
+   *         each parameter block of the cost function.
+   *  \param numeric_diff Use numeric rather than automatic differentiation.
+   *  \param analytic_diff Use the closed form derivatives of the model,
+   *         if it supports them for the free parameters.
    */
   static ceres::CostFunction* Create(Chain3dModel* a_model,
                                      OptimizationOffsets* offsets,
-                                     robot_calibration_msgs::msg::CalibrationData& data,
+                                     CalibrationDataConstPtr data,
                                      double a, double b, double c, double d,
-                                     double scale)
+                                     double scale,
+                                     std::vector<int>& blocks,
+                                     bool numeric_diff = false,
+                                     bool analytic_diff = false)
   {
-    int index = getSensorIndex(data, a_model->getName());
+    int index = getSensorIndex(*data, a_model->getName());
     if (index == -1)
     {
       // In theory, we should never get here, because the optimizer does a check
@@ -114,18 +185,27 @@ struct Chain3dToPlane
       return 0;
     }
 
-    ceres::DynamicNumericDiffCostFunction<Chain3dToPlane> * func;
-    func = new ceres::DynamicNumericDiffCostFunction<Chain3dToPlane>(
-                    new Chain3dToPlane(a_model, offsets, data, a, b, c, d, scale));
-    func->AddParameterBlock(offsets->size());
-    func->SetNumResiduals(data.observations[index].features.size());
+    Chain3dToPlane* error = new Chain3dToPlane(a_model, offsets, data, a, b, c, d, scale);
+    ceres::DynamicCostFunction* func;
+    if (analytic_diff && a_model->hasAnalyticJacobian(error->plan_, *offsets))
+      func = new DynamicAnalyticCostFunction<Chain3dToPlane>(error);
+    else
+      func = createDynamicCostFunction(error, numeric_diff);
+    error->parameter_blocks_.setup(*offsets, func);
+    blocks = error->parameter_blocks_.blocks();
+    func->SetNumResiduals(data->observations[index].features.size());
 
     return static_cast<ceres::CostFunction*>(func);
   }
 
   Chain3dModel * chain_model_;
   OptimizationOffsets * offsets_;
-  robot_calibration_msgs::msg::CalibrationData data_;
+  CalibrationDataConstPtr data_;
+  ChainPlan plan_;
+  ParameterBlocks parameter_blocks_;
+  mutable EvaluationScratch scratch_;
+  mutable ProjectionJacobian jacobian_;
+  mutable Eigen::VectorXd derivatives_;
   double a_, b_, c_, d_;
   double scale_, denom_;
 };
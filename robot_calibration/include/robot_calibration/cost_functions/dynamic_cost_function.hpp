@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_COST_FUNCTIONS_DYNAMIC_COST_FUNCTION_HPP
+#define ROBOT_CALIBRATION_COST_FUNCTIONS_DYNAMIC_COST_FUNCTION_HPP
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
+#include <ceres/ceres.h>
+#include <robot_calibration/optimization/jet.hpp>
+
+namespace robot_calibration
+{
+
+/**
+ *  \brief Wrap an error functor in a dynamically sized ceres cost function.
+ *  \param functor The error functor, ownership is passed to the cost function.
+ *         The functor must have a templated operator() which accepts both
+ *         double and Jet.
+ *  \param numeric_diff If true, use numeric differentiation, otherwise
+ *         automatic differentiation is used.
+ *
+ *  The caller still needs to add the parameter blocks and set the number
+ *  of residuals.
+ */
+template <typename Functor>
+ceres::DynamicCostFunction* createDynamicCostFunction(Functor* functor, bool numeric_diff)
+{
+  if (numeric_diff)
+    return new ceres::DynamicNumericDiffCostFunction<Functor, ceres::CENTRAL>(functor);
+  return new ceres::DynamicAutoDiffCostFunction<Functor, JET_STRIDE>(functor);
+}
+
+/**
+ *  \brief Automatic differentiation of an error functor with a number of
+ *         residuals known at compile time, and a dynamic set of parameter
+ *         blocks. This matches ceres::DynamicAutoDiffCostFunction, except
+ *         that the residual jets are on the stack and the parameter jets
+ *         are reused between evaluations, so no evaluation allocates.
+ *
+ *  Ceres evaluates each residual block on only one thread at a time, so
+ *  the buffers are mutable members. The caller still needs to add the
+ *  parameter blocks.
+ */
+template <typename Functor, int kNumResiduals>
+class FixedResidualAutoDiffCostFunction : public ceres::DynamicCostFunction
+{
+public:
+  /** \param functor The error functor, ownership is passed to the cost function. */
+  explicit FixedResidualAutoDiffCostFunction(Functor* functor) :
+    functor_(functor)
+  {
+    SetNumResiduals(kNumResiduals);
+  }
+
+  bool Evaluate(double const * const * parameters,
+                double* residuals,
+                double** jacobians) const override
+  {
+    if (!jacobians)
+      return (*functor_)(parameters, residuals);
+
+    // Setup jets for all parameters, and find those which need derivatives
+    const std::vector<int32_t>& block_sizes = parameter_block_sizes();
+    int num_parameters = 0;
+    for (int32_t size : block_sizes)
+      num_parameters += size;
+    parameter_jets_.resize(num_parameters);
+    jet_blocks_.resize(block_sizes.size());
+    active_.clear();
+    for (size_t i = 0, p = 0; i < block_sizes.size(); ++i)
+    {
+      jet_blocks_[i] = &parameter_jets_[p];
+      for (int j = 0; j < block_sizes[i]; ++j, ++p)
+      {
+        parameter_jets_[p] = Jet(parameters[i][j]);
+        if (jacobians[i])
+          active_.push_back(ActiveParameter{static_cast<int>(i), j, static_cast<int>(p)});
+      }
+    }
+
+    if (active_.empty())
+      return (*functor_)(parameters, residuals);
+
+    // Each pass computes the derivatives of up to JET_STRIDE parameters
+    std::array<Jet, kNumResiduals> residual_jets;
+    for (size_t start = 0; start < active_.size(); start += JET_STRIDE)
+    {
+      size_t end = std::min(start + JET_STRIDE, active_.size());
+      for (size_t k = start; k < end; ++k)
+        parameter_jets_[active_[k].index].v[k - start] = 1.0;
+      if (!(*functor_)(jet_blocks_.data(), residual_jets.data()))
+        return false;
+      for (size_t k = start; k < end; ++k)
+      {
+        const ActiveParameter& param = active_[k];
+        parameter_jets_[param.index].v[k - start] = 0.0;
+        double* jacobian = jacobians[param.block];
+        int size = block_sizes[param.block];
+        for (int r = 0; r < kNumResiduals; ++r)
+          jacobian[r * size + param.column] = residual_jets[r].v[k - start];
+      }
+    }
+
+    for (int r = 0; r < kNumResiduals; ++r)
+      residuals[r] = residual_jets[r].a;
+    return true;
+  }
+
+private:
+  struct ActiveParameter
+  {
+    int block;
+    int column;
+    int index;
+  };
+
+  std::unique_ptr<Functor> functor_;
+  mutable std::vector<Jet> parameter_jets_;
+  mutable std::vector<Jet*> jet_blocks_;
+  mutable std::vector<ActiveParameter> active_;
+};
+
+/**
+ *  \brief Numbers of features which have a fixed size cost function: the
+ *         LED gripper, and common checkerboard sizes (including the
+ *         default 5x4 of the checkerboard finder).
+ */
+template <int... Counts>
+struct FeatureCounts {};
+using FixedFeatureCounts = FeatureCounts<4, 20, 35, 42, 48, 54, 63, 70>;
+
+/**
+ *  \brief Create a fixed size cost function if num_features matches one
+ *         of the counts, otherwise return nullptr. Ownership of the functor
+ *         is only passed to the cost function if one is created.
+ */
+template <int kResidualsPerFeature, typename Functor, int... Counts>
+ceres::DynamicCostFunction* createFixedCostFunction(Functor* functor, size_t num_features,
+                                                    FeatureCounts<Counts...>)
+{
+  ceres::DynamicCostFunction* func = nullptr;
+  ((func == nullptr && num_features == static_cast<size_t>(Counts) ?
+      func = new FixedResidualAutoDiffCostFunction<Functor, Counts * kResidualsPerFeature>(functor) :
+      func), ...);
+  return func;
+}
+
+/**
+ *  \brief Wrap an error functor with kResidualsPerFeature residuals for
+ *         each feature in a ceres cost function. When using automatic
+ *         differentiation and the number of features is one of the
+ *         FixedFeatureCounts, the residuals are sized at compile time.
+ *
+ *  The caller still needs to add the parameter blocks and set the number
+ *  of residuals.
+ */
+template <int kResidualsPerFeature, typename Functor>
+ceres::DynamicCostFunction* createDynamicCostFunction(Functor* functor, size_t num_features,
+                                                      bool numeric_diff)
+{
+  if (!numeric_diff)
+  {
+    ceres::DynamicCostFunction* func =
+      createFixedCostFunction<kResidualsPerFeature>(functor, num_features, FixedFeatureCounts());
+    if (func)
+      return func;
+  }
+  return createDynamicCostFunction(functor, numeric_diff);
+}
+
+/**
+ *  \brief A dynamically sized ceres cost function for error functors which
+ *         compute their own jacobians. The functor must have an evaluate()
+ *         with the same signature as ceres::CostFunction::Evaluate().
+ *
+ *  The caller still needs to add the parameter blocks and set the number
+ *  of residuals.
+ */
+template <typename Functor>
+class DynamicAnalyticCostFunction : public ceres::DynamicCostFunction
+{
+public:
+  /** \param functor The error functor, ownership is passed to the cost function. */
+  explicit DynamicAnalyticCostFunction(Functor* functor) :
+    functor_(functor)
+  {
+  }
+
+  bool Evaluate(double const * const * parameters,
+                double* residuals,
+                double** jacobians) const override
+  {
+    return functor_->evaluate(parameters, residuals, jacobians);
+  }
+
+private:
+  std::unique_ptr<Functor> functor_;
+};
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_COST_FUNCTIONS_DYNAMIC_COST_FUNCTION_HPP
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_COST_FUNCTIONS_EVALUATION_SCRATCH_HPP
+#define ROBOT_CALIBRATION_COST_FUNCTIONS_EVALUATION_SCRATCH_HPP
+
+#include <vector>
+#include <robot_calibration/optimization/jet.hpp>
+
+namespace robot_calibration
+{
+
+/**
+ *  \brief Buffers which an error block reuses between evaluations, so that
+ *         once they have been sized by the first evaluation, the solver
+ *         does no further heap allocations for projection.
+ *
+ *  Ceres evaluates each residual block on only one thread at a time, so
+ *  each cost functor can hold its own scratch as a mutable member.
+ */
+class EvaluationScratch
+{
+public:
+  /** \brief Get the i-th buffer of 3d points for scalar type T. */
+  template <typename T>
+  Matrix3X<T>& points(size_t i)
+  {
+    return get(points(static_cast<T*>(nullptr)), i);
+  }
+
+  /** \brief Get the i-th buffer of 2d pixels for scalar type T. */
+  template <typename T>
+  Matrix2X<T>& pixels(size_t i)
+  {
+    return get(pixels(static_cast<T*>(nullptr)), i);
+  }
+
+private:
+  template <typename M>
+  static M& get(std::vector<M>& buffers, size_t i)
+  {
+    if (buffers.size() <= i)
+      buffers.resize(i + 1);
+    return buffers[i];
+  }
+
+  std::vector<Matrix3X<double>>& points(double*) { return points_; }
+  std::vector<Matrix3X<Jet>>& points(Jet*) { return jet_points_; }
+  std::vector<Matrix2X<double>>& pixels(double*) { return pixels_; }
+  std::vector<Matrix2X<Jet>>& pixels(Jet*) { return jet_pixels_; }
+
+  std::vector<Matrix3X<double>> points_;
+  std::vector<Matrix3X<Jet>> jet_points_;
+  std::vector<Matrix2X<double>> pixels_;
+  std::vector<Matrix2X<Jet>> jet_pixels_;
+};
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_COST_FUNCTIONS_EVALUATION_SCRATCH_HPP
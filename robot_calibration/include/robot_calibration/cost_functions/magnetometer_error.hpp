@@ -19,6 +19,7 @@
 #ifndef ROBOT_CALIBRATION_COST_FUNCTIONS_MAGNETOMETER_ERROR_HPP
 #define ROBOT_CALIBRATION_COST_FUNCTIONS_MAGNETOMETER_ERROR_HPP
 
+#include <vector>
 #include <ceres/ceres.h>
 
 /**
@@ -63,4 +64,108 @@ private:
   double x_, y_, z_;
 };
 
+/**
+ * @brief Cost function for all magnetometer samples at once, with analytic
+ *        jacobians. There is one residual per sample, the same as for
+ *        HardIronOffsetError when not using soft iron.
+ *
+ * Parameter blocks are:
+ *  0 = local magnetic field strength (1)
+ *  1 = x, y, z hard iron offset (3)
+ *  2 = upper triangle of the symmetric soft iron matrix, row major (6),
+ *      only if using soft iron
+ */
+class MagnetometerBatchError : public ceres::CostFunction
+{
+public:
+  /**
+   * @brief Create the cost function.
+   * @param x The x component of each sample.
+   * @param y The y component of each sample.
+   * @param z The z component of each sample.
+   * @param soft_iron Whether to correct for soft iron effects.
+   */
+  MagnetometerBatchError(const std::vector<double>& x,
+                         const std::vector<double>& y,
+                         const std::vector<double>& z,
+                         bool soft_iron)
+    : x_(x), y_(y), z_(z), soft_iron_(soft_iron)
+  {
+    set_num_residuals(x_.size());
+    mutable_parameter_block_sizes()->push_back(1);
+    mutable_parameter_block_sizes()->push_back(3);
+    if (soft_iron_)
+    {
+      mutable_parameter_block_sizes()->push_back(6);
+    }
+  }
+
+  virtual ~MagnetometerBatchError() {}
+
+  bool Evaluate(double const * const * parameters,
+                double* residuals,
+                double** jacobians) const override
+  {
+    const double field = parameters[0][0];
+    const double* offset = parameters[1];
+    double a[6] = {1.0, 0.0, 0.0, 1.0, 0.0, 1.0};
+    if (soft_iron_)
+    {
+      for (size_t i = 0; i < 6; ++i)
+        a[i] = parameters[2][i];
+    }
+
+    // Residual is |A * d|^2 - field^2 where d is the sample minus offset
+    for (size_t i = 0; i < x_.size(); ++i)
+    {
+      double dx = x_[i] - offset[0];
+      double dy = y_[i] - offset[1];
+      double dz = z_[i] - offset[2];
+      double ux = a[0] * dx + a[1] * dy + a[2] * dz;
+      double uy = a[1] * dx + a[3] * dy + a[4] * dz;
+      double uz = a[2] * dx + a[4] * dy + a[5] * dz;
+      residuals[i] = ux * ux + uy * uy + uz * uz - field * field;
+
+      if (!jacobians)
+        continue;
+
+      if (jacobians[0])
+      {
+        jacobians[0][i] = -2.0 * field;
+      }
+      if (jacobians[1])
+      {
+        // -2 * A^T * u, and A is symmetric
+        jacobians[1][(3 * i) + 0] = -2.0 * (a[0] * ux + a[1] * uy + a[2] * uz);
+        jacobians[1][(3 * i) + 1] = -2.0 * (a[1] * ux + a[3] * uy + a[4] * uz);
+        jacobians[1][(3 * i) + 2] = -2.0 * (a[2] * ux + a[4] * uy + a[5] * uz);
+      }
+      if (soft_iron_ && jacobians[2])
+      {
+        // Off diagonal values appear twice in A
+        jacobians[2][(6 * i) + 0] = 2.0 * ux * dx;
+        jacobians[2][(6 * i) + 1] = 2.0 * (ux * dy + uy * dx);
+        jacobians[2][(6 * i) + 2] = 2.0 * (ux * dz + uz * dx);
+        jacobians[2][(6 * i) + 3] = 2.0 * uy * dy;
+        jacobians[2][(6 * i) + 4] = 2.0 * (uy * dz + uz * dy);
+        jacobians[2][(6 * i) + 5] = 2.0 * uz * dz;
+      }
+    }
+    return true;
+  }
+
+  static ceres::CostFunction* Create(const std::vector<double>& x,
+                                     const std::vector<double>& y,
+                                     const std::vector<double>& z,
+                                     bool soft_iron)
+  {
+    return new MagnetometerBatchError(x, y, z, soft_iron);
+  }
+
+private:
+  // The actual sampled data, each component is contiguous
+  std::vector<double> x_, y_, z_;
+  bool soft_iron_;
+};
+
 #endif  // ROBOT_CALIBRATION_COST_FUNCTIONS_MAGNETOMETER_ERROR_HPP
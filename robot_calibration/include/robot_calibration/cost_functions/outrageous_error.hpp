@@ -21,6 +21,9 @@
 
 #include <string>
 #include <ceres/ceres.h>
+#include <ceres/rotation.h>
+#include <robot_calibration/cost_functions/dynamic_cost_function.hpp>
+#include <robot_calibration/cost_functions/parameter_blocks.hpp>
 #include <robot_calibration/models/chain3d.hpp>
 #include <robot_calibration/optimization/offsets.hpp>
 
@@ -54,6 +57,11 @@ struct OutrageousError
       position_(position_scaling),
       rotation_(rotation_scaling)
   {
+    // Resolve the name once, rather than on each evaluation
+    param_ = offsets_->getParamHandle(name_);
+    frame_ = offsets_->getFrameHandle(name_);
+    parameter_blocks_.add(*offsets_, param_);
+    parameter_blocks_.add(*offsets_, frame_);
   }
 
   virtual ~OutrageousError() {}
@@ -63,33 +71,37 @@ struct OutrageousError
    *  \param free_params Double pointer leading only to the offsets vector.
    *  \param residuals This functor returns 7 residuals.
    */
-  bool operator()(double const * const * free_params,
-                  double * residuals) const
+  template <typename T>
+  bool operator()(T const * const * free_params,
+                  T * residuals) const
   {
-    // Update calibration offsets based on free params
-    offsets_->update(free_params[0]);
+    using std::abs;
 
-    residuals[0] = joint_ * offsets_->get(name_);
-    KDL::Frame f;
-    if (offsets_->getFrame(name_, f))
+    // Get calibration offsets based on free params
+    OffsetsViewT<T> offsets(*offsets_, free_params, parameter_blocks_.index());
+
+    residuals[0] = joint_ * offsets.get(param_);
+    Transform<T> f;
+    if (offsets.getFrame(frame_, f))
     {
-      residuals[1] = position_ * f.p.x();
-      residuals[2] = position_ * f.p.y();
-      residuals[3] = position_ * f.p.z();
-      double x, y, z;
-      axis_magnitude_from_rotation(f.M, x, y, z);
-      residuals[4] = rotation_ * fabs(x);
-      residuals[5] = rotation_ * fabs(y);
-      residuals[6] = rotation_ * fabs(z);
+      residuals[1] = position_ * f.translation()(0);
+      residuals[2] = position_ * f.translation()(1);
+      residuals[3] = position_ * f.translation()(2);
+      Eigen::Matrix<T, 3, 3> rotation = f.linear();
+      T angle_axis[3];
+      ceres::RotationMatrixToAngleAxis(rotation.data(), angle_axis);
+      residuals[4] = rotation_ * abs(angle_axis[0]);
+      residuals[5] = rotation_ * abs(angle_axis[1]);
+      residuals[6] = rotation_ * abs(angle_axis[2]);
     }
     else
     {
-      residuals[1] = 0.0;
-      residuals[2] = 0.0;
-      residuals[3] = 0.0;
-      residuals[4] = 0.0;
-      residuals[5] = 0.0;
-      residuals[6] = 0.0;
+      residuals[1] = T(0.0);
+      residuals[2] = T(0.0);
+      residuals[3] = T(0.0);
+      residuals[4] = T(0.0);
+      residuals[5] = T(0.0);
+      residuals[6] = T(0.0);
     }
 
     return true;
@@ -97,17 +109,23 @@ struct OutrageousError
 
   /**
    *  \brief Helper factory function to create a new error block.
+   *  \param blocks Returns the blocks of the offsets which correspond to
+   *         each parameter block of the cost function.
+   *  \param numeric_diff Use numeric rather than automatic differentiation.
    */
   static ceres::CostFunction* Create(OptimizationOffsets* offsets,
                                      std::string name,
                                      double joint_scaling,
                                      double position_scaling,
-                                     double rotation_scaling)
+                                     double rotation_scaling,
+                                     std::vector<int>& blocks,
+                                     bool numeric_diff = false)
   {
-    ceres::DynamicNumericDiffCostFunction<OutrageousError, ceres::CENTRAL> * func;
-    func = new ceres::DynamicNumericDiffCostFunction<OutrageousError, ceres::CENTRAL>(
-                    new OutrageousError(offsets, name, joint_scaling, position_scaling, rotation_scaling));
-    func->AddParameterBlock(offsets->size());
+    OutrageousError* error =
+        new OutrageousError(offsets, name, joint_scaling, position_scaling, rotation_scaling);
+    ceres::DynamicCostFunction* func = createDynamicCostFunction(error, numeric_diff);
+    error->parameter_blocks_.setup(*offsets, func);
+    blocks = error->parameter_blocks_.blocks();
     func->SetNumResiduals(7);  // joint + 3 position + 3 rotation
     return static_cast<ceres::CostFunction*>(func);
   }
@@ -117,6 +135,9 @@ struct OutrageousError
   double joint_;
   double position_;
   double rotation_;
+  ParamHandle param_;
+  FrameHandle frame_;
+  ParameterBlocks parameter_blocks_;
 };
 
 }  // namespace robot_calibration
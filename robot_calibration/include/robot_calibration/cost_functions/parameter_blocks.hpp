@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_COST_FUNCTIONS_PARAMETER_BLOCKS_HPP
+#define ROBOT_CALIBRATION_COST_FUNCTIONS_PARAMETER_BLOCKS_HPP
+
+#include <algorithm>
+#include <vector>
+#include <ceres/ceres.h>
+#include <robot_calibration/models/chain3d.hpp>
+#include <robot_calibration/optimization/offsets.hpp>
+
+namespace robot_calibration
+{
+
+/**
+ *  \brief The parameter blocks of the offsets that an error block depends
+ *         on. Connecting each residual only to the blocks it actually uses
+ *         keeps the jacobian sparse.
+ */
+class ParameterBlocks
+{
+public:
+  /** \brief Depend on the block holding a parameter, if it is free. */
+  void add(const OptimizationOffsets& offsets, const ParamHandle& param)
+  {
+    int block = offsets.getBlock(param);
+    if (block >= 0 && std::find(blocks_.begin(), blocks_.end(), block) == blocks_.end())
+      blocks_.push_back(block);
+  }
+
+  /** \brief Depend on the blocks holding the parameters of a frame. */
+  void add(const OptimizationOffsets& offsets, const FrameHandle& frame)
+  {
+    if (!frame.valid)
+      return;
+    for (int i = 0; i < 6; ++i)
+      add(offsets, frame.params[i]);
+  }
+
+  /** \brief Depend on all the blocks used by a compiled model. */
+  void add(const OptimizationOffsets& offsets, const ChainPlan& plan)
+  {
+    for (const auto& segment : plan.segments)
+    {
+      add(offsets, segment.offset);
+      add(offsets, segment.frame);
+    }
+    for (const auto& group : plan.feature_groups)
+      add(offsets, group.frame);
+    for (const auto& param : plan.params)
+      add(offsets, param);
+  }
+
+  /**
+   *  \brief Add the parameter blocks to the cost function, once all
+   *         dependencies have been added.
+   */
+  void setup(const OptimizationOffsets& offsets, ceres::DynamicCostFunction* func)
+  {
+    std::sort(blocks_.begin(), blocks_.end());
+    index_.assign(offsets.getNumBlocks(), -1);
+    for (size_t i = 0; i < blocks_.size(); ++i)
+    {
+      index_[blocks_[i]] = i;
+      func->AddParameterBlock(offsets.getBlockSize(blocks_[i]));
+    }
+  }
+
+  /**
+   *  \brief Zero the jacobians of the cost function, before adding the
+   *         derivatives of each residual with addJacobian().
+   */
+  void zeroJacobians(const OptimizationOffsets& offsets, int num_residuals, double** jacobians) const
+  {
+    for (size_t i = 0; i < blocks_.size(); ++i)
+    {
+      if (jacobians[i])
+        std::fill(jacobians[i], jacobians[i] + num_residuals * offsets.getBlockSize(blocks_[i]), 0.0);
+    }
+  }
+
+  /**
+   *  \brief Add the derivatives of the residuals with respect to one free
+   *         parameter into the (row-major) jacobians of the cost function.
+   *  \param derivatives Derivative of each residual, num_residuals long.
+   */
+  void addJacobian(const OptimizationOffsets& offsets, const ParamHandle& param,
+                   int num_residuals, const double* derivatives, double** jacobians) const
+  {
+    int block = offsets.getBlock(param);
+    if (block < 0 || static_cast<size_t>(block) >= index_.size() || index_[block] < 0 ||
+        !jacobians[index_[block]])
+      return;
+    double* jacobian = jacobians[index_[block]];
+    int size = offsets.getBlockSize(block);
+    int column = offsets.getBlockOffset(param);
+    for (int r = 0; r < num_residuals; ++r)
+      jacobian[r * size + column] += derivatives[r];
+  }
+
+  /** \brief The blocks of the offsets, in the order of the cost function parameters. */
+  const std::vector<int>& blocks() const
+  {
+    return blocks_;
+  }
+
+  /**
+   *  \brief For each block of the offsets, the cost function parameter index
+   *         or -1. Error blocks read the free parameters through an
+   *         OffsetsView with this index, rather than updating the shared
+   *         offsets, so that residual blocks can be evaluated in parallel.
+   */
+  const std::vector<int>& index() const
+  {
+    return index_;
+  }
+
+private:
+  std::vector<int> blocks_;
+  std::vector<int> index_;
+};
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_COST_FUNCTIONS_PARAMETER_BLOCKS_HPP
@@ -23,8 +23,11 @@
 
 #include <string>
 #include <ceres/ceres.h>
+#include <robot_calibration/cost_functions/evaluation_scratch.hpp>
+#include <robot_calibration/cost_functions/parameter_blocks.hpp>
 #include <robot_calibration/models/chain3d.hpp>
 #include <robot_calibration/optimization/offsets.hpp>
+#include <robot_calibration/util/calibration_data.hpp>
 #include <robot_calibration/util/eigen_geometry.hpp>
 #include <robot_calibration_msgs/msg/calibration_data.hpp>
 
@@ -52,13 +55,22 @@ struct PlaneToPlaneError
   PlaneToPlaneError(Chain3dModel *model_a,
                     Chain3dModel *model_b,
                     OptimizationOffsets *offsets,
-                    robot_calibration_msgs::msg::CalibrationData &data,
+                    CalibrationDataConstPtr data,
                     double scale_normal, double scale_offset)
   {
     model_a_ = model_a;
     model_b_ = model_b;
     offsets_ = offsets;
     data_ = data;
+
+    // Resolve joint and offset names once, rather than on each evaluation
+    model_a_->compile(*data_, *offsets_, a_plan_);
+    model_b_->compile(*data_, *offsets_, b_plan_);
+    parameter_blocks_.add(*offsets_, a_plan_);
+    parameter_blocks_.add(*offsets_, b_plan_);
+
+    // Chains from the same root usually start with the same segments
+    shareChainFK(*model_a_, a_plan_, *model_b_, b_plan_, shared_fk_);
     scale_normal_ = scale_normal;
     scale_offset_ = scale_offset;
   }
@@ -73,28 +85,28 @@ struct PlaneToPlaneError
   bool operator()(double const *const *free_params,
                   double *residuals) const
   {
-    // Update calibration offsets based on free params
-    offsets_->update(free_params[0]);
+    // Get calibration offsets based on free params
+    OffsetsView offsets(*offsets_, free_params, parameter_blocks_.index());
+    shared_fk_.reset();
 
     // Project the first camera observations
-    std::vector<geometry_msgs::msg::PointStamped> a_pts =
-        model_a_->project(data_, *offsets_);
+    Matrix3X<double>& a_pts = scratch_.points<double>(0);
+    model_a_->project(*data_, a_plan_, offsets, a_pts);
 
     // Get plane parameters for first set of points
-    Eigen::MatrixXd matrix_a = getMatrix(a_pts);
+    PlaneFitter plane_a(a_pts);
     Eigen::Vector3d normal_a;
     double d_a = 0.0;
-    getPlane(matrix_a, normal_a, d_a);
+    plane_a.getPlane(normal_a, d_a);
 
     // Project the second camera estimation
-    std::vector<geometry_msgs::msg::PointStamped> b_pts =
-        model_b_->project(data_, *offsets_);
+    Matrix3X<double>& b_pts = scratch_.points<double>(1);
+    model_b_->project(*data_, b_plan_, offsets, b_pts);
 
     // Get plane parameters for second set of points
-    Eigen::MatrixXd matrix_b = getMatrix(b_pts);
     Eigen::Vector3d normal_b;
     double d_b = 0.0;
-    getPlane(matrix_b, normal_b, d_b);
+    PlaneFitter(b_pts).getPlane(normal_b, d_b);
 
     // Compute the residuals by minimizing the normals of the calculated planes
     residuals[0] = std::fabs(normal_a(0) - normal_b(0)) * scale_normal_;
@@ -102,7 +114,7 @@ struct PlaneToPlaneError
     residuals[2] = std::fabs(normal_a(2) - normal_b(2)) * scale_normal_;
 
     // Final residual is the distance between the centroid of one plane and the second plane itself
-    Eigen::Vector3d centroid_a = getCentroid(matrix_a);
+    Eigen::Vector3d centroid_a = plane_a.getCentroid();
     residuals[3] = std::fabs((normal_b(0) * centroid_a(0)) +
                              (normal_b(1) * centroid_a(1)) +
                              (normal_b(2) * centroid_a(2)) + d_b) * scale_offset_;
@@ -113,17 +125,26 @@ struct PlaneToPlaneError
   /**
    *  \brief Helper factory function to create a new error block. Parameters
    *         are described in the class constructor, which this function calls.
+   *
+   *  Unlike the other error blocks, this always uses numeric differentiation
+   *  since the eigen solver used to fit the planes does not support Jets.
+   *
+   *  \param blocks Returns the blocks of the offsets which correspond to
+   *         each parameter block of the cost function.
    */
   static ceres::CostFunction *Create(Chain3dModel *model_a,
                                      Chain3dModel *model_b,
                                      OptimizationOffsets *offsets,
-                                     robot_calibration_msgs::msg::CalibrationData &data,
-                                     double scale_normal, double scale_offset)
+                                     CalibrationDataConstPtr data,
+                                     double scale_normal, double scale_offset,
+                                     std::vector<int>& blocks)
   {
+    PlaneToPlaneError* error =
+        new PlaneToPlaneError(model_a, model_b, offsets, data, scale_normal, scale_offset);
     ceres::DynamicNumericDiffCostFunction <PlaneToPlaneError> *func;
-    func = new ceres::DynamicNumericDiffCostFunction<PlaneToPlaneError>(
-        new PlaneToPlaneError(model_a, model_b, offsets, data, scale_normal, scale_offset));
-    func->AddParameterBlock(offsets->size());
+    func = new ceres::DynamicNumericDiffCostFunction<PlaneToPlaneError>(error);
+    error->parameter_blocks_.setup(*offsets, func);
+    blocks = error->parameter_blocks_.blocks();
     func->SetNumResiduals(4);
 
     return static_cast<ceres::CostFunction*>(func);
@@ -132,7 +153,12 @@ struct PlaneToPlaneError
   Chain3dModel *model_a_;
   Chain3dModel *model_b_;
   OptimizationOffsets *offsets_;
-  robot_calibration_msgs::msg::CalibrationData data_;
+  CalibrationDataConstPtr data_;
+  ChainPlan a_plan_;
+  ChainPlan b_plan_;
+  ParameterBlocks parameter_blocks_;
+  mutable EvaluationScratch scratch_;
+  mutable SharedChainFK shared_fk_;
   double scale_normal_, scale_offset_;
 };
 
@@ -21,12 +21,17 @@
 #ifndef ROBOT_CALIBRATION_FINDERS_CHECKERBOARD_FINDER_HPP
 #define ROBOT_CALIBRATION_FINDERS_CHECKERBOARD_FINDER_HPP
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
 #include <rclcpp/rclcpp.hpp>
 #include <robot_calibration/finders/feature_finder.hpp>
 #include <robot_calibration/util/depth_camera_info.hpp>
 #include <robot_calibration_msgs/msg/calibration_data.hpp>
 
 #include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <cv_bridge/cv_bridge.h>
 
 namespace robot_calibration
@@ -40,25 +45,59 @@ class CheckerboardFinder : public FeatureFinder
 {
 public:
   CheckerboardFinder();
+  virtual ~CheckerboardFinder()
+  {
+    stopExecutor();
+  }
   bool init(const std::string& name,
             std::shared_ptr<tf2_ros::Buffer> buffer,
             rclcpp::Node::SharedPtr node);
   bool find(robot_calibration_msgs::msg::CalibrationData * msg);
+  bool getCaptureStamp(builtin_interfaces::msg::Time& stamp);
 
-private:
-  bool findInternal(robot_calibration_msgs::msg::CalibrationData * msg);
-  bool findCheckerboardPoints(sensor_msgs::msg::Image::ConstSharedPtr image,
-                              std::vector<cv::Point2f>& points);
+protected:
+  /**
+   *  \brief Find the checkerboard in a frame, this is called from the
+   *         detection threads and does not modify the finder.
+   */
+  bool detect(const T& frame, std::vector<cv::Point2f>& points) const;
+
+  /**
+   *  \brief Fill in the observations from a frame where detect() succeeded
+   */
+  void fillObservation(const T& frame,
+                       const std::vector<cv::Point2f>& points,
+                       ObservationBuffer& staged);
+
+  /**
+   *  \brief Find the checkerboard corners in a mono8 image
+   */
+  bool findCheckerboardPoints(const cv::Mat& image,
+                              std::vector<cv::Point2f>& points) const;
+
+  /**
+   *  \brief Detection thread, runs detect() on queued frames until the
+   *         checkerboard is found or find() is done.
+   */
+  void detectFrames();
 
   void cameraCallback(typename T::ConstSharedPtr cloud);
-  bool waitForMsg();
 
   typename rclcpp::Subscription<T>::SharedPtr subscriber_;
   rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr publisher_;
   rclcpp::Clock::SharedPtr clock_;
 
-  bool waiting_;
-  typename T::ConstSharedPtr msg_;
+  // Recent frames, waiting for detection
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<typename T::ConstSharedPtr> frames_;
+  rclcpp::Time after_;  // Only frames stamped after this are queued
+  bool searching_;
+  bool found_;
+  typename T::ConstSharedPtr found_frame_;
+  std::vector<cv::Point2f> found_points_;
+  builtin_interfaces::msg::Time found_stamp_;  // Stamp of the last frame found
+  bool has_found_stamp_;
   DepthCameraInfoManager depth_camera_manager_;
 
   /*
@@ -69,6 +108,11 @@ private:
 
   double square_size_;     /// Size of a square on checkboard (in meters)
 
+  int buffer_size_;         /// Number of recent frames to queue
+  int detection_threads_;   /// Number of threads running detection
+  double timeout_;          /// Time to search for checkerboard (in seconds)
+  double detection_scale_;  /// Scale of image to detect checkerboard in
+
   bool output_debug_;   /// Should we output debug image/cloud?
 
   std::string frame_id_;   /// Name of checkerboard frame
@@ -21,8 +21,19 @@
 #ifndef ROBOT_CALIBRATION_FINDERS_FEATURE_FINDER_HPP
 #define ROBOT_CALIBRATION_FINDERS_FEATURE_FINDER_HPP
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <builtin_interfaces/msg/time.hpp>
 #include <rclcpp/rclcpp.hpp>
 #include <robot_calibration_msgs/msg/calibration_data.hpp>
+#include <robot_calibration_msgs/msg/raw_observation.hpp>
 #include <tf2_ros/buffer.h>
 
 namespace robot_calibration
@@ -34,9 +45,18 @@ namespace robot_calibration
 class FeatureFinder
 {
 public:
+  /**
+   *  @brief Extracts features from a snapshot of sensor data, adding the
+   *         observations to the msg passed in.
+   */
+  using Extractor = std::function<bool(robot_calibration_msgs::msg::CalibrationData * msg)>;
+
   // pluginlib requires empty constructor
   FeatureFinder() {};
-  virtual ~FeatureFinder() {};
+  virtual ~FeatureFinder()
+  {
+    stopExecutor();
+  };
 
   /**
    *  @brief Initialize the feature finder.
@@ -58,7 +78,7 @@ public:
   /**
    *  @brief Get the name of this feature finder.
    */
-  std::string getName()
+  const std::string& getName() const
   {
     return name_;
   }
@@ -74,12 +94,224 @@ public:
    */
   virtual bool find(robot_calibration_msgs::msg::CalibrationData * msg) = 0;
 
+  /**
+   *  @brief Like find(), but returns as soon as the raw sensor data has been
+   *         captured, so that the robot can move on while features are
+   *         extracted. The default implementation simply calls find().
+   *  @returns A function which extracts the features from the captured
+   *           data, possibly on another thread. Extractors of one finder
+   *           are called in order, one at a time. Empty if the data could
+   *           not be captured.
+   */
+  virtual Extractor snapshot()
+  {
+    auto partial = std::make_shared<robot_calibration_msgs::msg::CalibrationData>();
+    if (!find(partial.get()))
+    {
+      return Extractor();
+    }
+    return [partial](robot_calibration_msgs::msg::CalibrationData * msg)
+    {
+      // Each extractor is only called once
+      msg->observations.insert(msg->observations.end(),
+                               std::make_move_iterator(partial->observations.begin()),
+                               std::make_move_iterator(partial->observations.end()));
+      return true;
+    };
+  }
+
+  /**
+   *  @brief Get the raw sensor data used by the last find() or snapshot(),
+   *         so that it can be recorded and replayed later. The default
+   *         implementation does not support replay.
+   *  @param raw Filled with the raw data, the finder_name is not set.
+   *  @returns False if this finder does not support replay, or has not
+   *           captured any data.
+   */
+  virtual bool getRawData(robot_calibration_msgs::msg::RawObservation& raw)
+  {
+    return false;
+  }
+
+  /**
+   *  @brief Extract features from raw sensor data returned by getRawData(),
+   *         possibly from an earlier run, rather than from the sensor. The
+   *         finder should have been initialized by a node with the offline
+   *         parameter set, so that it does not wait for its sensors.
+   *  @returns False if the features could not be extracted, or this finder
+   *           does not support replay.
+   */
+  virtual bool replay(const robot_calibration_msgs::msg::RawObservation& raw,
+                      robot_calibration_msgs::msg::CalibrationData * msg)
+  {
+    return false;
+  }
+
+  /**
+   *  @brief Get the time at which the sensor data used by the last find()
+   *         or snapshot() was captured, so that it can be matched with the
+   *         joint states while the robot is moving. The default
+   *         implementation does not know the capture time.
+   *  @returns False if this finder does not know the capture time, or has
+   *           not captured any data.
+   */
+  virtual bool getCaptureStamp(builtin_interfaces::msg::Time& stamp)
+  {
+    return false;
+  }
+
 protected:
+  /**
+   *  @brief Observations staged by a finder which may still fail. They are
+   *         moved into the message only once the finder succeeds, so that
+   *         the observations already in the message are never copied or
+   *         rolled back.
+   */
+  class ObservationBuffer
+  {
+  public:
+    /**
+     *  @brief Stage a new, empty observation.
+     *  @returns The observation, which stays valid until commit() or clear().
+     */
+    robot_calibration_msgs::msg::Observation& add(const std::string& sensor_name)
+    {
+      observations_.emplace_back();
+      observations_.back().sensor_name = sensor_name;
+      return observations_.back();
+    }
+
+    /** @brief Move the staged observations to the end of the message. */
+    void commit(robot_calibration_msgs::msg::CalibrationData * msg)
+    {
+      msg->observations.reserve(msg->observations.size() + observations_.size());
+      std::move(observations_.begin(), observations_.end(),
+                std::back_inserter(msg->observations));
+      observations_.clear();
+    }
+
+    /** @brief Discard the staged observations. */
+    void clear()
+    {
+      observations_.clear();
+    }
+
+    size_t size() const
+    {
+      return observations_.size();
+    }
+
+  private:
+    // Not invalidated by add()
+    std::deque<robot_calibration_msgs::msg::Observation> observations_;
+  };
+
+  /**
+   *  @brief Get options for a subscription whose callbacks are serviced
+   *         by a dedicated executor thread, so that messages arrive while
+   *         find() waits without anyone spinning the node. Must be called
+   *         after init() of this class.
+   */
+  rclcpp::SubscriptionOptions getSubscriptionOptions()
+  {
+    startExecutor();
+    rclcpp::SubscriptionOptions options;
+    options.callback_group = callback_group_;
+    return options;
+  }
+
+  /**
+   *  @brief Store a message in a subscription callback, and wake up
+   *         waitForMessage().
+   *  @param msg The message received.
+   *  @param latest Where to store it, only accessed under message_mutex_.
+   */
+  template <typename MsgT>
+  void storeMessage(const std::shared_ptr<const MsgT>& msg,
+                    std::shared_ptr<const MsgT>& latest)
+  {
+    {
+      std::lock_guard<std::mutex> lock(message_mutex_);
+      latest = msg;
+    }
+    message_condition_.notify_all();
+  }
+
+  /**
+   *  @brief Wait for a message stamped after some time.
+   *  @param latest The message stored by storeMessage().
+   *  @param after The message must be stamped after this time, typically
+   *         when the robot settled, so that it was not captured in motion.
+   *  @param timeout Maximum time to wait, in seconds.
+   *  @returns The message, or nullptr if none arrived in time.
+   */
+  template <typename MsgT>
+  std::shared_ptr<const MsgT> waitForMessage(const std::shared_ptr<const MsgT>& latest,
+                                             const rclcpp::Time& after,
+                                             double timeout)
+  {
+    std::unique_lock<std::mutex> lock(message_mutex_);
+    auto fresh = [&]()
+    {
+      return latest && rclcpp::Time(latest->header.stamp, after.get_clock_type()) > after;
+    };
+    if (!message_condition_.wait_for(lock, std::chrono::duration<double>(timeout), fresh))
+    {
+      return nullptr;
+    }
+    return latest;
+  }
+
+  /**
+   *  @brief Stop servicing subscription callbacks. Called on destruction,
+   *         derived classes whose callbacks use their own members should
+   *         call this first in their destructor.
+   */
+  void stopExecutor()
+  {
+    if (executor_)
+    {
+      executor_->cancel();
+      executor_thread_.join();
+      executor_.reset();
+    }
+  }
+
   std::shared_ptr<tf2_ros::Buffer> tf2_buffer_;
   rclcpp::Node::WeakPtr node_ptr_;
 
+  // Guards messages stored by storeMessage()
+  std::mutex message_mutex_;
+  std::condition_variable message_condition_;
+
 private:
+  void startExecutor()
+  {
+    if (executor_)
+    {
+      return;
+    }
+
+    auto node = node_ptr_.lock();
+    if (!node)
+    {
+      return;
+    }
+
+    // Not added to the executor of the node, so other code spinning the
+    // node does not dispatch these callbacks
+    callback_group_ = node->create_callback_group(
+      rclcpp::CallbackGroupType::MutuallyExclusive, false);
+    executor_ = std::make_shared<rclcpp::executors::SingleThreadedExecutor>();
+    executor_->add_callback_group(callback_group_, node->get_node_base_interface());
+    executor_thread_ = std::thread([this]() { executor_->spin(); });
+  }
+
   std::string name_;
+
+  rclcpp::CallbackGroup::SharedPtr callback_group_;
+  std::shared_ptr<rclcpp::executors::SingleThreadedExecutor> executor_;
+  std::thread executor_thread_;
 };
 
 }  // namespace robot_calibration
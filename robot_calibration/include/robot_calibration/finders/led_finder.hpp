@@ -27,6 +27,7 @@
 #include <robot_calibration/util/action_client.hpp>
 #include <robot_calibration/util/depth_camera_info.hpp>
 
+#include <sensor_msgs/msg/camera_info.hpp>
 #include <sensor_msgs/msg/image.hpp>
 #include <sensor_msgs/msg/point_cloud2.hpp>
 #include <geometry_msgs/msg/point_stamped.hpp>
@@ -39,6 +40,7 @@ namespace robot_calibration
 /** @brief This class processes the point cloud input to find the LED. */
 class LedFinder : public FeatureFinder
 {
+protected:
   /** @brief Internally used within LED finder to track each of several LEDs. */
   struct CloudDifferenceTracker
   {
@@ -47,19 +49,37 @@ class LedFinder : public FeatureFinder
     /**
      * @brief Update the tracker based on new cloud compared to previous.
      * @param cloud The newest cloud
-     * @param prev The previous cloud
+     * @param difference The change in color of each point since the
+     *        previous cloud, from LedFinder::updateDifference()
      * @param led_point The expected pose of this led in cloud frame
      * @param max_distance The maximum distance from expected led pose
      *        that we should consider changes.
      * @param weight Whether the change between frames should increase
      *        or decrease the LED point values. Should be +/- 1 typically.
      */
-    bool process(sensor_msgs::msg::PointCloud2& cloud,
-                 sensor_msgs::msg::PointCloud2& prev,
+    bool process(const sensor_msgs::msg::PointCloud2& cloud,
+                 const std::vector<double>& difference,
                  geometry_msgs::msg::Point& led_point,
                  double max_distance,
                  double weight);
 
+    /**
+     * @brief Correlate the color of a cloud with the pattern of this LED,
+     *        the max is not updated, see updateMax().
+     * @param cloud The newest cloud
+     * @param led_point The expected pose of this led in cloud frame
+     * @param max_distance The maximum distance from expected led pose
+     *        that we should consider changes.
+     * @param sign Whether the LED was on (+1) or off (-1) in this cloud.
+     */
+    void correlate(const sensor_msgs::msg::PointCloud2& cloud,
+                   const geometry_msgs::msg::Point& led_point,
+                   double max_distance,
+                   double sign);
+
+    // Find the max within the region, once a full set of patterns is correlated
+    void updateMax();
+
     // Have we found the LED?
     bool isFound(const sensor_msgs::msg::PointCloud2& cloud,
                  double threshold);
@@ -68,10 +88,22 @@ class LedFinder : public FeatureFinder
     bool getRefinedCentroid(const sensor_msgs::msg::PointCloud2& cloud,
                             geometry_msgs::msg::PointStamped& centroid);
 
-    // Reset the tracker
+    // Reset the tracker, the region is reset to the full frame
     void reset(size_t height, size_t width);
 
-    // Get an image of tracker status
+    /**
+     * @brief Limit processing to the pixels that points within max_distance
+     *        of the LED can project to. Uses the full frame if the LED may
+     *        not be in front of the camera, or the cloud is unorganized.
+     * @param led_point The expected pose of this led in cloud frame
+     * @param camera_info Intrinsics of the camera which produced the cloud
+     * @param max_distance The maximum distance from expected led pose
+     */
+    void setRegion(const geometry_msgs::msg::Point& led_point,
+                   const sensor_msgs::msg::CameraInfo& camera_info,
+                   double max_distance);
+
+    // Get an image of tracker status, within the region
     sensor_msgs::msg::Image getImage();
 
     std::vector<double> diff_;
@@ -79,6 +111,8 @@ class LedFinder : public FeatureFinder
     int max_idx_;
     int count_;
     size_t height_, width_;
+    size_t roi_min_x_, roi_max_x_;  // region processed, max is exclusive
+    size_t roi_min_y_, roi_max_y_;
     std::string frame_;  // frame of led coordinates
     geometry_msgs::msg::Point point_;  //coordinates of led this is tracking
   };
@@ -87,26 +121,71 @@ class LedFinder : public FeatureFinder
 
 public:
   LedFinder();
+  virtual ~LedFinder()
+  {
+    stopExecutor();
+  }
   bool init(const std::string& name,
             std::shared_ptr<tf2_ros::Buffer> buffer,
             rclcpp::Node::SharedPtr node);
   bool find(robot_calibration_msgs::msg::CalibrationData * msg);
 
-private:
+protected:
   void cameraCallback(sensor_msgs::msg::PointCloud2::ConstSharedPtr cloud);
   bool waitForCloud();
 
+  /** @brief Set the LEDs to a code, and wait for the command to finish. */
+  void setLeds(uint8_t code);
+
+  /**
+   * @brief Toggle each LED on and off in turn until all trackers converge.
+   */
+  bool cycleToggled(const sensor_msgs::msg::CameraInfo& camera_info);
+
+  /**
+   * @brief Show the multiplexed patterns until all trackers converge.
+   */
+  bool cycleMultiplexed(const sensor_msgs::msg::CameraInfo& camera_info);
+
+  /**
+   * @brief Get whether the LED of a tracker is on (+1) or off (-1) in a
+   *        frame of the multiplexed patterns.
+   */
+  int getPatternSign(size_t tracker, size_t frame) const;
+
+  /**
+   * @brief Get expected pose of the LED of a tracker in the cloud frame.
+   */
+  bool getExpectedPose(const CloudDifferenceTracker& tracker,
+                       geometry_msgs::msg::PointStamped& led);
+
+  /**
+   * @brief Publish the image of each tracker which has subscribers.
+   */
+  void publishTrackers();
+
+  /**
+   * @brief Compute the change in color of each point within the region of a
+   *        tracker into difference_. Positive if every channel got brighter,
+   *        negative if every channel got darker, zero otherwise.
+   */
+  bool updateDifference(const sensor_msgs::msg::PointCloud2& cloud,
+                        const sensor_msgs::msg::PointCloud2& prev,
+                        const CloudDifferenceTracker& tracker);
+
   rclcpp::Subscription<sensor_msgs::msg::PointCloud2>::SharedPtr subscriber_;
   rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr publisher_;
   robot_calibration::ActionClient<LedAction> client_;
   rclcpp::Clock::SharedPtr clock_;
 
-  bool waiting_;
-  sensor_msgs::msg::PointCloud2 cloud_;
+  sensor_msgs::msg::PointCloud2::ConstSharedPtr latest_;  // Written by cameraCallback
+  sensor_msgs::msg::PointCloud2::ConstSharedPtr cloud_;   // Returned by waitForCloud
 
   std::vector<rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr> tracker_publishers_;
   std::vector<CloudDifferenceTracker> trackers_;
+  std::vector<double> difference_;
   std::vector<uint8_t> codes_;
+  std::vector<uint8_t> patterns_;  // Code of each multiplexed frame
 
   DepthCameraInfoManager depth_camera_manager_;
 
@@ -119,6 +198,8 @@ private:
   double threshold_;    /// Minimum value of diffs in order to trigger that this is an LED
   int max_iterations_;  /// Maximum number of cycles before we abort finding the LED
 
+  bool multiplex_;      /// Drive all LEDs at once with orthogonal patterns?
+  bool use_roi_;        /// Only process a region around each LED?
   bool output_debug_;   /// Should we output debug image/cloud?
 
   std::string camera_sensor_name_;
@@ -23,6 +23,8 @@
 
 #include <map>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include <rclcpp/rclcpp.hpp>
 #include <pluginlib/class_loader.hpp>
@@ -68,8 +70,14 @@ public:
       return false;
     }
 
+    // Initialize the finders concurrently, so that they wait for their
+    // servers and camera info at the same time. Finders which are not
+    // thread safe during init() can be initialized one at a time.
+    bool parallel_init = node->declare_parameter<bool>("parallel_finder_init", true);
+
     // Load each finder
     RCLCPP_INFO(logger, "Loading %d feature finders.", static_cast<int>(feature_names.size()));
+    std::vector<FeatureFinderPtr> finders;
     for (auto name : feature_names)
     {
       // Get finder type
@@ -82,19 +90,46 @@ public:
         return false;
       }
 
-      // Load correct finder
-      FeatureFinderPtr finder;
+      // Load correct finder, the class loader is not thread safe
       RCLCPP_INFO(logger, "  New %s: %s", type.c_str(), name.c_str());
-      finder = plugin_loader_.createSharedInstance(type);
-      if (finder && finder->init(name, tf2_buffer_, node))
+      finders.push_back(plugin_loader_.createSharedInstance(type));
+    }
+
+    std::vector<char> initialized(finders.size(), false);
+    auto initFinder = [&](size_t i)
+    {
+      initialized[i] = finders[i] && finders[i]->init(feature_names[i], tf2_buffer_, node);
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < finders.size(); ++i)
+    {
+      if (parallel_init)
+      {
+        threads.emplace_back(initFinder, i);
+      }
+      else
+      {
+        initFinder(i);
+      }
+    }
+    for (auto& thread : threads)
+    {
+      thread.join();
+    }
+
+    // Report them together, once all are done
+    for (size_t i = 0; i < finders.size(); ++i)
+    {
+      if (initialized[i])
       {
-        features[name] = finder;
+        features[feature_names[i]] = finders[i];
       }
       else
       {
-        RCLCPP_ERROR(logger, "Feature finder %s failed to initialize", name.c_str());
+        RCLCPP_ERROR(logger, "Feature finder %s failed to initialize", feature_names[i].c_str());
       }
     }
+    RCLCPP_INFO(logger, "Initialized %lu of %lu feature finders.", features.size(), finders.size());
 
     // Make sure at least one finder loaded correctly
     if (features.empty())
@@ -34,15 +34,31 @@ class PlaneFinder : public FeatureFinder
 {
 public:
   PlaneFinder();
-  virtual ~PlaneFinder() = default;
+  virtual ~PlaneFinder()
+  {
+    stopExecutor();
+  }
   virtual bool init(const std::string& name,
                     std::shared_ptr<tf2_ros::Buffer> buffer,
                     rclcpp::Node::SharedPtr node);
   virtual bool find(robot_calibration_msgs::msg::CalibrationData * msg);
+  virtual Extractor snapshot();
+  virtual bool getRawData(robot_calibration_msgs::msg::RawObservation& raw);
+  virtual bool replay(const robot_calibration_msgs::msg::RawObservation& raw,
+                      robot_calibration_msgs::msg::CalibrationData * msg);
+  virtual bool getCaptureStamp(builtin_interfaces::msg::Time& stamp);
 
 protected:
   /**
-   * @brief ROS callback - updates cloud_ and resets waiting_ to false
+   * @brief Extract the observations from a cloud
+   * @param cloud The cloud from waitForCloud()
+   * @param msg CalibrationData to fill with observations
+   */
+  virtual bool extract(const sensor_msgs::msg::PointCloud2& cloud,
+                       robot_calibration_msgs::msg::CalibrationData * msg);
+
+  /**
+   * @brief ROS callback - updates latest_ and wakes up waitForCloud()
    */
   virtual void cameraCallback(sensor_msgs::msg::PointCloud2::ConstSharedPtr cloud);
 
@@ -59,6 +75,24 @@ protected:
   virtual void removeInvalidPoints(sensor_msgs::msg::PointCloud2& cloud,
                                    double min_x, double max_x, double min_y, double max_y, double min_z, double max_z);
 
+  /**
+   * @brief Copy the valid points of a cloud into another
+   * @param input The point cloud to copy valid points from
+   * @param cloud The point cloud to copy valid points into, its buffer is
+   *        reused so this does not allocate once it has grown. May be input.
+   */
+  virtual void removeInvalidPoints(const sensor_msgs::msg::PointCloud2& input,
+                                   sensor_msgs::msg::PointCloud2& cloud,
+                                   double min_x, double max_x, double min_y, double max_y, double min_z, double max_z);
+
+  /**
+   * @brief Downsample a cloud to the centroid of the points in each voxel,
+   *        this gives uniform coverage of surfaces regardless of how far they
+   *        are from the sensor. Does nothing if voxel_size is not set.
+   * @param cloud The point cloud to downsample
+   */
+  virtual void downsampleCloud(sensor_msgs::msg::PointCloud2& cloud);
+
   /**
    * @brief Extract a plane from the point cloud
    * @brief cloud The cloud to extract plane from - non-plane points will remain
@@ -79,7 +113,8 @@ protected:
                                   rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr publisher);
 
   /**
-   * @brief Wait until a new cloud has arrived
+   * @brief Wait until a cloud captured after this call has arrived, and
+   *        store it in msg_
    */
   virtual bool waitForCloud();
 
@@ -87,14 +122,23 @@ protected:
   rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr publisher_;
   rclcpp::Clock::SharedPtr clock_;
 
-  bool waiting_;
+  // Latest cloud, shared with the middleware rather than copied
+  sensor_msgs::msg::PointCloud2::ConstSharedPtr latest_;
+  // Cloud returned by waitForCloud()
+  sensor_msgs::msg::PointCloud2::ConstSharedPtr msg_;
+  // Cloud used by the last find() or snapshot(), for getRawData()
+  sensor_msgs::msg::PointCloud2::ConstSharedPtr raw_;
+  // Valid points of msg_, which is modified while finding features
   sensor_msgs::msg::PointCloud2 cloud_;
+  // Time of transforms used by extract(), latest unless run by snapshot()
+  tf2::TimePoint transform_time_;
   DepthCameraInfoManager depth_camera_manager_;
 
   // See init() function for parameter definitions
   std::string plane_sensor_name_;
   int points_max_;
   double initial_sampling_distance_;
+  double voxel_size_;
   double plane_tolerance_;
   double min_x_, max_x_;
   double min_y_, max_y_;
@@ -104,6 +148,9 @@ protected:
   std::string transform_frame_;
   int ransac_iterations_;
   int ransac_points_;
+  int ransac_threads_;
+  int ransac_seed_;
+  double ransac_confidence_;
 
   bool output_debug_;
 };
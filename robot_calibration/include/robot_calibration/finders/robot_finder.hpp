@@ -32,9 +32,11 @@ public:
   virtual bool init(const std::string& name,
                    std::shared_ptr<tf2_ros::Buffer> buffer,
                    rclcpp::Node::SharedPtr node);
-  virtual bool find(robot_calibration_msgs::msg::CalibrationData * msg);
 
 protected:
+  virtual bool extract(const sensor_msgs::msg::PointCloud2& cloud,
+                       robot_calibration_msgs::msg::CalibrationData * msg);
+
   // Observation name for robot points
   std::string robot_sensor_name_;
 
@@ -18,6 +18,7 @@
 #ifndef ROBOT_CALIBRATION_FINDERS_SCAN_FINDER_HPP
 #define ROBOT_CALIBRATION_FINDERS_SCAN_FINDER_HPP
 
+#include <vector>
 #include <rclcpp/rclcpp.hpp>
 #include <robot_calibration/finders/feature_finder.hpp>
 #include <robot_calibration_msgs/msg/calibration_data.hpp>
@@ -35,20 +36,25 @@ class ScanFinder : public FeatureFinder
 {
 public:
   ScanFinder();
-  virtual ~ScanFinder() = default;
+  virtual ~ScanFinder()
+  {
+    stopExecutor();
+  }
   virtual bool init(const std::string& name,
                     std::shared_ptr<tf2_ros::Buffer> buffer,
                     rclcpp::Node::SharedPtr node);
   virtual bool find(robot_calibration_msgs::msg::CalibrationData * msg);
+  virtual bool getCaptureStamp(builtin_interfaces::msg::Time& stamp);
 
 protected:
   /**
-   * @brief ROS callback - updates scan_ and resets waiting_ to false
+   * @brief ROS callback - updates latest_ and wakes up waitForScan()
    */
   virtual void scanCallback(sensor_msgs::msg::LaserScan::ConstSharedPtr scan);
 
   /**
-   * @brief Wait until a new scan has arrived
+   * @brief Wait until a scan captured after this call has arrived, and
+   *        store it in scan_
    */
   virtual bool waitForScan();
 
@@ -57,6 +63,11 @@ protected:
    */
   void extractPoints(sensor_msgs::msg::PointCloud2& cloud);
 
+  /**
+   * @brief Update the sin/cos of each beam angle, if the scan geometry changed
+   */
+  void updateAngleTables();
+
   /**
    * @brief Extract the point cloud into a calibration message.
    */
@@ -68,8 +79,9 @@ protected:
 
   rclcpp::Clock::SharedPtr clock_;
 
-  bool waiting_;
-  sensor_msgs::msg::LaserScan scan_;
+  // Latest scan, and the scan returned by waitForScan()
+  sensor_msgs::msg::LaserScan::ConstSharedPtr latest_;
+  sensor_msgs::msg::LaserScan::ConstSharedPtr scan_;
 
   std::string laser_sensor_name_;
   double min_x_;
@@ -81,6 +93,12 @@ protected:
   std::string transform_frame_;
 
   bool output_debug_;
+
+  // Sin/cos of each beam angle, and the scan geometry they were computed for
+  std::vector<double> cos_table_;
+  std::vector<double> sin_table_;
+  float table_angle_min_;
+  float table_angle_increment_;
 };
 
 }  // namespace robot_calibration
@@ -45,19 +45,62 @@ public:
   virtual ~Camera2dModel() {}
 
   /**
-   *  @brief Compute the updated positions of the observed points
+   *  @brief Resolve the joints, offsets and camera parameters used by this
+   *         model to indices.
    */
-  virtual std::vector<geometry_msgs::msg::PointStamped> project(
-    const robot_calibration_msgs::msg::CalibrationData& data,
-    const OptimizationOffsets& offsets);
+  virtual bool compile(const robot_calibration_msgs::msg::CalibrationData& data,
+                       const OptimizationOffsets& offsets,
+                       ChainPlan& plan) const;
+
+  /** @brief Pixels cannot be projected with projectWithJacobian(). */
+  virtual bool hasAnalyticJacobian(const ChainPlan& plan,
+                                   const OptimizationOffsets& offsets) const;
 
   /**
    *  @brief Compute the pixel coordinates of 3d coordinates, using camera model
    */
-  virtual std::vector<geometry_msgs::msg::PointStamped> project_pixel_error(
+  std::vector<geometry_msgs::msg::PointStamped> project_pixel_error(
     const robot_calibration_msgs::msg::CalibrationData& data,
     const std::vector<geometry_msgs::msg::PointStamped>& points,
-    const OptimizationOffsets& offsets);
+    const OffsetsView& offsets) const;
+
+  /**
+   *  @brief Compute the error between the observed pixels and the pixel
+   *         coordinates of 3d points, using camera model
+   *  @param data The calibration data for this observation.
+   *  @param points The 3d points, in the root frame, one per column.
+   *  @param offsets The offsets that the solver wants to examine.
+   *  @param pixels The pixel error of each point.
+   *  @returns False if the data has no observation for this model, or the
+   *           number of points does not match the observation.
+   */
+  bool project_pixel_error(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const Matrix3X<double>& points,
+    const OffsetsView& offsets,
+    Matrix2X<double>& pixels) const;
+  bool project_pixel_error(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const Matrix3X<Jet>& points,
+    const JetOffsetsView& offsets,
+    Matrix2X<Jet>& pixels) const;
+
+  /**
+   *  @brief Compute the error between the observed pixels and the pixel
+   *         coordinates of 3d points, using a plan from compile().
+   */
+  bool project_pixel_error(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const Matrix3X<double>& points,
+    const OffsetsView& offsets,
+    Matrix2X<double>& pixels) const;
+  bool project_pixel_error(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const Matrix3X<Jet>& points,
+    const JetOffsetsView& offsets,
+    Matrix2X<Jet>& pixels) const;
 
   /**
    * @brief Get the type for this model.
@@ -65,6 +108,38 @@ public:
   virtual std::string getType() const;
 
 protected:
+  /**
+   *  @brief A 2d camera cannot project its observations into 3d, this
+   *         always returns false.
+   */
+  virtual bool projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points) const;
+  virtual bool projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const JetOffsetsView& offsets,
+    Matrix3X<Jet>& points) const;
+
+  template <typename T>
+  bool projectPixels(const robot_calibration_msgs::msg::CalibrationData& data,
+                     const ChainPlan& plan,
+                     const Matrix3X<T>& points,
+                     const OffsetsViewT<T>& offsets,
+                     Matrix2X<T>& pixels) const;
+
+  // Order of camera parameters in ChainPlan::params
+  enum
+  {
+    PARAM_FX,
+    PARAM_FY,
+    PARAM_CX,
+    PARAM_CY,
+    NUM_PARAMS
+  };
+
   std::string param_name_;
 };
 
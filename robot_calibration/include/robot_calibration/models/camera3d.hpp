@@ -44,11 +44,19 @@ public:
   virtual ~Camera3dModel() {}
 
   /**
-   *  @brief Compute the updated positions of the observed points
+   *  @brief Resolve the joints, offsets and camera parameters used by this
+   *         model to indices.
    */
-  virtual std::vector<geometry_msgs::msg::PointStamped> project(
-    const robot_calibration_msgs::msg::CalibrationData& data,
-    const OptimizationOffsets& offsets);
+  virtual bool compile(const robot_calibration_msgs::msg::CalibrationData& data,
+                       const OptimizationOffsets& offsets,
+                       ChainPlan& plan) const;
+
+  /**
+   *  @brief Camera parameters are not supported by projectWithJacobian(),
+   *         so they must not be free.
+   */
+  virtual bool hasAnalyticJacobian(const ChainPlan& plan,
+                                   const OptimizationOffsets& offsets) const;
 
   /**
    * @brief Get the type for this model.
@@ -56,6 +64,45 @@ public:
   virtual std::string getType() const;
 
 protected:
+  /**
+   *  @brief Compute the updated positions of the observed points
+   */
+  virtual bool projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points) const;
+  virtual bool projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const JetOffsetsView& offsets,
+    Matrix3X<Jet>& points) const;
+
+  virtual bool projectCompiledWithJacobian(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points,
+    ProjectionJacobian& jacobian) const;
+
+  template <typename T>
+  bool projectCamera(const robot_calibration_msgs::msg::CalibrationData& data,
+                     const ChainPlan& plan,
+                     const OffsetsViewT<T>& offsets,
+                     Matrix3X<T>& points) const;
+
+  // Order of camera parameters in ChainPlan::params
+  enum
+  {
+    PARAM_FX,
+    PARAM_FY,
+    PARAM_CX,
+    PARAM_CY,
+    PARAM_Z_OFFSET,
+    PARAM_Z_SCALING,
+    NUM_PARAMS
+  };
+
   std::string param_name_;
 };
 
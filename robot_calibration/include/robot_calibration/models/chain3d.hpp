@@ -24,6 +24,8 @@
 #include <string>
 #include <kdl/chain.hpp>
 #include <kdl/tree.hpp>
+#include <Eigen/Geometry>
+#include <robot_calibration/optimization/jet.hpp>
 #include <robot_calibration/optimization/offsets.hpp>
 
 #include <geometry_msgs/msg/point_stamped.hpp>
@@ -34,6 +36,167 @@
 namespace robot_calibration
 {
 
+/**
+ *  @brief Forward kinematics of the leading segments which the chains of
+ *         two models have in common, for instance the torso of a head
+ *         camera chain and an arm chain. The models of an error block share
+ *         one of these, so the common segments are computed only once for
+ *         each evaluation. See shareChainFK().
+ *
+ *  The FK is only valid for one set of offsets (and, for Jets, one set of
+ *  derivative seeds), so the owner must reset() before every evaluation.
+ *  Like the rest of the error block, it is only used by one thread at once.
+ */
+class SharedChainFK
+{
+public:
+  template <typename T>
+  struct State
+  {
+    bool valid;
+    Eigen::Matrix<T, 3, 3> rotation;
+    Eigen::Matrix<T, 3, 1> position;
+  };
+
+  SharedChainFK()
+  {
+    reset();
+  }
+
+  /** @brief Forget the FK, before evaluating at new offsets. */
+  void reset()
+  {
+    value_.valid = false;
+    jet_.valid = false;
+  }
+
+  /** @brief Get the FK for scalar type T. */
+  template <typename T>
+  State<T>& get()
+  {
+    return get(static_cast<T*>(nullptr));
+  }
+
+private:
+  State<double>& get(double*) { return value_; }
+  State<Jet>& get(Jet*) { return jet_; }
+
+  State<double> value_;
+  State<Jet> jet_;
+};
+
+/**
+ *  @brief A compiled evaluation plan for a model. The joint positions and
+ *         offsets used by the model are resolved to indices and handles
+ *         once, so that projection does not need any string lookups or
+ *         allocation.
+ *
+ *  A plan is only valid for calibration data with the same joint states and
+ *  observations as the data it was compiled from. If the layout of the
+ *  offsets changes (see OptimizationOffsets::getRevision()), the plan is
+ *  ignored and projection falls back to resolving names.
+ */
+struct ChainPlan
+{
+  ChainPlan() :
+    sensor_index(-1),
+    offsets_revision(0),
+    shared_segments(0),
+    shared_fk(nullptr)
+  {
+  }
+
+  /** @brief Indices for each segment of the chain */
+  struct Segment
+  {
+    // Index into JointState::position, -1 if not found
+    int joint_index;
+    // Handle of the joint offset
+    ParamHandle offset;
+    // Handle of the frame offset
+    FrameHandle frame;
+    // If the pose of this segment does not depend on any free parameter,
+    // the end of the run of such segments, and the FK from the start of
+    // this segment to the tip of the run, otherwise the end is 0. These
+    // are computed once, for the joint states of the data.
+    size_t run_end;
+    Eigen::Matrix3d run_rotation;
+    Eigen::Vector3d run_position;
+  };
+
+  std::vector<Segment> segments;
+
+  /** @brief Index of the observation for this model, -1 if not found */
+  int sensor_index;
+
+  /** @brief Observed features, extracted from the observation */
+  Eigen::Matrix3Xd features;
+
+  /** @brief A run of consecutive features which have the same frame */
+  struct FeatureGroup
+  {
+    // Frame offset to apply to the features, before the FK projection
+    FrameHandle frame;
+    // Range of columns in features
+    int begin;
+    int end;
+  };
+
+  std::vector<FeatureGroup> feature_groups;
+
+  /** @brief Handles of any model-specific parameters (camera intrinsics) */
+  std::vector<ParamHandle> params;
+
+  /** @brief Values of the model-specific parameters from the observation */
+  std::vector<double> constants;
+
+  /**
+   *  @brief Observed features in the native space of the sensor, for models
+   *         which reproject the features through calibrated intrinsics (for
+   *         a depth camera, each column is the pixel u, v and raw depth).
+   */
+  Eigen::Matrix3Xd measurements;
+
+  /** @brief Revision of the offsets that this plan was compiled against */
+  size_t offsets_revision;
+
+  /**
+   *  @brief Number of leading segments whose FK is stored in shared_fk,
+   *         0 if the FK is not shared with another plan.
+   */
+  size_t shared_segments;
+  SharedChainFK* shared_fk;
+};
+
+/**
+ *  @brief Derivative of a transform with respect to one free parameter.
+ */
+struct TransformDerivative
+{
+  ParamHandle param;
+  Eigen::Matrix3d rotation;
+  Eigen::Vector3d translation;
+};
+
+/**
+ *  @brief Derivatives of projected points with respect to the free
+ *         parameters, from Chain3dModel::projectWithJacobian().
+ */
+struct ProjectionJacobian
+{
+  /** @brief The free parameters, one per column of the jacobian */
+  std::vector<ParamHandle> params;
+
+  /**
+   *  @brief Derivative of coordinate j of point i, in row (3 * i + j), with
+   *         respect to each parameter.
+   */
+  Eigen::MatrixXd jacobian;
+
+  /** @brief Get the column of a parameter, adding it if needed. */
+  int getColumn(const ParamHandle& param);
+};
+
 /**
  *  @brief Model of a kinematic chain. This is the basic instance where we
  *         transform the world observations into the proper root frame.
@@ -117,16 +280,108 @@ public:
    *  @param data The calibration data for this observation.
    *  @param offsets The offsets that the solver wants to examine.
    */
-  virtual std::vector<geometry_msgs::msg::PointStamped> project(
+  std::vector<geometry_msgs::msg::PointStamped> project(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const OffsetsView& offsets) const;
+
+  /**
+   *  @brief Compute the position of the estimated points, in the root frame.
+   *  @param data The calibration data for this observation.
+   *  @param offsets The offsets that the solver wants to examine.
+   *  @param points The projected points, one per column.
+   *  @returns False if the data has no observation for this model.
+   *
+   *  Projection does not modify the model, and may be called from
+   *  multiple threads at once. Overloads are provided for double and for
+   *  Jet, so that error blocks can use automatic differentiation.
+   */
+  bool project(
     const robot_calibration_msgs::msg::CalibrationData& data,
-    const OptimizationOffsets& offsets);
+    const OffsetsView& offsets,
+    Matrix3X<double>& points) const;
+  bool project(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const JetOffsetsView& offsets,
+    Matrix3X<Jet>& points) const;
+
+  /**
+   *  @brief Compute the position of the estimated points, in the root frame,
+   *         using a plan from compile(). This is what error blocks use, since
+   *         they evaluate the same data many times.
+   */
+  bool project(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points) const;
+  bool project(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const JetOffsetsView& offsets,
+    Matrix3X<Jet>& points) const;
+
+  /**
+   *  @brief Whether projectWithJacobian() can differentiate with respect to
+   *         all of the free parameters used by a plan.
+   */
+  virtual bool hasAnalyticJacobian(const ChainPlan& plan,
+                                   const OptimizationOffsets& offsets) const;
+
+  /**
+   *  @brief Compute the position of the estimated points, in the root frame,
+   *         and their derivatives with respect to the free parameters.
+   *
+   *  The derivatives with respect to joint and frame offsets are found in
+   *  closed form, from a single traversal of the chain, rather than by
+   *  differentiating the projection.
+   *
+   *  @param jacobian Returns the derivatives, only free parameters with
+   *         some effect on the points have a column.
+   *  @returns False if the data has no observation for this model, or if
+   *           hasAnalyticJacobian() is false.
+   */
+  bool projectWithJacobian(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points,
+    ProjectionJacobian& jacobian) const;
+
+  /**
+   *  @brief Resolve the joints and offsets used by this model to indices.
+   *  @param data The calibration data which will be projected.
+   *  @param offsets The offsets which will be used for projection.
+   *  @param plan The plan to fill in.
+   *  @returns False if the data has no observation for this model.
+   */
+  virtual bool compile(const robot_calibration_msgs::msg::CalibrationData& data,
+                       const OptimizationOffsets& offsets,
+                       ChainPlan& plan) const;
 
   /**
    *  @brief Compute the forward kinematics of the chain, based on the
    *         offsets and the joint positions of the state message.
+   *
+   *  This is instantiated for double and Jet.
+   */
+  template <typename T>
+  Transform<T> getChainFK(const OffsetsViewT<T>& offsets,
+                          const sensor_msgs::msg::JointState& state) const;
+
+  /**
+   *  @brief Compute the forward kinematics of the chain, using the indices
+   *         of a plan from compile().
+   */
+  template <typename T>
+  Transform<T> getChainFK(const ChainPlan& plan,
+                          const OffsetsViewT<T>& offsets,
+                          const sensor_msgs::msg::JointState& state) const;
+
+  /**
+   *  @brief Get the number of leading segments of the chain which are the
+   *         same as those of another model.
    */
-  KDL::Frame getChainFK(const OptimizationOffsets& offsets,
-                        const sensor_msgs::msg::JointState& state);
+  size_t getSharedSegments(const Chain3dModel& other) const;
 
   /**
    * @brief Get the name of this model (as provided in the YAML config)
@@ -138,8 +393,94 @@ public:
    */
   virtual std::string getType() const;
 
+protected:
+  /**
+   *  @brief Compute the position of the estimated points, using a plan
+   *         which is known to be current. Derived models override this.
+   */
+  virtual bool projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points) const;
+  virtual bool projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const JetOffsetsView& offsets,
+    Matrix3X<Jet>& points) const;
+
+  /**
+   *  @brief Implementation of projectWithJacobian(), using a plan which is
+   *         known to be current. Derived models override this.
+   */
+  virtual bool projectCompiledWithJacobian(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points,
+    ProjectionJacobian& jacobian) const;
+
+  /**
+   *  @brief Compute the forward kinematics of the chain, and its derivative
+   *         with respect to each free parameter of the joint and frame
+   *         offsets along the chain.
+   */
+  void getChainFKDerivatives(const ChainPlan& plan,
+                             const OffsetsView& offsets,
+                             const sensor_msgs::msg::JointState& state,
+                             Transform<double>& fk,
+                             std::vector<TransformDerivative>& derivatives) const;
+
+  /** @brief Implementation of projectCompiled() for both double and Jet */
+  template <typename T>
+  bool projectChain(const robot_calibration_msgs::msg::CalibrationData& data,
+                    const ChainPlan& plan,
+                    const OffsetsViewT<T>& offsets,
+                    Matrix3X<T>& points) const;
+
+  /** @brief Fill in the segments of the plan, for the given joint states */
+  void compileChain(const sensor_msgs::msg::JointState& state,
+                    const OptimizationOffsets& offsets,
+                    ChainPlan& plan) const;
+
+  /**
+   *  @brief Compute the transform from the start to the tip of one segment,
+   *         including its joint position and any corrections.
+   */
+  template <typename T>
+  void getSegmentPose(size_t i,
+                      const ChainPlan::Segment& compiled,
+                      const OffsetsViewT<T>& offsets,
+                      const sensor_msgs::msg::JointState& state,
+                      Eigen::Matrix<T, 3, 3>& rotation,
+                      Eigen::Matrix<T, 3, 1>& position) const;
+
 private:
+  /**
+   *  @brief A segment of the chain. This replicates what KDL::Segment does,
+   *         but because KDL::Joint::pose() caches the last rotation inside
+   *         the joint, it is not safe to use KDL when projecting from multiple
+   *         threads, and it does not support Jets.
+   */
+  struct ChainSegment
+  {
+    enum
+    {
+      FIXED,
+      ROTATIONAL,
+      TRANSLATIONAL
+    } type;
+    std::string joint_name;
+    Eigen::Vector3d joint_axis;
+    Eigen::Vector3d joint_origin;
+    // From the joint frame to the tip of the segment (KDL::Segment::f_tip)
+    Eigen::Isometry3d joint_to_tip;
+    // Pose of the segment tip at zero joint position (getFrameToTip())
+    Eigen::Isometry3d frame_to_tip;
+  };
+
   KDL::Chain chain_;
+  std::vector<ChainSegment> segments_;
 
 protected:
   std::string root_;
@@ -147,6 +488,15 @@ protected:
   std::string name_;
 };
 
+/**
+ *  @brief Set up two compiled plans, of the same calibration data, to share
+ *         the FK of the leading segments their chains have in common.
+ *  @param fk Storage for the shared FK, which must outlive the plans.
+ */
+void shareChainFK(const Chain3dModel& a_model, ChainPlan& a_plan,
+                  const Chain3dModel& b_model, ChainPlan& b_plan,
+                  SharedChainFK& fk);
+
 /** @brief Converts our angle-axis-with-integrated-magnitude representation to a KDL::Rotation */
 KDL::Rotation rotation_from_axis_magnitude(const double x, const double y, const double z);
 
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_OPTIMIZATION_BACKGROUND_OPTIMIZER_HPP
+#define ROBOT_CALIBRATION_OPTIMIZATION_BACKGROUND_OPTIMIZER_HPP
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <rclcpp/logger.hpp>
+#include <robot_calibration_msgs/msg/calibration_data.hpp>
+#include <robot_calibration/optimization/ceres_optimizer.hpp>
+#include <robot_calibration/optimization/params.hpp>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Runs an optimizer in a background thread while samples are still
+ *        being captured. Each time new samples arrive, the problem is solved
+ *        again starting from the previous solution, reusing the cost
+ *        functions of the samples that were already added.
+ */
+class BackgroundOptimizer
+{
+public:
+  /**
+   * @brief Start the background thread.
+   * @param robot_description The URDF.
+   * @param params The calibration step to solve as samples arrive.
+   * @param logger Logger to report the progress of each solve.
+   * @param mesh_params How the collision meshes of the URDF are loaded.
+   */
+  BackgroundOptimizer(const std::string& robot_description,
+                      const OptimizationParams& params,
+                      rclcpp::Logger logger,
+                      const MeshLoader::Params& mesh_params = MeshLoader::Params());
+  ~BackgroundOptimizer();
+
+  /** @brief Add a captured sample, this does not block for the solve. */
+  void add(const robot_calibration_msgs::msg::CalibrationData& msg);
+
+  /**
+   * @brief Stop the background thread, without solving for any samples
+   *        which have not yet been used. After this, the optimizer and data
+   *        can be used to run the full calibration, warm started from the
+   *        last background solve.
+   */
+  void stop();
+
+  /** @brief Get the optimizer, only valid after stop(). */
+  std::shared_ptr<Optimizer> getOptimizer();
+
+  /** @brief Get all samples added, only valid after stop(). */
+  const std::vector<robot_calibration_msgs::msg::CalibrationData>& getData() const;
+
+private:
+  void run();
+
+  std::shared_ptr<Optimizer> optimizer_;
+  OptimizationParams params_;
+  rclcpp::Logger logger_;
+
+  // Samples used by the optimizer, only accessed by the background thread
+  // until it is stopped
+  std::vector<robot_calibration_msgs::msg::CalibrationData> data_;
+
+  // Samples waiting to be added, and the request to stop
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<robot_calibration_msgs::msg::CalibrationData> pending_;
+  bool stop_;
+
+  std::thread thread_;
+};
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_OPTIMIZATION_BACKGROUND_OPTIMIZER_HPP
@@ -18,6 +18,9 @@
 
 // Author: Michael Ferguson
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <rclcpp/rclcpp.hpp>
 #include <geometry_msgs/msg/twist.hpp>
 #include <sensor_msgs/msg/imu.hpp>
@@ -28,6 +31,11 @@ namespace robot_calibration
 {
 /**
  * @brief Class for moving the base around and calibrating imu and odometry.
+ *
+ * The node should be spun by a MultiThreadedExecutor. Odometry and IMU are
+ * integrated in one callback group, scans are fit in another and the
+ * velocity controller runs from a fixed rate timer in a third, so that no
+ * callback delays another. align() and spin() only wait on the controller.
  */
 class BaseCalibration : public rclcpp::Node
 {
@@ -56,31 +64,71 @@ public:
   /** @brief Spin and record imu, odom, scan. */
   bool spin(double velocity, int rotations, bool verbose = false);
 
+  /**
+   * @brief Fit a line to the points of a scan between two angles.
+   * @param angle Returns the angle of the line.
+   * @param r2 Returns the goodness of the fit.
+   * @param dist Returns the mean distance of the points.
+   * @returns False if there are no valid points between the angles.
+   */
+  static bool fitLine(const sensor_msgs::msg::LaserScan& scan,
+                      double min_angle, double max_angle,
+                      double& angle, double& r2, double& dist);
+
 private:
+  enum class Mode
+  {
+    IDLE,
+    ALIGN,
+    SPIN
+  };
+
   void odometryCallback(const nav_msgs::msg::Odometry::ConstSharedPtr& odom);
   void imuCallback(const sensor_msgs::msg::Imu::ConstSharedPtr& imu);
   void laserCallback(const sensor_msgs::msg::LaserScan::ConstSharedPtr& scan);
 
+  /** @brief Run one step of the velocity controller. */
+  void controlCallback();
+
+  /**
+   * @brief Start the controller and wait for it to finish.
+   * @returns False if shutting down.
+   */
+  bool runController(Mode mode, double goal, double velocity, bool verbose);
+
   /** @brief Send a rotational velocity command. **/
   void sendVelocityCommand(double vel);
 
   /** @brief Reset the odom/imu counters. */
   void resetInternal();
 
+  /** @brief Get the odom/imu angle since the last reset. */
+  double getOdomAngle() const;
+  double getImuAngle() const;
+
   rclcpp::Publisher<geometry_msgs::msg::Twist>::SharedPtr cmd_pub_;
 
   rclcpp::Subscription<nav_msgs::msg::Odometry>::SharedPtr odom_subscriber_;
   rclcpp::Subscription<sensor_msgs::msg::Imu>::SharedPtr imu_subscriber_;
   rclcpp::Subscription<sensor_msgs::msg::LaserScan>::SharedPtr scan_subscriber_;
+  rclcpp::TimerBase::SharedPtr control_timer_;
+
+  rclcpp::CallbackGroup::SharedPtr sensor_group_;
+  rclcpp::CallbackGroup::SharedPtr scan_group_;
+  rclcpp::CallbackGroup::SharedPtr control_group_;
 
+  // Each value below is written only by its own callback, and is atomic so
+  // that it can be read from any thread. The odom and imu angles are never
+  // reset, instead the angle at the last reset is subtracted.
   rclcpp::Time last_odom_stamp_;
-  double odom_angle_;
+  std::atomic<double> odom_angle_, odom_reset_angle_;
 
   rclcpp::Time last_imu_stamp_;
-  double imu_angle_;
+  std::atomic<double> imu_angle_, imu_reset_angle_;
 
   rclcpp::Time last_scan_stamp_;
-  double scan_angle_, scan_r2_, scan_dist_, r2_tolerance_;
+  std::atomic<double> scan_angle_, scan_r2_, scan_dist_;
+  double r2_tolerance_;
 
   double min_angle_, max_angle_;
   double accel_limit_;
@@ -90,8 +138,15 @@ private:
   std::vector<double> imu_;
   std::vector<double> odom_;
 
-  std::recursive_mutex data_mutex_;
-  bool ready_;
+  std::atomic<bool> ready_;
+
+  // Controller goal, and notification when it is done
+  std::mutex control_mutex_;
+  std::condition_variable control_cond_;
+  Mode mode_;
+  double goal_;
+  double goal_velocity_;
+  bool verbose_;
 };
 
 }  // namespace robot_calibration
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_OPTIMIZATION_BATCHED_COST_FUNCTION_HPP
+#define ROBOT_CALIBRATION_OPTIMIZATION_BATCHED_COST_FUNCTION_HPP
+
+#include <vector>
+#include <ceres/ceres.h>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Evaluates the cost functions of several samples as a single
+ *        residual block.
+ *
+ * Every cost function must be connected to the same parameter blocks. The
+ * residuals of each are stacked in order, and since jacobians are row major,
+ * each cost function writes its rows of the jacobians in place. This saves
+ * the bookkeeping Ceres does for each residual block, which dominates for
+ * datasets with many samples. The cost functions are not owned.
+ */
+class BatchedCostFunction : public ceres::CostFunction
+{
+public:
+  explicit BatchedCostFunction(const std::vector<ceres::CostFunction*>& costs);
+  virtual ~BatchedCostFunction() {}
+
+  bool Evaluate(double const * const * parameters,
+                double* residuals,
+                double** jacobians) const override;
+
+  /** @brief Get the index of the first residual of each cost function. */
+  const std::vector<int>& getResidualStarts() const
+  {
+    return starts_;
+  }
+
+private:
+  std::vector<ceres::CostFunction*> costs_;
+  std::vector<int> starts_;
+  // Pointers into the jacobians for one cost function
+  mutable std::vector<double*> jacobians_;
+};
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_OPTIMIZATION_BATCHED_COST_FUNCTION_HPP
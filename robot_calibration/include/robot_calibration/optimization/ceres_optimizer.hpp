@@ -21,20 +21,28 @@
 #ifndef ROBOT_CALIBRATION_CERES_OPTIMIZER_H
 #define ROBOT_CALIBRATION_CERES_OPTIMIZER_H
 
+#include <functional>
 #include <memory>
 #include <ceres/ceres.h>
+#include <Eigen/Core>
 
 #include <urdf/model.h>
 #include <kdl_parser/kdl_parser.hpp>
 #include <rclcpp/logger.hpp>
 #include <robot_calibration_msgs/msg/calibration_data.hpp>
+#include <robot_calibration_msgs/msg/optimization_progress.hpp>
 #include <robot_calibration/optimization/offsets.hpp>
 #include <robot_calibration/optimization/params.hpp>
+#include <robot_calibration/optimization/profiler.hpp>
+#include <robot_calibration/optimization/residual_report.hpp>
 #include <robot_calibration/models/camera3d.hpp>
 #include <robot_calibration/models/chain3d.hpp>
+#include <robot_calibration/util/calibration_data.hpp>
 #include <robot_calibration/util/mesh_loader.hpp>
-#include <string>
 #include <map>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace robot_calibration
 {
@@ -43,22 +51,87 @@ namespace robot_calibration
 class Optimizer
 {
 public:
-  /** @brief Standard constructor */
-  Optimizer(const std::string& robot_description);
+  /**
+   * @brief Standard constructor
+   * @param robot_description The URDF.
+   * @param mesh_params How the collision meshes of the URDF are loaded.
+   */
+  Optimizer(const std::string& robot_description,
+            const MeshLoader::Params& mesh_params = MeshLoader::Params());
+
+  /**
+   * @brief Constructor from an already parsed robot description. The model,
+   *        and the meshes of the loader, may be shared by several optimizers,
+   *        including ones running in other threads.
+   */
+  Optimizer(std::shared_ptr<urdf::Model> model,
+            const KDL::Tree& tree,
+            std::shared_ptr<MeshLoader> mesh_loader);
   virtual ~Optimizer();
 
   /**
    * @brief Run optimization.
+   *
+   * Each call starts from the offsets found by the previous call. Models,
+   * and the cost functions of error blocks whose configuration (and free
+   * parameters) are unchanged, are reused by later calls with the same data.
+   *
    * @param data The data to be used for the optimization. Typically parsed
-   *        from bag file, or loaded over some topic subscriber.
+   *        from bag file, or loaded over some topic subscriber. Between
+   *        calls, samples may be appended but not otherwise modified.
    * @param progress_to_stdout If true, Ceres optimizer will output info to
-   *        stdout.
+   *        stdout, followed by a summary of the residual report.
+   *
+   * If the step has multi_start hypotheses (or a multi_start_grid), each is
+   * solved in parallel by its own copy of the offsets and problem, and the
+   * solution with the lowest final cost is kept. The progress callback is
+   * then only called once all are done.
+   *
+   * If the step has coarse_features, it is first solved on a subset of the
+   * features of each observation, and then on all of them starting from
+   * that solution. The summary and reports are those of the full solve.
    */
   int optimize(OptimizationParams& params,
-               std::vector<robot_calibration_msgs::msg::CalibrationData> data,
+               const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
                rclcpp::Logger& logger,
                bool progress_to_stdout = false);
 
+  /**
+   * @brief Compute how much each sample constrains the free parameters.
+   *
+   * The error blocks are set up as optimize() would, at the current offsets
+   * (or the free_frames_initial_values), but nothing is solved.
+   *
+   * @param information Returns J^T * J of each sample, where J is the
+   *        jacobian of its error blocks with respect to all of the free
+   *        parameters. Outrageous error blocks are not included, since they
+   *        do not depend on the sample.
+   * @returns False if the error blocks could not be set up or evaluated.
+   */
+  bool computeInformation(OptimizationParams& params,
+                          const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                          rclcpp::Logger& logger,
+                          std::vector<Eigen::MatrixXd>& information);
+
+  /**
+   * @brief Callback for the progress of optimize(). Returning false aborts
+   *        the step, leaving the offsets as they were before the step.
+   */
+  using ProgressCallback =
+    std::function<bool(const robot_calibration_msgs::msg::OptimizationProgress&)>;
+
+  /**
+   * @brief Set the callback for the progress of optimize(). It is called
+   *        after each iteration of the solver, in the thread calling
+   *        optimize(), and once more when the step is done, with done set
+   *        (the return value is then ignored). The stamp and step name are
+   *        not filled in.
+   */
+  void setProgressCallback(ProgressCallback callback)
+  {
+    progress_callback_ = callback;
+  }
+
   /**
    * @brief Returns the summary of the optimization last run.
    */
@@ -67,6 +140,58 @@ public:
     return summary_;
   }
 
+  /**
+   * @brief Returns the evaluation statistics of each error block during
+   *        the optimization last run, if profiling was enabled.
+   */
+  const std::vector<ErrorBlockProfile>& getProfile() const
+  {
+    return profile_;
+  }
+
+  /**
+   * @brief Returns the residuals of each sample before and after the
+   *        optimization last run, if progress_to_stdout was set or a
+   *        residual_report file was configured.
+   */
+  const std::vector<SampleResiduals>& getResidualReport() const
+  {
+    return residuals_;
+  }
+
+  /**
+   * @brief Returns the names of the free parameters of the covariance
+   *        estimated by the optimization last run. Empty if covariance was
+   *        not enabled for the step, or could not be computed.
+   */
+  const std::vector<std::string>& getCovarianceNames() const
+  {
+    return covariance_names_;
+  }
+
+  /**
+   * @brief Returns the covariance of the free parameters, in the order of
+   *        getCovarianceNames(). This is scaled by the variance of the
+   *        residuals at the solution. Frame rotations are the angle-axis
+   *        parameters.
+   */
+  const Eigen::MatrixXd& getCovariance() const
+  {
+    return covariance_;
+  }
+
+  /** @brief Returns the standard deviation of each free parameter. */
+  const Eigen::VectorXd& getStandardDeviations() const
+  {
+    return standard_deviations_;
+  }
+
+  /** @brief Returns the correlation between each pair of free parameters. */
+  const Eigen::MatrixXd& getCorrelations() const
+  {
+    return correlations_;
+  }
+
   std::shared_ptr<OptimizationOffsets> getOffsets()
   {
     return offsets_;
@@ -90,17 +215,135 @@ public:
   std::vector<std::string> getCameraNames();
 
 private:
+  /**
+   * @brief Set up the models and free parameters of a step.
+   * @returns False if the KDL tree could not be created.
+   */
+  bool setupOffsets(OptimizationParams& params, rclcpp::Logger& logger);
+
+  /**
+   * @brief Solve a step from each hypothesis of the initial values, in
+   *        parallel, keeping the solution with the lowest final cost.
+   */
+  int optimizeMultiStart(OptimizationParams& params,
+                         const std::vector<OptimizationParams::InitialValues>& hypotheses,
+                         const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                         rclcpp::Logger& logger,
+                         bool progress_to_stdout);
+
+  /**
+   * @brief Solve a step on decimated features, then refine on all of the
+   *        features from that solution.
+   */
+  int optimizeCoarseToFine(OptimizationParams& params,
+                           const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                           rclcpp::Logger& logger,
+                           bool progress_to_stdout);
+
+  /** @brief The residuals of one error block for one sample. */
+  struct SampleBlock
+  {
+    ceres::ResidualBlockId id;
+    size_t error_block;
+    // Residuals within the residual block, which may be batched
+    int start;
+    int num_residuals;
+  };
+
+  /**
+   * @brief Add the error blocks of every sample to a problem.
+   * @param free_params The free parameters, already added to the problem.
+   * @param batch_samples If greater than one, the samples of each error
+   *        block without a loss function are batched into residual blocks
+   *        of up to this many samples.
+   * @param profiled Returns the wrapped cost functions of each error block,
+   *        if profiling.
+   * @param sample_blocks Returns the residuals of each sample, other than
+   *        outrageous error blocks.
+   * @returns False if an error block is improperly configured.
+   */
+  bool addResidualBlocks(OptimizationParams& params,
+                         const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                         rclcpp::Logger& logger,
+                         ceres::Problem* problem,
+                         double* free_params,
+                         int batch_samples,
+                         std::vector<std::vector<ProfiledCostFunctionPtr>>& profiled,
+                         std::vector<std::vector<SampleBlock>>& sample_blocks);
+
+  /**
+   * @brief Evaluate the residuals of every sample, without loss functions.
+   * @param residuals Returns the residuals of each entry of sample_blocks,
+   *        in order.
+   */
+  static bool evaluateSampleResiduals(ceres::Problem* problem,
+                                      int num_threads,
+                                      const std::vector<std::vector<SampleBlock>>& sample_blocks,
+                                      std::vector<double>& residuals);
+
+  /**
+   * @brief Estimate the covariance of the free parameters at the solution.
+   * @returns False if the jacobian is rank deficient, in which case some of
+   *          the free parameters are not constrained by the error blocks.
+   */
+  bool computeCovariance(ceres::Problem* problem,
+                         double* free_params,
+                         int num_threads,
+                         rclcpp::Logger& logger);
+
+  /**
+   * @brief Create the models for a step, models which are configured the
+   *        same as in a previous step are reused.
+   * @returns False if any existing model had to be recreated.
+   */
+  bool updateModels(const OptimizationParams& params, rclcpp::Logger& logger);
+
+  /** @brief Get a model by name, or NULL if there is no such model. */
+  Chain3dModel* getModel(const std::string& name) const;
+
   std::shared_ptr<urdf::Model> model_;
   std::string root_frame_;
   std::string led_frame_;
   KDL::Tree tree_;
+  bool tree_valid_;
 
   std::shared_ptr<MeshLoader> mesh_loader_;
 
-  std::map<std::string, Chain3dModel*> models_;
+  std::map<std::string, std::shared_ptr<Chain3dModel>> models_;
+  // Configuration each model was created with
+  std::map<std::string, std::string> model_configs_;
+
+  // Samples used by the error blocks, and the data they were made from
+  std::vector<CalibrationDataConstPtr> samples_;
+  const std::vector<robot_calibration_msgs::msg::CalibrationData>* samples_source_;
+
+  /** @brief A cost function, and the blocks of the offsets it depends on. */
+  struct CachedCost
+  {
+    std::shared_ptr<ceres::CostFunction> cost;
+    std::vector<int> blocks;
+  };
+
+  // Cost functions by error block configuration and sample, these are
+  // reused by later steps with the same models, samples and free parameters
+  std::map<std::pair<std::string, size_t>, CachedCost> costs_;
+  std::string costs_layout_;
+
+  // Batched cost functions of the current problem, which does not own them
+  std::vector<std::shared_ptr<ceres::CostFunction>> batched_costs_;
 
   std::shared_ptr<OptimizationOffsets> offsets_;
   std::shared_ptr<ceres::Solver::Summary> summary_;
+  std::vector<ErrorBlockProfile> profile_;
+  std::vector<SampleResiduals> residuals_;
+  std::vector<std::string> covariance_names_;
+  Eigen::MatrixXd covariance_;
+  Eigen::VectorXd standard_deviations_;
+  Eigen::MatrixXd correlations_;
+  ProgressCallback progress_callback_;
+  // Compute the residual report even when it is not output, so that
+  // multi-start can report the hypothesis which is kept
+  bool keep_residuals_;
 
   int num_params_, num_residuals_;
 };
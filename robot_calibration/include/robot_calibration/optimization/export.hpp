@@ -31,9 +31,11 @@ namespace robot_calibration
  * @param optimizer The optimizer instance, where we get our offsets from
  * @param initial_urdf The initial URDF, to which offsets are added
  * @param data The raw calibration data, currently used only to get CameraInfo
+ * @param directory The directory to write the outputs to
  */
 bool exportResults(Optimizer& optimizer, const std::string& initial_urdf,
-                   const std::vector<robot_calibration_msgs::msg::CalibrationData>& data);
+                   const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                   const std::string& directory = "/tmp");
 
 }  // namespace robot_calibration
 
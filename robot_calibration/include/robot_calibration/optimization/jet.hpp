@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_OPTIMIZATION_JET_HPP
+#define ROBOT_CALIBRATION_OPTIMIZATION_JET_HPP
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <ceres/jet.h>
+
+namespace robot_calibration
+{
+
+/**
+ *  \brief Number of partial derivatives computed in each pass of automatic
+ *         differentiation. This is the Stride of DynamicAutoDiffCostFunction.
+ */
+static const int JET_STRIDE = 4;
+
+/** \brief Scalar type used by error blocks during automatic differentiation. */
+using Jet = ceres::Jet<double, JET_STRIDE>;
+
+/** \brief Rigid transform, usable with both double and Jet */
+template <typename T>
+using Transform = Eigen::Transform<T, 3, Eigen::Isometry>;
+
+/** \brief A set of 3d points, one per column */
+template <typename T>
+using Matrix3X = Eigen::Matrix<T, 3, Eigen::Dynamic>;
+
+/** \brief A set of 2d points (usually pixels), one per column */
+template <typename T>
+using Matrix2X = Eigen::Matrix<T, 2, Eigen::Dynamic>;
+
+/** \brief Get the value of a scalar, discarding any derivatives. */
+inline double getValue(const double value)
+{
+  return value;
+}
+
+/** \brief Get the value of a scalar, discarding any derivatives. */
+template <typename T, int N>
+double getValue(const ceres::Jet<T, N>& value)
+{
+  return value.a;
+}
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_OPTIMIZATION_JET_HPP
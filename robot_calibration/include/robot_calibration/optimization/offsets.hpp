@@ -20,11 +20,52 @@
 #ifndef ROBOT_CALIBRATION_OPTIMIZATION_OFFSETS_HPP
 #define ROBOT_CALIBRATION_OPTIMIZATION_OFFSETS_HPP
 
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <kdl/chain.hpp>
+#include <ceres/rotation.h>
+#include <robot_calibration/optimization/jet.hpp>
 
 namespace robot_calibration
 {
 
+template <typename T> class OffsetsViewT;
+
+/**
+ *  \brief Handle to a single parameter, as returned by
+ *         OptimizationOffsets::getParamHandle(). Resolving a handle once
+ *         avoids looking up the parameter by name on every evaluation.
+ */
+struct ParamHandle
+{
+  ParamHandle() : slot(-1) {}
+  explicit ParamHandle(int slot_) : slot(slot_) {}
+
+  /** \brief False if the parameter is not known. */
+  bool valid() const
+  {
+    return slot >= 0;
+  }
+
+  /** \brief Storage slot of the parameter, -1 if not known. */
+  int slot;
+};
+
+/**
+ *  \brief Handle to the six parameters of a frame offset, as returned by
+ *         OptimizationOffsets::getFrameHandle().
+ */
+struct FrameHandle
+{
+  FrameHandle() : valid(false) {}
+
+  /** \brief False if this frame is not being calibrated at all. */
+  bool valid;
+  /** \brief Handles of x, y, z, a, b, c. */
+  ParamHandle params[6];
+};
+
 /**
  *  \brief Combined parser and configuration for calibration offsets.
  *         Holds the configuration of what is to be calibrated, and
@@ -38,13 +79,14 @@ public:
 
   /**
    *  \brief Tell the parser we wish to calibrate an active joint or other
-   *         single parameter.
+   *         single parameter. The parameter is its own parameter block.
    *  \param name The name of the joint, e.g. "shoulder_pan_joint"
    */
   bool add(const std::string name);
 
   /**
-   *  \brief Tell the parser we wish to calibrate a fixed joint.
+   *  \brief Tell the parser we wish to calibrate a fixed joint. The free
+   *         parameters of the frame form a single parameter block.
    *  \param name The name of the fixed joint, e.g. "head_camera_rgb_joint"
    */
   bool addFrame(const std::string name,
@@ -68,7 +110,12 @@ public:
   /** \brief Initialize the free_params */
   bool initialize(double* free_params);
 
-  /** \brief Update the offsets based on free_params from ceres-solver. */
+  /**
+   *  \brief Update the offsets based on free_params from ceres-solver.
+   *
+   *  This modifies the parser, and so must not be called while error blocks
+   *  are being evaluated. Error blocks should use an OffsetsView instead.
+   */
   bool update(const double* const free_params);
 
   /** \brief Get the offset. */
@@ -82,12 +129,63 @@ public:
    */
   bool getFrame(const std::string name, KDL::Frame& offset) const;
 
+  /**
+   *  \brief Get a handle to a parameter, for use with OffsetsViewT::get().
+   *
+   *  Handles remain valid as parameters are freed or reset, but a handle to
+   *  a parameter that is not yet known will not see it once it is added,
+   *  see getRevision().
+   */
+  ParamHandle getParamHandle(const std::string& name) const;
+
+  /**
+   *  \brief Get a handle to a frame, for use with OffsetsViewT::getFrame().
+   *  \param name The name of the fixed joint, e.g. "head_camera_rgb_joint"
+   */
+  FrameHandle getFrameHandle(const std::string& name) const;
+
+  /**
+   *  \brief Get the revision of the parameter layout. This changes whenever
+   *         a new parameter or frame is added, and so previously resolved
+   *         handles may be out of date.
+   */
+  size_t getRevision() const;
+
   /** \returns The number of free parameters being parsed */
   size_t size();
 
+  /** \returns The name of a free parameter, by its index within free_params */
+  std::string getFreeParamName(size_t index) const;
+
+  /**
+   *  \returns The number of parameter blocks. Each free joint (or other
+   *           single parameter) and each free frame is its own block, so
+   *           that error blocks only need to depend on the blocks they use.
+   *           Blocks are stored contiguously within free_params.
+   */
+  size_t getNumBlocks() const;
+
+  /** \returns The number of free parameters in a block */
+  size_t getBlockSize(size_t block) const;
+
+  /** \returns The index within free_params of the first parameter of a block */
+  size_t getBlockStart(size_t block) const;
+
+  /** \returns The block which holds a parameter, -1 if it is not free */
+  int getBlock(const ParamHandle& param) const;
+
+  /** \returns The index of a parameter within its block, -1 if it is not free */
+  int getBlockOffset(const ParamHandle& param) const;
+
   /** \brief Clear free parameters, but retain values for multi-step calirations */
   bool reset();
 
+  /**
+   *  \brief Copy the parameters, their values, and which are free, from
+   *         another parser. Handles of either parser are valid for both.
+   */
+  void copy(const OptimizationOffsets& other);
+
   /** \brief Load all the current offsets from a YAML */
   bool loadOffsetYAML(const std::string& filename);
 
@@ -98,24 +196,222 @@ public:
   std::string updateURDF(const std::string& urdf);
 
 private:
-  // Names of parameters being calibrated. The order of this vector
-  // is the same as the free_param order will be interpreted.
-  std::vector<std::string> parameter_names_;
+  template <typename T> friend class OffsetsViewT;
+
+  /** \brief Add a free parameter, either to a new block or to the last block. */
+  bool addParameter(const std::string& name, bool new_block);
+
+  /** \brief Get the storage slot of a parameter, -1 if it is not known. */
+  int getSlot(const std::string& name) const;
+
+  /** \brief Update the free_params index and block of each slot, and the frame table. */
+  void updateSlots();
+
+  // Name and value of each parameter, indexed by slot. Slots are never
+  // removed or reordered, so that handles remain valid.
+  std::vector<std::string> slot_names_;
+  std::vector<double> slot_values_;
 
-  // Names of frames being calibrated.
-  std::vector<std::string> frame_names_;
+  // Index of each slot in free_params, -1 if not currently free
+  std::vector<int> slot_free_index_;
 
-  // Values of parameters from last update
-  std::vector<double> parameter_offsets_;
+  // Block of each slot, and index within that block, -1 if not currently free
+  std::vector<int> slot_block_;
+  std::vector<int> slot_block_offset_;
+
+  // Size of each block, these are contiguous within free_params
+  std::vector<size_t> block_sizes_;
+  std::vector<size_t> block_starts_;
+
+  // Lookup of slot by parameter name
+  std::unordered_map<std::string, int> slots_;
+
+  // Order of the parameters, as slots. The first num_free_params_
+  // entries are in the same order as free_params will be interpreted.
+  std::vector<int> order_;
+
+  // Frames being calibrated, with the slots of their parameters
+  std::unordered_map<std::string, FrameHandle> frames_;
 
   // Number of params being calibrated
   size_t num_free_params_;
 
+  // Incremented whenever a parameter or frame is added
+  size_t revision_;
+
   // No copy
   OptimizationOffsets(const OptimizationOffsets&);
   OptimizationOffsets& operator=(const OptimizationOffsets&);
 };
 
+/**
+ *  \brief Read-only view of the offsets, as seen at a particular set of
+ *         free_params from ceres-solver.
+ *
+ *  Unlike OptimizationOffsets::update(), creating a view does not modify the
+ *  parser, so multiple error blocks can be evaluated concurrently. The view
+ *  holds references to both the parser and the free_params, neither of which
+ *  may change or go away while the view is in use.
+ *
+ *  The scalar type T is double, or Jet when using automatic differentiation.
+ */
+template <typename T>
+class OffsetsViewT
+{
+public:
+  /** \brief View the offsets as they are currently stored in the parser. */
+  OffsetsViewT(const OptimizationOffsets& offsets) :
+    offsets_(offsets),
+    free_params_(nullptr),
+    blocks_(nullptr),
+    block_index_(nullptr)
+  {
+  }
+
+  /**
+   *  \brief View the offsets, substituting the values of the free parameters.
+   *  \param offsets The parser which defines the layout of free_params.
+   *  \param free_params The free parameters from ceres-solver.
+   */
+  OffsetsViewT(const OptimizationOffsets& offsets, const T* const free_params) :
+    offsets_(offsets),
+    free_params_(free_params),
+    blocks_(nullptr),
+    block_index_(nullptr)
+  {
+  }
+
+  /**
+   *  \brief View the offsets, substituting the values of the free parameters
+   *         from separate parameter blocks.
+   *  \param offsets The parser which defines the layout of the blocks.
+   *  \param blocks The parameter blocks from ceres-solver.
+   *  \param block_index For each block of the parser, the index within
+   *         blocks, or -1 if the block is not passed (the stored values of
+   *         that block are then used).
+   */
+  OffsetsViewT(const OptimizationOffsets& offsets,
+               const T* const* blocks,
+               const std::vector<int>& block_index) :
+    offsets_(offsets),
+    free_params_(nullptr),
+    blocks_(blocks),
+    block_index_(&block_index)
+  {
+  }
+
+  /** \brief Get the offset. */
+  T get(const std::string& name) const
+  {
+    return get(offsets_.getParamHandle(name));
+  }
+
+  /**
+   *  \brief Get the offset by handle, avoiding the lookup by name.
+   *  \param param The handle from OptimizationOffsets::getParamHandle().
+   */
+  T get(const ParamHandle& param) const
+  {
+    if (!param.valid())
+    {
+      // Not calibrating this
+      return T(0.0);
+    }
+
+    if (blocks_)
+    {
+      int block = offsets_.slot_block_[param.slot];
+      if (block >= 0 && static_cast<size_t>(block) < block_index_->size() &&
+          (*block_index_)[block] >= 0)
+      {
+        return blocks_[(*block_index_)[block]][offsets_.slot_block_offset_[param.slot]];
+      }
+    }
+    else if (free_params_)
+    {
+      int index = offsets_.slot_free_index_[param.slot];
+      if (index >= 0)
+        return free_params_[index];
+    }
+
+    // Stored value, possibly retained from a previous calibration step
+    return T(offsets_.slot_values_[param.slot]);
+  }
+
+  /**
+   *  \brief Get the offset for a frame calibration
+   *  \param name The name of the fixed joint, e.g. "head_camera_rgb_joint"
+   *  \param offset The transform to fill in the offset.
+   *  \returns True if there is an offset to apply, false if otherwise.
+   */
+  bool getFrame(const std::string& name, Transform<T>& offset) const
+  {
+    return getFrame(offsets_.getFrameHandle(name), offset);
+  }
+
+  /**
+   *  \brief Get the offset for a frame calibration, avoiding the lookup by name.
+   *  \param frame The handle from OptimizationOffsets::getFrameHandle().
+   *  \param offset The transform to fill in the offset.
+   *  \returns True if there is an offset to apply, false if otherwise.
+   */
+  bool getFrame(const FrameHandle& frame, Transform<T>& offset) const
+  {
+    // Don't bother with following computation if this isn't a calibrated frame.
+    if (!frame.valid)
+      return false;
+
+    offset.setIdentity();
+    offset.translation() << get(frame.params[0]),
+                            get(frame.params[1]),
+                            get(frame.params[2]);
+
+    T angle_axis[3] = {get(frame.params[3]), get(frame.params[4]), get(frame.params[5])};
+    Eigen::Matrix<T, 3, 3> rotation;
+    ceres::AngleAxisToRotationMatrix(angle_axis, rotation.data());
+    offset.linear() = rotation;
+
+    return true;
+  }
+
+  /**
+   *  \brief Get the offset for a frame calibration, only valid for double.
+   *  \param name The name of the fixed joint, e.g. "head_camera_rgb_joint"
+   *  \param offset The KDL::Frame to fill in the offset.
+   *  \returns True if there is an offset to apply, false if otherwise.
+   */
+  bool getFrame(const std::string& name, KDL::Frame& offset) const
+  {
+    Transform<T> f;
+    if (!getFrame(name, f))
+      return false;
+
+    for (int i = 0; i < 3; ++i)
+    {
+      offset.p(i) = f.translation()(i);
+      for (int j = 0; j < 3; ++j)
+        offset.M(i, j) = f.linear()(i, j);
+    }
+
+    return true;
+  }
+
+  /** \brief Get the parser which this is a view of. */
+  const OptimizationOffsets& getOffsets() const
+  {
+    return offsets_;
+  }
+
+private:
+  const OptimizationOffsets& offsets_;
+  const T* free_params_;
+  const T* const* blocks_;
+  const std::vector<int>* block_index_;
+};
+
+using OffsetsView = OffsetsViewT<double>;
+using JetOffsetsView = OffsetsViewT<Jet>;
+
 }  // namespace robot_calibration
 
 #endif  // ROBOT_CALIBRATION_OPTIMIZATION_OFFSETS_HPP
\ No newline at end of file
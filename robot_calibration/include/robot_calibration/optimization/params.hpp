@@ -60,6 +60,20 @@ struct OptimizationParams
     double yaw;
   };
 
+  struct MultiStartGrid : Params
+  {
+    // Perturbations of the initial value of each component of a frame,
+    // an empty list is the same as no perturbation
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> z;
+    std::vector<double> roll;
+    std::vector<double> pitch;
+    std::vector<double> yaw;
+  };
+
+  using InitialValues = std::vector<FreeFrameInitialValue>;
+
   struct ModelParams : Params
   {
     // All models need a sensor frame
@@ -68,14 +82,26 @@ struct OptimizationParams
     std::string param_name;
   };
 
-  struct Chain3dToChain3dParams : Params
+  struct ErrorBlockParams : Params
+  {
+    // Use numeric rather than automatic differentiation
+    bool numeric_diff;
+    // Robust loss function, empty for squared loss
+    std::string loss;
+    // Scale of the loss function, residuals beyond this are downweighted
+    double loss_scale;
+  };
+
+  struct Chain3dToChain3dParams : ErrorBlockParams
   {
     // Chain3d or Camera3d models to use
     std::string model_a;
     std::string model_b;
+    // Use closed form derivatives for joint and frame offsets
+    bool analytic_diff;
   };
 
-  struct Chain3dToCamera2dParams : Params
+  struct Chain3dToCamera2dParams : ErrorBlockParams
   {
     // Chain3d and Camera2d models to use
     std::string model_3d;
@@ -84,7 +110,7 @@ struct OptimizationParams
     double scale;
   };
 
-  struct Chain3dToPlaneParams : Params
+  struct Chain3dToPlaneParams : ErrorBlockParams
   {
     // Chain3d model to use
     std::string model;
@@ -92,17 +118,21 @@ struct OptimizationParams
     double a, b, c, d;
     // Scalar applied to residual
     double scale;
+    // Use closed form derivatives for joint and frame offsets
+    bool analytic_diff;
   };
 
-  struct Chain3dToMeshParams : Params
+  struct Chain3dToMeshParams : ErrorBlockParams
   {
     // Chain3d model to use
     std::string model;
     // Link in URDF to use for mesh
     std::string link_name;
+    // Use distance to triangles, rather than triangle edges
+    bool point_to_triangle;
   };
 
-  struct PlaneToPlaneParams : Params
+  struct PlaneToPlaneParams : ErrorBlockParams
   {
     // Chain3d or Camera3d models to use
     std::string model_a;
@@ -112,7 +142,7 @@ struct OptimizationParams
     double offset_scale;
   };
 
-  struct OutrageousParams : Params
+  struct OutrageousParams : ErrorBlockParams
   {
     std::string param;
     double joint_scale;
@@ -124,14 +154,56 @@ struct OptimizationParams
   std::vector<std::string> free_params;
   std::vector<FreeFrameParams> free_frames;
   std::vector<FreeFrameInitialValue> free_frames_initial_values;
+  // Additional hypotheses of the initial values, each is applied on top of
+  // free_frames_initial_values. The step is solved from the
+  // free_frames_initial_values and from every hypothesis, and the solution
+  // with the lowest final cost is kept.
+  std::vector<InitialValues> multi_start;
+  // Grid of perturbations of the initial values, combined with every
+  // hypothesis. Frames perturbed without an initial value start from zero.
+  std::vector<MultiStartGrid> multi_start_grid;
   std::vector<ModelParams> models;
   std::vector<ParamsPtr> error_blocks;
 
   // Parameters for the optimizer itself
   int max_num_iterations;
+  int num_threads;
+  std::string linear_solver;
+  std::string trust_region_strategy;
+  double function_tolerance;
+  double gradient_tolerance;
+  double parameter_tolerance;
+  bool jacobi_scaling;
+  bool use_nonmonotonic_steps;
+  // Record evaluation statistics of each error block
+  bool profile;
+  // If set, per-sample residual statistics are written to this CSV file
+  std::string residual_report;
+  // Estimate the covariance of the free parameters after the solve
+  bool covariance;
+  // Number of multi-start hypotheses solved at once, 0 for one per
+  // hardware thread. Each uses num_threads for its own solve.
+  int multi_start_threads;
+  // If non-zero, the step is first solved with at most this many features
+  // in each observation, then refined from that solution with all of them
+  int coarse_features;
+  // How the features of the coarse solve are selected, "stride" or
+  // "farthest_point"
+  std::string coarse_sampling;
+  // If greater than one, the samples of each error block are evaluated in
+  // residual blocks of up to this many samples, rather than one per sample.
+  // Error blocks with a loss function are not batched.
+  int batch_samples;
 
   OptimizationParams();
 
+  /**
+   * @brief Get every hypothesis of the initial values to solve from, given
+   *        multi_start and multi_start_grid. This is just the
+   *        free_frames_initial_values if neither is configured.
+   */
+  std::vector<InitialValues> getMultiStartHypotheses() const;
+
   /**
    * @brief Load from ROS parameters
    * @param node Node pointer to use for declaring/loading parameters
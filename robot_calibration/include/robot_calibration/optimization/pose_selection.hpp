@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_OPTIMIZATION_POSE_SELECTION_HPP
+#define ROBOT_CALIBRATION_OPTIMIZATION_POSE_SELECTION_HPP
+
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief How to score the information of a set of samples.
+ */
+enum class SelectionCriterion
+{
+  // Log determinant of the information matrix, this shrinks the volume of
+  // the uncertainty of all free parameters and does not depend on their units
+  D_OPTIMAL,
+  // Smallest eigenvalue of the information matrix, this improves the least
+  // constrained direction of the free parameters
+  MIN_EIGENVALUE,
+};
+
+/**
+ * @brief Parse "d_optimal" or "min_eigenvalue".
+ * @returns False if the name is not a valid criterion.
+ */
+bool getSelectionCriterion(const std::string& name, SelectionCriterion& criterion);
+
+/**
+ * @brief Score an information matrix, higher is better.
+ */
+double scoreInformation(const Eigen::MatrixXd& information, SelectionCriterion criterion);
+
+/**
+ * @brief Greedily choose the samples which best constrain the free parameters.
+ *
+ * Each step adds the sample which most improves the score of the summed
+ * information, ties go to the lowest index.
+ *
+ * @param information The information matrix (J^T * J) of each sample.
+ * @param count Number of samples to select.
+ * @param criterion How to score the information.
+ * @param prior Added to the diagonal of the summed information, so that the
+ *        score is defined before the parameters are fully constrained.
+ * @returns The indices of the selected samples, in increasing order.
+ */
+std::vector<size_t> selectSamples(const std::vector<Eigen::MatrixXd>& information,
+                                  size_t count,
+                                  SelectionCriterion criterion,
+                                  double prior = 1e-6);
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_OPTIMIZATION_POSE_SELECTION_HPP
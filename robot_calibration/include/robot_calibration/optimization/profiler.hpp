@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_OPTIMIZATION_PROFILER_HPP
+#define ROBOT_CALIBRATION_OPTIMIZATION_PROFILER_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <ceres/ceres.h>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Evaluation statistics of one error block, over all of the samples
+ *        it was added for. Times are in seconds.
+ */
+struct ErrorBlockProfile
+{
+  std::string name;
+  std::string type;
+  // Number of residual blocks (typically one per sample)
+  size_t num_blocks;
+  // Total number of residuals over all residual blocks
+  size_t num_residuals;
+  // Number of evaluations, and how many of those computed jacobians
+  size_t evaluations;
+  size_t jacobian_evaluations;
+  // Time for a single evaluation of a single residual block
+  double total_time;
+  double median_time;
+  double p90_time;
+  double p99_time;
+  double max_time;
+};
+
+/**
+ * @brief Wraps a cost function to record how long each evaluation takes.
+ *
+ * Ceres evaluates each residual block on only one thread at a time, so
+ * there is no locking. The wrapped cost function is not owned.
+ */
+class ProfiledCostFunction : public ceres::CostFunction
+{
+public:
+  explicit ProfiledCostFunction(ceres::CostFunction* cost);
+  virtual ~ProfiledCostFunction() {}
+
+  bool Evaluate(double const * const * parameters,
+                double* residuals,
+                double** jacobians) const override;
+
+  /** @brief Get the time of each evaluation so far. */
+  const std::vector<double>& getTimes() const
+  {
+    return times_;
+  }
+
+  /** @brief Get the number of evaluations which computed jacobians. */
+  size_t getJacobianEvaluations() const
+  {
+    return jacobian_evaluations_;
+  }
+
+private:
+  ceres::CostFunction* cost_;
+  mutable std::vector<double> times_;
+  mutable size_t jacobian_evaluations_;
+};
+
+using ProfiledCostFunctionPtr = std::shared_ptr<ProfiledCostFunction>;
+
+/**
+ * @brief Combine the statistics of the residual blocks of one error block.
+ * @param name Name of the error block.
+ * @param type Type of the error block.
+ * @param costs The wrapped cost function of each residual block.
+ */
+ErrorBlockProfile summarizeProfile(const std::string& name,
+                                   const std::string& type,
+                                   const std::vector<ProfiledCostFunctionPtr>& costs);
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_OPTIMIZATION_PROFILER_HPP
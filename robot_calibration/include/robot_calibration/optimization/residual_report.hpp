@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_OPTIMIZATION_RESIDUAL_REPORT_HPP
+#define ROBOT_CALIBRATION_OPTIMIZATION_RESIDUAL_REPORT_HPP
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Statistics of the residuals of one error block for one sample,
+ *        before and after a step is solved. Loss functions are not applied.
+ */
+struct SampleResiduals
+{
+  // Index of the sample in the data
+  size_t sample;
+  // Name and type of the error block
+  std::string name;
+  std::string type;
+  size_t num_residuals;
+  double initial_rms;
+  double initial_max;
+  double final_rms;
+  double final_max;
+  // RMS of each axis, see getResidualAxes()
+  std::vector<double> initial_axis_rms;
+  std::vector<double> final_axis_rms;
+};
+
+/**
+ * @brief Get the names of the axes that the residuals of an error block
+ *        type cycle through, for instance x, y, z for chain3d_to_chain3d.
+ */
+std::vector<std::string> getResidualAxes(const std::string& type);
+
+/**
+ * @brief Compute the statistics of the residuals of one residual block.
+ * @param residuals The residuals, interleaved by axis.
+ * @param num_residuals Number of residuals.
+ * @param num_axes Number of axes the residuals cycle through.
+ * @param rms Returns the RMS of all residuals.
+ * @param max Returns the largest absolute residual.
+ * @param axis_rms Returns the RMS of each axis.
+ */
+void computeResidualStatistics(const double* residuals,
+                               size_t num_residuals,
+                               size_t num_axes,
+                               double& rms,
+                               double& max,
+                               std::vector<double>& axis_rms);
+
+/**
+ * @brief Write the residual report as CSV, one row per sample and error
+ *        block. Axis columns are named <axis>_initial_rms and
+ *        <axis>_final_rms, and are empty for error blocks without that axis.
+ * @returns False if the file cannot be written.
+ */
+bool writeResidualReport(const std::string& filename,
+                         const std::vector<SampleResiduals>& report);
+
+/**
+ * @brief Print the RMS of each error block over all samples, before and
+ *        after the solve, and the sample with the largest final RMS.
+ */
+void printResidualSummary(std::ostream& out,
+                          const std::vector<SampleResiduals>& report);
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_OPTIMIZATION_RESIDUAL_REPORT_HPP
@@ -20,7 +20,11 @@
 #define ROBOT_CALIBRATION_UTIL_ACTION_CLIENT_HPP
 
 #include <chrono>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 #include <rclcpp/rclcpp.hpp>
 #include <rclcpp_action/rclcpp_action.hpp>
 
@@ -68,6 +72,12 @@ public:
     return client_->wait_for_action_server(std::chrono::milliseconds(static_cast<int>(1000 * timeout)));
   }
 
+  /** @brief Check if the server is available, without waiting. */
+  bool isServerReady()
+  {
+    return client_ && client_->action_server_is_ready();
+  }
+
   void sendGoal(const typename ActionType::Goal& goal)
   {
     auto goal_options = typename rclcpp_action::Client<ActionType>::SendGoalOptions();
@@ -89,9 +99,21 @@ public:
 
     // Wait for result, or timeout
     rclcpp::Time start = node->now();
-    while (state_ == ActionClientState::ACTIVE)
+    while (true)
     {
-      rclcpp::spin_some(node);
+      {
+        // Finders may wait for results concurrently, but the node can only
+        // be spun by one executor at a time. The result callbacks of all
+        // clients of this action type run under this lock, so state_ is
+        // also read under it.
+        static std::mutex spin_mutex;
+        std::lock_guard<std::mutex> lock(spin_mutex);
+        rclcpp::spin_some(node);
+        if (state_ != ActionClientState::ACTIVE)
+        {
+          break;
+        }
+      }
       rclcpp::sleep_for(std::chrono::milliseconds(10));
 
       if ((node->now() - start) > timeout)
@@ -104,6 +126,12 @@ public:
     return state_;
   }
 
+  /** @brief Get the state of the last goal, without waiting. */
+  ActionClientState getState() const
+  {
+    return state_;
+  }
+
   ActionResult getResult()
   {
     return result_;
@@ -130,6 +158,39 @@ private:
   ActionResult result_;
 };
 
+/**
+ * @brief Wait for several servers at once, with one overall timeout, rather
+ *        than waiting for each in turn.
+ * @param servers The name and readiness check of each server.
+ * @param timeout Time (in seconds) to wait for all of them.
+ * @returns The names of the servers which are not ready by the timeout.
+ */
+inline std::vector<std::string> waitForServers(
+  const std::vector<std::pair<std::string, std::function<bool()>>>& servers,
+  double timeout)
+{
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(static_cast<int>(1000 * timeout));
+  std::vector<bool> ready(servers.size(), false);
+  while (true)
+  {
+    std::vector<std::string> waiting;
+    for (size_t i = 0; i < servers.size(); ++i)
+    {
+      ready[i] = ready[i] || servers[i].second();
+      if (!ready[i])
+      {
+        waiting.push_back(servers[i].first);
+      }
+    }
+    if (waiting.empty() || std::chrono::steady_clock::now() >= deadline)
+    {
+      return waiting;
+    }
+    rclcpp::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
 }  // namespace robot_calibration
 
 #endif  // ROBOT_CALIBRATION_UTIL_ACTION_CLIENT_HPP
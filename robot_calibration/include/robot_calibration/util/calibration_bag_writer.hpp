@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_UTIL_CALIBRATION_BAG_WRITER_HPP
+#define ROBOT_CALIBRATION_UTIL_CALIBRATION_BAG_WRITER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <rclcpp/rclcpp.hpp>
+#include <rosbag2_cpp/writer.hpp>
+#include <std_msgs/msg/string.hpp>
+#include <robot_calibration_msgs/msg/calibration_data.hpp>
+#include <robot_calibration_msgs/msg/calibration_raw.hpp>
+#include <robot_calibration_msgs/msg/observation_debug.hpp>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Records calibration data to a bagfile, in the layout which
+ *        CalibrationBagReader loads.
+ *
+ * Messages are copied into a queue and serialized and written by a
+ * separate thread, so that writing does not block capture.
+ */
+class CalibrationBagWriter
+{
+public:
+  CalibrationBagWriter();
+
+  /** @brief Writes any queued messages, and closes the bag. */
+  ~CalibrationBagWriter();
+
+  /**
+   * @brief Create a new bagfile.
+   * @param uri Name of the bag to create, it must not already exist.
+   * @param compression Empty for none, otherwise the rosbag2 compression
+   *        format (such as zstd), each message is compressed separately.
+   * @returns False if the bag could not be created.
+   */
+  bool open(const std::string& uri, const std::string& compression);
+
+  /** @brief Queue the robot description, written to /robot_description. */
+  void write(const std_msgs::msg::String& msg, const rclcpp::Time& stamp);
+
+  /** @brief Queue a sample, written to /calibration_data. */
+  void write(const robot_calibration_msgs::msg::CalibrationData& msg, const rclcpp::Time& stamp);
+
+  /** @brief Queue debugging data, written to /calibration_debug. */
+  void write(const robot_calibration_msgs::msg::ObservationDebug& msg, const rclcpp::Time& stamp);
+
+  /** @brief Queue raw sensor data, written to /calibration_raw. */
+  void write(const robot_calibration_msgs::msg::CalibrationRaw& msg, const rclcpp::Time& stamp);
+
+  /** @brief Write any queued messages, and close the bag. */
+  void close();
+
+private:
+  template <typename MessageT>
+  void queue(const MessageT& msg, const std::string& topic, const rclcpp::Time& stamp)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!writer_)
+      {
+        return;
+      }
+      queue_.push_back([msg, topic, stamp](rosbag2_cpp::Writer& writer)
+      {
+        writer.write(msg, topic, stamp);
+      });
+    }
+    condition_.notify_one();
+  }
+
+  void run();
+
+  std::unique_ptr<rosbag2_cpp::Writer> writer_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<std::function<void(rosbag2_cpp::Writer&)>> queue_;
+  bool stop_;
+  std::thread thread_;
+};
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_UTIL_CALIBRATION_BAG_WRITER_HPP
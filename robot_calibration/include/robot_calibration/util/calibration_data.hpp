@@ -19,14 +19,53 @@
 #ifndef ROBOT_CALIBRATION_UTIL_CALIBRATION_DATA_HPP
 #define ROBOT_CALIBRATION_UTIL_CALIBRATION_DATA_HPP
 
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include <rclcpp/rclcpp.hpp>
 #include <rosbag2_cpp/reader.hpp>
+#include <rosbag2_storage/storage_filter.hpp>
 #include <std_msgs/msg/string.hpp>
 #include <robot_calibration_msgs/msg/calibration_data.hpp>
+#include <robot_calibration_msgs/msg/observation_debug.hpp>
 
 namespace robot_calibration
 {
 
+/**
+ *  @brief Samples of calibration data are shared, read-only, between all of
+ *         the error blocks that use them.
+ */
+using CalibrationDataConstPtr =
+  std::shared_ptr<const robot_calibration_msgs::msg::CalibrationData>;
+
+/**
+ *  @brief Copy a sample of calibration data for the optimizer, without the
+ *         debugging cloud and image of each observation.
+ */
+inline CalibrationDataConstPtr makeSample(
+  const robot_calibration_msgs::msg::CalibrationData& msg)
+{
+  auto sample = std::make_shared<robot_calibration_msgs::msg::CalibrationData>();
+  sample->joint_states = msg.joint_states;
+  sample->observations.resize(msg.observations.size());
+  for (size_t i = 0; i < msg.observations.size(); ++i)
+  {
+    sample->observations[i].sensor_name = msg.observations[i].sensor_name;
+    sample->observations[i].features = msg.observations[i].features;
+    sample->observations[i].ext_camera_info = msg.observations[i].ext_camera_info;
+  }
+  return sample;
+}
+
 /**
  *  @brief Determine which observation index corresponds to a particular sensor name
  */
@@ -55,41 +94,285 @@ inline bool hasSensor(
 }
 
 /**
- *  \brief Load a bagfile of calibration data.
- *  \param file_name Name of the bag file to load.
- *  \param description_msg This will be loaded with the URDF string.
- *  \param data This will be loaded with the calibration data.
+ *  \brief Streams samples of calibration data from a bagfile, so that tools
+ *         can process large bags without holding every sample in memory.
+ *
+ *  Only the /robot_description and /calibration_data topics are read from
+ *  storage. Unless requested, the debugging cloud and image of each
+ *  observation are released as soon as a sample is read. When they are
+ *  requested, debugging data which was published separately is also read
+ *  from /calibration_debug, and attached to its observation.
  */
-inline bool load_bag(const std::string& file_name,
-                     std_msgs::msg::String& description_msg,
-                     std::vector<robot_calibration_msgs::msg::CalibrationData>& data)
+class CalibrationBagReader
 {
-  rosbag2_cpp::Reader reader;
-  
-  // Open the bag file
-  reader.open(file_name);
+public:
+  /**
+   *  \brief Create a reader.
+   *  \param keep_debug If true, keep the cloud and image of each observation.
+   */
+  explicit CalibrationBagReader(bool keep_debug = false) :
+    keep_debug_(keep_debug)
+  {
+  }
 
-  // Load messages
-  while (reader.has_next())
+  /**
+   *  \brief Open a bagfile and read the robot description from it.
+   *  \param file_name Name of the bag file to load.
+   *  \param description_msg This will be loaded with the URDF string.
+   */
+  bool open(const std::string& file_name, std_msgs::msg::String& description_msg)
   {
-    auto bag_message = reader.read_next();
+    try
+    {
+      // The description is needed before any samples can be used, but
+      // it may have been recorded at any point in the bag
+      reader_.open(file_name);
+      setTopic("/robot_description");
+      bool found_description = false;
+      while (reader_.has_next())
+      {
+        auto bag_message = reader_.read_next();
+        rclcpp::SerializedMessage extracted_serialized_msg(*bag_message->serialized_data);
+        rclcpp::Serialization<std_msgs::msg::String> serialization;
+        serialization.deserialize_message(&extracted_serialized_msg, &description_msg);
+        found_description = true;
+      }
+      reader_.close();
+
+      if (!found_description)
+      {
+        std::cerr << "No robot description in " << file_name << std::endl;
+      }
 
-    if (bag_message->topic_name == "/robot_description")
+      // Now stream the calibration data
+      reader_.open(file_name);
+      setTopic("/calibration_data", keep_debug_);
+    }
+    catch (const std::exception& e)
+    {
+      std::cerr << "Unable to read " << file_name << ": " << e.what() << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   *  \brief Read the next sample of calibration data.
+   *  \param msg This will be loaded with the sample.
+   *  \returns False once all samples have been read.
+   */
+  bool next(robot_calibration_msgs::msg::CalibrationData& msg)
+  {
+    while (reader_.has_next())
     {
-      rclcpp::SerializedMessage extracted_serialized_msg(*bag_message->serialized_data);
-      rclcpp::Serialization<std_msgs::msg::String> serialization;
-      serialization.deserialize_message(&extracted_serialized_msg, &description_msg);
+      auto bag_message = reader_.read_next();
+      if (bag_message->topic_name == "/calibration_debug")
+      {
+        // Debugging data is published before its sample
+        robot_calibration_msgs::msg::ObservationDebug debug;
+        deserialize(*bag_message, debug);
+        debug_[debug.id] = std::move(debug);
+        continue;
+      }
+
+      deserialize(*bag_message, msg);
+      attachDebug(msg);
+      return true;
     }
-    else if (bag_message->topic_name == "/calibration_data")
+    return false;
+  }
+
+  /**
+   *  \brief Read all of the remaining samples of calibration data.
+   *  \param data The samples are appended to this, in bag order.
+   *  \param num_threads Number of threads to deserialize samples with. This
+   *         thread only reads serialized messages from the bag.
+   */
+  void readAll(std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+               size_t num_threads)
+  {
+    if (num_threads < 2)
     {
       robot_calibration_msgs::msg::CalibrationData msg;
-      rclcpp::SerializedMessage extracted_serialized_msg(*bag_message->serialized_data);
-      rclcpp::Serialization<robot_calibration_msgs::msg::CalibrationData> serialization;
-      serialization.deserialize_message(&extracted_serialized_msg, &msg);
-      data.push_back(msg);
+      while (next(msg))
+      {
+        data.push_back(std::move(msg));
+      }
+      return;
     }
+
+    // Elements of a deque are not moved as it grows, so workers can
+    // deserialize into their sample while more samples are added
+    struct Job
+    {
+      std::shared_ptr<rosbag2_storage::SerializedBagMessage> bag_message;
+      robot_calibration_msgs::msg::CalibrationData* sample;
+      robot_calibration_msgs::msg::ObservationDebug* debug;
+    };
+    std::deque<robot_calibration_msgs::msg::CalibrationData> samples;
+    std::deque<robot_calibration_msgs::msg::ObservationDebug> debug;
+    std::queue<Job> jobs;
+    std::mutex mutex;
+    std::condition_variable job_added, job_taken;
+    bool done = false;
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < num_threads; ++i)
+    {
+      workers.emplace_back([&]()
+      {
+        while (true)
+        {
+          Job job;
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_added.wait(lock, [&]() { return done || !jobs.empty(); });
+            if (jobs.empty())
+            {
+              return;
+            }
+            job = jobs.front();
+            jobs.pop();
+          }
+          job_taken.notify_one();
+          if (job.sample)
+          {
+            deserialize(*job.bag_message, *job.sample);
+          }
+          else
+          {
+            deserialize(*job.bag_message, *job.debug);
+          }
+        }
+      });
+    }
+
+    // Bound the number of serialized messages held in memory
+    const size_t max_jobs = 4 * num_threads;
+    while (reader_.has_next())
+    {
+      auto bag_message = reader_.read_next();
+      std::unique_lock<std::mutex> lock(mutex);
+      job_taken.wait(lock, [&]() { return jobs.size() < max_jobs; });
+      Job job = {bag_message, nullptr, nullptr};
+      if (bag_message->topic_name == "/calibration_debug")
+      {
+        debug.emplace_back();
+        job.debug = &debug.back();
+      }
+      else
+      {
+        samples.emplace_back();
+        job.sample = &samples.back();
+      }
+      jobs.push(job);
+      lock.unlock();
+      job_added.notify_one();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+    }
+    job_added.notify_all();
+    for (auto& worker : workers)
+    {
+      worker.join();
+    }
+
+    for (auto& d : debug)
+    {
+      debug_[d.id] = std::move(d);
+    }
+    for (auto& sample : samples)
+    {
+      attachDebug(sample);
+      data.push_back(std::move(sample));
+    }
+  }
+
+private:
+  /** \brief Deserialize a sample, this is safe to call from any thread. */
+  void deserialize(const rosbag2_storage::SerializedBagMessage& bag_message,
+                   robot_calibration_msgs::msg::CalibrationData& msg) const
+  {
+    rclcpp::SerializedMessage extracted_serialized_msg(*bag_message.serialized_data);
+    rclcpp::Serialization<robot_calibration_msgs::msg::CalibrationData> serialization;
+    serialization.deserialize_message(&extracted_serialized_msg, &msg);
+
+    if (!keep_debug_)
+    {
+      for (auto& observation : msg.observations)
+      {
+        observation.cloud = sensor_msgs::msg::PointCloud2();
+        observation.image = sensor_msgs::msg::Image();
+      }
+    }
+  }
+
+  /** \brief Deserialize debugging data, this is safe to call from any thread. */
+  void deserialize(const rosbag2_storage::SerializedBagMessage& bag_message,
+                   robot_calibration_msgs::msg::ObservationDebug& msg) const
+  {
+    rclcpp::SerializedMessage extracted_serialized_msg(*bag_message.serialized_data);
+    rclcpp::Serialization<robot_calibration_msgs::msg::ObservationDebug> serialization;
+    serialization.deserialize_message(&extracted_serialized_msg, &msg);
+  }
+
+  /** \brief Move separately stored debugging data into the observations of a sample. */
+  void attachDebug(robot_calibration_msgs::msg::CalibrationData& msg)
+  {
+    for (auto& observation : msg.observations)
+    {
+      auto it = debug_.find(observation.debug_id);
+      if (observation.debug_id.empty() || it == debug_.end())
+      {
+        continue;
+      }
+      observation.cloud = std::move(it->second.cloud);
+      observation.image = std::move(it->second.image);
+      debug_.erase(it);
+    }
+  }
+
+  void setTopic(const std::string& topic, bool debug = false)
+  {
+    rosbag2_storage::StorageFilter filter;
+    filter.topics.push_back(topic);
+    if (debug)
+    {
+      filter.topics.push_back("/calibration_debug");
+    }
+    reader_.set_filter(filter);
+  }
+
+  rosbag2_cpp::Reader reader_;
+  bool keep_debug_;
+  // Debugging data which has not yet been attached to a sample, by id
+  std::map<std::string, robot_calibration_msgs::msg::ObservationDebug> debug_;
+};
+
+/**
+ *  \brief Load a bagfile of calibration data.
+ *  \param file_name Name of the bag file to load.
+ *  \param description_msg This will be loaded with the URDF string.
+ *  \param data This will be loaded with the calibration data.
+ *  \param keep_debug If true, keep the cloud and image of each observation.
+ *  \param num_threads Number of threads to deserialize samples with.
+ */
+inline bool load_bag(const std::string& file_name,
+                     std_msgs::msg::String& description_msg,
+                     std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                     bool keep_debug = true,
+                     size_t num_threads = 1)
+{
+  CalibrationBagReader reader(keep_debug);
+  if (!reader.open(file_name, description_msg))
+  {
+    return false;
   }
 
+  reader.readAll(data, num_threads);
   return true;
 }
 
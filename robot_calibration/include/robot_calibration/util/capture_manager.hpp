@@ -21,10 +21,19 @@
 #ifndef ROBOT_CALIBRATION_UTIL_CAPTURE_MANAGER_HPP
 #define ROBOT_CALIBRATION_UTIL_CAPTURE_MANAGER_HPP
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 #include <rclcpp/rclcpp.hpp>
+#include <robot_calibration_msgs/msg/calibration_data.hpp>
+#include <robot_calibration_msgs/msg/calibration_raw.hpp>
+#include <robot_calibration_msgs/msg/observation_debug.hpp>
 #include <robot_calibration/finders/loader.hpp>
+#include <robot_calibration/util/calibration_bag_writer.hpp>
 #include <robot_calibration/util/chain_manager.hpp>
 
 namespace robot_calibration
@@ -33,16 +42,118 @@ class CaptureManager
 {
 public:
   CaptureManager();
+  ~CaptureManager();
   bool init(rclcpp::Node::SharedPtr node);
   bool moveToState(const sensor_msgs::msg::JointState& state);
+
+  /**
+   * @brief Start planning the move to the next state, see ChainManager::planAhead().
+   */
+  bool planAhead(const sensor_msgs::msg::JointState& state);
   bool captureFeatures(const std::vector<std::string>& feature_names,
                        robot_calibration_msgs::msg::CalibrationData& msg);
   std::string getUrdf();
 
+  /**
+   * @brief Is pipelined capture enabled? If so, use queueFeatures() rather
+   *        than captureFeatures().
+   */
+  bool isPipelined() const
+  {
+    return pipeline_depth_ > 0;
+  }
+
+  /**
+   * @brief Capture the raw sensor data and joint states, and queue the
+   *        extraction of features from them. Blocks while the queue is full.
+   * @returns False if the raw data could not be captured.
+   */
+  bool queueFeatures(const std::vector<std::string>& feature_names);
+
+  /**
+   * @brief Get the samples whose features have been extracted since the
+   *        last call, in the order they were queued. Samples where
+   *        extraction failed are dropped.
+   * @param samples Finished samples are appended to this.
+   * @param wait If true, first wait for all queued extraction to finish.
+   */
+  void getFinishedSamples(std::vector<robot_calibration_msgs::msg::CalibrationData>& samples,
+                          bool wait);
+
+  /**
+   * @brief Is continuous capture enabled? If so, use captureWhileMoving()
+   *        rather than moveToState() and capturing at each pose.
+   */
+  bool isContinuous() const
+  {
+    return continuous_capture_;
+  }
+
+  /**
+   * @brief Move to a state, capturing samples along the way. The joint
+   *        states of each sample are interpolated to the time at which
+   *        the sensor data was captured. Samples captured while a joint
+   *        moves faster than continuous_max_velocity are dropped.
+   * @param samples Samples extracted along the way are appended to this,
+   *        when pipelined they are returned by getFinishedSamples() instead.
+   * @returns False if the move failed, or a finder does not report when
+   *          its data was captured.
+   */
+  bool captureWhileMoving(const sensor_msgs::msg::JointState& state,
+                          const std::vector<std::string>& feature_names,
+                          std::vector<robot_calibration_msgs::msg::CalibrationData>& samples);
+
 private:
+  struct QueuedSample;
+
   void callback(std_msgs::msg::String::ConstSharedPtr msg);
 
+  // Get the finders to capture, in the order that observations are added
+  std::vector<FeatureFinderMap::iterator> selectFinders(const std::vector<std::string>& feature_names);
+
+  // Queue a sample for extraction, blocks while the queue is full
+  void enqueue(QueuedSample&& sample);
+
+  // Extract the features of a sample, and publish it if successful
+  bool extractSample(QueuedSample& sample);
+
+  // Extracts the features of queued samples, one at a time
+  void extractSamples();
+
+  // Publish a sample, and its debugging data
+  void publish(robot_calibration_msgs::msg::CalibrationData& msg);
+
+  // Add the raw data of a finder after it captured, if recording raw data
+  void addRawData(const std::string& name, FeatureFinder& finder,
+                  robot_calibration_msgs::msg::CalibrationRaw& raw);
+
+  // Publish the raw data of a sample, if recording raw data
+  void publishRaw(const robot_calibration_msgs::msg::CalibrationRaw& raw);
+
+  struct QueuedSample
+  {
+    robot_calibration_msgs::msg::CalibrationData msg;
+    robot_calibration_msgs::msg::CalibrationRaw raw;
+    std::vector<std::pair<std::string, FeatureFinder::Extractor>> extractors;
+    int pose;  // For tracing
+  };
+
   rclcpp::Publisher<robot_calibration_msgs::msg::CalibrationData>::SharedPtr data_pub_;
+
+  // Debugging data published separately from the calibration data
+  rclcpp::Publisher<robot_calibration_msgs::msg::ObservationDebug>::SharedPtr debug_pub_;
+  bool separate_debug_;
+  size_t num_samples_;
+
+  // Raw sensor data of each sample, for replay_finders
+  rclcpp::Publisher<robot_calibration_msgs::msg::CalibrationRaw>::SharedPtr raw_pub_;
+  bool record_raw_;
+  // Finders which have been found not to support replay
+  std::set<std::string> no_raw_data_;
+
+  // Records the description and samples, if record_bag is set
+  std::shared_ptr<CalibrationBagWriter> recorder_;
+  rclcpp::Clock::SharedPtr clock_;
   rclcpp::Subscription<std_msgs::msg::String>::SharedPtr urdf_sub_;
   std::string description_;
   bool description_valid_;
@@ -50,6 +161,23 @@ private:
   robot_calibration::ChainManager* chain_manager_;
   robot_calibration::FeatureFinderLoader feature_finder_loader_;
   robot_calibration::FeatureFinderMap finders_;
+  bool parallel_finders_;
+
+  // Continuous capture
+  bool continuous_capture_;
+  double continuous_max_velocity_;
+  double continuous_interval_;
+  double continuous_max_skew_;
+
+  // Pipelined capture
+  int pipeline_depth_;
+  std::mutex queue_mutex_;
+  std::condition_variable queue_condition_;
+  std::deque<QueuedSample> queued_;
+  std::vector<robot_calibration_msgs::msg::CalibrationData> finished_;
+  bool extracting_;
+  bool stop_;
+  std::thread extract_thread_;
 };
 
 }  // namespace robot_calibration
@@ -21,6 +21,12 @@
 #ifndef ROBOT_CALIBRATION_CAPTURE_CHAIN_MANAGER_HPP
 #define ROBOT_CALIBRATION_CAPTURE_CHAIN_MANAGER_HPP
 
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <builtin_interfaces/msg/time.hpp>
 #include <rclcpp/rclcpp.hpp>
 #include <sensor_msgs/msg/joint_state.hpp>
 #include <control_msgs/action/follow_joint_trajectory.hpp>
@@ -30,6 +36,88 @@
 namespace robot_calibration
 {
 
+/**
+ * @brief Decides when joints have settled, from a sequence of joint states.
+ *        Joints are settled once their velocities and the change in their
+ *        positions have stayed under thresholds for a window of time.
+ */
+class SettleDetector
+{
+public:
+  /**
+   * @param velocity_threshold Maximum absolute velocity of a settled joint.
+   * @param position_threshold Maximum change in position of a settled joint
+   *        over the window.
+   * @param window Time (in seconds) joints must stay under the thresholds,
+   *        if zero a single joint state under the velocity threshold suffices.
+   */
+  SettleDetector(double velocity_threshold, double position_threshold, double window);
+
+  /**
+   * @brief Start watching a set of joints, other joints are ignored.
+   */
+  void reset(const std::vector<std::string>& joint_names);
+
+  /**
+   * @brief Update with the latest joint state.
+   * @param state The joint state, joints missing from it are ignored.
+   * @param time Time (in seconds) of the joint state.
+   * @returns True if the joints are settled.
+   */
+  bool update(const sensor_msgs::msg::JointState& state, double time);
+
+private:
+  double velocity_threshold_;
+  double position_threshold_;
+  double window_;
+
+  std::vector<std::string> joint_names_;
+  // Position of each joint when the window started, NAN if not known
+  std::vector<double> window_positions_;
+  double window_start_;
+  bool window_started_;
+};
+
+/**
+ * @brief Recent timestamped joint states, so that the joint positions can be
+ *        interpolated to the stamp of sensor data captured while moving.
+ */
+class JointStateBuffer
+{
+public:
+  /** @param duration Time (in seconds) of joint states to keep. */
+  explicit JointStateBuffer(double duration = 0.0);
+
+  void setDuration(double duration);
+
+  /**
+   * @brief Add a joint state, in order of stamps. Joints may be added to
+   *        later states, but the joints of earlier states must stay in the
+   *        same order at the start of later states.
+   */
+  void add(const sensor_msgs::msg::JointState& state);
+
+  /**
+   * @brief Linearly interpolate the positions and velocities of the joints to
+   *        a time. Joints missing from the earlier state take the values of
+   *        the later state.
+   * @param time Time (in seconds) to interpolate to.
+   * @param max_interval Maximum time (in seconds) between the two states
+   *        interpolated between, so that a gap in the joint states is not
+   *        mistaken for uniform motion.
+   * @param state Filled with the interpolated joint state, stamped with time.
+   * @returns False if time is not between two states close enough together.
+   */
+  bool interpolate(double time, double max_interval, sensor_msgs::msg::JointState& state) const;
+
+  /** @brief Get the time (in seconds) of the latest joint state, or -inf if none. */
+  double getLatestTime() const;
+
+private:
+  double duration_;
+  std::deque<sensor_msgs::msg::JointState> states_;
+};
+
 /**
  * @brief Manages moving joints to a new pose, determining when they
  *        are settled, and returning current joint_states.
@@ -67,7 +155,8 @@ public:
   /**
    * @brief Constructor, sets up chains from ros parameters.
    * @param node The node handle, sets namespace for parameters.
-   * @param wait_time The time to wait for each action to come up.
+   * @param wait_time The time to wait for all of the actions to come up,
+   *        they are waited for at once.
    */
   ChainManager(rclcpp::Node::SharedPtr node, long int wait_time = 15);
 
@@ -78,6 +167,33 @@ public:
    */
   bool moveToState(const sensor_msgs::msg::JointState& state);
 
+  /**
+   * @brief Start a move to a state like moveToState(), without waiting for
+   *        it to finish. Call waitForMove() once isMoving() returns false.
+   * @returns False if the move could not be planned.
+   */
+  bool startMove(const sensor_msgs::msg::JointState& state);
+
+  /**
+   * @brief Check if the move started by startMove() is still in progress,
+   *        servicing callbacks of the node.
+   */
+  bool isMoving();
+
+  /**
+   * @brief Wait for the move started by startMove() to finish.
+   */
+  bool waitForMove();
+
+  /**
+   * @brief Start planning the move from the last state passed to
+   *        moveToState() to the next one, if plan_ahead is enabled. The
+   *        next moveToState() to this state then uses the plan, unless the
+   *        joints have drifted from where the plan starts.
+   * @returns True if a plan was requested.
+   */
+  bool planAhead(const sensor_msgs::msg::JointState& state);
+
   /**
    * @brief Wait for joints to settle.
    * @return True if joints have settled, false if timeout was hit.
@@ -89,6 +205,23 @@ public:
    */
   bool getState(sensor_msgs::msg::JointState* state);
 
+  /**
+   * @brief Start keeping recent joint states for getStateAt().
+   * @param duration Time (in seconds) of joint states to keep.
+   */
+  void bufferStates(double duration);
+
+  /**
+   * @brief Get the joint states interpolated to a time, see JointStateBuffer.
+   *        Waits for a joint state after the time to arrive, servicing
+   *        callbacks of the node.
+   * @param stamp Time to interpolate to, typically the stamp of sensor data.
+   * @param max_interval See JointStateBuffer::interpolate().
+   * @param timeout Maximum time (in seconds) to wait for a later joint state.
+   */
+  bool getStateAt(const builtin_interfaces::msg::Time& stamp, double max_interval,
+                  double timeout, sensor_msgs::msg::JointState* state);
+
   /**
    * @brief Get the names of chains. Mainly for testing
    */
@@ -105,15 +238,58 @@ public:
 private:
   void stateCallback(sensor_msgs::msg::JointState::ConstSharedPtr msg);
 
+  /**
+   * @brief Publish a copy of state_ for getState().
+   */
+  void publishState();
+
   trajectory_msgs::msg::JointTrajectoryPoint makePoint(const sensor_msgs::msg::JointState& state,
                                                        const std::vector<std::string>& joints);
 
+  /**
+   * @brief Send a plan_only request to move_group.
+   * @param controller The controller to plan for.
+   * @param goal The goal, ordered as the joints of the controller.
+   * @param start If not null, the start state, otherwise the current state is used.
+   */
+  void sendPlanRequest(const ChainController& controller,
+                       const trajectory_msgs::msg::JointTrajectoryPoint& goal,
+                       const trajectory_msgs::msg::JointTrajectoryPoint* start);
+
+  /**
+   * @brief Wait for the plan requested by sendPlanRequest().
+   * @returns False if planning failed.
+   */
+  bool waitForPlan(trajectory_msgs::msg::JointTrajectory& trajectory);
+
+  /**
+   * @brief Check if the current joint positions are close to a state.
+   */
+  bool isNear(const std::vector<std::string>& joints,
+              const trajectory_msgs::msg::JointTrajectoryPoint& point,
+              double tolerance);
+
   // Subscriber for joint_states topic, storage of message
   rclcpp::Node::WeakPtr node_ptr_;
   rclcpp::Subscription<sensor_msgs::msg::JointState>::SharedPtr subscriber_;
-  std::mutex state_mutex_;
+  std::atomic<bool> state_is_valid_;
+
+  // State of all joints seen so far, only accessed by stateCallback
   sensor_msgs::msg::JointState state_;
-  bool state_is_valid_;
+  std::unordered_map<std::string, size_t> state_index_;
+  // Joint names of the last message, and where each is stored in state_
+  std::vector<std::string> message_names_;
+  std::vector<size_t> message_indices_;
+
+  // Latest copy of state_, swapped atomically so that readers never block
+  // the callback. The previous copy is reused once no reader holds it.
+  std::shared_ptr<sensor_msgs::msg::JointState> snapshot_;
+  std::shared_ptr<sensor_msgs::msg::JointState> spare_snapshot_;
+
+  // Recent stamped copies of state_, if bufferStates() was called
+  std::mutex buffer_mutex_;
+  JointStateBuffer state_buffer_;
+  bool buffer_states_;
 
   // Mechanisms for passing commands to controllers
   double duration_;
@@ -121,8 +297,29 @@ private:
   std::shared_ptr<robot_calibration::ActionClient<MoveGroupAction>> move_group_;
   double velocity_factor_;  // scaling factor to slow down move_group plans
 
+  // Planning the next move while the current pose is captured
+  bool plan_ahead_;
+  double plan_ahead_tolerance_;
+  bool plan_pending_;
+  size_t plan_controller_;
+  trajectory_msgs::msg::JointTrajectoryPoint plan_start_;
+  trajectory_msgs::msg::JointTrajectoryPoint plan_goal_;
+  // Last state passed to moveToState(), where the next plan starts
+  sensor_msgs::msg::JointState last_state_;
+  bool last_state_is_valid_;
+
+  // Move started by startMove()
+  sensor_msgs::msg::JointState move_state_;
+  rclcpp::Time move_start_;
+  double move_timeout_;
+
   // Maximum time to wait (in seconds) for settling to occur
   double settling_timeout_;
+
+  // Thresholds for settling, see SettleDetector
+  double settling_velocity_;
+  double settling_position_;
+  double settling_window_;
 };
 
 }  // namespace robot_calibration
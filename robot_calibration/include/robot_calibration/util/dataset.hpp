@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_UTIL_DATASET_HPP
+#define ROBOT_CALIBRATION_UTIL_DATASET_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <std_msgs/msg/string.hpp>
+#include <robot_calibration_msgs/msg/calibration_data.hpp>
+
+namespace robot_calibration
+{
+
+// Layout of the file, see dataset.cpp
+struct DatasetHeader;
+
+/**
+ * @brief Write a compact binary dataset, which can be reloaded much faster
+ *        than a bagfile.
+ * @param file_name Name of the dataset file to write.
+ * @param description The URDF string.
+ * @param data The calibration data. Only the joint names and positions,
+ *        and the sensor name, features and camera info of each observation
+ *        are stored, which is everything the optimizer uses.
+ */
+bool writeDataset(const std::string& file_name,
+                  const std::string& description,
+                  const std::vector<robot_calibration_msgs::msg::CalibrationData>& data);
+
+/**
+ * @brief Read only access to a dataset written by writeDataset().
+ *
+ * The file is memory mapped and all of the tables are used in place, so
+ * opening a dataset does no parsing and samples are decoded directly from
+ * the flat joint and feature arrays.
+ */
+class Dataset
+{
+public:
+  Dataset();
+  ~Dataset();
+
+  Dataset(const Dataset&) = delete;
+  Dataset& operator=(const Dataset&) = delete;
+
+  /**
+   * @brief Map a dataset file.
+   * @returns False if the file cannot be mapped or is not a valid dataset.
+   */
+  bool open(const std::string& file_name);
+
+  /** @brief Unmap the dataset, if open. */
+  void close();
+
+  /** @brief Get the URDF string. */
+  std::string getDescription() const;
+
+  /** @brief Get the number of samples. */
+  size_t size() const;
+
+  /** @brief Get the joint positions of a sample, joint_count is returned. */
+  const double* getJointPositions(size_t sample, size_t& joint_count) const;
+
+  /**
+   * @brief Decode a sample.
+   * @returns False if the sample index or the file contents are invalid.
+   */
+  bool getSample(size_t sample, robot_calibration_msgs::msg::CalibrationData& msg) const;
+
+private:
+  /** @brief Get a pointer to count items at some offset, or nullptr if out of bounds. */
+  template <typename T>
+  const T* getTable(uint64_t offset, uint64_t count) const;
+
+  /** @brief Get a string from the string table. */
+  bool getString(uint64_t index, std::string& s) const;
+
+  const char* data_;
+  size_t size_;
+  const DatasetHeader* header_;
+};
+
+/**
+ * @brief Load a dataset written by writeDataset().
+ * @param file_name Name of the dataset file to load.
+ * @param description_msg This will be loaded with the URDF string.
+ * @param data This will be loaded with the calibration data.
+ */
+bool loadDataset(const std::string& file_name,
+                 std_msgs::msg::String& description_msg,
+                 std::vector<robot_calibration_msgs::msg::CalibrationData>& data);
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_UTIL_DATASET_HPP
@@ -21,6 +21,7 @@
 #ifndef ROBOT_CALIBRATION_CAPTURE_DEPTH_CAMERA_H
 #define ROBOT_CALIBRATION_CAPTURE_DEPTH_CAMERA_H
 
+#include <mutex>
 #include <rclcpp/rclcpp.hpp>
 #include <rclcpp/parameter_client.hpp>
 #include <sensor_msgs/msg/camera_info.hpp>
@@ -48,6 +49,13 @@ public:
     z_offset_mm_ = 0;
     z_scaling_ = 1.0;
 
+    // When replaying recorded data, the camera info comes with the data
+    bool offline = false;
+    if (node->get_parameter("offline", offline) && offline)
+    {
+      return true;
+    }
+
     // Get parameters of drivers
     std::string driver_name =
       node->declare_parameter<std::string>(name + ".camera_driver", "/head_camera/driver");
@@ -83,13 +91,37 @@ public:
         return true;
       }
       rclcpp::sleep_for(std::chrono::milliseconds(100));
-      rclcpp::spin_some(node);
+      {
+        // Finders are initialized concurrently, but the node can only be
+        // spun by one executor at a time
+        static std::mutex spin_mutex;
+        std::lock_guard<std::mutex> lock(spin_mutex);
+        rclcpp::spin_some(node);
+      }
     }
 
     RCLCPP_WARN(logger, "CameraInfo receive timed out.");
     return false;
   }
 
+  /** @brief Use the camera info recorded with some data, when replaying it. */
+  void setDepthCameraInfo(const robot_calibration_msgs::msg::ExtendedCameraInfo& info)
+  {
+    camera_info_ptr_ = std::make_shared<sensor_msgs::msg::CameraInfo>(info.camera_info);
+    for (auto& param : info.parameters)
+    {
+      if (param.name == "z_offset_mm")
+      {
+        z_offset_mm_ = param.value;
+      }
+      else if (param.name == "z_scaling")
+      {
+        z_scaling_ = param.value;
+      }
+    }
+    camera_info_valid_ = true;
+  }
+
   robot_calibration_msgs::msg::ExtendedCameraInfo getDepthCameraInfo()
   {
     robot_calibration_msgs::msg::ExtendedCameraInfo info;
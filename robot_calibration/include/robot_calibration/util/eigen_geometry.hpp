@@ -47,45 +47,131 @@ inline Eigen::MatrixXd getMatrix(const std::vector<geometry_msgs::msg::PointStam
 /**
  * @brief Get the centroid of a point cloud.
  */
-inline Eigen::Vector3d getCentroid(Eigen::MatrixXd points)
+inline Eigen::Vector3d getCentroid(const Eigen::Ref<const Eigen::MatrixXd>& points)
 {
   return Eigen::Vector3d(points.row(0).mean(), points.row(1).mean(), points.row(2).mean()); 
 }
 
 /**
- * @brief Find the plane parameters for a point cloud
- * @param points Point cloud to determine plane parameters
- * @param normal The calculated normal, returned by reference
- * @param d The calculated d value in the plane equation
+ * @brief Fits a plane to points that are added one at a time, by
+ *        accumulating the first and second moments of the points.
  *
- * The equation of the plane will be ax + by + cz + d = 0, where
- * a, b, and c are the normal.
+ * The moments are taken about the first point added, which keeps the
+ * scatter matrix accurate when the points are far from the origin.
  */
-inline bool getPlane(Eigen::MatrixXd points, Eigen::Vector3d& normal, double& d)
+class PlaneFitter
 {
-  // Find centroid
-  Eigen::Vector3d centroid = getCentroid(points);
+public:
+  PlaneFitter() :
+    count_(0),
+    origin_(Eigen::Vector3d::Zero()),
+    sum_(Eigen::Vector3d::Zero()),
+    sum_sq_(Eigen::Matrix3d::Zero())
+  {
+  }
 
-  // Center the cloud
-  points.row(0).array() -= centroid(0);
-  points.row(1).array() -= centroid(1);
-  points.row(2).array() -= centroid(2);
+  /**
+   * @brief Create a fitter and add each column of a point cloud.
+   */
+  explicit PlaneFitter(const Eigen::Ref<const Eigen::MatrixXd>& points) :
+    PlaneFitter()
+  {
+    for (int i = 0; i < points.cols(); ++i)
+    {
+      add(points.col(i));
+    }
+  }
 
-  // Find the plane
-  auto svd = points.jacobiSvd(Eigen::ComputeThinU | Eigen::ComputeThinV);
-  normal = svd.matrixU().rightCols<1>();
+  /**
+   * @brief Add a point to the fit.
+   */
+  void add(const Eigen::Vector3d& point)
+  {
+    if (count_ == 0)
+    {
+      origin_ = point;
+    }
+    Eigen::Vector3d p = point - origin_;
+    sum_ += p;
+    sum_sq_.selfadjointView<Eigen::Lower>().rankUpdate(p);
+    ++count_;
+  }
 
-  // Get the rest of plane equation
-  d = -(normal(0) * centroid(0) + normal(1) * centroid(1) + normal(2) * centroid(2));
+  /**
+   * @brief Get the number of points added.
+   */
+  size_t size() const
+  {
+    return count_;
+  }
 
-  if (d < 0)
+  /**
+   * @brief Get the centroid of the points added.
+   */
+  Eigen::Vector3d getCentroid() const
   {
-    // Invert the normal vector so that d is always positive
-    d *= -1;
-    normal *= -1;
+    if (count_ == 0)
+    {
+      return Eigen::Vector3d::Zero();
+    }
+    return origin_ + sum_ / count_;
   }
 
-  return true;
+  /**
+   * @brief Find the plane parameters from the points added.
+   * @param normal The calculated normal, returned by reference
+   * @param d The calculated d value in the plane equation
+   *
+   * The equation of the plane will be ax + by + cz + d = 0, where
+   * a, b, and c are the normal.
+   */
+  bool getPlane(Eigen::Vector3d& normal, double& d) const
+  {
+    Eigen::Vector3d centroid = getCentroid();
+
+    // Scatter matrix about the centroid, only the lower triangle is used
+    Eigen::Matrix3d scatter = sum_sq_;
+    if (count_ > 0)
+    {
+      scatter -= (sum_ * sum_.transpose()) / count_;
+    }
+
+    // Find the plane, the normal is the direction of least variance
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(scatter);
+    normal = solver.eigenvectors().col(0);
+
+    // Get the rest of plane equation
+    d = -(normal(0) * centroid(0) + normal(1) * centroid(1) + normal(2) * centroid(2));
+
+    if (d < 0)
+    {
+      // Invert the normal vector so that d is always positive
+      d *= -1;
+      normal *= -1;
+    }
+
+    return true;
+  }
+
+private:
+  size_t count_;
+  Eigen::Vector3d origin_;
+  Eigen::Vector3d sum_;
+  Eigen::Matrix3d sum_sq_;
+};
+
+/**
+ * @brief Find the plane parameters for a point cloud
+ * @param points Point cloud to determine plane parameters
+ * @param normal The calculated normal, returned by reference
+ * @param d The calculated d value in the plane equation
+ *
+ * The equation of the plane will be ax + by + cz + d = 0, where
+ * a, b, and c are the normal.
+ */
+inline bool getPlane(const Eigen::Ref<const Eigen::MatrixXd>& points, Eigen::Vector3d& normal, double& d)
+{
+  return PlaneFitter(points).getPlane(normal, d);
 }
 
 }  // namespace robot_calibration
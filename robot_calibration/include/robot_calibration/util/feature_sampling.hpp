@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_UTIL_FEATURE_SAMPLING_HPP
+#define ROBOT_CALIBRATION_UTIL_FEATURE_SAMPLING_HPP
+
+#include <cstddef>
+#include <vector>
+#include <geometry_msgs/msg/point_stamped.hpp>
+#include <robot_calibration_msgs/msg/calibration_data.hpp>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Select a deterministic subset of the features of an observation.
+ * @param features The features to select from.
+ * @param max_features Maximum number of features to select.
+ * @param farthest_point If true, use farthest point sampling starting from
+ *        the first feature, so that the selection covers the extent of the
+ *        features. Otherwise, features are selected at an even stride.
+ * @returns The indices of the selected features, in increasing order. All
+ *          of them if there are not more than max_features.
+ */
+std::vector<size_t> selectFeatures(const std::vector<geometry_msgs::msg::PointStamped>& features,
+                                   size_t max_features,
+                                   bool farthest_point);
+
+/**
+ * @brief Copy samples of calibration data with at most max_features
+ *        features in each observation, without the debugging cloud and
+ *        image of each observation.
+ *
+ * Error blocks pair the features of two observations by index, so within
+ * a sample, every observation with the same number of features keeps the
+ * same indices, which are selected from the first of those observations.
+ */
+void decimateFeatures(const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                      size_t max_features,
+                      bool farthest_point,
+                      std::vector<robot_calibration_msgs::msg::CalibrationData>& decimated);
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_UTIL_FEATURE_SAMPLING_HPP
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_UTIL_MAGNETOMETER_FIT_HPP
+#define ROBOT_CALIBRATION_UTIL_MAGNETOMETER_FIT_HPP
+
+#include <Eigen/Core>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Closed form least squares fit of a sphere to magnetometer samples,
+ *        the hard iron model |m - offset| = field.
+ * @param samples The magnetometer samples, one per column.
+ * @param offset Returns the hard iron offset (center of the sphere).
+ * @param field Returns the magnetic field strength (radius of the sphere).
+ * @returns False if the samples do not constrain a sphere, for instance if
+ *          they all lie in a plane.
+ */
+bool fitSphere(const Eigen::Matrix3Xd& samples,
+               Eigen::Vector3d& offset,
+               double& field);
+
+/**
+ * @brief Closed form least squares fit of an ellipsoid to magnetometer
+ *        samples, the soft iron model |soft_iron * (m - offset)| = field.
+ * @param samples The magnetometer samples, one per column.
+ * @param offset Returns the hard iron offset (center of the ellipsoid).
+ * @param soft_iron Returns the symmetric soft iron correction, scaled to
+ *        have a determinant of one, so that it does not change the field.
+ * @param field Returns the magnetic field strength.
+ * @returns False if the samples do not constrain an ellipsoid.
+ */
+bool fitEllipsoid(const Eigen::Matrix3Xd& samples,
+                  Eigen::Vector3d& offset,
+                  Eigen::Matrix3d& soft_iron,
+                  double& field);
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_UTIL_MAGNETOMETER_FIT_HPP
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_UTIL_MESH_CACHE_HPP
+#define ROBOT_CALIBRATION_UTIL_MESH_CACHE_HPP
+
+#include <memory>
+#include <string>
+
+#include <Eigen/Geometry>
+#include <geometric_shapes/shapes.h>
+#include <robot_calibration/util/mesh_tree.hpp>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief On disk cache of collision meshes, after they have been transformed
+ *        and decimated, together with their MeshTree. Each entry is a single
+ *        binary file which is loaded with mmap, so no parsing of the mesh or
+ *        building of the tree is needed.
+ */
+class MeshCache
+{
+public:
+  explicit MeshCache(const std::string& directory);
+
+  /**
+   * @brief Get the key for a mesh.
+   * @param resource The resource path of the mesh (package://path/x.stl).
+   * @param scale The scale of the mesh.
+   * @param origin The transform applied to the vertices of the mesh.
+   * @param target_triangles The triangle count the mesh is decimated to,
+   *        zero if not decimated.
+   *
+   * If the resource can be found on disk, the size and modification time
+   * of the file are part of the key, so that changed meshes are reloaded.
+   */
+  static std::string getKey(const std::string& resource,
+                            const Eigen::Vector3d& scale,
+                            const Eigen::Isometry3d& origin,
+                            size_t target_triangles);
+
+  /**
+   * @brief Load a mesh.
+   * @returns False if there is no valid entry for the key.
+   */
+  bool load(const std::string& key,
+            std::shared_ptr<shapes::Mesh>& mesh,
+            MeshTreePtr& tree) const;
+
+  /** @brief Save a mesh, and the tree built from it. */
+  bool save(const std::string& key,
+            const shapes::Mesh& mesh,
+            const MeshTree& tree) const;
+
+private:
+  /** @brief Get the name of the file for a key. */
+  std::string getFileName(const std::string& key) const;
+
+  std::string directory_;
+};
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_UTIL_MESH_CACHE_HPP
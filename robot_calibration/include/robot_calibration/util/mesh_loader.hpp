@@ -20,31 +20,74 @@
 #define ROBOT_CALIBRATION_UTIL_MESH_LOADER_HPP
 
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <geometric_shapes/shape_operations.h>
 #include <urdf/model.h>
+#include <robot_calibration/util/mesh_cache.hpp>
+#include <robot_calibration/util/mesh_tree.hpp>
 
 namespace robot_calibration
 {
 
 using MeshPtr = std::shared_ptr<shapes::Mesh>;
 
+/**
+ * @brief Reduce the number of triangles of a mesh by vertex clustering. The
+ *        vertices in each cell of a uniform grid are merged, using the finest
+ *        grid which gives at most max_triangles. Vertices move by at most the
+ *        size of a cell.
+ */
+MeshPtr decimateMesh(const shapes::Mesh& mesh, size_t max_triangles);
+
+/**
+ * @brief Loads collision meshes from a URDF. This is thread safe, so that
+ *        optimizers running in parallel can share one loader.
+ */
 class MeshLoader
 {
 public:
-  MeshLoader(std::shared_ptr<urdf::Model> model);
+  struct Params
+  {
+    Params();
+
+    // If not empty, preprocessed meshes are cached in this directory
+    std::string cache_directory;
+    // If non-zero, meshes with more triangles are decimated to this many
+    size_t target_triangles;
+  };
+
+  MeshLoader(std::shared_ptr<urdf::Model> model, const Params& params = Params());
 
   /**
    * @brief Get the collision mesh associated with a link in a URDF.
    */
   MeshPtr getCollisionMesh(const std::string& link_name);
 
+  /**
+   * @brief Get the tree for closest distance queries against the collision
+   *        mesh of a link. The tree is built once and then shared.
+   */
+  MeshTreePtr getCollisionMeshTree(const std::string& link_name);
+
 private:
+  /**
+   * @brief Load a mesh, unless already loaded, mutex_ must be held.
+   * @returns The index of the mesh, or -1 if it cannot be loaded.
+   */
+  int load(const std::string& link_name);
+
+  std::mutex mutex_;
   std::shared_ptr<urdf::Model> model_;
-  std::vector<std::string> link_names_;
+  Params params_;
+  std::unique_ptr<MeshCache> cache_;
+  // Index of each loaded link, -1 if it could not be loaded
+  std::unordered_map<std::string, int> link_index_;
   std::vector<MeshPtr> meshes_;
+  std::vector<MeshTreePtr> trees_;
 };
 
 }  // namespace robot_calibration
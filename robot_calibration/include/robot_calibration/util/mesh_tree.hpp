@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_UTIL_MESH_TREE_HPP
+#define ROBOT_CALIBRATION_UTIL_MESH_TREE_HPP
+
+#include <memory>
+#include <vector>
+
+#include <Eigen/Core>
+#include <geometric_shapes/shapes.h>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Get the closest point on line segment A-B to point P.
+ *
+ * Based on "Real Time Collision Detection", pg 129
+ */
+Eigen::Vector3d closestPointOnSegment(const Eigen::Vector3d& a,
+                                      const Eigen::Vector3d& b,
+                                      const Eigen::Vector3d& p);
+
+/**
+ * @brief Get the closest point on triangle A-B-C to point P.
+ *
+ * Based on "Real Time Collision Detection", pg 141
+ */
+Eigen::Vector3d closestPointOnTriangle(const Eigen::Vector3d& a,
+                                       const Eigen::Vector3d& b,
+                                       const Eigen::Vector3d& c,
+                                       const Eigen::Vector3d& p);
+
+/**
+ * @brief Bounding volume hierarchy of axis aligned boxes over the triangles
+ *        of a mesh, for fast closest distance queries.
+ */
+class MeshTree
+{
+public:
+  /**
+   * @brief Build the tree. The mesh should not be modified afterwards.
+   */
+  explicit MeshTree(const shapes::Mesh& mesh);
+
+  /**
+   * @brief Find the closest edge of any triangle to a point.
+   * @param p The point to query.
+   * @param a Returns one end of the closest edge.
+   * @param b Returns the other end of the closest edge.
+   * @returns The squared distance to the edge, or max() if the mesh is empty.
+   */
+  double closestEdge(const Eigen::Vector3d& p,
+                     Eigen::Vector3d& a,
+                     Eigen::Vector3d& b) const;
+
+  /**
+   * @brief Find the closest point on the surface of any triangle to a point.
+   * @param p The point to query.
+   * @param closest Returns the closest point on the mesh.
+   * @returns The squared distance to the mesh, or max() if the mesh is empty.
+   */
+  double closestPoint(const Eigen::Vector3d& p,
+                      Eigen::Vector3d& closest) const;
+
+  /** @brief Get the number of triangles in the tree. */
+  size_t size() const;
+
+private:
+  friend class MeshCache;
+
+  /** @brief Empty tree, for MeshCache to fill in. */
+  MeshTree() {}
+
+  /** @brief Check that the nodes can be searched safely. */
+  bool isValid() const;
+
+  struct Node
+  {
+    Eigen::Vector3d min;
+    Eigen::Vector3d max;
+    // Children, or -1 for leaf nodes
+    int left;
+    int right;
+    // Range of triangles in leaf nodes
+    int begin;
+    int end;
+  };
+
+  /** @brief Recursively build the node for a range of triangles, returns node index. */
+  int build(std::vector<int>& triangles, std::vector<Eigen::Vector3d>& centroids,
+            const std::vector<Eigen::Vector3d>& vertices, int begin, int end);
+
+  /** @brief Search the tree, see closestEdge() and closestPoint(). */
+  double search(const Eigen::Vector3d& p, bool edges,
+                Eigen::Vector3d& a, Eigen::Vector3d& b) const;
+
+  /** @brief Get a corner (0-2) of a triangle. */
+  Eigen::Vector3d vertex(int triangle, int corner) const;
+
+  std::vector<Node> nodes_;
+  // Coordinates of each corner of each triangle, in the order of the leaf
+  // nodes. Each coordinate is contiguous so that leaf tests are vectorized.
+  std::vector<double> x_[3];
+  std::vector<double> y_[3];
+  std::vector<double> z_[3];
+};
+
+using MeshTreePtr = std::shared_ptr<MeshTree>;
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_UTIL_MESH_TREE_HPP
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_UTIL_POSE_ORDERING_HPP
+#define ROBOT_CALIBRATION_UTIL_POSE_ORDERING_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sensor_msgs/msg/joint_state.hpp>
+#include <robot_calibration_msgs/msg/capture_config.hpp>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Estimates the time to move between poses, from joint velocity limits.
+ *
+ * Joints move simultaneously, so the time of a move is that of the joint
+ * which takes longest at its velocity limit. Joints which are not in both
+ * poses are ignored.
+ */
+class PoseMotionTime
+{
+public:
+  /**
+   * @param velocity_limits Velocity limit of each joint.
+   * @param default_velocity Velocity limit of joints not in velocity_limits.
+   */
+  PoseMotionTime(const std::map<std::string, double>& velocity_limits,
+                 double default_velocity);
+
+  /** @brief Get the time (in seconds) to move between two joint states. */
+  double getTime(const sensor_msgs::msg::JointState& from,
+                 const sensor_msgs::msg::JointState& to) const;
+
+  /** @brief Get the time (in seconds) to move through a sequence of poses. */
+  double getTime(const std::vector<robot_calibration_msgs::msg::CaptureConfig>& poses) const;
+
+private:
+  double getVelocity(const std::string& joint) const;
+
+  std::map<std::string, double> velocity_limits_;
+  double default_velocity_;
+};
+
+/**
+ * @brief Reorder poses to approximately minimize the total motion time.
+ *
+ * This is an open travelling salesman path, which starts at the first pose.
+ * A nearest neighbor ordering is built and then improved with 2-opt moves.
+ *
+ * @param poses The poses to reorder, in place.
+ * @param motion_time Estimates the time to move between poses.
+ * @returns The original index of each reordered pose.
+ */
+std::vector<size_t> orderPoses(std::vector<robot_calibration_msgs::msg::CaptureConfig>& poses,
+                               const PoseMotionTime& motion_time);
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_UTIL_POSE_ORDERING_HPP
@@ -34,6 +34,13 @@ namespace robot_calibration
 bool getPosesFromYaml(const std::string& filename,
                       std::vector<robot_calibration_msgs::msg::CaptureConfig>& poses);
 
+/**
+ * @brief Save a vector of calibration poses to a YAML file, in the format
+ *        loaded by getPosesFromYaml
+ */
+bool savePosesToYaml(const std::string& filename,
+                     const std::vector<robot_calibration_msgs::msg::CaptureConfig>& poses);
+
 }  // namespace robot_calibration
 
 #endif  // ROBOT_CALIBRATION_CAPTURE_POSES_FROM_YAML_H
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_UTIL_RANSAC_HPP
+#define ROBOT_CALIBRATION_UTIL_RANSAC_HPP
+
+#include <cstddef>
+#include <Eigen/Core>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief RANSAC fitting of a plane to a point cloud.
+ *
+ * Hypotheses are evaluated in parallel, in fixed size batches. Each
+ * hypothesis draws its samples from its own generator, seeded by the seed
+ * and the index of the hypothesis, so the result depends only on the seed
+ * and not on the number of threads.
+ */
+class PlaneRansac
+{
+public:
+  /**
+   * @brief One row per point, so that each coordinate is a contiguous
+   *        float array and inlier counting vectorizes.
+   */
+  using Points = Eigen::Matrix<float, Eigen::Dynamic, 3>;
+
+  struct Params
+  {
+    Params();
+
+    // Maximum number of hypotheses
+    int iterations;
+    // Number of points sampled for each hypothesis
+    int sample_size;
+    // Maximum distance of an inlier from the plane
+    double tolerance;
+    // If non-zero, the plane normal must be aligned with this, in the frame
+    // of the points, to within the angle whose cosine is cos_normal_angle
+    Eigen::Vector3d desired_normal;
+    double cos_normal_angle;
+    // Stop once this confidence of having sampled only inliers for some
+    // hypothesis is reached, given the best inlier ratio so far. Values
+    // outside (0, 1) disable early termination.
+    double confidence;
+    int num_threads;
+    unsigned int seed;
+  };
+
+  explicit PlaneRansac(const Params& params);
+
+  /**
+   * @brief Find the plane with the most inliers.
+   * @param points The points to fit.
+   * @param normal Returns the normal of the plane.
+   * @param d Returns the offset of the plane.
+   * @returns False if no hypothesis satisfies the normal constraint, or
+   *          there are not enough points.
+   */
+  bool fit(const Points& points, Eigen::Vector3d& normal, double& d) const;
+
+  /** @brief Get the number of hypotheses evaluated by the last fit(). */
+  int getIterations() const
+  {
+    return iterations_;
+  }
+
+  /** @brief Count the points within tolerance of a plane. */
+  static size_t countInliers(const Points& points,
+                             const Eigen::Vector3d& normal,
+                             double d,
+                             double tolerance);
+
+private:
+  struct Hypothesis
+  {
+    bool valid;
+    size_t inliers;
+    Eigen::Vector3d normal;
+    double d;
+  };
+
+  /** @brief Sample, fit and score hypothesis number index. */
+  void evaluate(const Points& points, int index, Hypothesis& hypothesis) const;
+
+  /** @brief Number of hypotheses needed to reach the confidence. */
+  int getRequiredIterations(double inlier_ratio) const;
+
+  Params params_;
+  mutable int iterations_;
+};
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_UTIL_RANSAC_HPP
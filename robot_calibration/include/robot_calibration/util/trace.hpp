@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#ifndef ROBOT_CALIBRATION_UTIL_TRACE_HPP
+#define ROBOT_CALIBRATION_UTIL_TRACE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Records timing spans of the capture pipeline, and writes them as a
+ *        Chrome trace, which can be viewed in chrome://tracing or Perfetto.
+ *
+ * There is one tracer per process, so that spans can be added anywhere
+ * without passing it around. Tracing is off until open() is called, while
+ * off a span costs a single atomic load.
+ */
+class Tracer
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /** @brief Get the tracer of this process. */
+  static Tracer& get();
+
+  /**
+   * @brief Clear any recorded spans and start recording.
+   * @param file_name Where close() writes the trace, may be empty to only
+   *        get the summary.
+   */
+  void open(const std::string& file_name);
+
+  /**
+   * @brief Stop recording, and write the trace.
+   * @returns False if the trace could not be written.
+   */
+  bool close();
+
+  bool isEnabled() const
+  {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Set the pose being captured, spans started after this are
+   *        attributed to it. Negative if no pose is being captured.
+   */
+  void setPose(int pose);
+
+  /** @brief Get the pose that spans started on this thread are attributed to. */
+  int getPose() const;
+
+  /** @brief Record a span which has ended, see TraceSpan. */
+  void record(std::string name, Clock::time_point start, Clock::time_point end, int pose);
+
+  /** @brief Get the number of spans recorded since open(). */
+  size_t getNumSpans() const;
+
+  /**
+   * @brief Get the count and total, mean and max time of each span name,
+   *        followed by the total time of each span name for each pose.
+   *        Nested spans are included in both, so times overlap.
+   */
+  std::string getSummary() const;
+
+  /**
+   * @brief Attributes the spans started on the current thread to a pose
+   *        while in scope, for work on a pose done after the robot has
+   *        moved on to the next one.
+   */
+  class PoseScope
+  {
+  public:
+    explicit PoseScope(int pose);
+    ~PoseScope();
+
+  private:
+    int previous_;
+  };
+
+private:
+  Tracer();
+
+  struct Span
+  {
+    std::string name;
+    Clock::time_point start;
+    Clock::time_point end;
+    int pose;
+    int thread;
+  };
+
+  std::atomic<bool> enabled_;
+  std::atomic<int> pose_;
+
+  mutable std::mutex mutex_;
+  std::string file_name_;
+  Clock::time_point start_;
+  std::vector<Span> spans_;
+};
+
+/**
+ * @brief Records the time from construction to destruction as a span of
+ *        the tracer, if it is enabled when constructed.
+ */
+class TraceSpan
+{
+public:
+  explicit TraceSpan(const char* name) :
+    enabled_(Tracer::get().isEnabled()),
+    name_(name)
+  {
+    if (enabled_)
+    {
+      begin();
+    }
+  }
+
+  /** @brief Span named "name/detail", such as the name of a feature finder. */
+  TraceSpan(const char* name, const std::string& detail) :
+    enabled_(Tracer::get().isEnabled()),
+    name_(name)
+  {
+    if (enabled_)
+    {
+      detail_ = detail;
+      begin();
+    }
+  }
+
+  ~TraceSpan()
+  {
+    if (enabled_)
+    {
+      end();
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+  void begin();
+  void end();
+
+  bool enabled_;
+  const char* name_;
+  std::string detail_;
+  int pose_;
+  Tracer::Clock::time_point start_;
+};
+
+}  // namespace robot_calibration
+
+#endif  // ROBOT_CALIBRATION_UTIL_TRACE_HPP
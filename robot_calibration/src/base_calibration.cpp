@@ -20,6 +20,7 @@
 
 #include <cmath>
 #include <fstream>
+#include <Eigen/Core>
 #include <robot_calibration/optimization/base_calibration.hpp>
 
 #define PI          3.14159265359
@@ -31,7 +32,11 @@ namespace robot_calibration
 {
 BaseCalibration::BaseCalibration()
   : rclcpp::Node("base_calibration_node"),
-    ready_(false)
+    ready_(false),
+    mode_(Mode::IDLE),
+    goal_(0.0),
+    goal_velocity_(0.0),
+    verbose_(false)
 {
   // Setup times
   last_odom_stamp_ = last_imu_stamp_ = last_scan_stamp_ = this->now();
@@ -50,19 +55,38 @@ BaseCalibration::BaseCalibration()
   align_tolerance_ = this->declare_parameter<double>("align_tolerance", 0.2);
   // Tolerance for r2
   r2_tolerance_ = this->declare_parameter<double>("r2_tolerance", 0.1);
+  // Rate of the velocity controller
+  double control_rate = this->declare_parameter<double>("control_rate", 50.0);
 
   // Command publisher
   cmd_pub_ = this->create_publisher<geometry_msgs::msg::Twist>("cmd_vel", 10);
 
+  // Integration of odom and imu is cheap, but should not wait on scan fitting
+  sensor_group_ = this->create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
+  scan_group_ = this->create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
+  control_group_ = this->create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
+
   // Subscribe
+  rclcpp::SubscriptionOptions sensor_options;
+  sensor_options.callback_group = sensor_group_;
+  rclcpp::SubscriptionOptions scan_options;
+  scan_options.callback_group = scan_group_;
   odom_subscriber_ = this->create_subscription<nav_msgs::msg::Odometry>(
-    "odom", 5, std::bind(&BaseCalibration::odometryCallback, this, _1));
+    "odom", 5, std::bind(&BaseCalibration::odometryCallback, this, _1), sensor_options);
   imu_subscriber_ =  this->create_subscription<sensor_msgs::msg::Imu>(
-    "imu", 5, std::bind(&BaseCalibration::imuCallback, this, _1));
+    "imu", 5, std::bind(&BaseCalibration::imuCallback, this, _1), sensor_options);
   scan_subscriber_ = this->create_subscription<sensor_msgs::msg::LaserScan>(
-    "base_scan", 1, std::bind(&BaseCalibration::laserCallback, this, _1));
+    "base_scan", 1, std::bind(&BaseCalibration::laserCallback, this, _1), scan_options);
 
+  odom_angle_ = odom_reset_angle_ = 0.0;
+  imu_angle_ = imu_reset_angle_ = 0.0;
+  scan_dist_ = 0.0;
   resetInternal();
+
+  control_timer_ = this->create_wall_timer(
+    std::chrono::duration<double>(1.0 / control_rate),
+    std::bind(&BaseCalibration::controlCallback, this),
+    control_group_);
 }
 
 void BaseCalibration::clearMessages()
@@ -75,7 +99,7 @@ void BaseCalibration::clearMessages()
 std::string BaseCalibration::print()
 {
   std::stringstream ss;
-  ss << scan_r2_ << " " << imu_angle_ << " " << odom_angle_ << " " << scan_angle_;
+  ss << scan_r2_ << " " << getImuAngle() << " " << getOdomAngle() << " " << scan_angle_;
   return ss.str();
 }
 
@@ -107,44 +131,11 @@ std::string BaseCalibration::printCalibrationData()
 
 bool BaseCalibration::align(double angle, bool verbose)
 {
-  while (!ready_)
-  {
-    RCLCPP_WARN(LOGGER, "Not ready!");
-    rclcpp::sleep_for(std::chrono::milliseconds(100));
-    rclcpp::spin_some(this->shared_from_this());
-  }
-
   std::cout << "aligning..." << std::endl;
-
-  double error = scan_angle_ - angle;
-  while (fabs(error) > align_tolerance_ || (scan_r2_ < r2_tolerance_))
+  if (!runController(Mode::ALIGN, angle, 0.0, verbose))
   {
-    if (verbose)
-    {
-      std::cout << scan_r2_ << " " << scan_angle_ << std::endl;
-    }
-
-    // Send command
-    double velocity = std::min(std::max(-error * align_gain_, -align_velocity_), align_velocity_);
-    sendVelocityCommand(velocity);
-
-    // Sleep a moment
-    rclcpp::sleep_for(std::chrono::milliseconds(20));
-    rclcpp::spin_some(this->shared_from_this());
-
-    // Update error before comparing again
-    error = scan_angle_ - angle;
-
-    // Exit if shutting down
-    if (!rclcpp::ok())
-    {
-      sendVelocityCommand(0.0);
-      return false;
-    }
+    return false;
   }
-
-  // Done - stop the robot
-  sendVelocityCommand(0.0);
   std::cout << "...done" << std::endl;
   rclcpp::sleep_for(std::chrono::milliseconds(250));
 
@@ -163,34 +154,18 @@ bool BaseCalibration::spin(double velocity, int rotations, bool verbose)
   // Need to account for de-acceleration time (v^2/2a)
   double angle = rotations * 2 * PI - (0.5 * velocity * velocity / accel_limit_);
 
-  while (fabs(odom_angle_) < angle)
+  if (!runController(Mode::SPIN, angle, velocity, verbose))
   {
-    if (verbose)
-    {
-      std::cout << scan_angle_ << " " << odom_angle_ << " " << imu_angle_ << std::endl;
-    }
-    sendVelocityCommand(velocity);
-    rclcpp::sleep_for(std::chrono::milliseconds(20));
-    rclcpp::spin_some(this->shared_from_this());
-
-    // Exit if shutting down
-    if (!rclcpp::ok())
-    {
-      sendVelocityCommand(0.0);
-      return false;
-    }
+    return false;
   }
-
-  // Stop the robot
-  sendVelocityCommand(0.0);
   std::cout << "...done" << std::endl;
 
   // Wait to stop
   rclcpp::sleep_for(std::chrono::seconds(1));
 
   // Save measurements
-  imu_.push_back(imu_angle_);
-  odom_.push_back(odom_angle_);
+  imu_.push_back(getImuAngle());
+  odom_.push_back(getOdomAngle());
   if (velocity > 0)
   {
     scan_.push_back(scan_start + 2 * rotations * PI - scan_angle_);
@@ -203,101 +178,153 @@ bool BaseCalibration::spin(double velocity, int rotations, bool verbose)
   return true;
 }
 
-void BaseCalibration::odometryCallback(const nav_msgs::msg::Odometry::ConstSharedPtr& odom)
-{
-  std::lock_guard<std::recursive_mutex> lock(data_mutex_);
-
-  double dt = rclcpp::Time(odom->header.stamp).seconds() - last_odom_stamp_.seconds();
-  odom_angle_ += odom->twist.twist.angular.z * dt;
-
-  last_odom_stamp_ = odom->header.stamp;
-}
-
-void BaseCalibration::imuCallback(const sensor_msgs::msg::Imu::ConstSharedPtr& imu)
+bool BaseCalibration::runController(Mode mode, double goal, double velocity, bool verbose)
 {
-  std::lock_guard<std::recursive_mutex> lock(data_mutex_);
-
-  double dt = rclcpp::Time(imu->header.stamp).seconds() - last_imu_stamp_.seconds();
-  imu_angle_ += imu->angular_velocity.z * dt;
+  std::unique_lock<std::mutex> lock(control_mutex_);
+  mode_ = mode;
+  goal_ = goal;
+  goal_velocity_ = velocity;
+  verbose_ = verbose;
 
-  last_imu_stamp_ = imu->header.stamp;
+  while (mode_ != Mode::IDLE)
+  {
+    // Exit if shutting down
+    if (!rclcpp::ok())
+    {
+      mode_ = Mode::IDLE;
+      sendVelocityCommand(0.0);
+      return false;
+    }
+    control_cond_.wait_for(lock, std::chrono::milliseconds(100));
+  }
+  return true;
 }
 
-void BaseCalibration::laserCallback(const sensor_msgs::msg::LaserScan::ConstSharedPtr& scan)
+void BaseCalibration::controlCallback()
 {
-  std::lock_guard<std::recursive_mutex> lock(data_mutex_);
+  std::lock_guard<std::mutex> lock(control_mutex_);
+  if (mode_ == Mode::IDLE)
+  {
+    return;
+  }
 
-  double angle = scan->angle_min;
-  double mean_x, mean_y, n;
-  mean_x = mean_y = n = 0;
-  int start = -1;
-  for (size_t i = 0; i < scan->ranges.size(); ++i, angle += scan->angle_increment)
+  if (mode_ == Mode::ALIGN)
   {
-    if (angle < min_angle_ || angle > max_angle_)
+    if (!ready_)
     {
-      continue;
+      RCLCPP_WARN_THROTTLE(LOGGER, *this->get_clock(), 1000, "Not ready!");
+      return;
     }
 
-    if (std::isnan(scan->ranges[i]))
+    if (verbose_)
     {
-      continue;
+      std::cout << scan_r2_ << " " << scan_angle_ << std::endl;
     }
 
-    if (start < 0)
+    double error = scan_angle_ - goal_;
+    if (fabs(error) > align_tolerance_ || (scan_r2_ < r2_tolerance_))
     {
-      start = i;
+      double velocity = std::min(std::max(-error * align_gain_, -align_velocity_), align_velocity_);
+      sendVelocityCommand(velocity);
+      return;
+    }
+  }
+  else if (mode_ == Mode::SPIN)
+  {
+    if (verbose_)
+    {
+      std::cout << scan_angle_ << " " << getOdomAngle() << " " << getImuAngle() << std::endl;
     }
 
-    // Compute point
-    double px = sin(angle) * scan->ranges[i];
-    double py = cos(angle) * scan->ranges[i];
-
-    mean_x += px;
-    mean_y += py;
-    ++n;
+    if (fabs(getOdomAngle()) < goal_)
+    {
+      sendVelocityCommand(goal_velocity_);
+      return;
+    }
   }
 
-  if (n == 0)
+  // Done - stop the robot
+  sendVelocityCommand(0.0);
+  mode_ = Mode::IDLE;
+  control_cond_.notify_all();
+}
+
+void BaseCalibration::odometryCallback(const nav_msgs::msg::Odometry::ConstSharedPtr& odom)
+{
+  double dt = rclcpp::Time(odom->header.stamp).seconds() - last_odom_stamp_.seconds();
+  odom_angle_ = odom_angle_ + odom->twist.twist.angular.z * dt;
+
+  last_odom_stamp_ = odom->header.stamp;
+}
+
+void BaseCalibration::imuCallback(const sensor_msgs::msg::Imu::ConstSharedPtr& imu)
+{
+  double dt = rclcpp::Time(imu->header.stamp).seconds() - last_imu_stamp_.seconds();
+  imu_angle_ = imu_angle_ + imu->angular_velocity.z * dt;
+
+  last_imu_stamp_ = imu->header.stamp;
+}
+
+void BaseCalibration::laserCallback(const sensor_msgs::msg::LaserScan::ConstSharedPtr& scan)
+{
+  double angle, r2, dist;
+  if (!fitLine(*scan, min_angle_, max_angle_, angle, r2, dist))
   {
     return;
   }
 
-  mean_x /= n;
-  mean_y /= n;
+  scan_dist_ = dist;
+  scan_angle_ = angle;
+  scan_r2_ = r2;
+  last_scan_stamp_ = scan->header.stamp;
+  ready_ = true;
+}
 
-  angle = scan->angle_min + start * scan->angle_increment;  // reset angle
-  double x, y, xx, xy, yy;
-  x = y = xx = xy = yy = n = 0;
-  for (size_t i = start; i < scan->ranges.size(); ++i, angle += scan->angle_increment)
+bool BaseCalibration::fitLine(const sensor_msgs::msg::LaserScan& scan,
+                              double min_angle, double max_angle,
+                              double& angle, double& r2, double& dist)
+{
+  // Gather the valid ranges between the angles
+  std::vector<double> angles, ranges;
+  angles.reserve(scan.ranges.size());
+  ranges.reserve(scan.ranges.size());
+  for (size_t i = 0; i < scan.ranges.size(); ++i)
   {
-    if (angle > max_angle_)
-    {
-      break;
-    }
-
-    if (std::isnan(scan->ranges[i]))
+    double a = scan.angle_min + i * scan.angle_increment;
+    if (a < min_angle || a > max_angle || std::isnan(scan.ranges[i]))
     {
       continue;
     }
+    angles.push_back(a);
+    ranges.push_back(scan.ranges[i]);
+  }
 
-    // Compute point
-    double px = sin(angle) * scan->ranges[i] - mean_x;
-    double py = cos(angle) * scan->ranges[i] - mean_y;
-
-    // Sums for simple linear regression
-    xx += px * px;
-    xy += px * py;
-    x += px;
-    y += py;
-    yy += py * py;
-    ++n;
+  if (angles.empty())
+  {
+    return false;
   }
 
-  scan_dist_ = mean_y;
-  scan_angle_ = atan2((n*xy-x*y)/(n*xx-x*x), 1.0);
-  scan_r2_ = fabs(xy)/(xx * yy);
-  last_scan_stamp_ = scan->header.stamp;
-  ready_ = true;
+  // Compute points, centered on their mean
+  Eigen::Map<const Eigen::ArrayXd> a(angles.data(), angles.size());
+  Eigen::Map<const Eigen::ArrayXd> r(ranges.data(), ranges.size());
+  Eigen::ArrayXd px = a.sin() * r;
+  Eigen::ArrayXd py = a.cos() * r;
+  double mean_y = py.mean();
+  px -= px.mean();
+  py -= mean_y;
+
+  // Sums for simple linear regression
+  double n = angles.size();
+  double x = px.sum();
+  double y = py.sum();
+  double xx = (px * px).sum();
+  double xy = (px * py).sum();
+  double yy = (py * py).sum();
+
+  dist = mean_y;
+  angle = atan2((n*xy-x*y)/(n*xx-x*x), 1.0);
+  r2 = fabs(xy)/(xx * yy);
+  return true;
 }
 
 void BaseCalibration::sendVelocityCommand(double vel)
@@ -309,8 +336,19 @@ void BaseCalibration::sendVelocityCommand(double vel)
 
 void BaseCalibration::resetInternal()
 {
-  std::lock_guard<std::recursive_mutex> lock(data_mutex_);
-  odom_angle_ = imu_angle_ = scan_angle_ = scan_r2_ = 0.0;
+  odom_reset_angle_ = odom_angle_.load();
+  imu_reset_angle_ = imu_angle_.load();
+  scan_angle_ = scan_r2_ = 0.0;
+}
+
+double BaseCalibration::getOdomAngle() const
+{
+  return odom_angle_ - odom_reset_angle_;
+}
+
+double BaseCalibration::getImuAngle() const
+{
+  return imu_angle_ - imu_reset_angle_;
 }
 
 }  // namespace robot_calibration
@@ -18,7 +18,12 @@
 
 // Author: Michael Ferguson
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
 #include <robot_calibration/finders/checkerboard_finder.hpp>
+#include <robot_calibration/util/trace.hpp>
 #include <sensor_msgs/point_cloud2_iterator.hpp>
 
 static const rclcpp::Logger LOGGER = rclcpp::get_logger("checkerboard_finder");
@@ -33,7 +38,9 @@ const unsigned Z = 2;
 
 template <typename T>
 CheckerboardFinder<T>::CheckerboardFinder() :
-  waiting_(false)
+  searching_(false),
+  found_(false),
+  has_found_stamp_(false)
 {
 }
 
@@ -52,13 +59,11 @@ bool CheckerboardFinder<T>::init(const std::string& name,
   // Setup subscriber
   std::string topic_name;
   topic_name = node->declare_parameter<std::string>(name + ".topic", name + "/points");
-  rclcpp::SubscriptionOptions options;
-  options.qos_overriding_options = rclcpp::QosOverridingOptions::with_default_policies();
   subscriber_ = node->create_subscription<T>(
     topic_name,
     rclcpp::QoS(1).best_effort().keep_last(1),
     std::bind(&CheckerboardFinder::cameraCallback, this, std::placeholders::_1),
-    options);
+    getSubscriptionOptions());
 
   // Size of checkerboard
   points_x_ = node->declare_parameter<int>(name + ".points_x", 5);
@@ -69,6 +74,26 @@ bool CheckerboardFinder<T>::init(const std::string& name,
     RCLCPP_WARN(LOGGER, "Checkerboard is symmetric - orientation estimate can be wrong");
   }
 
+  // Number of recent frames to queue for detection, older frames are dropped
+  buffer_size_ = node->declare_parameter<int>(name + ".buffer_size", 4);
+  buffer_size_ = std::max(1, buffer_size_);
+
+  // Number of threads running detection on queued frames
+  detection_threads_ = node->declare_parameter<int>(name + ".detection_threads", 1);
+  detection_threads_ = std::max(1, detection_threads_);
+
+  // Scale to downsample images to for detection, corners are then refined
+  //   at full resolution. If 1.0, detection is done at full resolution
+  detection_scale_ = node->declare_parameter<double>(name + ".detection_scale", 1.0);
+  if (detection_scale_ <= 0.0 || detection_scale_ > 1.0)
+  {
+    RCLCPP_WARN(LOGGER, "Invalid detection_scale, using full resolution");
+    detection_scale_ = 1.0;
+  }
+
+  // Maximum time (in seconds) to spend looking for the checkerboard
+  timeout_ = node->declare_parameter<double>(name + ".timeout", 5.0);
+
   // Should we include debug image/cloud in observations
   output_debug_ = node->declare_parameter<bool>(name + ".debug", false);
 
@@ -95,249 +120,260 @@ bool CheckerboardFinder<T>::init(const std::string& name,
 template <typename T>
 void CheckerboardFinder<T>::cameraCallback(typename T::ConstSharedPtr msg)
 {
-  if (waiting_)
+  // Queue the frame for detection, dropping the oldest if full
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!searching_ || rclcpp::Time(msg->header.stamp, after_.get_clock_type()) <= after_)
   {
-    msg_ = msg;
-    waiting_ = false;
+    return;
   }
+  frames_.push_back(msg);
+  while (frames_.size() > static_cast<size_t>(buffer_size_))
+  {
+    frames_.pop_front();
+  }
+  condition_.notify_all();
 }
 
-// Returns true if we got a message, false if we timeout
 template <typename T>
-bool CheckerboardFinder<T>::waitForMsg()
+void CheckerboardFinder<T>::detectFrames()
 {
-  // Stored as weak pointer, need to grab a real shared pointer
-  auto node = node_ptr_.lock();
-  if (!node)
+  while (true)
   {
-    RCLCPP_ERROR(LOGGER, "Unable to get rclcpp::Node lock");
-    return false;
-  }
-
-  // Initial wait cycle so that camera is definitely up to date.
-  rclcpp::sleep_for(std::chrono::milliseconds(100));
+    // Wait for a frame, or to be done
+    typename T::ConstSharedPtr frame;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this]() { return !searching_ || found_ || !frames_.empty(); });
+      if (!searching_ || found_)
+      {
+        return;
+      }
+      frame = frames_.front();
+      frames_.pop_front();
+    }
 
-  waiting_ = true;
-  int count = 250;
-  while (--count)
-  {
-    if (!waiting_)
+    std::vector<cv::Point2f> points;
+    bool detected = false;
     {
-      // success
-      return true;
+      TraceSpan span("detect", getName());
+      detected = detect(*frame, points);
+    }
+    if (detected)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!found_)
+      {
+        found_ = true;
+        found_frame_ = frame;
+        found_points_ = points;
+      }
+      condition_.notify_all();
+      return;
     }
-    rclcpp::sleep_for(std::chrono::milliseconds(10));
-    rclcpp::spin_some(node);
   }
-  RCLCPP_ERROR(LOGGER, "Failed to get message");
-  return !waiting_;
 }
 
 template <typename T>
 bool CheckerboardFinder<T>::find(robot_calibration_msgs::msg::CalibrationData * msg)
 {
-  // Try up to 50 frames
-  for (int i = 0; i < 50; ++i)
+  // Frames captured before now may have been captured while moving
   {
-    // temporary copy of msg, so we throw away all changes if findInternal() returns false
-    robot_calibration_msgs::msg::CalibrationData tmp_msg(*msg);
-    if (findInternal(&tmp_msg))
-    {
-      *msg = tmp_msg;
-      return true;
-    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    frames_.clear();
+    after_ = clock_->now();
+    found_ = false;
+    searching_ = true;
+  }
+  has_found_stamp_ = false;
+
+  // Detection runs on frames as they arrive
+  std::vector<std::thread> workers;
+  for (int i = 0; i < detection_threads_; ++i)
+  {
+    workers.emplace_back(&CheckerboardFinder<T>::detectFrames, this);
   }
-  return false;
+
+  // Frames are received on the executor thread of the finder
+  bool found = false;
+  {
+    TraceSpan span("wait_for_checkerboard", getName());
+    std::unique_lock<std::mutex> lock(mutex_);
+    found = condition_.wait_for(lock, std::chrono::duration<double>(timeout_),
+                                [this]() { return found_; });
+  }
+
+  // Stop the workers, any detection in progress is finished first
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    searching_ = false;
+  }
+  condition_.notify_all();
+  for (auto& worker : workers)
+  {
+    worker.join();
+  }
+  found = found || found_;
+
+  if (!found)
+  {
+    RCLCPP_ERROR(LOGGER, "Failed to find checkerboard within %f seconds", timeout_);
+    return false;
+  }
+
+  RCLCPP_INFO(LOGGER, "Found the checkboard");
+  ObservationBuffer staged;
+  fillObservation(*found_frame_, found_points_, staged);
+  staged.commit(msg);
+  found_stamp_ = found_frame_->header.stamp;
+  has_found_stamp_ = true;
+  found_frame_.reset();
+  return true;
 }
 
-template <>
-bool CheckerboardFinder<sensor_msgs::msg::PointCloud2>::findInternal(robot_calibration_msgs::msg::CalibrationData * msg)
+template <typename T>
+bool CheckerboardFinder<T>::getCaptureStamp(builtin_interfaces::msg::Time& stamp)
 {
-  // Get cloud
-  if (!waitForMsg())
+  if (!has_found_stamp_)
   {
-    RCLCPP_ERROR(LOGGER, "No point cloud data");
     return false;
   }
+  stamp = found_stamp_;
+  return true;
+}
 
-  if (msg_->height == 1)
+template <>
+bool CheckerboardFinder<sensor_msgs::msg::PointCloud2>::detect(const sensor_msgs::msg::PointCloud2& cloud,
+                                                              std::vector<cv::Point2f>& points) const
+{
+  if (cloud.height == 1)
   {
     RCLCPP_ERROR(LOGGER, "OpenCV does not support unorganized cloud/image.");
     return false;
   }
 
-  // Get an image message from point cloud
-  sensor_msgs::msg::Image::SharedPtr image_msg(new sensor_msgs::msg::Image);
-  sensor_msgs::PointCloud2ConstIterator<uint8_t> rgb(*msg_, "rgb");
-  image_msg->encoding = "bgr8";
-  image_msg->height = msg_->height;
-  image_msg->width = msg_->width;
-  image_msg->step = image_msg->width * sizeof (uint8_t) * 3;
-  image_msg->data.resize(image_msg->step * image_msg->height);
-  for (size_t y = 0; y < msg_->height; y++)
+  // Find the packed color of each point
+  int rgb_offset = -1;
+  for (const auto& field : cloud.fields)
   {
-    for (size_t x = 0; x < msg_->width; x++)
+    if (field.name == "rgb")
     {
-      uint8_t* pixel = &(image_msg->data[y * image_msg->step + x * 3]);
-      pixel[0] = rgb[0];
-      pixel[1] = rgb[1];
-      pixel[2] = rgb[2];
-      ++rgb;
+      rgb_offset = field.offset;
     }
   }
-
-  std::vector<cv::Point2f> points;
-  if (findCheckerboardPoints(image_msg, points))
+  if (rgb_offset < 0 || cloud.point_step > CV_CN_MAX)
   {
-    RCLCPP_INFO(LOGGER, "Found the checkboard");
-
-    // Create PointCloud2 to publish
-    sensor_msgs::msg::PointCloud2 cloud;
-    cloud.width = 0;
-    cloud.height = 0;
-    cloud.header.stamp = clock_->now();
-    cloud.header.frame_id = msg_->header.frame_id;
-    sensor_msgs::PointCloud2Modifier cloud_mod(cloud);
-    cloud_mod.setPointCloud2FieldsByString(1, "xyz");
-    cloud_mod.resize(points_x_ * points_y_);
-    sensor_msgs::PointCloud2Iterator<float> iter_cloud(cloud, "x");
-
-    // Set msg size
-    int idx_cam = msg->observations.size() + 0;
-    int idx_chain = msg->observations.size() + 1;
-    msg->observations.resize(msg->observations.size() + 2);
-    msg->observations[idx_cam].sensor_name = camera_sensor_name_;
-    msg->observations[idx_chain].sensor_name = chain_sensor_name_;
-         
-    msg->observations[idx_cam].features.resize(points_x_ * points_y_);
-    msg->observations[idx_chain].features.resize(points_x_ * points_y_);
-
-    // Setup observed points
-    geometry_msgs::msg::PointStamped rgbd;
-    rgbd.header = msg_->header;
-    geometry_msgs::msg::PointStamped world;
-    world.header.frame_id = frame_id_;
-
-    // Fill in message
-    sensor_msgs::PointCloud2ConstIterator<float> xyz(*msg_, "x");
-    for (size_t i = 0; i < points.size(); ++i)
-    {
-      // Create 3d position of corner (in checkerboard frame)
-      world.point.x = (i % points_x_) * square_size_;
-      world.point.y = (i / points_x_) * square_size_;
-
-      // Get 3d point
-      int index = (int)(points[i].y) * msg_->width + (int)(points[i].x);
-      rgbd.point.x = (xyz + index)[X];
-      rgbd.point.y = (xyz + index)[Y];
-      rgbd.point.z = (xyz + index)[Z];
-
-      // Do not accept NANs
-      if (std::isnan(rgbd.point.x) ||
-          std::isnan(rgbd.point.y) ||
-          std::isnan(rgbd.point.z))
-      {
-        RCLCPP_ERROR_STREAM(LOGGER, "NAN point on " << i);
-        return false;
-      }
+    RCLCPP_ERROR(LOGGER, "Cloud does not have a usable rgb field.");
+    return false;
+  }
 
-      msg->observations[idx_cam].features[i] = rgbd;
-      msg->observations[idx_cam].ext_camera_info = depth_camera_manager_.getDepthCameraInfo();
-      msg->observations[idx_chain].features[i] = world;
+  // View each point as a pixel with point_step channels, this does not
+  // copy the cloud, and is only read from
+  cv::Mat packed(cloud.height, cloud.width, CV_8UC(cloud.point_step),
+                 const_cast<uint8_t*>(cloud.data.data()), cloud.row_step);
 
-      // Visualize
-      iter_cloud[0] = rgbd.point.x;
-      iter_cloud[1] = rgbd.point.y;
-      iter_cloud[2] = rgbd.point.z;
-      ++iter_cloud;
-    }
+  // Extract the blue, green and red bytes in a single pass
+  cv::Mat bgr(cloud.height, cloud.width, CV_8UC3);
+  int from_to[] = {rgb_offset, 0, rgb_offset + 1, 1, rgb_offset + 2, 2};
+  cv::mixChannels(&packed, 1, &bgr, 1, from_to, 3);
 
-    // Add debug cloud to message
-    if (output_debug_)
-    {
-      msg->observations[idx_cam].cloud = *msg_;
-    }
+  cv::Mat gray;
+  cv::cvtColor(bgr, gray, cv::COLOR_BGR2GRAY);
 
-    // Publish results
-    publisher_->publish(cloud);
+  if (!findCheckerboardPoints(gray, points))
+  {
+    return false;
+  }
 
-    // Found all points
-    return true;
+  // Do not accept NANs
+  sensor_msgs::PointCloud2ConstIterator<float> xyz(cloud, "x");
+  for (size_t i = 0; i < points.size(); ++i)
+  {
+    int index = (int)(points[i].y) * cloud.width + (int)(points[i].x);
+    if (std::isnan((xyz + index)[X]) ||
+        std::isnan((xyz + index)[Y]) ||
+        std::isnan((xyz + index)[Z]))
+    {
+      RCLCPP_ERROR_STREAM(LOGGER, "NAN point on " << i);
+      return false;
+    }
   }
 
-  return false;
+  return true;
 }
 
 template <>
-bool CheckerboardFinder<sensor_msgs::msg::Image>::findInternal(robot_calibration_msgs::msg::CalibrationData * msg)
+void CheckerboardFinder<sensor_msgs::msg::PointCloud2>::fillObservation(const sensor_msgs::msg::PointCloud2& frame,
+                                                                       const std::vector<cv::Point2f>& points,
+                                                                       ObservationBuffer& staged)
 {
-  // Get image
-  if (!waitForMsg())
+  // Create PointCloud2 to publish
+  sensor_msgs::msg::PointCloud2 cloud;
+  cloud.width = 0;
+  cloud.height = 0;
+  cloud.header.stamp = clock_->now();
+  cloud.header.frame_id = frame.header.frame_id;
+  sensor_msgs::PointCloud2Modifier cloud_mod(cloud);
+  cloud_mod.setPointCloud2FieldsByString(1, "xyz");
+  cloud_mod.resize(points_x_ * points_y_);
+  sensor_msgs::PointCloud2Iterator<float> iter_cloud(cloud, "x");
+
+  // Stage the observations
+  robot_calibration_msgs::msg::Observation& camera = staged.add(camera_sensor_name_);
+  robot_calibration_msgs::msg::Observation& chain = staged.add(chain_sensor_name_);
+  camera.ext_camera_info = depth_camera_manager_.getDepthCameraInfo();
+
+  camera.features.resize(points_x_ * points_y_);
+  chain.features.resize(points_x_ * points_y_);
+
+  // Setup observed points
+  geometry_msgs::msg::PointStamped rgbd;
+  rgbd.header = frame.header;
+  geometry_msgs::msg::PointStamped world;
+  world.header.frame_id = frame_id_;
+
+  // Fill in message
+  sensor_msgs::PointCloud2ConstIterator<float> xyz(frame, "x");
+  for (size_t i = 0; i < points.size(); ++i)
   {
-    RCLCPP_ERROR(LOGGER, "No image data");
-    return false;
+    // Create 3d position of corner (in checkerboard frame)
+    world.point.x = (i % points_x_) * square_size_;
+    world.point.y = (i / points_x_) * square_size_;
+
+    // Get 3d point, detect() has checked these are valid
+    int index = (int)(points[i].y) * frame.width + (int)(points[i].x);
+    rgbd.point.x = (xyz + index)[X];
+    rgbd.point.y = (xyz + index)[Y];
+    rgbd.point.z = (xyz + index)[Z];
+
+    camera.features[i] = rgbd;
+    chain.features[i] = world;
+
+    // Visualize
+    iter_cloud[0] = rgbd.point.x;
+    iter_cloud[1] = rgbd.point.y;
+    iter_cloud[2] = rgbd.point.z;
+    ++iter_cloud;
   }
 
-  std::vector<cv::Point2f> points;
-  if (findCheckerboardPoints(msg_, points))
+  // Add debug cloud to message
+  if (output_debug_)
   {
-    RCLCPP_INFO(LOGGER, "Found the checkboard");
-
-    // Set msg size
-    int idx_cam = msg->observations.size() + 0;
-    int idx_chain = msg->observations.size() + 1;
-    msg->observations.resize(msg->observations.size() + 2);
-    msg->observations[idx_cam].sensor_name = camera_sensor_name_;
-    msg->observations[idx_chain].sensor_name = chain_sensor_name_;
-
-    msg->observations[idx_cam].features.resize(points_x_ * points_y_);
-    msg->observations[idx_chain].features.resize(points_x_ * points_y_);
-
-    // Setup observed points
-    geometry_msgs::msg::PointStamped rgbd;
-    rgbd.header = msg_->header;
-    geometry_msgs::msg::PointStamped world;
-    world.header.frame_id = frame_id_;
-
-    // Fill in message
-    for (size_t i = 0; i < points.size(); ++i)
-    {
-      // Create 3d position of corner (in checkerboard frame)
-      world.point.x = (i % points_x_) * square_size_;
-      world.point.y = (i / points_x_) * square_size_;
-
-      // Save 2d pixel
-      rgbd.point.x = points[i].x;
-      rgbd.point.y = points[i].y;
-      rgbd.point.z = 0.0;  // No Z information
-
-      msg->observations[idx_cam].features[i] = rgbd;
-      msg->observations[idx_cam].ext_camera_info = depth_camera_manager_.getDepthCameraInfo();
-      msg->observations[idx_chain].features[i] = world;
-    }
-
-    // Add debug cloud to message
-    if (output_debug_)
-    {
-      msg->observations[idx_cam].image = *msg_;
-    }
-
-    // Found all points
-    return true;
+    camera.cloud = frame;
   }
 
-  return false;
+  // Publish results
+  publisher_->publish(cloud);
 }
 
-template <typename T>
-bool CheckerboardFinder<T>::findCheckerboardPoints(sensor_msgs::msg::Image::ConstSharedPtr image,
-                                                   std::vector<cv::Point2f>& points)
+template <>
+bool CheckerboardFinder<sensor_msgs::msg::Image>::detect(const sensor_msgs::msg::Image& image,
+                                                        std::vector<cv::Point2f>& points) const
 {
-  // Get an OpenCV image from the cloud
-  cv_bridge::CvImagePtr bridge;
+  // Get an OpenCV image, this only copies if the image is not mono8
+  cv_bridge::CvImageConstPtr bridge;
   try
   {
-    bridge = cv_bridge::toCvCopy(image, "mono8");  // TODO: was rgb8? does this work?
+    bridge = cv_bridge::toCvShare(image, nullptr, "mono8");
   }
   catch(cv_bridge::Exception& e)
   {
@@ -345,13 +381,92 @@ bool CheckerboardFinder<T>::findCheckerboardPoints(sensor_msgs::msg::Image::Cons
     return false;
   }
 
+  return findCheckerboardPoints(bridge->image, points);
+}
+
+template <>
+void CheckerboardFinder<sensor_msgs::msg::Image>::fillObservation(const sensor_msgs::msg::Image& frame,
+                                                                 const std::vector<cv::Point2f>& points,
+                                                                 ObservationBuffer& staged)
+{
+  // Stage the observations
+  robot_calibration_msgs::msg::Observation& camera = staged.add(camera_sensor_name_);
+  robot_calibration_msgs::msg::Observation& chain = staged.add(chain_sensor_name_);
+  camera.ext_camera_info = depth_camera_manager_.getDepthCameraInfo();
+
+  camera.features.resize(points_x_ * points_y_);
+  chain.features.resize(points_x_ * points_y_);
+
+  // Setup observed points
+  geometry_msgs::msg::PointStamped rgbd;
+  rgbd.header = frame.header;
+  geometry_msgs::msg::PointStamped world;
+  world.header.frame_id = frame_id_;
+
+  // Fill in message
+  for (size_t i = 0; i < points.size(); ++i)
+  {
+    // Create 3d position of corner (in checkerboard frame)
+    world.point.x = (i % points_x_) * square_size_;
+    world.point.y = (i / points_x_) * square_size_;
+
+    // Save 2d pixel
+    rgbd.point.x = points[i].x;
+    rgbd.point.y = points[i].y;
+    rgbd.point.z = 0.0;  // No Z information
+
+    camera.features[i] = rgbd;
+    chain.features[i] = world;
+  }
+
+  // Add debug image to message
+  if (output_debug_)
+  {
+    camera.image = frame;
+  }
+}
+
+template <typename T>
+bool CheckerboardFinder<T>::findCheckerboardPoints(const cv::Mat& image,
+                                                   std::vector<cv::Point2f>& points) const
+{
   // Find checkerboard
   points.resize(points_x_ * points_y_);
   cv::Size checkerboard_size(points_x_, points_y_);
-  return cv::findChessboardCorners(bridge->image, checkerboard_size,
-                                   points, cv::CALIB_CB_ADAPTIVE_THRESH);
+  if (detection_scale_ >= 1.0)
+  {
+    return cv::findChessboardCorners(image, checkerboard_size,
+                                     points, cv::CALIB_CB_ADAPTIVE_THRESH);
+  }
+
+  // Find checkerboard in a downscaled image
+  cv::Mat small;
+  cv::resize(image, small, cv::Size(), detection_scale_, detection_scale_, cv::INTER_AREA);
+  if (!cv::findChessboardCorners(small, checkerboard_size,
+                                 points, cv::CALIB_CB_ADAPTIVE_THRESH))
+  {
+    return false;
+  }
+
+  // Map corners back to full resolution, pixel centers are at +0.5
+  for (auto& point : points)
+  {
+    point.x = (point.x + 0.5f) / detection_scale_ - 0.5f;
+    point.y = (point.y + 0.5f) / detection_scale_ - 0.5f;
+  }
+
+  // Refine at full resolution, searching a window larger than the
+  // error of the downscaled corners
+  int window = std::max(5, static_cast<int>(std::ceil(2.0 / detection_scale_)));
+  cv::cornerSubPix(image, points, cv::Size(window, window), cv::Size(-1, -1),
+                   cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 30, 0.01));
+  return true;
 }
 
+// Also used directly by the finder benchmark
+template class CheckerboardFinder<sensor_msgs::msg::PointCloud2>;
+template class CheckerboardFinder<sensor_msgs::msg::Image>;
+
 }  // namespace robot_calibration
 
 #include <pluginlib/class_list_macros.hpp>
@@ -19,7 +19,10 @@
 // Author: Michael Ferguson
 
 #include <math.h>
+#include <algorithm>
+#include <bitset>
 #include <robot_calibration/finders/led_finder.hpp>
+#include <robot_calibration/util/trace.hpp>
 #include <sensor_msgs/point_cloud2_iterator.hpp>
 #include <sensor_msgs/image_encodings.hpp>
 
@@ -45,8 +48,7 @@ double distancePoints(
                    (p1.z-p2.z) * (p1.z-p2.z));
 }
 
-LedFinder::LedFinder() :
-  waiting_(false)
+LedFinder::LedFinder()
 {
 }
 
@@ -65,17 +67,19 @@ bool LedFinder::init(const std::string& name,
   std::string topic_name =
     node->declare_parameter<std::string>(name + ".action", "/gripper_led_action");
   client_.init(node, topic_name);
-  client_.waitForServer(10.0);
+  bool offline = false;
+  if (!node->get_parameter("offline", offline) || !offline)
+  {
+    client_.waitForServer(10.0);
+  }
 
   // Setup subscriber
   topic_name = node->declare_parameter<std::string>(name + ".topic", name + "/points");
-  rclcpp::SubscriptionOptions options;
-  options.qos_overriding_options = rclcpp::QosOverridingOptions::with_default_policies();
   subscriber_ = node->create_subscription<sensor_msgs::msg::PointCloud2>(
     topic_name,
     rclcpp::QoS(1).best_effort(),
     std::bind(&LedFinder::cameraCallback, this, std::placeholders::_1),
-    options);
+    getSubscriptionOptions());
 
   // Publish where LEDs were seen
   publisher_ = node->create_publisher<sensor_msgs::msg::PointCloud2>(name + "_points", 10);
@@ -89,6 +93,15 @@ bool LedFinder::init(const std::string& name,
   threshold_ = node->declare_parameter<double>(name + ".threshold", 1000.0);
   max_iterations_ = node->declare_parameter<int>(name + ".max_iterations", 50);
 
+  // Drive all LEDs at once with orthogonal on/off patterns, rather than
+  //   toggling one at a time. The code of each LED must be a bit flag, so
+  //   that codes can be combined to turn several LEDs on
+  multiplex_ = node->declare_parameter<bool>(name + ".multiplex", false);
+
+  // Only process a window of the cloud around the expected pose of each
+  //   LED, sized to cover max_error, rather than the full frame
+  use_roi_ = node->declare_parameter<bool>(name + ".use_roi", false);
+
   // Should we output debug image/cloud
   output_debug_ = node->declare_parameter<bool>(name + ".debug", false);
 
@@ -120,6 +133,30 @@ bool LedFinder::init(const std::string& name,
     tracker_publishers_.push_back(pub);
   }
 
+  // Code shown for each frame of the multiplexed patterns, the number of
+  //   frames is the smallest power of two larger than the number of LEDs
+  if (multiplex_)
+  {
+    size_t frames = 2;
+    while (frames <= trackers_.size())
+    {
+      frames *= 2;
+    }
+    patterns_.clear();
+    for (size_t frame = 0; frame < frames; ++frame)
+    {
+      uint8_t code = 0;
+      for (size_t t = 0; t < trackers_.size(); ++t)
+      {
+        if (getPatternSign(t, frame) > 0)
+        {
+          code |= codes_[2 * t];
+        }
+      }
+      patterns_.push_back(code);
+    }
+  }
+
   // Setup to get camera depth info
   if (!depth_camera_manager_.init(name, node, LOGGER))
   {
@@ -132,133 +169,70 @@ bool LedFinder::init(const std::string& name,
 
 void LedFinder::cameraCallback(sensor_msgs::msg::PointCloud2::ConstSharedPtr cloud)
 {
-  if (waiting_)
-  {
-    cloud_ = *cloud;
-    waiting_ = false;
-  }
+  storeMessage(cloud, latest_);
+}
+
+// Send an LED code to the gripper, and wait for it to be shown.
+void LedFinder::setLeds(uint8_t code)
+{
+  TraceSpan span("set_leds", getName());
+  auto command = LedAction::Goal();
+  command.led_code = code;
+  client_.sendGoal(command);
+  client_.waitForResult(rclcpp::Duration::from_seconds(10.0));
 }
 
 // Returns true if we got a message, false if we timeout.
 bool LedFinder::waitForCloud()
 {
-  // Stored as weak pointer, need to grab a real shared pointer
-  auto node = node_ptr_.lock();
-  if (!node)
+  TraceSpan span("wait_for_cloud", getName());
+  // Camera is up to date once a cloud captured after this arrives
+  cloud_ = waitForMessage(latest_, clock_->now(), 2.5);
+  if (!cloud_)
   {
-    RCLCPP_ERROR(LOGGER, "Unable to get rclcpp::Node lock");
+    RCLCPP_ERROR(LOGGER, "Failed to get cloud");
     return false;
   }
-
-  // Initial wait cycle so that camera is definitely up to date.
-  rclcpp::sleep_for(std::chrono::milliseconds(100));
-
-  waiting_ = true;
-  int count = 250;
-  while (--count)
-  {
-    if (!waiting_)
-    {
-      // success
-      return true;
-    }
-    rclcpp::sleep_for(std::chrono::milliseconds(10));
-    rclcpp::spin_some(node);
-  }
-  RCLCPP_ERROR(LOGGER, "Failed to get cloud");
-  return !waiting_;
+  return true;
 }
 
 bool LedFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
 {
-  uint8_t code_idx = -1;
-
   std::vector<geometry_msgs::msg::PointStamped> rgbd;
   std::vector<geometry_msgs::msg::PointStamped> world;
 
-  sensor_msgs::msg::PointCloud2 prev_cloud;
-
-  auto command = LedAction::Goal();
-  command.led_code = 0;
-  client_.sendGoal(command);
-  client_.waitForResult(rclcpp::Duration::from_seconds(10.0));
+  setLeds(0);
 
   // Get initial cloud
   if (!waitForCloud())
   {
     return false;
   }
-  prev_cloud = cloud_;
 
   // Initialize difference trackers
   for (size_t i = 0; i < trackers_.size(); ++i)
   {
-    trackers_[i].reset(cloud_.height, cloud_.width);
+    trackers_[i].reset(cloud_->height, cloud_->width);
   }
 
-  int cycles = 0;
-  while (true)
+  // Intrinsics for projecting the LEDs into the cloud
+  sensor_msgs::msg::CameraInfo camera_info;
+  if (use_roi_)
   {
-    // Toggle LED to next state
-    code_idx = (code_idx + 1) % codes_.size();
-    command.led_code = codes_[code_idx];
-    client_.sendGoal(command);
-    client_.waitForResult(rclcpp::Duration::from_seconds(10.0));
-
-    // Get a point cloud
-    if (!waitForCloud())
-    {
-      return false;
-    }
-
-    // Commands are organized as On-Off for each led.
-    int tracker = code_idx/2;
-    // Even indexes are turning on, Odd are turning off
-    double weight = (code_idx%2 == 0) ? 1: -1;
-
-    // Has each point converged?
-    bool done = true;
-    for (size_t t = 0; t < trackers_.size(); ++t)
-    {
-      done &= trackers_[t].isFound(cloud_, threshold_);
-    }
-    // We want to break only if the LED is off, so that pixel is not washed out
-    if (done && (weight == -1))
-    {
-      break;
-    }
-
-    // Get expected pose of LED in the cloud frame
-    geometry_msgs::msg::PointStamped led;
-    led.point = trackers_[tracker].point_;
-    led.header.frame_id = trackers_[tracker].frame_;
-    try
-    {
-      tf2_buffer_->transform(led, led, cloud_.header.frame_id);
-    }
-    catch (tf2::TransformException& ex)
-    {
-      RCLCPP_ERROR(LOGGER, "Failed to transform feature to %s", cloud_.header.frame_id.c_str());
-      return false;
-    }
-
-    // Update the tracker
-    trackers_[tracker].process(cloud_, prev_cloud, led.point, max_error_, weight);
+    camera_info = depth_camera_manager_.getDepthCameraInfo().camera_info;
+  }
 
-    if (++cycles > max_iterations_)
+  // Cycle the LEDs until every tracker has converged, leaves an all-off cloud in cloud_
+  if (multiplex_)
+  {
+    if (!cycleMultiplexed(camera_info))
     {
-      RCLCPP_ERROR(LOGGER, "Failed to find features before using maximum iterations.");
       return false;
     }
-
-    prev_cloud = cloud_;
-
-    // Publish state of each tracker
-    for (size_t i = 0; i < trackers_.size(); i++)
-    {
-      sensor_msgs::msg::Image image = trackers_[i].getImage();
-      tracker_publishers_[i]->publish(image);
-    }
+  }
+  else if (!cycleToggled(camera_info))
+  {
+    return false;
   }
 
   // Create PointCloud2 to publish
@@ -266,18 +240,17 @@ bool LedFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
   cloud.width = 0;
   cloud.height = 0;
   cloud.header.stamp = clock_->now();
-  cloud.header.frame_id = cloud_.header.frame_id;
+  cloud.header.frame_id = cloud_->header.frame_id;
   sensor_msgs::PointCloud2Modifier cloud_mod(cloud);
   cloud_mod.setPointCloud2FieldsByString(1, "xyz");
   cloud_mod.resize(4);
   sensor_msgs::PointCloud2Iterator<float> iter_cloud(cloud, "x");
 
-  // Collect Results
-  const int CAMERA = 0;
-  const int CHAIN = 1;
-  robot_calibration_msgs::msg::Observation observations[2];
-  observations[CAMERA].sensor_name = camera_sensor_name_;
-  observations[CHAIN].sensor_name = chain_sensor_name_;
+  // Collect Results, these are only added to msg if all features are found
+  ObservationBuffer staged;
+  robot_calibration_msgs::msg::Observation& camera = staged.add(camera_sensor_name_);
+  robot_calibration_msgs::msg::Observation& chain = staged.add(chain_sensor_name_);
+  camera.ext_camera_info = depth_camera_manager_.getDepthCameraInfo();
 
   for (size_t t = 0; t < trackers_.size(); ++t)
   {
@@ -285,7 +258,7 @@ bool LedFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
     geometry_msgs::msg::PointStamped world_pt;
 
     // Get point
-    if (!trackers_[t].getRefinedCentroid(cloud_, rgbd_pt))
+    if (!trackers_[t].getRefinedCentroid(*cloud_, rgbd_pt))
     {
       RCLCPP_ERROR_STREAM(LOGGER, "No centroid for feature " << t);
       return false;
@@ -312,7 +285,7 @@ bool LedFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
     for (size_t t2 = 0; t2 < t; ++t2)
     {
       double expected = distancePoints(trackers_[t2].point_, trackers_[t].point_);
-      double actual = distancePoints(observations[CAMERA].features[t2].point, rgbd_pt.point);
+      double actual = distancePoints(camera.features[t2].point, rgbd_pt.point);
       if (fabs(expected-actual) > max_inconsistency_)
       {
         RCLCPP_ERROR_STREAM(LOGGER, "Features not internally consistent: " << expected << " " << actual);
@@ -321,8 +294,7 @@ bool LedFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
     }
 
     // Push back observation
-    observations[CAMERA].features.push_back(rgbd_pt);
-    observations[CAMERA].ext_camera_info = depth_camera_manager_.getDepthCameraInfo();
+    camera.features.push_back(rgbd_pt);
 
     // Visualize
     iter_cloud[0] = rgbd_pt.point.x;
@@ -333,11 +305,11 @@ bool LedFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
     // Push back expected location of point on robot
     world_pt.header.frame_id = trackers_[t].frame_;
     world_pt.point = trackers_[t].point_;
-    observations[CHAIN].features.push_back(world_pt);
+    chain.features.push_back(world_pt);
   }
 
   // Final check that all points are valid
-  if (observations[CAMERA].features.size() != trackers_.size())
+  if (camera.features.size() != trackers_.size())
   {
     return false;
   }
@@ -345,12 +317,11 @@ bool LedFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
   // Add debug cloud to message
   if (output_debug_)
   {
-    observations[CAMERA].cloud = cloud_;
+    camera.cloud = *cloud_;
   }
 
-  // Copy results to message
-  msg->observations.push_back(observations[CAMERA]);
-  msg->observations.push_back(observations[CHAIN]);
+  // Move results to message
+  staged.commit(msg);
 
   // Publish results
   publisher_->publish(cloud);
@@ -358,6 +329,217 @@ bool LedFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
   return true;
 }
 
+bool LedFinder::cycleToggled(const sensor_msgs::msg::CameraInfo& camera_info)
+{
+  uint8_t code_idx = -1;
+
+  // Previous and current cloud are swapped by pointer, never copied
+  sensor_msgs::msg::PointCloud2::ConstSharedPtr prev_cloud = cloud_;
+
+  int cycles = 0;
+  while (true)
+  {
+    // Toggle LED to next state
+    code_idx = (code_idx + 1) % codes_.size();
+    setLeds(codes_[code_idx]);
+
+    // Get a point cloud
+    if (!waitForCloud())
+    {
+      return false;
+    }
+
+    // Commands are organized as On-Off for each led.
+    int tracker = code_idx/2;
+    // Even indexes are turning on, Odd are turning off
+    double weight = (code_idx%2 == 0) ? 1: -1;
+
+    // Has each point converged?
+    bool done = true;
+    for (size_t t = 0; t < trackers_.size(); ++t)
+    {
+      done &= trackers_[t].isFound(*cloud_, threshold_);
+    }
+    // We want to break only if the LED is off, so that pixel is not washed out
+    if (done && (weight == -1))
+    {
+      return true;
+    }
+
+    // Get expected pose of LED in the cloud frame
+    geometry_msgs::msg::PointStamped led;
+    if (!getExpectedPose(trackers_[tracker], led))
+    {
+      return false;
+    }
+
+    // Update the tracker
+    if (use_roi_)
+    {
+      trackers_[tracker].setRegion(led.point, camera_info, max_error_);
+    }
+    if (!updateDifference(*cloud_, *prev_cloud, trackers_[tracker]))
+    {
+      return false;
+    }
+    trackers_[tracker].process(*cloud_, difference_, led.point, max_error_, weight);
+
+    if (++cycles > max_iterations_)
+    {
+      RCLCPP_ERROR(LOGGER, "Failed to find features before using maximum iterations.");
+      return false;
+    }
+
+    prev_cloud = cloud_;
+
+    publishTrackers();
+  }
+}
+
+bool LedFinder::cycleMultiplexed(const sensor_msgs::msg::CameraInfo& camera_info)
+{
+  // LEDs do not move while cycling, get expected pose of each once
+  std::vector<geometry_msgs::msg::PointStamped> leds(trackers_.size());
+  for (size_t t = 0; t < trackers_.size(); ++t)
+  {
+    if (!getExpectedPose(trackers_[t], leds[t]))
+    {
+      return false;
+    }
+    if (use_roi_)
+    {
+      trackers_[t].setRegion(leds[t].point, camera_info, max_error_);
+    }
+  }
+
+  int cycles = 0;
+  while (true)
+  {
+    // Show every pattern, each tracker correlates the color of its
+    // region with the on/off pattern of its own LED
+    for (size_t frame = 0; frame < patterns_.size(); ++frame)
+    {
+      setLeds(patterns_[frame]);
+
+      if (!waitForCloud())
+      {
+        return false;
+      }
+
+      for (size_t t = 0; t < trackers_.size(); ++t)
+      {
+        trackers_[t].correlate(*cloud_, leds[t].point, max_error_, getPatternSign(t, frame));
+      }
+
+      if (++cycles > max_iterations_)
+      {
+        RCLCPP_ERROR(LOGGER, "Failed to find features before using maximum iterations.");
+        return false;
+      }
+    }
+
+    // Turn all LEDs off, so that found pixels are not washed out
+    setLeds(0);
+    if (!waitForCloud())
+    {
+      return false;
+    }
+
+    // Other LEDs and the background only cancel out over a full set of
+    // patterns, so only now is the max of each tracker meaningful
+    bool done = true;
+    for (size_t t = 0; t < trackers_.size(); ++t)
+    {
+      trackers_[t].updateMax();
+      done &= trackers_[t].isFound(*cloud_, threshold_);
+    }
+
+    publishTrackers();
+
+    if (done)
+    {
+      return true;
+    }
+  }
+}
+
+int LedFinder::getPatternSign(size_t tracker, size_t frame) const
+{
+  // Row tracker + 1 of a Sylvester Hadamard matrix, rows other than the
+  // first are balanced and mutually orthogonal
+  return (std::bitset<32>((tracker + 1) & frame).count() % 2) ? -1 : 1;
+}
+
+bool LedFinder::getExpectedPose(const CloudDifferenceTracker& tracker,
+                                geometry_msgs::msg::PointStamped& led)
+{
+  led.point = tracker.point_;
+  led.header.frame_id = tracker.frame_;
+  try
+  {
+    tf2_buffer_->transform(led, led, cloud_->header.frame_id);
+  }
+  catch (tf2::TransformException& ex)
+  {
+    RCLCPP_ERROR(LOGGER, "Failed to transform feature to %s", cloud_->header.frame_id.c_str());
+    return false;
+  }
+  return true;
+}
+
+void LedFinder::publishTrackers()
+{
+  // Publish state of each tracker, if anyone is listening
+  for (size_t i = 0; i < trackers_.size(); i++)
+  {
+    if (tracker_publishers_[i]->get_subscription_count() +
+        tracker_publishers_[i]->get_intra_process_subscription_count() == 0)
+    {
+      continue;
+    }
+    sensor_msgs::msg::Image image = trackers_[i].getImage();
+    tracker_publishers_[i]->publish(image);
+  }
+}
+
+bool LedFinder::updateDifference(const sensor_msgs::msg::PointCloud2& cloud,
+                                 const sensor_msgs::msg::PointCloud2& prev,
+                                 const CloudDifferenceTracker& tracker)
+{
+  const size_t num_points = cloud.width * cloud.height;
+  if (prev.width * prev.height != num_points)
+  {
+    RCLCPP_ERROR(LOGGER, "Cloud size has changed");
+    return false;
+  }
+
+  // Buffer is reused between cycles, only the region is written
+  difference_.resize(num_points);
+
+  sensor_msgs::PointCloud2ConstIterator<uint8_t> rgb(cloud, "rgb");
+  sensor_msgs::PointCloud2ConstIterator<uint8_t> prev_rgb(prev, "rgb");
+  for (size_t row = tracker.roi_min_y_; row < tracker.roi_max_y_; ++row)
+  {
+    for (size_t i = row * cloud.width + tracker.roi_min_x_; i < row * cloud.width + tracker.roi_max_x_; i++)
+    {
+      // Only a change with the same sign in every channel is kept
+      double r = (double)((rgb + i)[R]) - (double)((prev_rgb + i)[R]);
+      double g = (double)((rgb + i)[G]) - (double)((prev_rgb + i)[G]);
+      double b = (double)((rgb + i)[B]) - (double)((prev_rgb + i)[B]);
+      if ((r > 0 && g > 0 && b > 0) || (r < 0 && g < 0 && b < 0))
+      {
+        difference_[i] = r + g + b;
+      }
+      else
+      {
+        difference_[i] = 0.0;
+      }
+    }
+  }
+
+  return true;
+}
+
 LedFinder::CloudDifferenceTracker::CloudDifferenceTracker(
   std::string frame, double x, double y, double z) :
     frame_(frame)
@@ -386,12 +568,72 @@ void LedFinder::CloudDifferenceTracker::reset(size_t height, size_t width)
   {
     *it = 0.0;
   }
+
+  // Process the full frame until a region is set
+  roi_min_x_ = 0;
+  roi_max_x_ = width;
+  roi_min_y_ = 0;
+  roi_max_y_ = height;
+}
+
+void LedFinder::CloudDifferenceTracker::setRegion(
+  const geometry_msgs::msg::Point& led_point,
+  const sensor_msgs::msg::CameraInfo& camera_info,
+  double max_distance)
+{
+  // Fall back to the full frame, the distance test then rejects points
+  roi_min_x_ = 0;
+  roi_max_x_ = width_;
+  roi_min_y_ = 0;
+  roi_max_y_ = height_;
+
+  double fx = camera_info.k[0];
+  double cx = camera_info.k[2];
+  double fy = camera_info.k[4];
+  double cy = camera_info.k[5];
+  if (fx <= 0.0 || fy <= 0.0 || camera_info.width == 0 || camera_info.height == 0 ||
+      led_point.z - max_distance <= 0.0 || height_ < 2)
+  {
+    // No intrinsics, unorganized cloud or LED may be behind the camera
+    return;
+  }
+
+  // Cloud may be at a different resolution than the camera info
+  double scale_x = static_cast<double>(width_) / camera_info.width;
+  double scale_y = static_cast<double>(height_) / camera_info.height;
+
+  // Bound the projection of the cube which contains all points within
+  // max_distance of the expected pose
+  double min_u = width_, max_u = -1.0;
+  double min_v = height_, max_v = -1.0;
+  for (int corner = 0; corner < 8; ++corner)
+  {
+    double x = led_point.x + ((corner & 1) ? max_distance : -max_distance);
+    double y = led_point.y + ((corner & 2) ? max_distance : -max_distance);
+    double z = led_point.z + ((corner & 4) ? max_distance : -max_distance);
+    double u = (fx * x / z + cx) * scale_x;
+    double v = (fy * y / z + cy) * scale_y;
+    min_u = std::min(min_u, u);
+    max_u = std::max(max_u, u);
+    min_v = std::min(min_v, v);
+    max_v = std::max(max_v, v);
+  }
+
+  if (max_u < 0.0 || min_u >= width_ || max_v < 0.0 || min_v >= height_)
+  {
+    // Not in view
+    return;
+  }
+  roi_min_x_ = static_cast<size_t>(std::max(0.0, std::floor(min_u)));
+  roi_max_x_ = static_cast<size_t>(std::min(static_cast<double>(width_), std::floor(max_u) + 1));
+  roi_min_y_ = static_cast<size_t>(std::max(0.0, std::floor(min_v)));
+  roi_max_y_ = static_cast<size_t>(std::min(static_cast<double>(height_), std::floor(max_v) + 1));
 }
 
 // Weight should be +/- 1 typically
 bool LedFinder::CloudDifferenceTracker::process(
-  sensor_msgs::msg::PointCloud2& cloud,
-  sensor_msgs::msg::PointCloud2& prev,
+  const sensor_msgs::msg::PointCloud2& cloud,
+  const std::vector<double>& difference,
   geometry_msgs::msg::Point& led_point,
   double max_distance,
   double weight)
@@ -403,66 +645,123 @@ bool LedFinder::CloudDifferenceTracker::process(
   }
 
   sensor_msgs::PointCloud2ConstIterator<float> xyz(cloud, "x");
-  sensor_msgs::PointCloud2ConstIterator<uint8_t> rgb(cloud, "rgb");
-  sensor_msgs::PointCloud2ConstIterator<uint8_t> prev_rgb(prev, "rgb");
 
   // We want to compare each point to the expected LED pose,
   // but when the LED is on, the points will be NAN,
   // fall back on most recent distance for these points
   double last_distance = 1000.0;
 
-  // Update each point in the tracker
-  const size_t num_points = cloud.data.size() / cloud.point_step;
+  // Update each point in the region of the tracker
   int valid = 0;
   int used = 0;
-  for (size_t i = 0; i < num_points; i++)
+  for (size_t row = roi_min_y_; row < roi_max_y_; ++row)
   {
-    // If within range of LED pose...
-    geometry_msgs::msg::Point p;
-    p.x = (xyz + i)[X];
-    p.y = (xyz + i)[Y];
-    p.z = (xyz + i)[Z];
-    double distance = distancePoints(p, led_point);
-
-    if (std::isfinite(distance))
-    {
-      last_distance = distance;
-      valid++;
-    }
-    else
+    for (size_t i = row * width_ + roi_min_x_; i < row * width_ + roi_max_x_; i++)
     {
-      distance = last_distance;
-    }
+      // If within range of LED pose...
+      geometry_msgs::msg::Point p;
+      p.x = (xyz + i)[X];
+      p.y = (xyz + i)[Y];
+      p.z = (xyz + i)[Z];
+      double distance = distancePoints(p, led_point);
+
+      if (std::isfinite(distance))
+      {
+        last_distance = distance;
+        valid++;
+      }
+      else
+      {
+        distance = last_distance;
+      }
 
-    if (!std::isfinite(distance) || distance > max_distance)
-    {
-      continue;
-    }
+      if (!std::isfinite(distance) || distance > max_distance)
+      {
+        continue;
+      }
 
-    // ...and has proper change in sign
-    double r = (double)((rgb + i)[R]) - (double)((prev_rgb + i)[R]);
-    double g = (double)((rgb + i)[G]) - (double)((prev_rgb + i)[G]);
-    double b = (double)((rgb + i)[B]) - (double)((prev_rgb + i)[B]);
-    if (r > 0 && g > 0 && b > 0 && weight > 0)
-    {
-      diff_[i] += (r + g + b) * weight;
-      used++;
+      // ...and has proper change in sign
+      if ((difference[i] > 0 && weight > 0) || (difference[i] < 0 && weight < 0))
+      {
+        diff_[i] += difference[i] * weight;
+        used++;
+      }
+
+      // Is this a new max value?
+      if (diff_[i] > max_)
+      {
+        max_ = diff_[i];
+        max_idx_ = i;
+      }
     }
-    else if (r < 0 && g < 0 && b < 0 && weight < 0)
+  }
+
+  return true;
+}
+
+void LedFinder::CloudDifferenceTracker::correlate(
+  const sensor_msgs::msg::PointCloud2& cloud,
+  const geometry_msgs::msg::Point& led_point,
+  double max_distance,
+  double sign)
+{
+  if ((cloud.width * cloud.height) != diff_.size())
+  {
+    RCLCPP_ERROR(LOGGER, "Cloud size has changed");
+    return;
+  }
+
+  sensor_msgs::PointCloud2ConstIterator<float> xyz(cloud, "x");
+  sensor_msgs::PointCloud2ConstIterator<uint8_t> rgb(cloud, "rgb");
+
+  // As in process(), points which are NAN while the LED is on fall back
+  // on the most recent distance
+  double last_distance = 1000.0;
+  for (size_t row = roi_min_y_; row < roi_max_y_; ++row)
+  {
+    for (size_t i = row * width_ + roi_min_x_; i < row * width_ + roi_max_x_; i++)
     {
-      diff_[i] += (r + g + b) * weight;
-      used++;
+      geometry_msgs::msg::Point p;
+      p.x = (xyz + i)[X];
+      p.y = (xyz + i)[Y];
+      p.z = (xyz + i)[Z];
+      double distance = distancePoints(p, led_point);
+      if (std::isfinite(distance))
+      {
+        last_distance = distance;
+      }
+      else
+      {
+        distance = last_distance;
+      }
+
+      if (distance > max_distance)
+      {
+        continue;
+      }
+
+      double color = (double)((rgb + i)[R]) + (double)((rgb + i)[G]) + (double)((rgb + i)[B]);
+      diff_[i] += color * sign;
     }
+  }
+  ++count_;
+}
 
-    // Is this a new max value?
-    if (diff_[i] > max_)
+void LedFinder::CloudDifferenceTracker::updateMax()
+{
+  max_ = -1000.0;
+  max_idx_ = -1;
+  for (size_t row = roi_min_y_; row < roi_max_y_; ++row)
+  {
+    for (size_t i = row * width_ + roi_min_x_; i < row * width_ + roi_max_x_; i++)
     {
-      max_ = diff_[i];
-      max_idx_ = i;
+      if (diff_[i] > max_)
+      {
+        max_ = diff_[i];
+        max_idx_ = i;
+      }
     }
   }
-
-  return true;
 }
 
 bool LedFinder::CloudDifferenceTracker::isFound(
@@ -558,33 +857,38 @@ sensor_msgs::msg::Image LedFinder::CloudDifferenceTracker::getImage()
 {
   sensor_msgs::msg::Image image;
 
-  image.height = height_;
-  image.width = width_;
+  // Image covers only the region of the tracker
+  image.height = roi_max_y_ - roi_min_y_;
+  image.width = roi_max_x_ - roi_min_x_;
 
   image.encoding = sensor_msgs::image_encodings::BGR8;
-  image.step = width_ * 3;
+  image.step = image.width * 3;
 
-  image.data.resize(width_ * height_ * 3);
+  image.data.resize(image.width * image.height * 3);
 
-  for (size_t i = 0; i < diff_.size(); i++)
+  size_t j = 0;
+  for (size_t row = roi_min_y_; row < roi_max_y_; ++row)
   {
-    if (diff_[i] > max_ * 0.9)
+    for (size_t i = row * width_ + roi_min_x_; i < row * width_ + roi_max_x_; i++, j++)
     {
-      image.data[i*3] = 255;
-      image.data[i*3 + 1] = 0;
-      image.data[i*3 + 2] = 0;
-    }
-    else if (diff_[i] > 0)
-    {
-      image.data[i*3] = static_cast<uint8_t>(diff_[i]/2.0);
-      image.data[i*3 + 1] = static_cast<uint8_t>(diff_[i]/2.0);
-      image.data[i*3 + 2] = static_cast<uint8_t>(diff_[i]/2.0);
-    }
-    else
-    {
-      image.data[i*3] = 0;
-      image.data[i*3 + 1] = 0;
-      image.data[i*3 + 2] = 0;
+      if (diff_[i] > max_ * 0.9)
+      {
+        image.data[j*3] = 255;
+        image.data[j*3 + 1] = 0;
+        image.data[j*3 + 2] = 0;
+      }
+      else if (diff_[i] > 0)
+      {
+        image.data[j*3] = static_cast<uint8_t>(diff_[i]/2.0);
+        image.data[j*3 + 1] = static_cast<uint8_t>(diff_[i]/2.0);
+        image.data[j*3 + 2] = static_cast<uint8_t>(diff_[i]/2.0);
+      }
+      else
+      {
+        image.data[j*3] = 0;
+        image.data[j*3 + 1] = 0;
+        image.data[j*3 + 2] = 0;
+      }
     }
   }
 
@@ -20,9 +20,17 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
 
+#include <Eigen/Geometry>
+#include <rclcpp/serialization.hpp>
 #include <robot_calibration/finders/plane_finder.hpp>
 #include <robot_calibration/util/eigen_geometry.hpp>
+#include <robot_calibration/util/ransac.hpp>
+#include <robot_calibration/util/trace.hpp>
 #include <sensor_msgs/point_cloud2_iterator.hpp>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.hpp>
 
@@ -88,7 +96,7 @@ int sampleCloud(const sensor_msgs::msg::PointCloud2& points,
 }
 
 PlaneFinder::PlaneFinder() :
-  waiting_(false)
+  transform_time_(tf2::TimePointZero)
 {
 }
 
@@ -106,13 +114,11 @@ bool PlaneFinder::init(const std::string& name,
   // We subscribe to a PointCloud2
   std::string topic_name =
     node->declare_parameter<std::string>(name + ".topic", name + "/points");
-  rclcpp::SubscriptionOptions options;
-  options.qos_overriding_options = rclcpp::QosOverridingOptions::with_default_policies();
   subscriber_ = node->create_subscription<sensor_msgs::msg::PointCloud2>(
     topic_name,
     rclcpp::QoS(1).best_effort(),
     std::bind(&PlaneFinder::cameraCallback, this, std::placeholders::_1),
-    options);
+    getSubscriptionOptions());
 
   // Name of the sensor model that will be used during optimization
   plane_sensor_name_ = node->declare_parameter<std::string>(name + ".camera_sensor_name", "camera");
@@ -124,6 +130,10 @@ bool PlaneFinder::init(const std::string& name,
   initial_sampling_distance_ = node->declare_parameter<double>(
     name + ".initial_sample_distance", 0.2);
 
+  // Size of voxels to downsample the cloud to before extracting the plane,
+  //   if zero, the full resolution cloud is used
+  voxel_size_ = node->declare_parameter<double>(name + ".voxel_size", 0.0);
+
   // Maximum distance from plane that point can be located
   plane_tolerance_ = node->declare_parameter<double>(name + ".tolerance", 0.02);
 
@@ -143,6 +153,12 @@ bool PlaneFinder::init(const std::string& name,
   // Parameters for RANSAC
   ransac_iterations_ = node->declare_parameter<int>(name + ".ransac_iterations", 100);
   ransac_points_ = node->declare_parameter<int>(name + ".ransac_points", 35);
+  // Hypotheses are evaluated on this many threads
+  ransac_threads_ = node->declare_parameter<int>(name + ".ransac_threads", 1);
+  // Random samples are drawn from this seed, so results are reproducible
+  ransac_seed_ = node->declare_parameter<int>(name + ".ransac_seed", 0);
+  // Stop early once this confidence of having found the plane is reached
+  ransac_confidence_ = node->declare_parameter<double>(name + ".ransac_confidence", 0.99);
 
   // Optional normal vector that found plane should align with
   // Leave all parameters set to 0 to disable check and simply take best fitting plane
@@ -173,51 +189,136 @@ bool PlaneFinder::init(const std::string& name,
 
 void PlaneFinder::cameraCallback(sensor_msgs::msg::PointCloud2::ConstSharedPtr cloud)
 {
-  if (waiting_)
+  storeMessage(cloud, latest_);
+}
+
+bool PlaneFinder::waitForCloud()
+{
+  TraceSpan span("wait_for_cloud", getName());
+  // Camera is up to date once a cloud captured after this arrives
+  msg_ = waitForMessage(latest_, clock_->now(), 2.5);
+  if (!msg_)
   {
-    cloud_ = *cloud;
-    waiting_ = false;
+    RCLCPP_ERROR(LOGGER, "Failed to get cloud");
+    return false;
   }
+  return true;
 }
 
-bool PlaneFinder::waitForCloud()
+bool PlaneFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
 {
-  // Stored as weak pointer, need to grab a real shared pointer
-  auto node = node_ptr_.lock();
-  if (!node)
+  if (!waitForCloud())
   {
-    RCLCPP_ERROR(LOGGER, "Unable to get rclcpp::Node lock");
+    RCLCPP_ERROR(LOGGER, "No point cloud data");
     return false;
   }
 
-  // Initial wait cycle so that camera is definitely up to date.
-  rclcpp::sleep_for(std::chrono::milliseconds(100));
+  sensor_msgs::msg::PointCloud2::ConstSharedPtr cloud = msg_;
+  msg_.reset();
+  raw_ = cloud;
+  return extract(*cloud, msg);
+}
+
+FeatureFinder::Extractor PlaneFinder::snapshot()
+{
+  if (!waitForCloud())
+  {
+    RCLCPP_ERROR(LOGGER, "No point cloud data");
+    return Extractor();
+  }
+
+  sensor_msgs::msg::PointCloud2::ConstSharedPtr cloud = msg_;
+  msg_.reset();
+  raw_ = cloud;
+  return [this, cloud](robot_calibration_msgs::msg::CalibrationData * msg)
+  {
+    // The robot may have moved on, use the transforms from when the
+    // cloud was captured
+    transform_time_ = tf2_ros::fromMsg(cloud->header.stamp);
+    bool success = extract(*cloud, msg);
+    transform_time_ = tf2::TimePointZero;
+    return success;
+  };
+}
+
+bool PlaneFinder::getCaptureStamp(builtin_interfaces::msg::Time& stamp)
+{
+  if (!raw_)
+  {
+    return false;
+  }
+  stamp = raw_->header.stamp;
+  return true;
+}
+
+bool PlaneFinder::getRawData(robot_calibration_msgs::msg::RawObservation& raw)
+{
+  if (!raw_)
+  {
+    return false;
+  }
 
-  waiting_ = true;
-  int count = 250;
-  while (--count)
+  raw.type = "sensor_msgs/msg/PointCloud2";
+  rclcpp::SerializedMessage serialized;
+  rclcpp::Serialization<sensor_msgs::msg::PointCloud2> serialization;
+  serialization.serialize_message(raw_.get(), &serialized);
+  const rcl_serialized_message_t& buffer = serialized.get_rcl_serialized_message();
+  raw.data.assign(buffer.buffer, buffer.buffer + buffer.buffer_length);
+  raw.ext_camera_info = depth_camera_manager_.getDepthCameraInfo();
+
+  // The only transform extract() uses
+  raw.transforms.clear();
+  if (transform_frame_ != "none")
   {
-    if (!waiting_)
+    try
     {
-      // success
-      return true;
+      raw.transforms.push_back(
+        tf2_buffer_->lookupTransform(transform_frame_, raw_->header.frame_id,
+                                     tf2_ros::fromMsg(raw_->header.stamp)));
+    }
+    catch (tf2::TransformException& ex)
+    {
+      RCLCPP_ERROR(LOGGER, "%s", ex.what());
+      return false;
     }
-    rclcpp::sleep_for(std::chrono::milliseconds(10));
-    rclcpp::spin_some(node);
   }
-  RCLCPP_ERROR(LOGGER, "Failed to get cloud");
-  return !waiting_;
+  return true;
 }
 
-bool PlaneFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
+bool PlaneFinder::replay(const robot_calibration_msgs::msg::RawObservation& raw,
+                         robot_calibration_msgs::msg::CalibrationData * msg)
 {
-  if (!waitForCloud())
+  if (raw.type != "sensor_msgs/msg/PointCloud2")
   {
-    RCLCPP_ERROR(LOGGER, "No point cloud data");
+    RCLCPP_ERROR(LOGGER, "Cannot replay data of type %s", raw.type.c_str());
     return false;
   }
 
-  removeInvalidPoints(cloud_, min_x_, max_x_, min_y_, max_y_, min_z_, max_z_);
+  sensor_msgs::msg::PointCloud2 cloud;
+  rclcpp::SerializedMessage serialized(raw.data.size());
+  rcl_serialized_message_t& buffer = serialized.get_rcl_serialized_message();
+  std::copy(raw.data.begin(), raw.data.end(), buffer.buffer);
+  buffer.buffer_length = raw.data.size();
+  rclcpp::Serialization<sensor_msgs::msg::PointCloud2> serialization;
+  serialization.deserialize_message(&serialized, &cloud);
+
+  // Use the camera info and transforms from when the data was captured
+  depth_camera_manager_.setDepthCameraInfo(raw.ext_camera_info);
+  for (const auto& transform : raw.transforms)
+  {
+    tf2_buffer_->setTransform(transform, "replay", true);
+  }
+  transform_time_ = tf2_ros::fromMsg(cloud.header.stamp);
+  bool success = extract(cloud, msg);
+  transform_time_ = tf2::TimePointZero;
+  return success;
+}
+
+bool PlaneFinder::extract(const sensor_msgs::msg::PointCloud2& cloud,
+                          robot_calibration_msgs::msg::CalibrationData * msg)
+{
+  removeInvalidPoints(cloud, cloud_, min_x_, max_x_, min_y_, max_y_, min_z_, max_z_);
+  downsampleCloud(cloud_);
   sensor_msgs::msg::PointCloud2 plane = extractPlane(cloud_);
   extractObservation(plane_sensor_name_, plane, msg, publisher_);
 
@@ -227,163 +328,236 @@ bool PlaneFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
 
 void PlaneFinder::removeInvalidPoints(sensor_msgs::msg::PointCloud2& cloud,
   double min_x, double max_x, double min_y, double max_y, double min_z, double max_z)
+{
+  removeInvalidPoints(cloud, cloud, min_x, max_x, min_y, max_y, min_z, max_z);
+}
+
+void PlaneFinder::removeInvalidPoints(const sensor_msgs::msg::PointCloud2& input,
+  sensor_msgs::msg::PointCloud2& cloud,
+  double min_x, double max_x, double min_y, double max_y, double min_z, double max_z)
 {
   //  Remove any point that is invalid or not with our tolerance
-  size_t num_points = cloud.width * cloud.height;
-  sensor_msgs::PointCloud2ConstIterator<float> xyz(cloud, "x");
-  sensor_msgs::PointCloud2Iterator<float> cloud_iter(cloud, "x");
+  size_t num_points = input.width * input.height;
+  sensor_msgs::PointCloud2ConstIterator<float> xyz(input, "x");
 
-  bool do_transform = transform_frame_ != "none";  // This can go away once the cloud gets transformed outside loop
-  size_t j = 0;
+  // Gather the points in one pass, so they can be transformed all at once
+  Eigen::Matrix3Xf points(3, num_points);
   for (size_t i = 0; i < num_points; i++)
   {
-    geometry_msgs::msg::PointStamped p;
-    p.point.x = (xyz + i)[X];
-    p.point.y = (xyz + i)[Y];
-    p.point.z = (xyz + i)[Z];
+    points(X, i) = (xyz + i)[X];
+    points(Y, i) = (xyz + i)[Y];
+    points(Z, i) = (xyz + i)[Z];
+  }
+
+  // Output may be the input, valid points are only ever moved forward. When
+  // it is not, the buffer of the output is reused from the last cloud.
+  if (&input != &cloud)
+  {
+    cloud.header = input.header;
+    cloud.fields = input.fields;
+    cloud.is_bigendian = input.is_bigendian;
+    cloud.point_step = input.point_step;
+    cloud.is_dense = input.is_dense;
+    cloud.data.resize(num_points * input.point_step);
+  }
+
+  // Get transform (if any), this is the same for every point of the cloud
+  Eigen::Matrix3Xf transformed;
+  if (transform_frame_ != "none")
+  {
+    geometry_msgs::msg::TransformStamped transform;
+    try
+    {
+      transform = tf2_buffer_->lookupTransform(transform_frame_, input.header.frame_id,
+                                               transform_time_);
+    }
+    catch (tf2::TransformException& ex)
+    {
+      RCLCPP_ERROR(LOGGER, "%s", ex.what());
+      rclcpp::sleep_for(std::chrono::seconds(1));
+      // No point can be tested without the transform
+      cloud.height = 1;
+      cloud.width = 0;
+      cloud.row_step = 0;
+      cloud.data.clear();
+      return;
+    }
 
+    const auto& q = transform.transform.rotation;
+    const auto& t = transform.transform.translation;
+    Eigen::Matrix3f rotation =
+      Eigen::Quaterniond(q.w, q.x, q.y, q.z).toRotationMatrix().cast<float>();
+    Eigen::Vector3f translation(t.x, t.y, t.z);
+    transformed = (rotation * points).colwise() + translation;
+  }
+  else
+  {
+    transformed = points;
+  }
+
+  size_t j = 0;
+  for (size_t i = 0; i < num_points; i++)
+  {
     // Remove the NaNs in the point cloud
-    if (!std::isfinite(p.point.x) || !std::isfinite(p.point.y) || !std::isfinite(p.point.z))
+    if (!points.col(i).allFinite())
     {
       continue;
     }
 
     // Remove the points immediately in front of the camera in the point cloud
     // NOTE : This is to handle sensors that publish zeros instead of NaNs in the point cloud
-    if (p.point.z == 0)
+    if (points(Z, i) == 0)
     {
       continue;
     }
 
-    // Get transform (if any)
-    geometry_msgs::msg::PointStamped p_out;
-    if (do_transform)
-    {
-      p.header.stamp.sec = 0;
-      p.header.stamp.nanosec = 0;
-      p.header.frame_id = cloud_.header.frame_id;
-      try
-      {
-        tf2_buffer_->transform(p, p_out, transform_frame_);
-      }
-      catch (tf2::TransformException& ex)
-      {
-        RCLCPP_ERROR(LOGGER, "%s", ex.what());
-        rclcpp::sleep_for(std::chrono::seconds(1));
-        continue;
-      }
-    }
-    else
-    {
-      p_out = p;
-    }
-
     // Test the transformed point
-    if (p_out.point.x < min_x || p_out.point.x > max_x || p_out.point.y < min_y || p_out.point.y > max_y ||
-        p_out.point.z < min_z || p_out.point.z > max_z)
+    if (transformed(X, i) < min_x || transformed(X, i) > max_x ||
+        transformed(Y, i) < min_y || transformed(Y, i) > max_y ||
+        transformed(Z, i) < min_z || transformed(Z, i) > max_z)
     {
       continue;
     }
 
-    // This is a valid point, move it forward
-    (cloud_iter + j)[X] = (xyz + i)[X];
-    (cloud_iter + j)[Y] = (xyz + i)[Y];
-    (cloud_iter + j)[Z] = (xyz + i)[Z];
+    // This is a valid point, copy all of its fields forward
+    if (&input != &cloud || i != j)
+    {
+      std::memmove(&cloud.data[j * cloud.point_step], &input.data[i * input.point_step],
+                   input.point_step);
+    }
     j++;
   }
   cloud.height = 1;
   cloud.width  = j;
+  cloud.row_step = cloud.width * cloud.point_step;
   cloud.data.resize(cloud.width * cloud.point_step);
 }
 
-sensor_msgs::msg::PointCloud2 PlaneFinder::extractPlane(sensor_msgs::msg::PointCloud2& cloud)
+void PlaneFinder::downsampleCloud(sensor_msgs::msg::PointCloud2& cloud)
 {
-  sensor_msgs::PointCloud2ConstIterator<float> xyz(cloud, "x");
-
-  // Copy cloud to eigen matrix for SVD
-  Eigen::MatrixXd points(3, cloud.width);
-  for (size_t i = 0; i < cloud.width; ++i)
+  if (voxel_size_ <= 0.0)
   {
-    points(0, i) = (xyz + i)[X];
-    points(1, i) = (xyz + i)[Y];
-    points(2, i) = (xyz + i)[Z];
+    return;
   }
 
-  // Find the best fit plane
-  Eigen::Vector3d best_normal(0, 0, 1);
-  double best_d = 0.0;
-  int best_fit = -1;
-  for (int i = 0; i < ransac_iterations_; ++i)
+  size_t num_points = cloud.width * cloud.height;
+  sensor_msgs::PointCloud2Iterator<float> xyz(cloud, "x");
+
+  // Accumulate the points in each occupied voxel, voxels are kept
+  // in the order they are first seen so the result is deterministic
+  std::unordered_map<uint64_t, size_t> voxel_index;
+  std::vector<Eigen::Vector3d> sums;
+  std::vector<size_t> counts;
+  std::vector<size_t> firsts;
+  voxel_index.reserve(num_points);
+  for (size_t i = 0; i < num_points; ++i)
   {
-    // Select random points
-    Eigen::MatrixXd test_points(3, ransac_points_);
-    for (int p = 0; p < ransac_points_; ++p)
+    Eigen::Vector3d p((xyz + i)[X], (xyz + i)[Y], (xyz + i)[Z]);
+
+    // Pack 21 bits of each voxel coordinate into the key
+    uint64_t key = 0;
+    for (int axis = 0; axis < 3; ++axis)
     {
-      int index = rand() % cloud.width;
-      test_points(0, p) = points(0, index);
-      test_points(1, p) = points(1, index);
-      test_points(2, p) = points(2, index);
+      int64_t v = static_cast<int64_t>(std::floor(p(axis) / voxel_size_));
+      key = (key << 21) | (static_cast<uint64_t>(v) & 0x1FFFFF);
     }
 
-    // Get plane for this test set
-    Eigen::Vector3d normal;
-    double d = 0.0;
-    getPlane(test_points, normal, d);
+    auto voxel = voxel_index.emplace(key, sums.size());
+    if (voxel.second)
+    {
+      sums.push_back(p);
+      counts.push_back(1);
+      firsts.push_back(i);
+    }
+    else
+    {
+      sums[voxel.first->second] += p;
+      ++counts[voxel.first->second];
+    }
+  }
 
-    // If we have desired normal, check if plane is well enough aligned
-    if (desired_normal_.norm() > 0.1)
+  // Replace the cloud with the centroid of each voxel, the other fields
+  // come from the first point in the voxel. Since firsts[j] >= j, points
+  // are only moved towards the front of the buffer.
+  for (size_t j = 0; j < sums.size(); ++j)
+  {
+    if (firsts[j] != j)
     {
-      // We might have to transform the normal to a different frame
-      geometry_msgs::msg::Vector3Stamped transformed_normal;
-      transformed_normal.header = cloud.header;
-      transformed_normal.vector.x = normal(0);
-      transformed_normal.vector.y = normal(1);
-      transformed_normal.vector.z = normal(2);
-
-      if (transform_frame_ != "none")
-      {
-        try
-        {
-          tf2_buffer_->transform(transformed_normal, transformed_normal, transform_frame_);
-        }
-        catch (tf2::TransformException& ex)
-        {
-          RCLCPP_ERROR(LOGGER, "%s", ex.what());
-          continue;
-        }
-      }
+      std::memmove(&cloud.data[j * cloud.point_step], &cloud.data[firsts[j] * cloud.point_step],
+                   cloud.point_step);
+    }
+    Eigen::Vector3d centroid = sums[j] / counts[j];
+    (xyz + j)[X] = centroid(X);
+    (xyz + j)[Y] = centroid(Y);
+    (xyz + j)[Z] = centroid(Z);
+  }
+  RCLCPP_DEBUG(LOGGER, "Downsampled cloud from %lu to %lu points", num_points, sums.size());
 
-      Eigen::Vector3d transformed(transformed_normal.vector.x,
-                                  transformed_normal.vector.y,
-                                  transformed_normal.vector.z);
+  cloud.height = 1;
+  cloud.width  = sums.size();
+  cloud.row_step = cloud.width * cloud.point_step;
+  cloud.data.resize(cloud.width * cloud.point_step);
+}
 
-      // a.dot(b) = norm(a) * norm(b) * cos(angle between a & b)
-      double angle = transformed.dot(desired_normal_) / desired_normal_.norm() / transformed.norm();
-      if (std::fabs(angle) < cos_normal_angle_)
-      {
-        continue;
-      }
-    }
+sensor_msgs::msg::PointCloud2 PlaneFinder::extractPlane(sensor_msgs::msg::PointCloud2& cloud)
+{
+  TraceSpan span("extract_plane", getName());
+  sensor_msgs::PointCloud2ConstIterator<float> xyz(cloud, "x");
+
+  // Copy cloud to contiguous arrays for RANSAC
+  PlaneRansac::Points points(cloud.width, 3);
+  for (size_t i = 0; i < cloud.width; ++i)
+  {
+    points(i, X) = (xyz + i)[X];
+    points(i, Y) = (xyz + i)[Y];
+    points(i, Z) = (xyz + i)[Z];
+  }
 
-    // Test how many fit
-    int fit_count = 0;
-    for (size_t i = 0; i < cloud.width; ++i)
+  PlaneRansac::Params params;
+  params.iterations = ransac_iterations_;
+  params.sample_size = ransac_points_;
+  params.tolerance = plane_tolerance_;
+  params.cos_normal_angle = cos_normal_angle_;
+  params.confidence = ransac_confidence_;
+  params.num_threads = ransac_threads_;
+  params.seed = ransac_seed_;
+
+  // If we have desired normal, the plane must be well enough aligned
+  bool can_fit = true;
+  if (desired_normal_.norm() > 0.1)
+  {
+    params.desired_normal = desired_normal_;
+    if (transform_frame_ != "none")
     {
-      // Compute distance to plane
-      double dist = normal(0) * (xyz + i)[X] + normal(1) * (xyz + i)[Y] + normal(2) * (xyz + i)[Z] + d;
-      if (std::fabs(dist) < plane_tolerance_)
+      // Rotate the desired normal into the frame of the cloud once, rather
+      // than transforming the normal of every hypothesis
+      try
+      {
+        geometry_msgs::msg::TransformStamped transform =
+          tf2_buffer_->lookupTransform(transform_frame_, cloud.header.frame_id, transform_time_);
+        const auto& q = transform.transform.rotation;
+        params.desired_normal =
+          Eigen::Quaterniond(q.w, q.x, q.y, q.z).toRotationMatrix().transpose() * desired_normal_;
+      }
+      catch (tf2::TransformException& ex)
       {
-        ++fit_count;
+        RCLCPP_ERROR(LOGGER, "%s", ex.what());
+        can_fit = false;
       }
     }
+  }
 
-    if (fit_count > best_fit)
+  // Find the best fit plane
+  Eigen::Vector3d best_normal(0, 0, 1);
+  double best_d = 0.0;
+  if (can_fit)
+  {
+    PlaneRansac ransac(params);
+    if (!ransac.fit(points, best_normal, best_d))
     {
-      // Accept this as our best fit
-      best_fit = fit_count;
-      best_normal = normal;
-      best_d = d;
+      RCLCPP_WARN(LOGGER, "No plane hypothesis satisfied the constraints");
     }
+    RCLCPP_DEBUG(LOGGER, "RANSAC evaluated %d hypotheses", ransac.getIterations());
   }
   // Note: parameters are in cloud.header.frame_id and not transform_frame
   RCLCPP_INFO(LOGGER, "Found plane with parameters: %f %f %f %f", best_normal(0), best_normal(1), best_normal(2), best_d);
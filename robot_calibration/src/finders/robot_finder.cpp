@@ -63,16 +63,12 @@ bool RobotFinder::init(const std::string& name,
   return true;
 }
 
-bool RobotFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
+bool RobotFinder::extract(const sensor_msgs::msg::PointCloud2& cloud,
+                          robot_calibration_msgs::msg::CalibrationData * msg)
 {
-  if (!waitForCloud())
-  {
-    RCLCPP_ERROR(LOGGER, "No point cloud data");
-    return false;
-  }
-
   // Remove invalid points
-  removeInvalidPoints(cloud_, min_x_, max_x_, min_y_, max_y_, min_z_, max_z_);
+  removeInvalidPoints(cloud, cloud_, min_x_, max_x_, min_y_, max_y_, min_z_, max_z_);
+  downsampleCloud(cloud_);
 
   // Find the ground plane and extract it
   sensor_msgs::msg::PointCloud2 plane = extractPlane(cloud_);
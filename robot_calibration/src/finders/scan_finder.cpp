@@ -19,7 +19,9 @@
 // Author: Michael Ferguson
 
 #include <math.h>
+#include <Eigen/Geometry>
 #include <robot_calibration/finders/scan_finder.hpp>
+#include <robot_calibration/util/trace.hpp>
 #include <sensor_msgs/point_cloud2_iterator.hpp>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.hpp>
 
@@ -33,7 +35,8 @@ const unsigned Y = 1;
 const unsigned Z = 2;
 
 ScanFinder::ScanFinder() :
-  waiting_(false)
+  table_angle_min_(0.0),
+  table_angle_increment_(0.0)
 {
 }
 
@@ -51,13 +54,11 @@ bool ScanFinder::init(const std::string& name,
   // We subscribe to a LaserScan
   std::string topic_name;
   topic_name = node->declare_parameter<std::string>(name + ".topic", name + "/scan");
-  rclcpp::SubscriptionOptions options;
-  options.qos_overriding_options = rclcpp::QosOverridingOptions::with_default_policies();
   subscriber_ = node->create_subscription<sensor_msgs::msg::LaserScan>(
     topic_name,
     rclcpp::QoS(1).best_effort(),
     std::bind(&ScanFinder::scanCallback, this, std::placeholders::_1),
-    options);
+    getSubscriptionOptions());
 
   // Name of the sensor model that will be used during optimization
   laser_sensor_name_ = node->declare_parameter<std::string>(name + ".sensor_name", "laser");
@@ -88,40 +89,20 @@ bool ScanFinder::init(const std::string& name,
 
 void ScanFinder::scanCallback(sensor_msgs::msg::LaserScan::ConstSharedPtr scan)
 {
-  if (waiting_)
-  {
-    scan_ = *scan;
-    waiting_ = false;
-  }
+  storeMessage(scan, latest_);
 }
 
 bool ScanFinder::waitForScan()
 {
-  // Stored as weak pointer, need to grab a real shared pointer
-  auto node = node_ptr_.lock();
-  if (!node)
+  TraceSpan span("wait_for_scan", getName());
+  // Laser scan is up to date once a scan captured after this arrives
+  scan_ = waitForMessage(latest_, clock_->now(), 2.5);
+  if (!scan_)
   {
-    RCLCPP_ERROR(LOGGER, "Unable to get rclcpp::Node lock");
+    RCLCPP_ERROR(LOGGER, "Failed to get scan");
     return false;
   }
-
-  // Initial wait cycle so that laser scan is definitely up to date.
-  rclcpp::sleep_for(std::chrono::milliseconds(100));
-
-  waiting_ = true;
-  int count = 250;
-  while (--count)
-  {
-    if (!waiting_)
-    {
-      // success
-      return true;
-    }
-    rclcpp::sleep_for(std::chrono::milliseconds(10));
-    rclcpp::spin_some(node);
-  }
-  RCLCPP_ERROR(LOGGER, "Failed to get scan");
-  return !waiting_;
+  return true;
 }
 
 bool ScanFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
@@ -141,80 +122,114 @@ bool ScanFinder::find(robot_calibration_msgs::msg::CalibrationData * msg)
   return true;
 }
 
+bool ScanFinder::getCaptureStamp(builtin_interfaces::msg::Time& stamp)
+{
+  if (!scan_)
+  {
+    return false;
+  }
+  stamp = scan_->header.stamp;
+  return true;
+}
+
+void ScanFinder::updateAngleTables()
+{
+  // Scan geometry rarely changes, only recompute the tables when it does
+  if (cos_table_.size() == scan_->ranges.size() &&
+      table_angle_min_ == scan_->angle_min &&
+      table_angle_increment_ == scan_->angle_increment)
+  {
+    return;
+  }
+
+  cos_table_.resize(scan_->ranges.size());
+  sin_table_.resize(scan_->ranges.size());
+  for (size_t i = 0; i < scan_->ranges.size(); ++i)
+  {
+    double angle = scan_->angle_min + (i * scan_->angle_increment);
+    cos_table_[i] = cos(angle);
+    sin_table_[i] = sin(angle);
+  }
+  table_angle_min_ = scan_->angle_min;
+  table_angle_increment_ = scan_->angle_increment;
+}
+
 void ScanFinder::extractPoints(sensor_msgs::msg::PointCloud2& cloud)
 {
+  TraceSpan span("extract_points", getName());
   bool do_transform = transform_frame_ != "none";
 
   // Reset cloud
   cloud.width = 0;
   cloud.height = 0;
   cloud.header.stamp = clock_->now();
-  cloud.header.frame_id = do_transform ? transform_frame_ : scan_.header.frame_id;
+  cloud.header.frame_id = do_transform ? transform_frame_ : scan_->header.frame_id;
 
   // Setup cloud to be XYZ
   sensor_msgs::PointCloud2Modifier cloud_mod(cloud);
   cloud_mod.setPointCloud2FieldsByString(1, "xyz");
-  cloud_mod.resize(scan_.ranges.size() * z_repeats_);
+  cloud_mod.resize(scan_->ranges.size() * z_repeats_);
 
   // Create iterator to edit cloud
   sensor_msgs::PointCloud2Iterator<float> cloud_iter(cloud, "x");
 
-  // Filter and transform scan points
+  // Filter scan points, in the sensor frame
+  updateAngleTables();
+  Eigen::Matrix3Xd points(3, scan_->ranges.size() * z_repeats_);
   size_t line_point_count = 0;
-  for (size_t i = 0; i < scan_.ranges.size(); ++i)
+  for (size_t i = 0; i < scan_->ranges.size(); ++i)
   {
     // Remove any NaNs in scan
-    if (!std::isfinite(scan_.ranges[i]))
+    if (!std::isfinite(scan_->ranges[i]))
     {
       continue;
     }
 
-    // Geometry to convert from scan to cloud
-    double angle = scan_.angle_min + (i * scan_.angle_increment);
-
     // Create point (in sensor frame)
-    geometry_msgs::msg::PointStamped p;
-    p.point.x = cos(angle) * scan_.ranges[i];
-    p.point.y = sin(angle) * scan_.ranges[i];
-    p.point.z = 0.0;
+    double x = cos_table_[i] * scan_->ranges[i];
+    double y = sin_table_[i] * scan_->ranges[i];
 
-    // Test the transformed point
-    if (p.point.x < min_x_ || p.point.x > max_x_ || p.point.y < min_y_ || p.point.y > max_y_)
+    // Test the point
+    if (x < min_x_ || x > max_x_ || y < min_y_ || y > max_y_)
     {
       continue;
     }
 
-    // Get transform (if any)
+    // Repeats are only offset in z when transformed, otherwise all are at z = 0
     for (int z = 0; z < z_repeats_; ++z)
     {
-      geometry_msgs::msg::PointStamped p_out;
-      if (do_transform)
-      {
-        //p.header.stamp = ros::Time(0);
-        p.header.frame_id = scan_.header.frame_id;
-        p.point.z = z * z_offset_;
-        try
-        {
-          tf2_buffer_->transform(p, p_out, transform_frame_);
-        }
-        catch (tf2::TransformException& ex)
-        {
-          RCLCPP_ERROR(LOGGER, "%s", ex.what());
-          rclcpp::sleep_for(std::chrono::seconds(1));
-          continue;
-        }
-      }
-      else
-      {
-        p_out = p;
-      }
-
-      // This is a valid point, move it forward
-      (cloud_iter + line_point_count)[X] = p_out.point.x;
-      (cloud_iter + line_point_count)[Y] = p_out.point.y;
-      (cloud_iter + line_point_count)[Z] = p_out.point.z;
-      ++line_point_count;
+      points.col(line_point_count++) << x, y, do_transform ? z * z_offset_ : 0.0;
+    }
+  }
+  points.conservativeResize(3, line_point_count);
+
+  // Get transform (if any), and apply it to all points at once
+  if (do_transform)
+  {
+    try
+    {
+      geometry_msgs::msg::TransformStamped transform =
+        tf2_buffer_->lookupTransform(transform_frame_, scan_->header.frame_id, tf2::TimePointZero);
+      const auto& q = transform.transform.rotation;
+      const auto& t = transform.transform.translation;
+      Eigen::Matrix3d rotation = Eigen::Quaterniond(q.w, q.x, q.y, q.z).toRotationMatrix();
+      points = (rotation * points).colwise() + Eigen::Vector3d(t.x, t.y, t.z);
     }
+    catch (tf2::TransformException& ex)
+    {
+      RCLCPP_ERROR(LOGGER, "%s", ex.what());
+      rclcpp::sleep_for(std::chrono::seconds(1));
+      // No point can be transformed
+      line_point_count = 0;
+    }
+  }
+
+  // Copy valid points into the cloud
+  for (size_t i = 0; i < line_point_count; ++i)
+  {
+    (cloud_iter + i)[X] = points(X, i);
+    (cloud_iter + i)[Y] = points(Y, i);
+    (cloud_iter + i)[Z] = points(Z, i);
   }
 
   // Resize clouds
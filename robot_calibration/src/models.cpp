@@ -18,6 +18,7 @@
 
 // Author: Michael Ferguson
 
+#include <algorithm>
 #include <iostream>
 #include <robot_calibration/models/chain3d.hpp>
 #include <robot_calibration/models/camera2d.hpp>
@@ -27,18 +28,187 @@
 namespace robot_calibration
 {
 
-double positionFromMsg(const std::string& name,
-                       const sensor_msgs::msg::JointState& msg)
+int indexFromMsg(const std::string& name,
+                 const sensor_msgs::msg::JointState& msg)
 {
   for (size_t i = 0; i < msg.name.size(); ++i)
   {
     if (msg.name[i] == name)
-      return msg.position[i];
+      return i;
   }
 
   std::cerr << "Unable to find " << name << " in sensor_msgs::JointState" << std::endl;
 
-  return 0.0;
+  return -1;
+}
+
+double positionFromMsg(int index,
+                       const sensor_msgs::msg::JointState& msg)
+{
+  if (index < 0 || static_cast<size_t>(index) >= msg.position.size())
+    return 0.0;
+  return msg.position[index];
+}
+
+Eigen::Isometry3d toEigen(const KDL::Frame& frame)
+{
+  Eigen::Isometry3d iso = Eigen::Isometry3d::Identity();
+  for (int i = 0; i < 3; ++i)
+  {
+    iso.translation()(i) = frame.p(i);
+    for (int j = 0; j < 3; ++j)
+      iso.linear()(i, j) = frame.M(i, j);
+  }
+  return iso;
+}
+
+/** @brief Rotation about a (unit) axis, usable with Jets. */
+template <typename T>
+Eigen::Matrix<T, 3, 3> rotationAboutAxis(const Eigen::Vector3d& axis, const T& angle)
+{
+  using std::cos;
+  using std::sin;
+  T c = cos(angle);
+  T s = sin(angle);
+  T v = T(1.0) - c;
+
+  Eigen::Matrix<T, 3, 3> r;
+  r(0, 0) = axis(0) * axis(0) * v + c;
+  r(0, 1) = axis(0) * axis(1) * v - axis(2) * s;
+  r(0, 2) = axis(0) * axis(2) * v + axis(1) * s;
+  r(1, 0) = axis(0) * axis(1) * v + axis(2) * s;
+  r(1, 1) = axis(1) * axis(1) * v + c;
+  r(1, 2) = axis(1) * axis(2) * v - axis(0) * s;
+  r(2, 0) = axis(0) * axis(2) * v - axis(1) * s;
+  r(2, 1) = axis(1) * axis(2) * v + axis(0) * s;
+  r(2, 2) = axis(2) * axis(2) * v + c;
+  return r;
+}
+
+/** @brief Skew symmetric matrix, such that skew(a) * b is the cross product. */
+static Eigen::Matrix3d skew(const Eigen::Vector3d& a)
+{
+  Eigen::Matrix3d m;
+  m <<   0.0, -a(2),  a(1),
+        a(2),   0.0, -a(0),
+       -a(1),  a(0),   0.0;
+  return m;
+}
+
+/**
+ *  @brief Get a frame offset, and its derivative with respect to each of
+ *         its free parameters.
+ *  @returns False if the frame is not being calibrated.
+ */
+static bool getFrameDerivatives(const OffsetsView& offsets,
+                                const FrameHandle& frame,
+                                Transform<double>& offset,
+                                std::vector<TransformDerivative>& derivatives)
+{
+  derivatives.clear();
+  if (!offsets.getFrame(frame, offset))
+  {
+    offset.setIdentity();
+    return false;
+  }
+
+  const OptimizationOffsets& parser = offsets.getOffsets();
+  for (int k = 0; k < 3; ++k)
+  {
+    if (parser.getBlock(frame.params[k]) >= 0)
+    {
+      TransformDerivative d;
+      d.param = frame.params[k];
+      d.rotation.setZero();
+      d.translation = Eigen::Vector3d::Unit(k);
+      derivatives.push_back(d);
+    }
+  }
+
+  // Only the conversion from angle-axis is differentiated, with a small Jet
+  using AngleJet = ceres::Jet<double, 3>;
+  AngleJet angle_axis[3];
+  bool free_rotation = false;
+  for (int k = 0; k < 3; ++k)
+  {
+    angle_axis[k] = AngleJet(offsets.get(frame.params[3 + k]), k);
+    free_rotation |= (parser.getBlock(frame.params[3 + k]) >= 0);
+  }
+  if (free_rotation)
+  {
+    Eigen::Matrix<AngleJet, 3, 3> rotation;
+    ceres::AngleAxisToRotationMatrix(angle_axis, rotation.data());
+    for (int k = 0; k < 3; ++k)
+    {
+      if (parser.getBlock(frame.params[3 + k]) < 0)
+        continue;
+
+      TransformDerivative d;
+      d.param = frame.params[3 + k];
+      for (int i = 0; i < 3; ++i)
+      {
+        for (int j = 0; j < 3; ++j)
+          d.rotation(i, j) = rotation(i, j).v[k];
+      }
+      d.translation.setZero();
+      derivatives.push_back(d);
+    }
+  }
+
+  return true;
+}
+
+/**
+ *  @brief Append a transform to another, updating the derivatives.
+ *  @param transform The transform, which becomes transform * (rotation, translation).
+ *  @param derivatives The derivatives of the transform, which are updated.
+ *  @param local The derivatives of the appended rotation and translation.
+ */
+static void appendTransform(Transform<double>& transform,
+                            std::vector<TransformDerivative>& derivatives,
+                            const Eigen::Matrix3d& rotation,
+                            const Eigen::Vector3d& translation,
+                            const std::vector<TransformDerivative>& local)
+{
+  for (auto& d : derivatives)
+  {
+    d.translation += d.rotation * translation;
+    d.rotation = d.rotation * rotation;
+  }
+
+  const Eigen::Matrix3d r = transform.linear();
+  for (const auto& l : local)
+  {
+    auto d = std::find_if(derivatives.begin(), derivatives.end(),
+                          [&l](const TransformDerivative& x) { return x.param.slot == l.param.slot; });
+    if (d == derivatives.end())
+    {
+      TransformDerivative appended;
+      appended.param = l.param;
+      appended.rotation = r * l.rotation;
+      appended.translation = r * l.translation;
+      derivatives.push_back(appended);
+    }
+    else
+    {
+      d->rotation += r * l.rotation;
+      d->translation += r * l.translation;
+    }
+  }
+
+  transform.translation() += r * translation;
+  transform.linear() = r * rotation;
+}
+
+int ProjectionJacobian::getColumn(const ParamHandle& param)
+{
+  for (size_t i = 0; i < params.size(); ++i)
+  {
+    if (params[i].slot == param.slot)
+      return i;
+  }
+  params.push_back(param);
+  return params.size() - 1;
 }
 
 Chain3dModel::Chain3dModel(const std::string& name, KDL::Tree model, std::string root, std::string tip) :
@@ -51,96 +221,595 @@ Chain3dModel::Chain3dModel(const std::string& name, KDL::Tree model, std::string
     //ROS_ERROR("%s", error_msg.c_str());
     throw std::runtime_error(error_msg);
   }
+
+  // Extract the segments
+  for (size_t i = 0; i < chain_.getNrOfSegments(); ++i)
+  {
+    const KDL::Segment& kdl_segment = chain_.getSegment(i);
+    const KDL::Joint& joint = kdl_segment.getJoint();
+
+    ChainSegment segment;
+    switch (joint.getType())
+    {
+      case KDL::Joint::RotAxis:
+      case KDL::Joint::RotX:
+      case KDL::Joint::RotY:
+      case KDL::Joint::RotZ:
+        segment.type = ChainSegment::ROTATIONAL;
+        break;
+      case KDL::Joint::TransAxis:
+      case KDL::Joint::TransX:
+      case KDL::Joint::TransY:
+      case KDL::Joint::TransZ:
+        segment.type = ChainSegment::TRANSLATIONAL;
+        break;
+      default:
+        segment.type = ChainSegment::FIXED;
+        break;
+    }
+    segment.joint_name = joint.getName();
+    // NOTE: kdl_parser always creates joints with unit scale and no offset
+    segment.joint_axis = Eigen::Vector3d(joint.JointAxis().x(), joint.JointAxis().y(), joint.JointAxis().z());
+    segment.joint_origin = Eigen::Vector3d(joint.JointOrigin().x(), joint.JointOrigin().y(), joint.JointOrigin().z());
+    segment.frame_to_tip = toEigen(kdl_segment.getFrameToTip());
+    segment.joint_to_tip = toEigen(joint.pose(0.0).Inverse() * kdl_segment.getFrameToTip());
+    segments_.push_back(segment);
+  }
 }
 
 std::vector<geometry_msgs::msg::PointStamped> Chain3dModel::project(
     const robot_calibration_msgs::msg::CalibrationData& data,
-    const OptimizationOffsets& offsets)
+    const OffsetsView& offsets) const
 {
   // Projected points, to be returned
   std::vector<geometry_msgs::msg::PointStamped> points;
 
-  // Determine which observation to use
-  int sensor_idx = getSensorIndex(data, name_);
-  if (sensor_idx < 0)
+  Matrix3X<double> projected;
+  if (!project(data, offsets, projected))
   {
     // TODO: any sort of error message?
     return points;
   }
 
-  // Resize to match # of features
-  points.resize(data.observations[sensor_idx].features.size());
-
-  // Get the projection from forward kinematics of the robot chain
-  KDL::Frame fk = getChainFK(offsets, data.joint_states);
-
-  // Project each individual point
+  points.resize(projected.cols());
   for (size_t i = 0; i < points.size(); ++i)
   {
     points[i].header.frame_id = root_;  // fk returns point in root_ frame
+    points[i].point.x = projected(0, i);
+    points[i].point.y = projected(1, i);
+    points[i].point.z = projected(2, i);
+  }
+
+  return points;
+}
+
+bool Chain3dModel::project(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points) const
+{
+  ChainPlan plan;
+  compile(data, offsets.getOffsets(), plan);
+  return projectCompiled(data, plan, offsets, points);
+}
+
+bool Chain3dModel::project(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const JetOffsetsView& offsets,
+    Matrix3X<Jet>& points) const
+{
+  ChainPlan plan;
+  compile(data, offsets.getOffsets(), plan);
+  return projectCompiled(data, plan, offsets, points);
+}
 
-    KDL::Frame p(KDL::Frame::Identity());
-    p.p.x(data.observations[sensor_idx].features[i].point.x);
-    p.p.y(data.observations[sensor_idx].features[i].point.y);
-    p.p.z(data.observations[sensor_idx].features[i].point.z);
+bool Chain3dModel::project(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points) const
+{
+  if (plan.offsets_revision != offsets.getOffsets().getRevision())
+  {
+    // Offsets have changed since the plan was compiled
+    return project(data, offsets, points);
+  }
+  return projectCompiled(data, plan, offsets, points);
+}
 
-    // This is primarily for the case of checkerboards
-    //   The observation is in "checkerboard" frame, but the tip of the
-    //   kinematic chain is typically something like "wrist_roll_link".
-    if (data.observations[sensor_idx].features[i].header.frame_id != tip_)
+bool Chain3dModel::project(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const JetOffsetsView& offsets,
+    Matrix3X<Jet>& points) const
+{
+  if (plan.offsets_revision != offsets.getOffsets().getRevision())
+  {
+    // Offsets have changed since the plan was compiled
+    return project(data, offsets, points);
+  }
+  return projectCompiled(data, plan, offsets, points);
+}
+
+bool Chain3dModel::compile(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const OptimizationOffsets& offsets,
+    ChainPlan& plan) const
+{
+  compileChain(data.joint_states, offsets, plan);
+
+  // Determine which observation to use
+  plan.sensor_index = getSensorIndex(data, name_);
+  plan.feature_groups.clear();
+  if (plan.sensor_index < 0)
+  {
+    plan.features.resize(3, 0);
+    return false;
+  }
+
+  const auto& features = data.observations[plan.sensor_index].features;
+  plan.features.resize(3, features.size());
+  for (size_t i = 0; i < features.size(); ++i)
+  {
+    plan.features(0, i) = features[i].point.x;
+    plan.features(1, i) = features[i].point.y;
+    plan.features(2, i) = features[i].point.z;
+
+    // Features are typically all in the same frame, so start a new
+    // group only when the frame changes
+    if (i == 0 || features[i].header.frame_id != features[i - 1].header.frame_id)
     {
-      KDL::Frame p2(KDL::Frame::Identity());
-      if (offsets.getFrame(data.observations[sensor_idx].features[i].header.frame_id, p2))
+      ChainPlan::FeatureGroup group;
+      // This is primarily for the case of checkerboards
+      //   The observation is in "checkerboard" frame, but the tip of the
+      //   kinematic chain is typically something like "wrist_roll_link".
+      if (features[i].header.frame_id != tip_)
       {
-        // We have to apply the frame offset before the FK projection
-        p = p2 * p;
+        group.frame = offsets.getFrameHandle(features[i].header.frame_id);
       }
+      group.begin = i;
+      plan.feature_groups.push_back(group);
     }
+    plan.feature_groups.back().end = i + 1;
+  }
 
-    // Apply the FK projection
-    p = fk * p;
+  return true;
+}
 
-    points[i].point.x = p.p.x();
-    points[i].point.y = p.p.y();
-    points[i].point.z = p.p.z();
+void Chain3dModel::compileChain(
+    const sensor_msgs::msg::JointState& state,
+    const OptimizationOffsets& offsets,
+    ChainPlan& plan) const
+{
+  plan.offsets_revision = offsets.getRevision();
+  plan.segments.resize(segments_.size());
+  for (size_t i = 0; i < segments_.size(); ++i)
+  {
+    const ChainSegment& segment = segments_[i];
+    ChainPlan::Segment& compiled = plan.segments[i];
+    compiled.joint_index = -1;
+    compiled.offset = ParamHandle();
+    if (segment.type != ChainSegment::FIXED)
+    {
+      compiled.joint_index = indexFromMsg(segment.joint_name, state);
+      compiled.offset = offsets.getParamHandle(segment.joint_name);
+    }
+    compiled.frame = offsets.getFrameHandle(segment.joint_name);
   }
 
-  return points;
+  // Fold each run of segments which do not depend on any free parameter,
+  // so that evaluation only steps through the segments being calibrated
+  OffsetsView stored(offsets);
+  size_t run_end = segments_.size();
+  Eigen::Matrix3d run_rotation = Eigen::Matrix3d::Identity();
+  Eigen::Vector3d run_position = Eigen::Vector3d::Zero();
+  for (size_t i = segments_.size(); i-- > 0; )
+  {
+    ChainPlan::Segment& compiled = plan.segments[i];
+    bool constant = segments_[i].type == ChainSegment::FIXED || offsets.getBlock(compiled.offset) < 0;
+    for (int k = 0; compiled.frame.valid && k < 6; ++k)
+    {
+      constant = constant && offsets.getBlock(compiled.frame.params[k]) < 0;
+    }
+
+    if (!constant)
+    {
+      compiled.run_end = 0;
+      run_end = i;
+      run_rotation.setIdentity();
+      run_position.setZero();
+      continue;
+    }
+
+    Eigen::Matrix3d rotation;
+    Eigen::Vector3d position;
+    getSegmentPose(i, compiled, stored, state, rotation, position);
+    run_position = position + rotation * run_position;
+    run_rotation = rotation * run_rotation;
+    compiled.run_end = run_end;
+    compiled.run_rotation = run_rotation;
+    compiled.run_position = run_position;
+  }
+}
+
+template <typename T>
+void Chain3dModel::getSegmentPose(size_t i,
+                                  const ChainPlan::Segment& compiled,
+                                  const OffsetsViewT<T>& offsets,
+                                  const sensor_msgs::msg::JointState& state,
+                                  Eigen::Matrix<T, 3, 3>& rotation,
+                                  Eigen::Matrix<T, 3, 1>& position) const
+{
+  const ChainSegment& segment = segments_[i];
+
+  Transform<T> correction = Transform<T>::Identity();
+  offsets.getFrame(compiled.frame, correction);
+
+  // Pose of the segment, at the current joint position
+  Eigen::Matrix<T, 3, 3> pose_rotation;
+  Eigen::Matrix<T, 3, 1> pose_position;
+  if (segment.type == ChainSegment::ROTATIONAL)
+  {
+    // Apply any joint offset calibration
+    T p = T(positionFromMsg(compiled.joint_index, state)) + offsets.get(compiled.offset);
+    Eigen::Matrix<T, 3, 3> joint_rotation = rotationAboutAxis(segment.joint_axis, p);
+    pose_rotation = joint_rotation * segment.joint_to_tip.linear().cast<T>();
+    pose_position = joint_rotation * segment.joint_to_tip.translation().cast<T>() +
+                    segment.joint_origin.cast<T>();
+  }
+  else if (segment.type == ChainSegment::TRANSLATIONAL)
+  {
+    // Apply any joint offset calibration
+    T p = T(positionFromMsg(compiled.joint_index, state)) + offsets.get(compiled.offset);
+    pose_rotation = segment.joint_to_tip.linear().cast<T>();
+    pose_position = segment.joint_to_tip.translation().cast<T>() +
+                    segment.joint_origin.cast<T>() +
+                    segment.joint_axis.cast<T>() * p;
+  }
+  else
+  {
+    pose_rotation = segment.frame_to_tip.linear().cast<T>();
+    pose_position = segment.frame_to_tip.translation().cast<T>();
+  }
+
+  Eigen::Matrix<T, 3, 3> totip = segment.frame_to_tip.linear().cast<T>();
+
+  // Apply any frame calibration on the joint <origin> frame
+  position = pose_position + totip * correction.translation();
+  rotation = totip * correction.linear() * totip.transpose() * pose_rotation;
 }
 
-KDL::Frame Chain3dModel::getChainFK(const OptimizationOffsets& offsets,
-                                    const sensor_msgs::msg::JointState& state)
+bool Chain3dModel::projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points) const
+{
+  return projectChain(data, plan, offsets, points);
+}
+
+bool Chain3dModel::projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const JetOffsetsView& offsets,
+    Matrix3X<Jet>& points) const
+{
+  return projectChain(data, plan, offsets, points);
+}
+
+template <typename T>
+bool Chain3dModel::projectChain(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsViewT<T>& offsets,
+    Matrix3X<T>& points) const
+{
+  // Determine which observation to use
+  if (plan.sensor_index < 0)
+  {
+    return false;
+  }
+
+  // Resize to match # of features
+  points.resize(3, plan.features.cols());
+
+  // Get the projection from forward kinematics of the robot chain
+  Transform<T> fk = getChainFK(plan, offsets, data.joint_states);
+
+  // Project each group of points
+  for (const auto& group : plan.feature_groups)
+  {
+    Transform<T> projection = fk;
+    Transform<T> p2;
+    if (offsets.getFrame(group.frame, p2))
+    {
+      // We have to apply the frame offset before the FK projection
+      projection = fk * p2;
+    }
+
+    for (int i = group.begin; i < group.end; ++i)
+    {
+      points.col(i) = projection * plan.features.col(i).cast<T>();
+    }
+  }
+
+  return true;
+}
+
+template <typename T>
+Transform<T> Chain3dModel::getChainFK(const OffsetsViewT<T>& offsets,
+                                      const sensor_msgs::msg::JointState& state) const
+{
+  ChainPlan plan;
+  compileChain(state, offsets.getOffsets(), plan);
+  return getChainFK(plan, offsets, state);
+}
+
+template <typename T>
+Transform<T> Chain3dModel::getChainFK(const ChainPlan& plan,
+                                      const OffsetsViewT<T>& offsets,
+                                      const sensor_msgs::msg::JointState& state) const
 {
   // FK from root to tip
-  KDL::Frame p_out = KDL::Frame::Identity();
+  Eigen::Matrix<T, 3, 3> out_rotation = Eigen::Matrix<T, 3, 3>::Identity();
+  Eigen::Matrix<T, 3, 1> out_position = Eigen::Matrix<T, 3, 1>::Zero();
 
-  // Step through joints
-  for (size_t i = 0; i < chain_.getNrOfSegments(); ++i)
+  // Start from the segments shared with another model, if already computed
+  size_t start = 0;
+  SharedChainFK::State<T>* shared = nullptr;
+  if (plan.shared_fk && plan.shared_segments > 0 && plan.shared_segments <= segments_.size())
   {
-    std::string name = chain_.getSegment(i).getJoint().getName();
-    KDL::Frame correction = KDL::Frame::Identity();
-    offsets.getFrame(name, correction);
+    shared = &plan.shared_fk->get<T>();
+    if (shared->valid)
+    {
+      out_rotation = shared->rotation;
+      out_position = shared->position;
+      start = plan.shared_segments;
+      shared = nullptr;
+    }
+  }
 
-    KDL::Frame pose;
-    if (chain_.getSegment(i).getJoint().getType() != KDL::Joint::None)
+  // Step through joints, runs of constant segments are folded by compileChain()
+  for (size_t i = start; i < segments_.size(); )
+  {
+    const ChainPlan::Segment& compiled = plan.segments[i];
+
+    // Stop at the end of the shared segments, to store their FK
+    if (compiled.run_end > 0 && !(shared && plan.shared_segments > i && plan.shared_segments < compiled.run_end))
     {
-      // Apply any joint offset calibration
-      double p = positionFromMsg(name, state) + offsets.get(name);
-      pose = chain_.getSegment(i).pose(p);
+      out_position += out_rotation * compiled.run_position.cast<T>();
+      out_rotation = out_rotation * compiled.run_rotation.cast<T>();
+      i = compiled.run_end;
     }
     else
     {
-      pose = chain_.getSegment(i).pose(0.0);
+      Eigen::Matrix<T, 3, 3> rotation;
+      Eigen::Matrix<T, 3, 1> position;
+      getSegmentPose(i, compiled, offsets, state, rotation, position);
+      out_position += out_rotation * position;
+      out_rotation = out_rotation * rotation;
+      ++i;
+    }
+
+    if (shared && i == plan.shared_segments)
+    {
+      shared->rotation = out_rotation;
+      shared->position = out_position;
+      shared->valid = true;
     }
+  }
 
-    KDL::Frame totip = chain_.getSegment(i).getFrameToTip();
+  Transform<T> p_out = Transform<T>::Identity();
+  p_out.linear() = out_rotation;
+  p_out.translation() = out_position;
+  return p_out;
+}
 
-    // Apply any frame calibration on the joint <origin> frame
-    p_out = p_out * KDL::Frame(pose.p + totip.M * correction.p);
-    p_out = p_out * KDL::Frame(totip.M * correction.M * totip.M.Inverse() * pose.M);
+// Explicit instantiation, so that others can use the chain FK
+template Transform<double> Chain3dModel::getChainFK(const OffsetsViewT<double>& offsets,
+                                                    const sensor_msgs::msg::JointState& state) const;
+template Transform<Jet> Chain3dModel::getChainFK(const OffsetsViewT<Jet>& offsets,
+                                                 const sensor_msgs::msg::JointState& state) const;
+template Transform<double> Chain3dModel::getChainFK(const ChainPlan& plan,
+                                                    const OffsetsViewT<double>& offsets,
+                                                    const sensor_msgs::msg::JointState& state) const;
+template Transform<Jet> Chain3dModel::getChainFK(const ChainPlan& plan,
+                                                 const OffsetsViewT<Jet>& offsets,
+                                                 const sensor_msgs::msg::JointState& state) const;
+
+size_t Chain3dModel::getSharedSegments(const Chain3dModel& other) const
+{
+  if (root_ != other.root_)
+  {
+    return 0;
+  }
 
+  size_t i = 0;
+  while (i < segments_.size() && i < other.segments_.size() &&
+         chain_.getSegment(i).getName() == other.chain_.getSegment(i).getName() &&
+         segments_[i].joint_name == other.segments_[i].joint_name)
+  {
+    ++i;
+  }
+  return i;
+}
+
+void shareChainFK(const Chain3dModel& a_model, ChainPlan& a_plan,
+                  const Chain3dModel& b_model, ChainPlan& b_plan,
+                  SharedChainFK& fk)
+{
+  size_t shared = a_model.getSharedSegments(b_model);
+  a_plan.shared_segments = b_plan.shared_segments = shared;
+  a_plan.shared_fk = b_plan.shared_fk = (shared > 0) ? &fk : nullptr;
+}
+
+bool Chain3dModel::hasAnalyticJacobian(const ChainPlan&, const OptimizationOffsets&) const
+{
+  return true;
+}
+
+bool Chain3dModel::projectWithJacobian(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points,
+    ProjectionJacobian& jacobian) const
+{
+  if (plan.offsets_revision != offsets.getOffsets().getRevision())
+  {
+    // Offsets have changed since the plan was compiled
+    ChainPlan current;
+    compile(data, offsets.getOffsets(), current);
+    return projectWithJacobian(data, current, offsets, points, jacobian);
+  }
+
+  if (!hasAnalyticJacobian(plan, offsets.getOffsets()))
+  {
+    return false;
+  }
+  return projectCompiledWithJacobian(data, plan, offsets, points, jacobian);
+}
+
+bool Chain3dModel::projectCompiledWithJacobian(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points,
+    ProjectionJacobian& jacobian) const
+{
+  if (plan.sensor_index < 0)
+  {
+    return false;
+  }
+
+  Transform<double> fk;
+  std::vector<TransformDerivative> fk_derivatives;
+  getChainFKDerivatives(plan, offsets, data.joint_states, fk, fk_derivatives);
+
+  // Apply the frame offset of each group of points before the FK projection
+  std::vector<Transform<double>> projections(plan.feature_groups.size(), fk);
+  std::vector<std::vector<TransformDerivative>> derivatives(plan.feature_groups.size(), fk_derivatives);
+  std::vector<std::vector<int>> columns(plan.feature_groups.size());
+  std::vector<TransformDerivative> frame_derivatives;
+  jacobian.params.clear();
+  for (size_t g = 0; g < plan.feature_groups.size(); ++g)
+  {
+    Transform<double> p2;
+    if (getFrameDerivatives(offsets, plan.feature_groups[g].frame, p2, frame_derivatives))
+    {
+      appendTransform(projections[g], derivatives[g], p2.linear(), p2.translation(), frame_derivatives);
+    }
+    for (const auto& d : derivatives[g])
+    {
+      columns[g].push_back(jacobian.getColumn(d.param));
+    }
+  }
+
+  points.resize(3, plan.features.cols());
+  jacobian.jacobian.setZero(3 * plan.features.cols(), jacobian.params.size());
+  for (size_t g = 0; g < plan.feature_groups.size(); ++g)
+  {
+    const ChainPlan::FeatureGroup& group = plan.feature_groups[g];
+    for (int i = group.begin; i < group.end; ++i)
+    {
+      const Eigen::Vector3d feature = plan.features.col(i);
+      points.col(i) = projections[g] * feature;
+      for (size_t k = 0; k < derivatives[g].size(); ++k)
+      {
+        jacobian.jacobian.block<3, 1>(3 * i, columns[g][k]) =
+          derivatives[g][k].rotation * feature + derivatives[g][k].translation;
+      }
+    }
+  }
+
+  return true;
+}
+
+void Chain3dModel::getChainFKDerivatives(const ChainPlan& plan,
+                                         const OffsetsView& offsets,
+                                         const sensor_msgs::msg::JointState& state,
+                                         Transform<double>& fk,
+                                         std::vector<TransformDerivative>& derivatives) const
+{
+  const OptimizationOffsets& parser = offsets.getOffsets();
+  fk.setIdentity();
+  derivatives.clear();
+
+  // Same steps as getChainFK(), each segment is appended along with the
+  // derivatives of its pose with respect to its joint and frame offsets
+  std::vector<TransformDerivative> frame_derivatives;
+  std::vector<TransformDerivative> local;
+  for (size_t i = 0; i < segments_.size(); ++i)
+  {
+    const ChainSegment& segment = segments_[i];
+    const ChainPlan::Segment& compiled = plan.segments[i];
+
+    // Runs of constant segments have no derivatives of their own
+    if (compiled.run_end > 0)
+    {
+      local.clear();
+      appendTransform(fk, derivatives, compiled.run_rotation, compiled.run_position, local);
+      i = compiled.run_end - 1;
+      continue;
+    }
+
+    Transform<double> correction;
+    getFrameDerivatives(offsets, compiled.frame, correction, frame_derivatives);
+
+    // Pose of the segment, at the current joint position, and its
+    // derivative with respect to the joint offset
+    Eigen::Matrix3d pose_rotation;
+    Eigen::Vector3d pose_position;
+    Eigen::Matrix3d d_pose_rotation = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d d_pose_position = Eigen::Vector3d::Zero();
+    if (segment.type == ChainSegment::ROTATIONAL)
+    {
+      double p = positionFromMsg(compiled.joint_index, state) + offsets.get(compiled.offset);
+      Eigen::Matrix3d joint_rotation = rotationAboutAxis(segment.joint_axis, p);
+      pose_rotation = joint_rotation * segment.joint_to_tip.linear();
+      pose_position = joint_rotation * segment.joint_to_tip.translation() + segment.joint_origin;
+      d_pose_rotation = skew(segment.joint_axis) * pose_rotation;
+      d_pose_position = skew(segment.joint_axis) * joint_rotation * segment.joint_to_tip.translation();
+    }
+    else if (segment.type == ChainSegment::TRANSLATIONAL)
+    {
+      double p = positionFromMsg(compiled.joint_index, state) + offsets.get(compiled.offset);
+      pose_rotation = segment.joint_to_tip.linear();
+      pose_position = segment.joint_to_tip.translation() + segment.joint_origin +
+                      segment.joint_axis * p;
+      d_pose_position = segment.joint_axis;
+    }
+    else
+    {
+      pose_rotation = segment.frame_to_tip.linear();
+      pose_position = segment.frame_to_tip.translation();
+    }
+
+    // Frame calibration is applied on the joint <origin> frame
+    const Eigen::Matrix3d totip = segment.frame_to_tip.linear();
+    const Eigen::Matrix3d rotation = totip * correction.linear() * totip.transpose();
+
+    local.clear();
+    if (segment.type != ChainSegment::FIXED && parser.getBlock(compiled.offset) >= 0)
+    {
+      TransformDerivative d;
+      d.param = compiled.offset;
+      d.rotation = rotation * d_pose_rotation;
+      d.translation = d_pose_position;
+      local.push_back(d);
+    }
+    for (const auto& frame : frame_derivatives)
+    {
+      TransformDerivative d;
+      d.param = frame.param;
+      d.rotation = totip * frame.rotation * totip.transpose() * pose_rotation;
+      d.translation = totip * frame.translation;
+      local.push_back(d);
+    }
+
+    appendTransform(fk, derivatives, rotation * pose_rotation,
+                    pose_position + totip * correction.translation(), local);
   }
-  return p_out;
 }
 
 std::string Chain3dModel::getName() const
@@ -160,90 +829,201 @@ Camera3dModel::Camera3dModel(const std::string& name, const std::string& param_n
   // TODO add additional parameters for unprojecting observations using initial parameters
 }
 
-std::vector<geometry_msgs::msg::PointStamped> Camera3dModel::project(
+bool Camera3dModel::compile(
     const robot_calibration_msgs::msg::CalibrationData& data,
-    const OptimizationOffsets& offsets)
+    const OptimizationOffsets& offsets,
+    ChainPlan& plan) const
 {
-  std::vector<geometry_msgs::msg::PointStamped> points;
+  bool has_sensor = Chain3dModel::compile(data, offsets, plan);
 
-  // Determine which observation to use
-  int sensor_idx = getSensorIndex(data, name_);
-  if (sensor_idx < 0)
+  plan.params.resize(NUM_PARAMS);
+  plan.params[PARAM_FX] = offsets.getParamHandle(param_name_ + "_fx");
+  plan.params[PARAM_FY] = offsets.getParamHandle(param_name_ + "_fy");
+  plan.params[PARAM_CX] = offsets.getParamHandle(param_name_ + "_cx");
+  plan.params[PARAM_CY] = offsets.getParamHandle(param_name_ + "_cy");
+  plan.params[PARAM_Z_OFFSET] = offsets.getParamHandle(param_name_ + "_z_offset");
+  plan.params[PARAM_Z_SCALING] = offsets.getParamHandle(param_name_ + "_z_scaling");
+
+  if (!has_sensor)
   {
-    // TODO: any sort of error message?
-    return points;
+    plan.measurements.resize(3, 0);
+    return false;
   }
+  const auto& observation = data.observations[plan.sensor_index];
 
   // Get existing camera info
-  if (data.observations[sensor_idx].ext_camera_info.camera_info.p.size() != 12)
+  if (observation.ext_camera_info.camera_info.p.size() != 12)
     std::cerr << "Unexpected CameraInfo projection matrix size" << std::endl;
 
-  double camera_fx = data.observations[sensor_idx].ext_camera_info.camera_info.p[CAMERA_INFO_P_FX_INDEX];
-  double camera_fy = data.observations[sensor_idx].ext_camera_info.camera_info.p[CAMERA_INFO_P_FY_INDEX];
-  double camera_cx = data.observations[sensor_idx].ext_camera_info.camera_info.p[CAMERA_INFO_P_CX_INDEX];
-  double camera_cy = data.observations[sensor_idx].ext_camera_info.camera_info.p[CAMERA_INFO_P_CY_INDEX];
+  plan.constants.resize(NUM_PARAMS);
+  plan.constants[PARAM_FX] = observation.ext_camera_info.camera_info.p[CAMERA_INFO_P_FX_INDEX];
+  plan.constants[PARAM_FY] = observation.ext_camera_info.camera_info.p[CAMERA_INFO_P_FY_INDEX];
+  plan.constants[PARAM_CX] = observation.ext_camera_info.camera_info.p[CAMERA_INFO_P_CX_INDEX];
+  plan.constants[PARAM_CY] = observation.ext_camera_info.camera_info.p[CAMERA_INFO_P_CY_INDEX];
 
   /*
    * z_scale and z_offset defined in openni2_camera/src/openni2_driver.cpp
    * new_depth_mm = (depth_mm + z_offset_mm) * z_scale
    * NOTE: these work on integer values not floats
    */
-  double z_offset = 0.0;
-  double z_scaling = 1.0;
-  for (size_t i = 0; i < data.observations[sensor_idx].ext_camera_info.parameters.size(); i++)
+  plan.constants[PARAM_Z_OFFSET] = 0.0;
+  plan.constants[PARAM_Z_SCALING] = 1.0;
+  for (size_t i = 0; i < observation.ext_camera_info.parameters.size(); i++)
   {
-    if (data.observations[sensor_idx].ext_camera_info.parameters[i].name == "z_scaling")
+    if (observation.ext_camera_info.parameters[i].name == "z_scaling")
     {
-      z_scaling = data.observations[sensor_idx].ext_camera_info.parameters[i].value;
+      plan.constants[PARAM_Z_SCALING] = observation.ext_camera_info.parameters[i].value;
     }
-    else if (data.observations[sensor_idx].ext_camera_info.parameters[i].name == "z_offset_mm")
+    else if (observation.ext_camera_info.parameters[i].name == "z_offset_mm")
     {
-      z_offset = data.observations[sensor_idx].ext_camera_info.parameters[i].value / 1000.0;  // (mm -> m)
+      plan.constants[PARAM_Z_OFFSET] = observation.ext_camera_info.parameters[i].value / 1000.0;  // (mm -> m)
     }
   }
 
-  // Get calibrated camera info
-  double new_camera_fx = camera_fx * (1.0 + offsets.get(param_name_ + "_fx"));
-  double new_camera_fy = camera_fy * (1.0 + offsets.get(param_name_ + "_fy"));
-  double new_camera_cx = camera_cx * (1.0 + offsets.get(param_name_ + "_cx"));
-  double new_camera_cy = camera_cy * (1.0 + offsets.get(param_name_ + "_cy"));
-  double new_z_offset = offsets.get(param_name_ + "_z_offset");
-  double new_z_scaling = 1.0 + offsets.get(param_name_ + "_z_scaling");
+  // Unproject through parameters stored at runtime, these do not
+  // change during optimization
+  plan.measurements.resize(3, plan.features.cols());
+  for (int i = 0; i < plan.features.cols(); ++i)
+  {
+    double x = plan.features(0, i);
+    double y = plan.features(1, i);
+    double z = plan.features(2, i);
+    plan.measurements(0, i) = x * plan.constants[PARAM_FX] / z + plan.constants[PARAM_CX];
+    plan.measurements(1, i) = y * plan.constants[PARAM_FY] / z + plan.constants[PARAM_CY];
+    plan.measurements(2, i) = z / plan.constants[PARAM_Z_SCALING] - plan.constants[PARAM_Z_OFFSET];
+  }
 
-  points.resize(data.observations[sensor_idx].features.size());
+  return true;
+}
 
-  // Get position of camera frame
-  KDL::Frame fk = getChainFK(offsets, data.joint_states);
+bool Camera3dModel::projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points) const
+{
+  return projectCamera(data, plan, offsets, points);
+}
 
-  for (size_t i = 0; i < points.size(); ++i)
+bool Camera3dModel::projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const JetOffsetsView& offsets,
+    Matrix3X<Jet>& points) const
+{
+  return projectCamera(data, plan, offsets, points);
+}
+
+template <typename T>
+bool Camera3dModel::projectCamera(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsViewT<T>& offsets,
+    Matrix3X<T>& points) const
+{
+  // Determine which observation to use
+  if (plan.sensor_index < 0)
   {
-    // TODO: warn if frame_id != tip?
-    double x = data.observations[sensor_idx].features[i].point.x;
-    double y = data.observations[sensor_idx].features[i].point.y;
-    double z = data.observations[sensor_idx].features[i].point.z;
+    // TODO: any sort of error message?
+    return false;
+  }
+
+  // Get calibrated camera info, existing camera info is from compile()
+  T new_camera_fx = plan.constants[PARAM_FX] * (T(1.0) + offsets.get(plan.params[PARAM_FX]));
+  T new_camera_fy = plan.constants[PARAM_FY] * (T(1.0) + offsets.get(plan.params[PARAM_FY]));
+  T new_camera_cx = plan.constants[PARAM_CX] * (T(1.0) + offsets.get(plan.params[PARAM_CX]));
+  T new_camera_cy = plan.constants[PARAM_CY] * (T(1.0) + offsets.get(plan.params[PARAM_CY]));
+  T new_z_offset = offsets.get(plan.params[PARAM_Z_OFFSET]);
+  T new_z_scaling = T(1.0) + offsets.get(plan.params[PARAM_Z_SCALING]);
+  T inv_camera_fx = T(1.0) / new_camera_fx;
+  T inv_camera_fy = T(1.0) / new_camera_fy;
 
-    // Unproject through parameters stored at runtime
-    double u = x * camera_fx / z + camera_cx;
-    double v = y * camera_fy / z + camera_cy;
-    double depth = z/z_scaling - z_offset;
+  points.resize(3, plan.measurements.cols());
 
-    KDL::Frame pt(KDL::Frame::Identity());
+  // Get position of camera frame
+  Transform<T> fk = getChainFK(plan, offsets, data.joint_states);
+
+  for (int i = 0; i < plan.measurements.cols(); ++i)
+  {
+    // TODO: warn if frame_id != tip?
+    // Pixel and depth, unprojected in compile()
+    double u = plan.measurements(0, i);
+    double v = plan.measurements(1, i);
+    double depth = plan.measurements(2, i);
 
     // Reproject through new calibrated parameters
-    pt.p.z((depth + new_z_offset) * new_z_scaling);
-    pt.p.x((u - new_camera_cx) * pt.p.z() / new_camera_fx);
-    pt.p.y((v - new_camera_cy) * pt.p.z() / new_camera_fy);
+    Eigen::Matrix<T, 3, 1> pt;
+    pt(2) = (depth + new_z_offset) * new_z_scaling;
+    pt(0) = (u - new_camera_cx) * pt(2) * inv_camera_fx;
+    pt(1) = (v - new_camera_cy) * pt(2) * inv_camera_fy;
 
     // Project through fk
-    pt = fk * pt;
+    points.col(i) = fk * pt;
+  }
 
-    points[i].point.x = pt.p.x();
-    points[i].point.y = pt.p.y();
-    points[i].point.z = pt.p.z();
-    points[i].header.frame_id = root_;
+  return true;
+}
+
+bool Camera3dModel::hasAnalyticJacobian(const ChainPlan& plan,
+                                        const OptimizationOffsets& offsets) const
+{
+  for (const auto& param : plan.params)
+  {
+    if (offsets.getBlock(param) >= 0)
+      return false;
   }
+  return true;
+}
 
-  return points;
+bool Camera3dModel::projectCompiledWithJacobian(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const OffsetsView& offsets,
+    Matrix3X<double>& points,
+    ProjectionJacobian& jacobian) const
+{
+  if (plan.sensor_index < 0)
+  {
+    return false;
+  }
+
+  // Camera parameters are not free, see hasAnalyticJacobian(), but may
+  // have been calibrated by a previous step
+  double camera_fx = plan.constants[PARAM_FX] * (1.0 + offsets.get(plan.params[PARAM_FX]));
+  double camera_fy = plan.constants[PARAM_FY] * (1.0 + offsets.get(plan.params[PARAM_FY]));
+  double camera_cx = plan.constants[PARAM_CX] * (1.0 + offsets.get(plan.params[PARAM_CX]));
+  double camera_cy = plan.constants[PARAM_CY] * (1.0 + offsets.get(plan.params[PARAM_CY]));
+  double z_offset = offsets.get(plan.params[PARAM_Z_OFFSET]);
+  double z_scaling = 1.0 + offsets.get(plan.params[PARAM_Z_SCALING]);
+
+  Transform<double> fk;
+  std::vector<TransformDerivative> derivatives;
+  getChainFKDerivatives(plan, offsets, data.joint_states, fk, derivatives);
+
+  jacobian.params.clear();
+  for (const auto& d : derivatives)
+  {
+    jacobian.params.push_back(d.param);
+  }
+
+  points.resize(3, plan.measurements.cols());
+  jacobian.jacobian.setZero(3 * plan.measurements.cols(), jacobian.params.size());
+  for (int i = 0; i < plan.measurements.cols(); ++i)
+  {
+    // Reproject the pixel and depth, as in projectCamera()
+    Eigen::Vector3d pt;
+    pt(2) = (plan.measurements(2, i) + z_offset) * z_scaling;
+    pt(0) = (plan.measurements(0, i) - camera_cx) * pt(2) / camera_fx;
+    pt(1) = (plan.measurements(1, i) - camera_cy) * pt(2) / camera_fy;
+
+    points.col(i) = fk * pt;
+    for (size_t c = 0; c < derivatives.size(); ++c)
+    {
+      jacobian.jacobian.block<3, 1>(3 * i, c) = derivatives[c].rotation * pt + derivatives[c].translation;
+    }
+  }
+
+  return true;
 }
 
 std::string Camera3dModel::getType() const
@@ -258,83 +1038,200 @@ Camera2dModel::Camera2dModel(const std::string& name, const std::string& param_n
   // TODO add additional parameters for unprojecting observations using initial parameters
 }
 
-std::vector<geometry_msgs::msg::PointStamped> Camera2dModel::project(
+bool Camera2dModel::compile(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const OptimizationOffsets& offsets,
+    ChainPlan& plan) const
+{
+  bool has_sensor = Chain3dModel::compile(data, offsets, plan);
+
+  plan.params.resize(NUM_PARAMS);
+  plan.params[PARAM_FX] = offsets.getParamHandle(param_name_ + "_fx");
+  plan.params[PARAM_FY] = offsets.getParamHandle(param_name_ + "_fy");
+  plan.params[PARAM_CX] = offsets.getParamHandle(param_name_ + "_cx");
+  plan.params[PARAM_CY] = offsets.getParamHandle(param_name_ + "_cy");
+
+  if (!has_sensor)
+  {
+    return false;
+  }
+  const auto& observation = data.observations[plan.sensor_index];
+
+  // Get existing camera info
+  if (observation.ext_camera_info.camera_info.p.size() != 12)
+    std::cerr << "Unexpected CameraInfo projection matrix size" << std::endl;
+
+  plan.constants.resize(NUM_PARAMS);
+  plan.constants[PARAM_FX] = observation.ext_camera_info.camera_info.p[CAMERA_INFO_P_FX_INDEX];
+  plan.constants[PARAM_FY] = observation.ext_camera_info.camera_info.p[CAMERA_INFO_P_FY_INDEX];
+  plan.constants[PARAM_CX] = observation.ext_camera_info.camera_info.p[CAMERA_INFO_P_CX_INDEX];
+  plan.constants[PARAM_CY] = observation.ext_camera_info.camera_info.p[CAMERA_INFO_P_CY_INDEX];
+
+  return true;
+}
+
+bool Camera2dModel::projectCompiled(
     const robot_calibration_msgs::msg::CalibrationData&,
-    const OptimizationOffsets&)
+    const ChainPlan&,
+    const OffsetsView&,
+    Matrix3X<double>&) const
 {
   // TODO: just toss error?
-  std::vector<geometry_msgs::msg::PointStamped> points;
-  return points;
+  return false;
+}
+
+bool Camera2dModel::projectCompiled(
+    const robot_calibration_msgs::msg::CalibrationData&,
+    const ChainPlan&,
+    const JetOffsetsView&,
+    Matrix3X<Jet>&) const
+{
+  return false;
+}
+
+bool Camera2dModel::hasAnalyticJacobian(const ChainPlan&, const OptimizationOffsets&) const
+{
+  return false;
 }
 
 std::vector<geometry_msgs::msg::PointStamped> Camera2dModel::project_pixel_error(
     const robot_calibration_msgs::msg::CalibrationData& data,
     const std::vector<geometry_msgs::msg::PointStamped>& points,
-    const OptimizationOffsets& offsets)
+    const OffsetsView& offsets) const
 {
   std::vector<geometry_msgs::msg::PointStamped> pixels;
 
+  Matrix3X<double> world(3, points.size());
+  for (size_t i = 0; i < points.size(); ++i)
+  {
+    world(0, i) = points[i].point.x;
+    world(1, i) = points[i].point.y;
+    world(2, i) = points[i].point.z;
+  }
+
+  Matrix2X<double> error;
+  if (!project_pixel_error(data, world, offsets, error))
+  {
+    // TODO: error message?
+    return pixels;
+  }
+
+  pixels.resize(error.cols());
+  for (size_t i = 0; i < pixels.size(); ++i)
+  {
+    pixels[i].point.x = error(0, i);
+    pixels[i].point.y = error(1, i);
+  }
+
+  return pixels;
+}
+
+bool Camera2dModel::project_pixel_error(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const Matrix3X<double>& points,
+    const OffsetsView& offsets,
+    Matrix2X<double>& pixels) const
+{
+  ChainPlan plan;
+  compile(data, offsets.getOffsets(), plan);
+  return projectPixels(data, plan, points, offsets, pixels);
+}
+
+bool Camera2dModel::project_pixel_error(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const Matrix3X<Jet>& points,
+    const JetOffsetsView& offsets,
+    Matrix2X<Jet>& pixels) const
+{
+  ChainPlan plan;
+  compile(data, offsets.getOffsets(), plan);
+  return projectPixels(data, plan, points, offsets, pixels);
+}
+
+bool Camera2dModel::project_pixel_error(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const Matrix3X<double>& points,
+    const OffsetsView& offsets,
+    Matrix2X<double>& pixels) const
+{
+  if (plan.offsets_revision != offsets.getOffsets().getRevision())
+  {
+    // Offsets have changed since the plan was compiled
+    return project_pixel_error(data, points, offsets, pixels);
+  }
+  return projectPixels(data, plan, points, offsets, pixels);
+}
+
+bool Camera2dModel::project_pixel_error(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const Matrix3X<Jet>& points,
+    const JetOffsetsView& offsets,
+    Matrix2X<Jet>& pixels) const
+{
+  if (plan.offsets_revision != offsets.getOffsets().getRevision())
+  {
+    // Offsets have changed since the plan was compiled
+    return project_pixel_error(data, points, offsets, pixels);
+  }
+  return projectPixels(data, plan, points, offsets, pixels);
+}
+
+template <typename T>
+bool Camera2dModel::projectPixels(
+    const robot_calibration_msgs::msg::CalibrationData& data,
+    const ChainPlan& plan,
+    const Matrix3X<T>& points,
+    const OffsetsViewT<T>& offsets,
+    Matrix2X<T>& pixels) const
+{
   // Determine which observation to use
-  int sensor_idx = getSensorIndex(data, name_);
-  if (sensor_idx < 0)
+  if (plan.sensor_index < 0)
   {
     // TODO: any sort of error message?
-    return pixels;
+    return false;
   }
 
   // Make sure point count matches
-  if (points.size() != data.observations[sensor_idx].features.size())
+  if (points.cols() != plan.features.cols())
   {
     // TODO: error message?
-    return pixels;
+    return false;
   }
 
-  // Get existing camera info
-  if (data.observations[sensor_idx].ext_camera_info.camera_info.p.size() != 12)
-    std::cerr << "Unexpected CameraInfo projection matrix size" << std::endl;
-
-  double camera_fx = data.observations[sensor_idx].ext_camera_info.camera_info.p[CAMERA_INFO_P_FX_INDEX];
-  double camera_fy = data.observations[sensor_idx].ext_camera_info.camera_info.p[CAMERA_INFO_P_FY_INDEX];
-  double camera_cx = data.observations[sensor_idx].ext_camera_info.camera_info.p[CAMERA_INFO_P_CX_INDEX];
-  double camera_cy = data.observations[sensor_idx].ext_camera_info.camera_info.p[CAMERA_INFO_P_CY_INDEX];
+  // Existing camera info, from compile()
+  double camera_fx = plan.constants[PARAM_FX];
+  double camera_fy = plan.constants[PARAM_FY];
+  double camera_cx = plan.constants[PARAM_CX];
+  double camera_cy = plan.constants[PARAM_CY];
 
   // Get calibrated camera info
-  camera_fx *= (1.0 + offsets.get(param_name_ + "_fx"));
-  camera_fy *= (1.0 + offsets.get(param_name_ + "_fy"));
-  camera_cx *= (1.0 + offsets.get(param_name_ + "_cx"));
-  camera_cy *= (1.0 + offsets.get(param_name_ + "_cy"));
+  T new_camera_fx = camera_fx * (T(1.0) + offsets.get(plan.params[PARAM_FX]));
+  T new_camera_fy = camera_fy * (T(1.0) + offsets.get(plan.params[PARAM_FY]));
+  T new_camera_cx = camera_cx * (T(1.0) + offsets.get(plan.params[PARAM_CX]));
+  T new_camera_cy = camera_cy * (T(1.0) + offsets.get(plan.params[PARAM_CY]));
 
   // Get position of camera frame
-  KDL::Frame fk = getChainFK(offsets, data.joint_states);
+  Transform<T> fk_inverse = getChainFK(plan, offsets, data.joint_states).inverse(Eigen::Isometry);
 
   // Project world points into camera pixels
-  pixels.resize(data.observations[sensor_idx].features.size());
-  for (size_t i = 0; i < pixels.size(); ++i)
+  pixels.resize(2, points.cols());
+  for (int i = 0; i < points.cols(); ++i)
   {
     // Project point into camera frame, still in 3d
-    KDL::Frame pt(KDL::Frame::Identity());
-    pt.p.x(points[i].point.x);
-    pt.p.y(points[i].point.y);
-    pt.p.z(points[i].point.z);
-    pt = fk.Inverse() * pt;
+    Eigen::Matrix<T, 3, 1> pt = fk_inverse * points.col(i);
 
     // Project point into pixel space
-    double px = camera_fx * (pt.p.x() / pt.p.z());
-    double py = camera_fy * (pt.p.y() / pt.p.z());
+    T px = new_camera_fx * (pt(0) / pt(2));
+    T py = new_camera_fy * (pt(1) / pt(2));
 
-    // Add lens correction
-    pixels[i].point.x = px + camera_cx;
-    pixels[i].point.y = py + camera_cy;
+    // Add lens correction, and subtract observed pixel value to get error
+    pixels(0, i) = px + new_camera_cx - plan.features(0, i);
+    pixels(1, i) = py + new_camera_cy - plan.features(1, i);
   }
 
-  // Subtract observed pixel value to get error
-  for (size_t i = 0; i < pixels.size(); ++i)
-  {
-    pixels[i].point.x -= data.observations[sensor_idx].features[i].point.x;
-    pixels[i].point.y -= data.observations[sensor_idx].features[i].point.y;
-  }
-
-  return pixels;
+  return true;
 }
 
 std::string Camera2dModel::getType() const
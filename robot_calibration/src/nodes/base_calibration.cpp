@@ -20,6 +20,7 @@
 
 #include <cmath>
 #include <fstream>
+#include <thread>
 #include "robot_calibration/optimization/base_calibration.hpp"
 
 int main(int argc, char** argv)
@@ -30,6 +31,11 @@ int main(int argc, char** argv)
     std::make_shared<robot_calibration::BaseCalibration>();
   b->clearMessages();
 
+  // Callbacks and the velocity controller run in the background
+  rclcpp::executors::MultiThreadedExecutor executor;
+  executor.add_node(b);
+  std::thread executor_thread([&executor]() { executor.spin(); });
+
   bool verbose = b->declare_parameter<bool>("verbose", false);
 
   // Rotate at several different speeds
@@ -60,5 +66,8 @@ int main(int argc, char** argv)
     std::cout << cal;
   }
 
+  rclcpp::shutdown();
+  executor_thread.join();
+
   return 0;
 }
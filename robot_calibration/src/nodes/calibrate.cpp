@@ -18,18 +18,28 @@
 
 // Author: Michael Ferguson
 
+#include <algorithm>
 #include <ctime>
+#include <map>
+#include <thread>
+#include <sys/stat.h>
 #include <rclcpp/rclcpp.hpp>
 #include <std_msgs/msg/string.hpp>
 #include <robot_calibration_msgs/msg/calibration_data.hpp>
 #include <robot_calibration_msgs/msg/capture_config.hpp>
+#include <robot_calibration_msgs/msg/optimization_progress.hpp>
+#include <urdf/model.h>
 
+#include <robot_calibration/optimization/background_optimizer.hpp>
 #include <robot_calibration/optimization/ceres_optimizer.hpp>
 #include <robot_calibration/optimization/export.hpp>
 #include <robot_calibration/util/calibration_data.hpp>
 #include <robot_calibration/util/capture_manager.hpp>
+#include <robot_calibration/util/dataset.hpp>
+#include <robot_calibration/util/pose_ordering.hpp>
 #include <robot_calibration/util/poses_from_bag.hpp>
 #include <robot_calibration/util/poses_from_yaml.hpp>
+#include <robot_calibration/util/trace.hpp>
 
 /** \mainpage
  * \section parameters Parameters of the Optimization:
@@ -70,10 +80,54 @@ int main(int argc, char** argv)
   // Should we be stupidly verbose?
   bool verbose = node->declare_parameter<bool>("verbose", false);
 
+  // Should the first calibration step be solved while capturing?
+  bool online = node->declare_parameter<bool>("online", false);
+
+  // Should the capture poses be reordered to reduce the motion time?
+  // Joints without a velocity limit in the URDF use default_joint_velocity.
+  // If reordered_poses is set, the reordered poses are saved to that file.
+  bool reorder_poses = node->declare_parameter<bool>("reorder_poses", false);
+  double default_joint_velocity = node->declare_parameter<double>("default_joint_velocity", 1.0);
+  std::string reordered_poses = node->declare_parameter<std::string>("reordered_poses", "");
+
+  // Should the time spent in each stage of capture and calibration be
+  // traced? A summary is logged at the end, and if trace_file is set, the
+  // spans are written to it as a Chrome trace.
+  bool trace = node->declare_parameter<bool>("trace", false);
+  std::string trace_file = node->declare_parameter<std::string>("trace_file", "");
+  if (trace)
+  {
+    robot_calibration::Tracer::get().open(trace_file);
+  }
+
+  // Where preprocessed collision meshes are cached (empty to disable), and
+  // how many triangles meshes are decimated to (zero to disable)
+  robot_calibration::MeshLoader::Params mesh_params;
+  mesh_params.cache_directory = node->declare_parameter<std::string>("mesh_cache_directory", "");
+  mesh_params.target_triangles =
+    std::max(0, node->declare_parameter<int>("mesh_target_triangles", 0));
+
+  // Load calibration steps
+  std::vector<std::string> calibration_steps =
+    node->declare_parameter<std::vector<std::string>>("calibration_steps", std::vector<std::string>());
+  if (calibration_steps.empty())
+  {
+    RCLCPP_FATAL(logger, "Parameter calibration_steps is not defined");
+    return -1;
+  }
+  std::vector<robot_calibration::OptimizationParams> step_params(calibration_steps.size());
+  for (size_t i = 0; i < calibration_steps.size(); ++i)
+  {
+    step_params[i].LoadFromROS(node, calibration_steps[i]);
+  }
+
   // The calibration data
   std_msgs::msg::String description_msg;
   std::vector<robot_calibration_msgs::msg::CalibrationData> data;
 
+  // Solver for the first step, run while capturing in online mode
+  std::shared_ptr<robot_calibration::BackgroundOptimizer> background;
+
   // Where should calibration data come from:
   //  --manual          manually trigger after moving robot to poses
   //  --from-bag <bag>  use a bagfile of pre-recorded data
@@ -96,6 +150,13 @@ int main(int argc, char** argv)
     // Save URDF for calibration/export step
     description_msg.data = capture_manager.getUrdf();
 
+    if (online)
+    {
+      RCLCPP_INFO(logger, "Solving %s while capturing", calibration_steps.front().c_str());
+      background = std::make_shared<robot_calibration::BackgroundOptimizer>(
+        description_msg.data, step_params.front(), logger, mesh_params);
+    }
+
     // Load a set of calibration poses
     std::vector<robot_calibration_msgs::msg::CaptureConfig> poses;
     if (data_source.compare("--manual") != 0)
@@ -124,18 +185,53 @@ int main(int argc, char** argv)
       RCLCPP_INFO(logger, "Using manual calibration mode");
     }
 
+    if (reorder_poses && !poses.empty())
+    {
+      std::map<std::string, double> velocity_limits;
+      urdf::Model model;
+      if (model.initString(description_msg.data))
+      {
+        for (const auto& joint : model.joints_)
+        {
+          if (joint.second->limits)
+          {
+            velocity_limits[joint.first] = joint.second->limits->velocity;
+          }
+        }
+      }
+      robot_calibration::PoseMotionTime motion_time(velocity_limits, default_joint_velocity);
+
+      double original_time = motion_time.getTime(poses);
+      robot_calibration::orderPoses(poses, motion_time);
+      RCLCPP_INFO(logger, "Reordered poses, estimated motion time reduced from %f to %f seconds",
+                  original_time, motion_time.getTime(poses));
+
+      if (!reordered_poses.empty())
+      {
+        if (robot_calibration::savePosesToYaml(reordered_poses, poses))
+        {
+          RCLCPP_INFO(logger, "Saved reordered poses to %s", reordered_poses.c_str());
+        }
+      }
+    }
+
     // For each pose in the capture sequence.
     for (unsigned pose_idx = 0;
          (pose_idx < poses.size() || poses.empty()) && rclcpp::ok();
          ++pose_idx)
     {
       robot_calibration_msgs::msg::CalibrationData msg;
+      std::vector<robot_calibration_msgs::msg::CalibrationData> moving_samples;
+      robot_calibration::Tracer::get().setPose(pose_idx);
       if (poses.empty())
       {
         // Manual calibration, wait for keypress
         RCLCPP_INFO(logger, "Press [Enter] to capture a sample... (or type 'done' and [Enter] to finish capture)");
         std::string throwaway;
-        std::getline(std::cin, throwaway);
+        {
+          robot_calibration::TraceSpan span("wait_for_user");
+          std::getline(std::cin, throwaway);
+        }
         if (throwaway.compare("done") == 0)
           break;
         if (throwaway.compare("exit") == 0)
@@ -145,7 +241,15 @@ int main(int argc, char** argv)
 
         // Empty vector causes us to capture all features
         std::vector<std::string> features;
-        if (!capture_manager.captureFeatures(features, msg))
+        if (capture_manager.isPipelined())
+        {
+          if (!capture_manager.queueFeatures(features))
+          {
+            RCLCPP_WARN(logger, "Failed to capture sample %u.", pose_idx);
+            continue;
+          }
+        }
+        else if (!capture_manager.captureFeatures(features, msg))
         {
           RCLCPP_WARN(logger, "Failed to capture sample %u.", pose_idx);
           continue;
@@ -153,6 +257,17 @@ int main(int argc, char** argv)
 
         RCLCPP_INFO(logger, "Captured pose %u", pose_idx + 1);
       }
+      else if (capture_manager.isContinuous())
+      {
+        // Capture samples on the way to the pose, rather than at it
+        if (!capture_manager.captureWhileMoving(poses[pose_idx].joint_states, poses[pose_idx].features,
+                                                moving_samples))
+        {
+          RCLCPP_WARN(logger, "Unable to capture while moving to pose %u.", pose_idx);
+        }
+
+        RCLCPP_INFO(logger, "Moved to pose %u of %lu", pose_idx + 1, poses.size());
+      }
       else
       {
         // Move head/arm to pose
@@ -162,11 +277,23 @@ int main(int argc, char** argv)
           continue;
         }
 
-        // Make sure sensor data is up to date after settling
-        rclcpp::sleep_for(std::chrono::milliseconds(100));
+        // Plan the next move while capturing this pose
+        if (pose_idx + 1 < poses.size())
+        {
+          capture_manager.planAhead(poses[pose_idx + 1].joint_states);
+        }
 
-        // Get pose of the features
-        if (!capture_manager.captureFeatures(poses[pose_idx].features, msg))
+        // Get pose of the features, when pipelined the features are extracted
+        // while moving to the next pose
+        if (capture_manager.isPipelined())
+        {
+          if (!capture_manager.queueFeatures(poses[pose_idx].features))
+          {
+            RCLCPP_WARN(logger, "Failed to capture sample %u.", pose_idx);
+            continue;
+          }
+        }
+        else if (!capture_manager.captureFeatures(poses[pose_idx].features, msg))
         {
           RCLCPP_WARN(logger, "Failed to capture sample %u.", pose_idx);
           continue;
@@ -177,10 +304,47 @@ int main(int argc, char** argv)
 
 
       // Add to samples
-      data.push_back(msg);
+      std::vector<robot_calibration_msgs::msg::CalibrationData> samples;
+      if (capture_manager.isPipelined())
+      {
+        capture_manager.getFinishedSamples(samples, false);
+      }
+      else if (!poses.empty() && capture_manager.isContinuous())
+      {
+        samples.swap(moving_samples);
+      }
+      else
+      {
+        samples.push_back(msg);
+      }
+      for (const auto& sample : samples)
+      {
+        data.push_back(sample);
+        if (background)
+        {
+          background->add(sample);
+        }
+      }
+    }
+
+    // Wait for the features of the last samples
+    robot_calibration::Tracer::get().setPose(-1);
+    std::vector<robot_calibration_msgs::msg::CalibrationData> samples;
+    capture_manager.getFinishedSamples(samples, true);
+    for (const auto& sample : samples)
+    {
+      data.push_back(sample);
+      if (background)
+      {
+        background->add(sample);
+      }
     }
 
     RCLCPP_INFO(logger, "Done capturing samples");
+    if (background)
+    {
+      background->stop();
+    }
   }
   else
   {
@@ -188,44 +352,105 @@ int main(int argc, char** argv)
     std::string data_bag_name("/tmp/calibration_data.bag");
     if (argc > 2)
       data_bag_name = argv[2];
-    RCLCPP_INFO(logger, "Loading calibration data from %s", data_bag_name.c_str());
 
-    if (!robot_calibration::load_bag(data_bag_name, description_msg, data))
+    // A compact dataset is kept next to the bag, it is much faster to
+    // reload when calibrating the same data repeatedly
+    std::string dataset_name = data_bag_name;
+    while (dataset_name.size() > 1 && dataset_name.back() == '/')
+      dataset_name.pop_back();
+    dataset_name += ".dataset";
+
+    struct stat bag_stat, dataset_stat;
+    if (stat(dataset_name.c_str(), &dataset_stat) == 0 &&
+        stat(data_bag_name.c_str(), &bag_stat) == 0 &&
+        dataset_stat.st_mtime >= bag_stat.st_mtime &&
+        robot_calibration::loadDataset(dataset_name, description_msg, data))
     {
-      // Error will have been printed in function
-      return -1;
+      RCLCPP_INFO(logger, "Loaded calibration data from %s", dataset_name.c_str());
     }
-  }
+    else
+    {
+      RCLCPP_INFO(logger, "Loading calibration data from %s", data_bag_name.c_str());
 
-  // Create instance of optimizer
-  robot_calibration::OptimizationParams params;
-  robot_calibration::Optimizer opt(description_msg.data);
+      // The optimizer does not use the debugging cloud or image, so do not
+      // hold them in memory
+      data.clear();
+      size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+      if (!robot_calibration::load_bag(data_bag_name, description_msg, data, false, num_threads))
+      {
+        // Error will have been printed in function
+        return -1;
+      }
 
-  // Load calibration steps
-  std::vector<std::string> calibration_steps =
-    node->declare_parameter<std::vector<std::string>>("calibration_steps", std::vector<std::string>());
-  if (calibration_steps.empty())
+      if (robot_calibration::writeDataset(dataset_name, description_msg.data, data))
+      {
+        RCLCPP_INFO(logger, "Saved calibration data to %s", dataset_name.c_str());
+      }
+      else
+      {
+        RCLCPP_WARN(logger, "Unable to save calibration data to %s", dataset_name.c_str());
+      }
+    }
+  }
+
+  // Create instance of optimizer, or continue from the background solve
+  std::shared_ptr<robot_calibration::Optimizer> opt;
+  const std::vector<robot_calibration_msgs::msg::CalibrationData>* samples = &data;
+  if (background)
   {
-    RCLCPP_FATAL(logger, "Parameter calibration_steps is not defined");
-    return -1;
+    opt = background->getOptimizer();
+    samples = &background->getData();
+  }
+  else
+  {
+    opt = std::make_shared<robot_calibration::Optimizer>(description_msg.data, mesh_params);
   }
 
+  // Publish the progress of each solver iteration, a step is aborted on shutdown
+  auto progress_pub =
+    node->create_publisher<robot_calibration_msgs::msg::OptimizationProgress>("optimization_progress", 10);
+
   // Run calibration steps
-  for (auto step : calibration_steps)
+  for (size_t i = 0; i < calibration_steps.size(); ++i)
   {
-    params.LoadFromROS(node, step);
-    opt.optimize(params, data, logger, verbose);
+    const std::string& step = calibration_steps[i];
+    opt->setProgressCallback(
+      [&node, &progress_pub, &step](const robot_calibration_msgs::msg::OptimizationProgress& progress)
+      {
+        robot_calibration_msgs::msg::OptimizationProgress msg = progress;
+        msg.stamp = node->now();
+        msg.step = step;
+        progress_pub->publish(msg);
+        return rclcpp::ok();
+      });
+    {
+      robot_calibration::TraceSpan span("optimize", step);
+      opt->optimize(step_params[i], *samples, logger, verbose);
+    }
     if (verbose)
     {
       std::cout << "Parameter Offsets:" << std::endl;
-      std::cout << opt.getOffsets()->getOffsetYAML() << std::endl;
+      std::cout << opt->getOffsets()->getOffsetYAML() << std::endl;
     }
   }
 
   // Write outputs
-  robot_calibration::exportResults(opt, description_msg.data, data);
+  {
+    robot_calibration::TraceSpan span("export");
+    robot_calibration::exportResults(*opt, description_msg.data, data);
+  }
 
   RCLCPP_INFO(logger, "Done calibrating");
+  if (trace)
+  {
+    bool saved = robot_calibration::Tracer::get().close();
+    RCLCPP_INFO(logger, "Time spent in each stage:\n%s",
+                robot_calibration::Tracer::get().getSummary().c_str());
+    if (!trace_file.empty() && saved)
+    {
+      RCLCPP_INFO(logger, "Saved trace to %s", trace_file.c_str());
+    }
+  }
   rclcpp::shutdown();
 
   return 0;
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
+#include <kdl_parser/kdl_parser.hpp>
+#include <rclcpp/rclcpp.hpp>
+#include <std_msgs/msg/string.hpp>
+#include <robot_calibration_msgs/msg/calibration_data.hpp>
+#include <urdf/model.h>
+
+#include <robot_calibration/optimization/ceres_optimizer.hpp>
+#include <robot_calibration/optimization/export.hpp>
+#include <robot_calibration/util/calibration_data.hpp>
+#include <robot_calibration/util/mesh_loader.hpp>
+
+/** @brief The parsed robot description, shared by all bags recorded with it. */
+struct Description
+{
+  std::shared_ptr<urdf::Model> model;
+  KDL::Tree tree;
+  std::shared_ptr<robot_calibration::MeshLoader> mesh_loader;
+};
+
+/** @brief Parsed robot descriptions, by URDF string. */
+class DescriptionCache
+{
+public:
+  explicit DescriptionCache(const robot_calibration::MeshLoader::Params& mesh_params) :
+    mesh_params_(mesh_params)
+  {
+  }
+
+  /** @brief Get the parsed description, or NULL if it could not be parsed. */
+  std::shared_ptr<Description> get(const std::string& urdf)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = descriptions_.find(urdf);
+    if (it != descriptions_.end())
+    {
+      return it->second;
+    }
+
+    auto description = std::make_shared<Description>();
+    description->model = std::make_shared<urdf::Model>();
+    if (!description->model->initString(urdf) ||
+        !kdl_parser::treeFromUrdfModel(*description->model, description->tree))
+    {
+      description.reset();
+    }
+    else
+    {
+      description->mesh_loader =
+        std::make_shared<robot_calibration::MeshLoader>(description->model, mesh_params_);
+    }
+    descriptions_[urdf] = description;
+    return description;
+  }
+
+private:
+  robot_calibration::MeshLoader::Params mesh_params_;
+  std::mutex mutex_;
+  std::map<std::string, std::shared_ptr<Description>> descriptions_;
+};
+
+/** @brief Get the name of a bag, without any directories. */
+std::string getBagName(std::string bag_name)
+{
+  while (bag_name.size() > 1 && bag_name.back() == '/')
+    bag_name.pop_back();
+  size_t slash = bag_name.find_last_of('/');
+  if (slash != std::string::npos)
+    bag_name = bag_name.substr(slash + 1);
+  return bag_name;
+}
+
+/*
+ * usage:
+ *  calibrate_batch output_directory calibration_data_1.bag calibration_data_2.bag ...
+ *
+ * Runs the calibration steps on each bag, the results of each bag are
+ * exported into output_directory/<bag name>.
+ */
+int main(int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    std::cerr << std::endl;
+    std::cerr << "usage:" << std::endl;
+    std::cerr << "  calibrate_batch output_directory calibration_data_1.bag calibration_data_2.bag ..." << std::endl;
+    std::cerr << std::endl;
+    return -1;
+  }
+  std::string output_directory = argv[1];
+  std::vector<std::string> bag_names(argv + 2, argv + argc);
+
+  rclcpp::init(argc, argv);
+  rclcpp::Node::SharedPtr node = std::make_shared<rclcpp::Node>("robot_calibration_batch");
+  rclcpp::Logger logger = node->get_logger();
+
+  // Number of bags to calibrate at the same time
+  int num_jobs = node->declare_parameter<int>("num_jobs",
+                                              std::max(1u, std::thread::hardware_concurrency()));
+  num_jobs = std::max(1, std::min(num_jobs, static_cast<int>(bag_names.size())));
+
+  // Where preprocessed collision meshes are cached (empty to disable), and
+  // how many triangles meshes are decimated to (zero to disable)
+  robot_calibration::MeshLoader::Params mesh_params;
+  mesh_params.cache_directory = node->declare_parameter<std::string>("mesh_cache_directory", "");
+  mesh_params.target_triangles =
+    std::max(0, node->declare_parameter<int>("mesh_target_triangles", 0));
+
+  // Load calibration steps
+  std::vector<std::string> calibration_steps =
+    node->declare_parameter<std::vector<std::string>>("calibration_steps", std::vector<std::string>());
+  if (calibration_steps.empty())
+  {
+    RCLCPP_FATAL(logger, "Parameter calibration_steps is not defined");
+    return -1;
+  }
+  std::vector<robot_calibration::OptimizationParams> step_params(calibration_steps.size());
+  for (size_t i = 0; i < calibration_steps.size(); ++i)
+  {
+    step_params[i].LoadFromROS(node, calibration_steps[i]);
+  }
+
+  mkdir(output_directory.c_str(), 0755);
+
+  DescriptionCache descriptions(mesh_params);
+  std::atomic<size_t> num_succeeded(0);
+
+  // Each job loads, calibrates and exports one bag at a time
+  std::atomic<size_t> next(0);
+  auto worker = [&]()
+  {
+    for (size_t b = next++; b < bag_names.size(); b = next++)
+    {
+      // The optimizer does not use the debugging cloud or image
+      std_msgs::msg::String description_msg;
+      std::vector<robot_calibration_msgs::msg::CalibrationData> data;
+      if (!robot_calibration::load_bag(bag_names[b], description_msg, data, false, 1))
+      {
+        RCLCPP_ERROR(logger, "Unable to load %s", bag_names[b].c_str());
+        continue;
+      }
+
+      std::shared_ptr<Description> description = descriptions.get(description_msg.data);
+      if (!description)
+      {
+        RCLCPP_ERROR(logger, "Unable to parse robot description of %s", bag_names[b].c_str());
+        continue;
+      }
+
+      // Parameters are copied, since the optimizer may modify them
+      robot_calibration::Optimizer opt(description->model, description->tree,
+                                       description->mesh_loader);
+      for (size_t i = 0; i < step_params.size(); ++i)
+      {
+        robot_calibration::OptimizationParams params = step_params[i];
+        opt.optimize(params, data, logger, false);
+      }
+
+      std::string directory = output_directory + "/" + getBagName(bag_names[b]);
+      mkdir(directory.c_str(), 0755);
+      if (!robot_calibration::exportResults(opt, description_msg.data, data, directory))
+      {
+        RCLCPP_ERROR(logger, "Unable to export results of %s", bag_names[b].c_str());
+        continue;
+      }
+      RCLCPP_INFO(logger, "Calibrated %s, exported results to %s",
+                  bag_names[b].c_str(), directory.c_str());
+      ++num_succeeded;
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_jobs; ++t)
+  {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  RCLCPP_INFO(logger, "Calibrated %lu of %lu bags", num_succeeded.load(), bag_names.size());
+
+  rclcpp::shutdown();
+  return (num_succeeded == bag_names.size()) ? 0 : -1;
+}
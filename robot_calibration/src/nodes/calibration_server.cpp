@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <kdl_parser/kdl_parser.hpp>
+#include <rclcpp/rclcpp.hpp>
+#include <rclcpp_action/rclcpp_action.hpp>
+#include <robot_calibration_msgs/action/calibrate.hpp>
+#include <robot_calibration_msgs/msg/calibration_data.hpp>
+#include <urdf/model.h>
+
+#include <robot_calibration/optimization/ceres_optimizer.hpp>
+#include <robot_calibration/optimization/export.hpp>
+#include <robot_calibration/util/capture_manager.hpp>
+#include <robot_calibration/util/mesh_loader.hpp>
+
+using robot_calibration_msgs::action::Calibrate;
+using CalibrateGoalHandle = rclcpp_action::ServerGoalHandle<Calibrate>;
+
+/**
+ * @brief Captures samples and solves calibrations on request, over the
+ *        calibrate action.
+ *
+ * Unlike the calibrate node, everything is loaded once: the feature finders,
+ * the chain manager, the parsed robot description with its KDL tree and
+ * collision meshes, and the optimizer with its models and cost functions.
+ * Samples are kept between goals, and each solve starts from the offsets of
+ * the previous one, unless the goal clears the samples or resets the offsets.
+ * Only one goal is run at a time.
+ */
+class CalibrationServer
+{
+public:
+  /**
+   * @param node The node for the parameters, capture manager and finders,
+   *        which is spun while capturing.
+   * @param action_node The node for the action server, which must be spun
+   *        by another thread than the one running goals.
+   */
+  CalibrationServer(rclcpp::Node::SharedPtr node, rclcpp::Node::SharedPtr action_node) :
+    node_(node),
+    action_node_(action_node),
+    logger_(node->get_logger()),
+    busy_(false)
+  {
+  }
+
+  ~CalibrationServer()
+  {
+    if (worker_.joinable())
+    {
+      worker_.join();
+    }
+  }
+
+  /** @brief Load the calibration steps and finders, and start the server. */
+  bool init()
+  {
+    verbose_ = node_->declare_parameter<bool>("verbose", false);
+    output_directory_ = node_->declare_parameter<std::string>("output_directory", "/tmp");
+
+    // Where preprocessed collision meshes are cached (empty to disable), and
+    // how many triangles meshes are decimated to (zero to disable)
+    mesh_params_.cache_directory = node_->declare_parameter<std::string>("mesh_cache_directory", "");
+    mesh_params_.target_triangles =
+      std::max(0, node_->declare_parameter<int>("mesh_target_triangles", 0));
+
+    // Load calibration steps
+    calibration_steps_ =
+      node_->declare_parameter<std::vector<std::string>>("calibration_steps", std::vector<std::string>());
+    if (calibration_steps_.empty())
+    {
+      RCLCPP_FATAL(logger_, "Parameter calibration_steps is not defined");
+      return false;
+    }
+    step_params_.resize(calibration_steps_.size());
+    for (size_t i = 0; i < calibration_steps_.size(); ++i)
+    {
+      step_params_[i].LoadFromROS(node_, calibration_steps_[i]);
+    }
+
+    if (!capture_manager_.init(node_))
+    {
+      // Error will be printed in function
+      return false;
+    }
+    if (!loadDescription(capture_manager_.getUrdf()))
+    {
+      return false;
+    }
+
+    server_ = rclcpp_action::create_server<Calibrate>(
+      action_node_, "calibrate",
+      std::bind(&CalibrationServer::handleGoal, this, std::placeholders::_1, std::placeholders::_2),
+      std::bind(&CalibrationServer::handleCancel, this, std::placeholders::_1),
+      std::bind(&CalibrationServer::handleAccepted, this, std::placeholders::_1));
+
+    RCLCPP_INFO(logger_, "Calibration server is ready");
+    return true;
+  }
+
+private:
+  rclcpp_action::GoalResponse handleGoal(const rclcpp_action::GoalUUID&,
+                                         std::shared_ptr<const Calibrate::Goal> goal)
+  {
+    for (const auto& step : goal->steps)
+    {
+      if (std::find(calibration_steps_.begin(), calibration_steps_.end(), step) == calibration_steps_.end())
+      {
+        RCLCPP_ERROR(logger_, "Rejecting goal, %s is not a calibration step", step.c_str());
+        return rclcpp_action::GoalResponse::REJECT;
+      }
+    }
+
+    // Only one goal at a time, the robot can only be in one place
+    bool expected = false;
+    if (!busy_.compare_exchange_strong(expected, true))
+    {
+      RCLCPP_ERROR(logger_, "Rejecting goal, already running a goal");
+      return rclcpp_action::GoalResponse::REJECT;
+    }
+    return rclcpp_action::GoalResponse::ACCEPT_AND_EXECUTE;
+  }
+
+  rclcpp_action::CancelResponse handleCancel(std::shared_ptr<CalibrateGoalHandle>)
+  {
+    return rclcpp_action::CancelResponse::ACCEPT;
+  }
+
+  void handleAccepted(std::shared_ptr<CalibrateGoalHandle> goal_handle)
+  {
+    // The previous worker is done, it clears busy_ as it finishes
+    if (worker_.joinable())
+    {
+      worker_.join();
+    }
+    worker_ = std::thread(&CalibrationServer::execute, this, goal_handle);
+  }
+
+  /**
+   * @brief Parse the robot description, unless it is the one already parsed.
+   *        A new description discards the optimizer.
+   */
+  bool loadDescription(const std::string& description)
+  {
+    if (model_ && description == description_)
+    {
+      return true;
+    }
+
+    auto model = std::make_shared<urdf::Model>();
+    KDL::Tree tree;
+    if (!model->initString(description) || !kdl_parser::treeFromUrdfModel(*model, tree))
+    {
+      RCLCPP_ERROR(logger_, "Unable to parse robot_description");
+      return false;
+    }
+
+    description_ = description;
+    model_ = model;
+    tree_ = tree;
+    mesh_loader_ = std::make_shared<robot_calibration::MeshLoader>(model_, mesh_params_);
+    optimizer_.reset();
+    return true;
+  }
+
+  /** @brief Add the samples captured so far, waiting for pipelined ones if wait is set. */
+  void addFinishedSamples(bool wait)
+  {
+    std::vector<robot_calibration_msgs::msg::CalibrationData> samples;
+    capture_manager_.getFinishedSamples(samples, wait);
+    data_.insert(data_.end(), samples.begin(), samples.end());
+  }
+
+  /** @brief Capture the poses of a goal, returns false if canceled. */
+  bool capture(const std::shared_ptr<CalibrateGoalHandle>& goal_handle,
+               const std::vector<robot_calibration_msgs::msg::CaptureConfig>& poses)
+  {
+    auto feedback = std::make_shared<Calibrate::Feedback>();
+    feedback->stage = "capture";
+    feedback->num_poses = poses.size();
+
+    for (size_t pose_idx = 0; pose_idx < poses.size() && rclcpp::ok(); ++pose_idx)
+    {
+      if (goal_handle->is_canceling())
+      {
+        addFinishedSamples(true);
+        return false;
+      }
+
+      feedback->pose = pose_idx;
+      feedback->num_samples = data_.size();
+      goal_handle->publish_feedback(feedback);
+
+      if (capture_manager_.isContinuous())
+      {
+        // Capture samples on the way to the pose, rather than at it
+        std::vector<robot_calibration_msgs::msg::CalibrationData> samples;
+        if (!capture_manager_.captureWhileMoving(poses[pose_idx].joint_states, poses[pose_idx].features,
+                                                 samples))
+        {
+          RCLCPP_WARN(logger_, "Unable to capture while moving to pose %lu.", pose_idx);
+        }
+        data_.insert(data_.end(), samples.begin(), samples.end());
+        continue;
+      }
+
+      // Move head/arm to pose
+      if (!capture_manager_.moveToState(poses[pose_idx].joint_states))
+      {
+        RCLCPP_WARN(logger_, "Unable to move to desired state for sample %lu.", pose_idx);
+        continue;
+      }
+
+      // Plan the next move while capturing this pose
+      if (pose_idx + 1 < poses.size())
+      {
+        capture_manager_.planAhead(poses[pose_idx + 1].joint_states);
+      }
+
+      // Get pose of the features, when pipelined the features are extracted
+      // while moving to the next pose
+      if (capture_manager_.isPipelined())
+      {
+        if (!capture_manager_.queueFeatures(poses[pose_idx].features))
+        {
+          RCLCPP_WARN(logger_, "Failed to capture sample %lu.", pose_idx);
+        }
+        addFinishedSamples(false);
+      }
+      else
+      {
+        robot_calibration_msgs::msg::CalibrationData msg;
+        if (!capture_manager_.captureFeatures(poses[pose_idx].features, msg))
+        {
+          RCLCPP_WARN(logger_, "Failed to capture sample %lu.", pose_idx);
+          continue;
+        }
+        data_.push_back(msg);
+      }
+    }
+
+    // Wait for the features of the last samples
+    addFinishedSamples(true);
+    return true;
+  }
+
+  void execute(std::shared_ptr<CalibrateGoalHandle> goal_handle)
+  {
+    std::shared_ptr<const Calibrate::Goal> goal = goal_handle->get_goal();
+    auto result = std::make_shared<Calibrate::Result>();
+    runGoal(goal_handle, *goal, *result);
+    result->num_samples = data_.size();
+
+    if (!rclcpp::ok())
+    {
+      result->success = false;
+      result->message = "Shutting down";
+      goal_handle->abort(result);
+    }
+    else if (goal_handle->is_canceling())
+    {
+      result->success = false;
+      result->message = "Canceled";
+      goal_handle->canceled(result);
+    }
+    else if (result->success)
+    {
+      goal_handle->succeed(result);
+    }
+    else
+    {
+      goal_handle->abort(result);
+    }
+    busy_ = false;
+  }
+
+  /** @brief Run a goal, filling in the result. */
+  void runGoal(const std::shared_ptr<CalibrateGoalHandle>& goal_handle,
+              const Calibrate::Goal& goal,
+              Calibrate::Result& result)
+  {
+    result.success = false;
+
+    // Samples must only be appended while an optimizer is using them
+    if (goal.clear_samples)
+    {
+      data_.clear();
+      optimizer_.reset();
+    }
+
+    if (!capture(goal_handle, goal.poses) || goal.capture_only)
+    {
+      result.success = true;
+      result.message = "Captured " + std::to_string(data_.size()) + " samples";
+      return;
+    }
+
+    // The robot description may have been updated while capturing
+    if (!loadDescription(capture_manager_.getUrdf()))
+    {
+      result.message = "Unable to parse robot_description";
+      return;
+    }
+
+    if (data_.empty())
+    {
+      result.message = "No samples to calibrate with";
+      return;
+    }
+
+    if (goal.reset_offsets || !optimizer_)
+    {
+      optimizer_ = std::make_shared<robot_calibration::Optimizer>(model_, tree_, mesh_loader_);
+    }
+
+    // Run the requested steps, or all of them
+    std::vector<size_t> steps;
+    if (goal.steps.empty())
+    {
+      for (size_t i = 0; i < calibration_steps_.size(); ++i)
+      {
+        steps.push_back(i);
+      }
+    }
+    for (const auto& step : goal.steps)
+    {
+      steps.push_back(std::find(calibration_steps_.begin(), calibration_steps_.end(), step) -
+                      calibration_steps_.begin());
+    }
+
+    auto feedback = std::make_shared<Calibrate::Feedback>();
+    feedback->stage = "solve";
+    feedback->num_samples = data_.size();
+    for (size_t i : steps)
+    {
+      const std::string& step = calibration_steps_[i];
+      optimizer_->setProgressCallback(
+        [this, &goal_handle, &feedback, &step](const robot_calibration_msgs::msg::OptimizationProgress& progress)
+        {
+          feedback->progress = progress;
+          feedback->progress.stamp = node_->now();
+          feedback->progress.step = step;
+          goal_handle->publish_feedback(feedback);
+          return rclcpp::ok() && !goal_handle->is_canceling();
+        });
+      if (optimizer_->optimize(step_params_[i], data_, logger_, verbose_) != 0)
+      {
+        result.message = "Unable to run calibration step " + step;
+        return;
+      }
+      if (!rclcpp::ok() || goal_handle->is_canceling())
+      {
+        return;
+      }
+    }
+
+    result.success = true;
+    result.message = "Calibrated with " + std::to_string(data_.size()) + " samples";
+    result.offsets = optimizer_->getOffsets()->getOffsetYAML();
+    result.robot_description = optimizer_->getOffsets()->updateURDF(description_);
+    if (!robot_calibration::exportResults(*optimizer_, description_, data_, output_directory_))
+    {
+      RCLCPP_WARN(logger_, "Unable to export results to %s", output_directory_.c_str());
+    }
+    RCLCPP_INFO(logger_, "%s", result.message.c_str());
+  }
+
+  rclcpp::Node::SharedPtr node_;
+  rclcpp::Node::SharedPtr action_node_;
+  rclcpp::Logger logger_;
+  rclcpp_action::Server<Calibrate>::SharedPtr server_;
+
+  bool verbose_;
+  std::string output_directory_;
+  std::vector<std::string> calibration_steps_;
+  std::vector<robot_calibration::OptimizationParams> step_params_;
+  robot_calibration::CaptureManager capture_manager_;
+
+  // The parsed robot description, and the optimizer solving with it
+  robot_calibration::MeshLoader::Params mesh_params_;
+  std::string description_;
+  std::shared_ptr<urdf::Model> model_;
+  KDL::Tree tree_;
+  std::shared_ptr<robot_calibration::MeshLoader> mesh_loader_;
+  std::shared_ptr<robot_calibration::Optimizer> optimizer_;
+
+  // The samples captured by all goals since they were last cleared
+  std::vector<robot_calibration_msgs::msg::CalibrationData> data_;
+
+  std::atomic<bool> busy_;
+  std::thread worker_;
+};
+
+int main(int argc, char** argv)
+{
+  rclcpp::init(argc, argv);
+
+  // The capture manager spins its node while capturing, so the action
+  // server needs a node of its own to receive goals and cancels meanwhile
+  rclcpp::Node::SharedPtr node = std::make_shared<rclcpp::Node>("robot_calibration");
+  rclcpp::Node::SharedPtr action_node = std::make_shared<rclcpp::Node>("calibration_server");
+
+  {
+    CalibrationServer server(node, action_node);
+    if (!server.init())
+    {
+      // Error will be printed in function
+      rclcpp::shutdown();
+      return -1;
+    }
+    rclcpp::spin(action_node);
+  }
+
+  rclcpp::shutdown();
+  return 0;
+}
@@ -16,9 +16,12 @@
 
 // Author: Michael Ferguson
 
+#include <cmath>
 #include <vector>
+#include <Eigen/Core>
 
 #include <robot_calibration/cost_functions/magnetometer_error.hpp>
+#include <robot_calibration/util/magnetometer_fit.hpp>
 
 #include <rclcpp/rclcpp.hpp>
 #include <rosbag2_cpp/reader.hpp>
@@ -71,10 +74,6 @@ int main(int argc, char** argv)
    * unmagnetized ferromagnetic elements.
    */
   bool soft_iron = node->declare_parameter<bool>("soft_iron", false);
-  if (soft_iron)
-  {
-    RCLCPP_ERROR(node->get_logger(), "Soft Iron Calibration Is Not Yet Available.");
-  }
 
   /*
    * Speed and duration to rotate the robot.
@@ -175,7 +174,7 @@ int main(int argc, char** argv)
       metadata.serialization_format = "cdr";
       writer.create_topic(metadata);
     }
-    for (auto msg : data)
+    for (const auto& msg : data)
     {
       // Serialize data
       rclcpp::Serialization<sensor_msgs::msg::MagneticField> serialization;
@@ -191,57 +190,69 @@ int main(int argc, char** argv)
     }
   }
 
-  // Setup free parameters
-  size_t num_params = 4;
-  if (soft_iron)
+  if (data.empty())
   {
-    num_params += 6;
+    RCLCPP_ERROR(node->get_logger(), "No magnetometer samples to calibrate with.");
+    rclcpp::shutdown();
+    executor_thread.join();
+    return -1;
   }
-  double* free_params = new double[num_params];
-  // Set initial estimate of magnetic field strength
-  free_params[0] = 0.45;
-  // Setup initial estimates of hard iron offsets (bias)
+
+  // Copy the samples into contiguous arrays for the batch cost
+  Eigen::Matrix3Xd samples(3, data.size());
+  std::vector<double> x(data.size()), y(data.size()), z(data.size());
+  for (size_t i = 0; i < data.size(); ++i)
   {
-    double bias_x = 0.0;
-    double bias_y = 0.0;
-    double bias_z = 0.0;
-    for (auto msg : data)
-    {
-      bias_x += msg.magnetic_field.x;
-      bias_y += msg.magnetic_field.y;
-      bias_z += msg.magnetic_field.z;
-    }
-    bias_x /= data.size();
-    bias_y /= data.size();
-    bias_z /= data.size();
-
-    free_params[1] = bias_x;
-    free_params[2] = bias_y;
-    free_params[3] = bias_z;
-
-    RCLCPP_INFO_STREAM(node->get_logger(), "Initial estimate for hard iron offsets: [" <<
-                       bias_x << ", " <<
-                       bias_y << ", " <<
-                       bias_z << "]");
+    const auto& m = data[i].magnetic_field;
+    samples.col(i) = Eigen::Vector3d(m.x, m.y, m.z);
+    x[i] = m.x;
+    y[i] = m.y;
+    z[i] = m.z;
   }
 
-  // Setup error blocks
-  ceres::Problem* problem = new ceres::Problem();
-  ceres::TrivialLoss loss;
-  for (auto msg : data)
+  // Setup free parameters, see MagnetometerBatchError
+  double field = 0.45;
+  Eigen::Vector3d offset = samples.rowwise().mean();
+  Eigen::Matrix3d soft_iron_matrix = Eigen::Matrix3d::Identity();
+
+  // Initial estimate from a closed form fit, if the samples constrain it,
+  // otherwise from the mean of the samples
+  bool fit = soft_iron ?
+    robot_calibration::fitEllipsoid(samples, offset, soft_iron_matrix, field) :
+    robot_calibration::fitSphere(samples, offset, field);
+  if (!fit)
   {
-    auto m = msg.magnetic_field;
-    if (soft_iron)
-    {
+    RCLCPP_WARN(node->get_logger(), "Samples do not constrain a closed form fit, "
+                                    "rotate the sensor to more orientations.");
+    field = 0.45;
+    offset = samples.rowwise().mean();
+    soft_iron_matrix = Eigen::Matrix3d::Identity();
+  }
+  double field_param[1] = {field};
+  double offset_params[3] = {offset(0), offset(1), offset(2)};
+  double soft_iron_params[6] = {soft_iron_matrix(0, 0), soft_iron_matrix(0, 1), soft_iron_matrix(0, 2),
+                                soft_iron_matrix(1, 1), soft_iron_matrix(1, 2), soft_iron_matrix(2, 2)};
 
-    }
-    else
-    {
-      problem->AddResidualBlock(
-        HardIronOffsetError::Create(m.x, m.y, m.z),
-        &loss,  // squared loss
-        free_params);
-    }
+  RCLCPP_INFO_STREAM(node->get_logger(), "Initial estimate for hard iron offsets: [" <<
+                     offset_params[0] << ", " <<
+                     offset_params[1] << ", " <<
+                     offset_params[2] << "]");
+
+  // Setup error block, all samples are a single residual block
+  ceres::Problem* problem = new ceres::Problem();
+  std::vector<double*> blocks = {field_param, offset_params};
+  if (soft_iron)
+  {
+    blocks.push_back(soft_iron_params);
+  }
+  problem->AddResidualBlock(MagnetometerBatchError::Create(x, y, z, soft_iron),
+                            NULL,  // squared loss
+                            blocks);
+  if (soft_iron)
+  {
+    // The scale of the soft iron matrix and the field are not separable,
+    // the matrix is rescaled to unit determinant after the solve
+    problem->SetParameterBlockConstant(field_param);
   }
 
   // Run calibration
@@ -255,16 +266,36 @@ int main(int argc, char** argv)
   ceres::Solver::Summary summary;
   ceres::Solve(options, problem, &summary);
   RCLCPP_INFO_STREAM(node->get_logger(), summary.BriefReport());
+  delete problem;
+
+  if (soft_iron)
+  {
+    soft_iron_matrix << soft_iron_params[0], soft_iron_params[1], soft_iron_params[2],
+                        soft_iron_params[1], soft_iron_params[3], soft_iron_params[4],
+                        soft_iron_params[2], soft_iron_params[4], soft_iron_params[5];
+    double det_root = std::cbrt(soft_iron_matrix.determinant());
+    soft_iron_matrix /= det_root;
+    field_param[0] /= det_root;
+  }
 
   // Save results
-  RCLCPP_INFO_STREAM(node->get_logger(), "Estimated total magnetic field: " << free_params[0] << "T");
+  RCLCPP_INFO_STREAM(node->get_logger(), "Estimated total magnetic field: " << field_param[0] << "T");
   RCLCPP_INFO(node->get_logger(), "You can compare to expected values from");
   RCLCPP_INFO(node->get_logger(), "  https://www.ngdc.noaa.gov/geomag/calculators/magcalc.shtml#igrfwmm");
 
-  std::cout << "mag_bias_x: " << free_params[1] << std::endl;
-  std::cout << "mag_bias_y: " << free_params[2] << std::endl;
-  std::cout << "mag_bias_z: " << free_params[3] << std::endl;
-  delete[] free_params;
+  std::cout << "mag_bias_x: " << offset_params[0] << std::endl;
+  std::cout << "mag_bias_y: " << offset_params[1] << std::endl;
+  std::cout << "mag_bias_z: " << offset_params[2] << std::endl;
+  if (soft_iron)
+  {
+    // Row major, corrected = mag_soft_iron * (raw - mag_bias)
+    std::cout << "mag_soft_iron: [";
+    for (int i = 0; i < 9; ++i)
+    {
+      std::cout << soft_iron_matrix(i / 3, i % 3) << ((i < 8) ? ", " : "]");
+    }
+    std::cout << std::endl;
+  }
 
   rclcpp::shutdown();
   executor_thread.join();
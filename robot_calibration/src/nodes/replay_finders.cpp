@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <rclcpp/rclcpp.hpp>
+#include <rclcpp/serialization.hpp>
+#include <rosbag2_cpp/reader.hpp>
+#include <rosbag2_storage/storage_filter.hpp>
+#include <std_msgs/msg/string.hpp>
+#include <robot_calibration_msgs/msg/calibration_data.hpp>
+#include <robot_calibration_msgs/msg/calibration_raw.hpp>
+
+#include <robot_calibration/finders/loader.hpp>
+#include <robot_calibration/util/calibration_bag_writer.hpp>
+
+/** @brief Feature finders with their own node, so each can run in its own thread. */
+struct ReplayWorker
+{
+  rclcpp::Node::SharedPtr node;
+  robot_calibration::FeatureFinderLoader loader;
+  robot_calibration::FeatureFinderMap finders;
+};
+
+/** @brief Read the robot description and raw data recorded by the capture node. */
+bool readRawBag(const std::string& file_name,
+                std_msgs::msg::String& description,
+                std::vector<robot_calibration_msgs::msg::CalibrationRaw>& raw)
+{
+  try
+  {
+    rosbag2_cpp::Reader reader;
+    reader.open(file_name);
+    rosbag2_storage::StorageFilter filter;
+    filter.topics.push_back("/robot_description");
+    filter.topics.push_back("/calibration_raw");
+    reader.set_filter(filter);
+
+    rclcpp::Serialization<std_msgs::msg::String> description_serialization;
+    rclcpp::Serialization<robot_calibration_msgs::msg::CalibrationRaw> raw_serialization;
+    while (reader.has_next())
+    {
+      auto bag_message = reader.read_next();
+      rclcpp::SerializedMessage serialized(*bag_message->serialized_data);
+      if (bag_message->topic_name == "/robot_description")
+      {
+        description_serialization.deserialize_message(&serialized, &description);
+      }
+      else
+      {
+        raw.emplace_back();
+        raw_serialization.deserialize_message(&serialized, &raw.back());
+      }
+    }
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "Unable to read " << file_name << ": " << e.what() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * usage:
+ *  replay_finders raw_data.bag calibration_data.bag
+ *
+ * Runs the feature finders again over the raw sensor data recorded by the
+ * capture node (with record_raw set), typically with new finder parameters.
+ * The regenerated samples are written to a new bag, which can be used just
+ * like one recorded during capture.
+ */
+int main(int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    std::cerr << std::endl;
+    std::cerr << "usage:" << std::endl;
+    std::cerr << "  replay_finders raw_data.bag calibration_data.bag" << std::endl;
+    std::cerr << std::endl;
+    return -1;
+  }
+  std::string input_bag = argv[1];
+  std::string output_bag = argv[2];
+
+  rclcpp::init(argc, argv);
+  rclcpp::Node::SharedPtr node = std::make_shared<rclcpp::Node>("robot_calibration_replay");
+  rclcpp::Logger logger = node->get_logger();
+
+  // Number of poses to process at the same time
+  int num_threads = node->declare_parameter<int>("num_threads",
+                                                 std::max(1u, std::thread::hardware_concurrency()));
+
+  std_msgs::msg::String description;
+  std::vector<robot_calibration_msgs::msg::CalibrationRaw> raw;
+  if (!readRawBag(input_bag, description, raw))
+  {
+    return -1;
+  }
+  if (raw.empty())
+  {
+    RCLCPP_FATAL(logger, "No raw data in %s, was it captured with record_raw?", input_bag.c_str());
+    return -1;
+  }
+  RCLCPP_INFO(logger, "Read raw data of %lu poses", raw.size());
+  num_threads = std::max(1, std::min(num_threads, static_cast<int>(raw.size())));
+
+  // Finders are not thread safe, so each worker has its own, configured by
+  // the same parameters as this node. Offline, they do not wait for sensors.
+  std::vector<rclcpp::Parameter> parameters;
+  for (const auto& p : node->get_node_parameters_interface()->get_parameter_overrides())
+  {
+    parameters.emplace_back(p.first, p.second);
+  }
+  parameters.emplace_back("offline", true);
+  std::vector<std::unique_ptr<ReplayWorker>> workers;
+  for (int t = 0; t < num_threads; ++t)
+  {
+    rclcpp::NodeOptions options;
+    options.parameter_overrides(parameters);
+    options.use_global_arguments(false);
+    std::unique_ptr<ReplayWorker> worker(new ReplayWorker());
+    worker->node = std::make_shared<rclcpp::Node>("robot_calibration_replay_" + std::to_string(t), options);
+    worker->node->declare_parameter<bool>("offline", true);
+    if (!worker->loader.load(worker->node, worker->finders))
+    {
+      RCLCPP_FATAL(logger, "Unable to load feature finders!");
+      return -1;
+    }
+    workers.push_back(std::move(worker));
+  }
+
+  // Each worker replays one pose at a time
+  std::vector<robot_calibration_msgs::msg::CalibrationData> data(raw.size());
+  std::vector<char> success(raw.size(), false);
+  std::atomic<size_t> next(0);
+  auto replay = [&](ReplayWorker& worker)
+  {
+    for (size_t i = next++; i < raw.size(); i = next++)
+    {
+      data[i].joint_states = raw[i].joint_states;
+      success[i] = true;
+      for (const auto& observation : raw[i].observations)
+      {
+        auto finder = worker.finders.find(observation.finder_name);
+        if (finder == worker.finders.end())
+        {
+          RCLCPP_WARN(logger, "Pose %lu: no feature finder named %s", i, observation.finder_name.c_str());
+          success[i] = false;
+          break;
+        }
+        if (!finder->second->replay(observation, &data[i]))
+        {
+          RCLCPP_WARN(logger, "Pose %lu: %s failed to find features", i, observation.finder_name.c_str());
+          success[i] = false;
+          break;
+        }
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; ++t)
+  {
+    threads.emplace_back(replay, std::ref(*workers[t]));
+  }
+  replay(*workers[0]);
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  // Samples are written in the order they were captured
+  robot_calibration::CalibrationBagWriter writer;
+  if (!writer.open(output_bag, ""))
+  {
+    return -1;
+  }
+  writer.write(description, node->now());
+  size_t num_samples = 0;
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    if (success[i])
+    {
+      writer.write(data[i], node->now());
+      ++num_samples;
+    }
+  }
+  writer.close();
+  RCLCPP_INFO(logger, "Wrote %lu of %lu samples to %s", num_samples, data.size(), output_bag.c_str());
+
+  workers.clear();
+  rclcpp::shutdown();
+  return (num_samples == data.size()) ? 0 : -1;
+}
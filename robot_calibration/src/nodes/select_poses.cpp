@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <rclcpp/rclcpp.hpp>
+#include <std_msgs/msg/string.hpp>
+#include <robot_calibration_msgs/msg/calibration_data.hpp>
+#include <robot_calibration_msgs/msg/capture_config.hpp>
+
+#include <robot_calibration/optimization/ceres_optimizer.hpp>
+#include <robot_calibration/optimization/pose_selection.hpp>
+#include <robot_calibration/util/calibration_data.hpp>
+#include <robot_calibration/util/poses_from_yaml.hpp>
+
+/*
+ * usage:
+ *  select_poses calibration_data.bag calibration_poses.yaml
+ *
+ * Chooses the samples of calibration_data.bag which best constrain the free
+ * parameters of the first calibration step, and saves their poses.
+ */
+int main(int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    std::cerr << std::endl;
+    std::cerr << "usage:" << std::endl;
+    std::cerr << "  select_poses calibration_data.bag calibration_poses.yaml" << std::endl;
+    std::cerr << std::endl;
+    return -1;
+  }
+  std::string bag_name = argv[1];
+  std::string poses_name = argv[2];
+
+  rclcpp::init(argc, argv);
+  rclcpp::Node::SharedPtr node = std::make_shared<rclcpp::Node>("robot_calibration_select_poses");
+  rclcpp::Logger logger = node->get_logger();
+
+  // Number of poses to select
+  int num_poses = node->declare_parameter<int>("num_poses", 0);
+  if (num_poses < 1)
+  {
+    RCLCPP_FATAL(logger, "Parameter num_poses must be greater than zero");
+    return -1;
+  }
+
+  // Either d_optimal or min_eigenvalue
+  std::string criterion_name =
+    node->declare_parameter<std::string>("selection_criterion", "d_optimal");
+  robot_calibration::SelectionCriterion criterion;
+  if (!robot_calibration::getSelectionCriterion(criterion_name, criterion))
+  {
+    RCLCPP_FATAL(logger, "Unknown selection_criterion '%s'", criterion_name.c_str());
+    return -1;
+  }
+
+  // The free parameters, and their nominal values, come from the first step
+  std::vector<std::string> calibration_steps =
+    node->declare_parameter<std::vector<std::string>>("calibration_steps", std::vector<std::string>());
+  if (calibration_steps.empty())
+  {
+    RCLCPP_FATAL(logger, "Parameter calibration_steps is not defined");
+    return -1;
+  }
+  robot_calibration::OptimizationParams params;
+  params.LoadFromROS(node, calibration_steps.front());
+
+  // Load the candidate samples
+  std_msgs::msg::String description_msg;
+  std::vector<robot_calibration_msgs::msg::CalibrationData> data;
+  size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+  if (!robot_calibration::load_bag(bag_name, description_msg, data, false, num_threads))
+  {
+    // Error will have been printed in function
+    return -1;
+  }
+
+  robot_calibration::Optimizer opt(description_msg.data);
+  std::vector<Eigen::MatrixXd> information;
+  if (!opt.computeInformation(params, data, logger, information))
+  {
+    // Error will have been printed in function
+    return -1;
+  }
+
+  std::vector<size_t> selected = robot_calibration::selectSamples(information, num_poses, criterion);
+
+  // Compare the selected samples to all of them
+  Eigen::MatrixXd all_information = Eigen::MatrixXd::Zero(opt.getOffsets()->size(),
+                                                          opt.getOffsets()->size());
+  Eigen::MatrixXd selected_information = all_information;
+  for (size_t i = 0; i < information.size(); ++i)
+  {
+    all_information += information[i];
+  }
+  for (size_t i : selected)
+  {
+    selected_information += information[i];
+  }
+  RCLCPP_INFO(logger, "Selected %lu of %lu poses, %s score %f (all poses %f)",
+              selected.size(), information.size(), criterion_name.c_str(),
+              robot_calibration::scoreInformation(selected_information, criterion),
+              robot_calibration::scoreInformation(all_information, criterion));
+
+  std::vector<robot_calibration_msgs::msg::CaptureConfig> poses;
+  for (size_t i : selected)
+  {
+    // Capture all features, since the finders are not recorded in the data
+    robot_calibration_msgs::msg::CaptureConfig pose;
+    pose.joint_states.name = data[i].joint_states.name;
+    pose.joint_states.position = data[i].joint_states.position;
+    poses.push_back(pose);
+  }
+  if (!robot_calibration::savePosesToYaml(poses_name, poses))
+  {
+    // Error will have been printed in function
+    return -1;
+  }
+  RCLCPP_INFO(logger, "Saved poses to %s", poses_name.c_str());
+
+  rclcpp::shutdown();
+  return 0;
+}
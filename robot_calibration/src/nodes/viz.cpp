@@ -16,10 +16,15 @@
 
 // Author: Michael Ferguson
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
 #include <rclcpp/rclcpp.hpp>
 #include <robot_calibration/util/calibration_data.hpp>
 #include <sensor_msgs/msg/joint_state.hpp>
 #include <sensor_msgs/msg/point_cloud2.hpp>
+#include <sensor_msgs/point_cloud2_iterator.hpp>
 #include <visualization_msgs/msg/marker_array.hpp>
 
 #include <urdf/model.h>
@@ -30,6 +35,137 @@
 #include <robot_calibration/models/camera3d.hpp>
 #include <robot_calibration/models/chain3d.hpp>
 
+using Projections = std::vector<std::vector<geometry_msgs::msg::PointStamped>>;
+
+/**
+ * @brief Get the markers of the projections of each model for one sample.
+ *        Models without projections delete their marker of the previous
+ *        sample, so only the markers of this sample are shown.
+ */
+visualization_msgs::msg::MarkerArray makeMarkers(const Projections& projections,
+                                                 const std::vector<std::string>& model_names,
+                                                 const std::vector<std_msgs::msg::ColorRGBA>& model_colors,
+                                                 const std::string& frame,
+                                                 const rclcpp::Time& stamp)
+{
+  visualization_msgs::msg::MarkerArray markers;
+  for (size_t m = 0; m < model_names.size(); ++m)
+  {
+    const auto& points = projections[m];
+
+    // Convert into marker
+    visualization_msgs::msg::Marker msg;
+    msg.header.frame_id = frame;
+    msg.header.stamp = stamp;
+    msg.ns = model_names[m];
+    msg.id = m;
+    if (points.empty())
+    {
+      msg.action = msg.DELETE;
+      markers.markers.push_back(msg);
+      continue;
+    }
+    msg.type = msg.SPHERE_LIST;
+    msg.pose.orientation.w = 1.0;
+    msg.scale.x = 0.01;
+    msg.scale.y = 0.01;
+    msg.scale.z = 0.01;
+    msg.points.push_back(points[0].point);
+    msg.colors.push_back(model_colors[0]);
+    for (size_t p = 1; p < points.size(); ++p)
+    {
+      msg.points.push_back(points[p].point);
+      msg.colors.push_back(model_colors[m+1]);
+    }
+    markers.markers.push_back(msg);
+  }
+  return markers;
+}
+
+/**
+ * @brief Get the residual of each projected point of a model, the distance
+ *        to the mean of the same feature as projected by every model with
+ *        the same number of features. Zero if no other model has them.
+ */
+std::vector<double> getResiduals(const Projections& projections, size_t model)
+{
+  const auto& points = projections[model];
+  std::vector<double> residuals(points.size(), 0.0);
+  for (size_t p = 0; p < points.size(); ++p)
+  {
+    double x = 0.0, y = 0.0, z = 0.0;
+    int count = 0;
+    for (const auto& other : projections)
+    {
+      if (other.size() == points.size())
+      {
+        x += other[p].point.x;
+        y += other[p].point.y;
+        z += other[p].point.z;
+        ++count;
+      }
+    }
+    if (count > 1)
+    {
+      x = x / count - points[p].point.x;
+      y = y / count - points[p].point.y;
+      z = z / count - points[p].point.z;
+      residuals[p] = std::sqrt(x * x + y * y + z * z);
+    }
+  }
+  return residuals;
+}
+
+/**
+ * @brief Get a cloud of the projections of one model for all samples,
+ *        coloured from green to red as the residual goes to residual_scale.
+ */
+sensor_msgs::msg::PointCloud2 makeResidualCloud(const std::vector<Projections>& projections,
+                                                size_t model,
+                                                double residual_scale,
+                                                const std::string& frame,
+                                                const rclcpp::Time& stamp)
+{
+  size_t num_points = 0;
+  for (const auto& sample : projections)
+  {
+    num_points += sample[model].size();
+  }
+
+  sensor_msgs::msg::PointCloud2 cloud;
+  cloud.header.frame_id = frame;
+  cloud.header.stamp = stamp;
+  sensor_msgs::PointCloud2Modifier cloud_mod(cloud);
+  cloud_mod.setPointCloud2Fields(5,
+                                 "x", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                 "y", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                 "z", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                 "rgb", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                 "residual", 1, sensor_msgs::msg::PointField::FLOAT32);
+  cloud_mod.resize(num_points);
+
+  sensor_msgs::PointCloud2Iterator<float> xyz(cloud, "x");
+  sensor_msgs::PointCloud2Iterator<uint8_t> rgb(cloud, "rgb");
+  sensor_msgs::PointCloud2Iterator<float> residual(cloud, "residual");
+  for (const auto& sample : projections)
+  {
+    std::vector<double> residuals = getResiduals(sample, model);
+    for (size_t p = 0; p < residuals.size(); ++p, ++xyz, ++rgb, ++residual)
+    {
+      xyz[0] = sample[model][p].point.x;
+      xyz[1] = sample[model][p].point.y;
+      xyz[2] = sample[model][p].point.z;
+      double t = std::min(residuals[p] / residual_scale, 1.0);
+      // Packed as b, g, r
+      rgb[0] = 0;
+      rgb[1] = static_cast<uint8_t>(255 * (1.0 - t));
+      rgb[2] = static_cast<uint8_t>(255 * t);
+      *residual = residuals[p];
+    }
+  }
+  return cloud;
+}
+
 int main(int argc, char** argv)
 {
   // What bag to visualize
@@ -57,10 +193,10 @@ int main(int argc, char** argv)
     node->create_publisher<visualization_msgs::msg::MarkerArray>("data",
       rclcpp::QoS(1).transient_local());
 
-  // The calibration data
+  // The calibration data, samples are streamed as they are published
   std_msgs::msg::String description_msg;
-  std::vector<robot_calibration_msgs::msg::CalibrationData> data;
-  if (!robot_calibration::load_bag(bag_name, description_msg, data))
+  robot_calibration::CalibrationBagReader reader(true);
+  if (!reader.open(bag_name, description_msg))
   {
     // Error will be printed in function
     return -1;
@@ -208,50 +344,91 @@ int main(int argc, char** argv)
     }
   }
 
+  // Should all samples be projected before stepping through them?
+  bool precompute = node->declare_parameter<bool>("precompute", false);
+  // Residual at which points of the combined clouds are fully red
+  double residual_scale = node->declare_parameter<double>("residual_scale", 0.01);
+
+  // Project every sample in parallel, and build the markers of each one
+  std::vector<robot_calibration_msgs::msg::CalibrationData> samples;
+  std::vector<Projections> projections;
+  std::vector<visualization_msgs::msg::MarkerArray> sample_markers;
+  if (precompute)
+  {
+    robot_calibration_msgs::msg::CalibrationData data;
+    while (reader.next(data))
+    {
+      samples.push_back(data);
+    }
+    projections.resize(samples.size(), Projections(model_names.size()));
+    sample_markers.resize(samples.size());
+
+    // Projection does not modify the models or offsets
+    rclcpp::Time stamp = node->now();
+    std::atomic<size_t> next(0);
+    auto worker = [&]()
+    {
+      for (size_t s = next++; s < samples.size(); s = next++)
+      {
+        for (size_t m = 0; m < model_names.size(); ++m)
+        {
+          projections[s][m] = models[model_names[m]]->project(samples[s], offsets);
+        }
+        sample_markers[s] = makeMarkers(projections[s], model_names, model_colors,
+                                        params.base_link, stamp);
+      }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < std::max(1u, std::thread::hardware_concurrency()); ++t)
+    {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads)
+    {
+      thread.join();
+    }
+    RCLCPP_INFO(node->get_logger(), "Projected %lu samples", samples.size());
+
+    // Publish the combined cloud of each model (latched)
+    std::vector<rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr> all_pubs;
+    for (size_t m = 0; m < model_names.size(); ++m)
+    {
+      all_pubs.push_back(node->create_publisher<sensor_msgs::msg::PointCloud2>(
+        model_names[m] + "_all", rclcpp::QoS(1).transient_local()));
+      all_pubs.back()->publish(makeResidualCloud(projections, m, residual_scale,
+                                                 params.base_link, stamp));
+    }
+  }
+
   // Publish messages
-  for (size_t i = 0; i < data.size(); ++i)
+  robot_calibration_msgs::msg::CalibrationData data;
+  for (size_t s = 0; precompute ? (s < samples.size()) : reader.next(data); ++s)
   {
     // Break out if ROS is dead
     if (!rclcpp::ok())
       break;
 
     // Publish a marker array
-    visualization_msgs::msg::MarkerArray markers;
-    for (size_t m = 0; m < model_names.size(); ++m)
+    if (precompute)
     {
-      // Project through model
-      std::vector<geometry_msgs::msg::PointStamped> points;
-      points = models[model_names[m]]->project(data[i], offsets);
-
-      if (points.empty())
-      {
-        continue;
-      }
-
-      // Convert into marker
-      visualization_msgs::msg::Marker msg;
-      msg.header.frame_id = params.base_link;
-      msg.header.stamp = node->now();
-      msg.ns = model_names[m];
-      msg.id = m;
-      msg.type = msg.SPHERE_LIST;
-      msg.pose.orientation.w = 1.0;
-      msg.scale.x = 0.01;
-      msg.scale.y = 0.01;
-      msg.scale.z = 0.01;
-      msg.points.push_back(points[0].point);
-      msg.colors.push_back(model_colors[0]);
-      for (size_t p = 1; p < points.size(); ++p)
+      pub->publish(sample_markers[s]);
+    }
+    else
+    {
+      Projections points(model_names.size());
+      for (size_t m = 0; m < model_names.size(); ++m)
       {
-        msg.points.push_back(points[p].point);
-        msg.colors.push_back(model_colors[m+1]);
+        // Project through model
+        points[m] = models[model_names[m]]->project(data, offsets);
       }
-      markers.markers.push_back(msg);
+      pub->publish(makeMarkers(points, model_names, model_colors, params.base_link, node->now()));
     }
-    pub->publish(markers);
+
+    const robot_calibration_msgs::msg::CalibrationData& sample = precompute ? samples[s] : data;
 
     // Publish the joint states
-    sensor_msgs::msg::JointState state_msg = data[i].joint_states;
+    sensor_msgs::msg::JointState state_msg = sample.joint_states;
     for (size_t j = 0; j < state_msg.name.size(); ++j)
     {
       double offset = offsets.get(state_msg.name[j]);
@@ -260,14 +437,14 @@ int main(int argc, char** argv)
     state->publish(state_msg);
 
     // Publish sensor data (if present)
-    for (size_t obs = 0; obs < data[i].observations.size(); ++obs)
+    for (size_t obs = 0; obs < sample.observations.size(); ++obs)
     {
-      if (data[i].observations[obs].cloud.height != 0)
+      if (sample.observations[obs].cloud.height != 0)
       {
-        auto pub = camera_pubs.find(data[i].observations[obs].sensor_name);
+        auto pub = camera_pubs.find(sample.observations[obs].sensor_name);
         if (pub != camera_pubs.end())
         {
-          pub->second->publish(data[i].observations[obs].cloud);
+          pub->second->publish(sample.observations[obs].cloud);
         }
       }
     }
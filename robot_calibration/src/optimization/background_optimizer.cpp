@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <robot_calibration/optimization/background_optimizer.hpp>
+#include <robot_calibration/util/calibration_data.hpp>
+
+namespace robot_calibration
+{
+
+BackgroundOptimizer::BackgroundOptimizer(const std::string& robot_description,
+                                         const OptimizationParams& params,
+                                         rclcpp::Logger logger,
+                                         const MeshLoader::Params& mesh_params) :
+  optimizer_(std::make_shared<Optimizer>(robot_description, mesh_params)),
+  params_(params),
+  logger_(logger),
+  stop_(false)
+{
+  thread_ = std::thread(&BackgroundOptimizer::run, this);
+}
+
+BackgroundOptimizer::~BackgroundOptimizer()
+{
+  stop();
+}
+
+void BackgroundOptimizer::add(const robot_calibration_msgs::msg::CalibrationData& msg)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The optimizer does not use the debugging cloud or image
+    pending_.push_back(*makeSample(msg));
+  }
+  cond_.notify_one();
+}
+
+void BackgroundOptimizer::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+}
+
+std::shared_ptr<Optimizer> BackgroundOptimizer::getOptimizer()
+{
+  return optimizer_;
+}
+
+const std::vector<robot_calibration_msgs::msg::CalibrationData>& BackgroundOptimizer::getData() const
+{
+  return data_;
+}
+
+void BackgroundOptimizer::run()
+{
+  while (true)
+  {
+    bool stopping = false;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this]() { return stop_ || !pending_.empty(); });
+      for (auto& msg : pending_)
+      {
+        data_.push_back(std::move(msg));
+      }
+      pending_.clear();
+      stopping = stop_;
+    }
+
+    if (stopping)
+    {
+      // The full calibration will be run on all of the samples
+      return;
+    }
+
+    // Samples are only appended, so the optimizer keeps the cost functions
+    // of earlier samples and starts from the previous solution
+    if (optimizer_->optimize(params_, data_, logger_) != 0)
+    {
+      RCLCPP_WARN(logger_, "Background calibration failed with %lu samples", data_.size());
+      continue;
+    }
+
+    auto summary = optimizer_->summary();
+    RCLCPP_INFO(logger_, "Background calibration with %lu samples: %d residuals, final cost %f",
+                data_.size(), optimizer_->getNumResiduals(), summary->final_cost);
+  }
+}
+
+}  // namespace robot_calibration
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <robot_calibration/optimization/batched_cost_function.hpp>
+
+namespace robot_calibration
+{
+
+BatchedCostFunction::BatchedCostFunction(const std::vector<ceres::CostFunction*>& costs) :
+  costs_(costs)
+{
+  int num_residuals = 0;
+  for (const auto& cost : costs_)
+  {
+    starts_.push_back(num_residuals);
+    num_residuals += cost->num_residuals();
+  }
+  set_num_residuals(num_residuals);
+  if (!costs_.empty())
+  {
+    *mutable_parameter_block_sizes() = costs_.front()->parameter_block_sizes();
+  }
+  jacobians_.resize(parameter_block_sizes().size());
+}
+
+bool BatchedCostFunction::Evaluate(double const * const * parameters,
+                                   double* residuals,
+                                   double** jacobians) const
+{
+  const std::vector<int32_t>& block_sizes = parameter_block_sizes();
+  for (size_t c = 0; c < costs_.size(); ++c)
+  {
+    double** cost_jacobians = NULL;
+    if (jacobians)
+    {
+      for (size_t b = 0; b < block_sizes.size(); ++b)
+      {
+        jacobians_[b] = jacobians[b] ? jacobians[b] + starts_[c] * block_sizes[b] : NULL;
+      }
+      cost_jacobians = jacobians_.data();
+    }
+    if (!costs_[c]->Evaluate(parameters, residuals + starts_[c], cost_jacobians))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace robot_calibration
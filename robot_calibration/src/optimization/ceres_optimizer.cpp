@@ -20,15 +20,25 @@
 
 #include <robot_calibration/optimization/ceres_optimizer.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <limits>
 #include <memory>
+#include <sstream>
+#include <thread>
 #include <ceres/ceres.h>
 
 #include <urdf/model.h>
 #include <kdl_parser/kdl_parser.hpp>
 #include <robot_calibration_msgs/msg/calibration_data.hpp>
 
+#include <robot_calibration/optimization/batched_cost_function.hpp>
 #include <robot_calibration/optimization/offsets.hpp>
+#include <robot_calibration/optimization/residual_report.hpp>
 #include <robot_calibration/util/calibration_data.hpp>
+#include <robot_calibration/util/feature_sampling.hpp>
 #include <robot_calibration/cost_functions/chain3d_to_camera2d_error.hpp>
 #include <robot_calibration/cost_functions/chain3d_to_chain3d_error.hpp>
 #include <robot_calibration/cost_functions/chain3d_to_mesh_error.hpp>
@@ -44,7 +54,226 @@
 namespace robot_calibration
 {
 
-Optimizer::Optimizer(const std::string& robot_description) :
+/**
+ *  @brief Get the cost function to add to the problem, wrapped to record
+ *         evaluation times if profiling.
+ *  @param profiled The wrapped cost functions of this error block.
+ */
+static ceres::CostFunction* profileCost(ceres::CostFunction* cost,
+                                        bool profile,
+                                        std::vector<ProfiledCostFunctionPtr>& profiled)
+{
+  if (!profile)
+  {
+    return cost;
+  }
+  profiled.push_back(std::make_shared<ProfiledCostFunction>(cost));
+  return profiled.back().get();
+}
+
+/**
+ *  @brief Get the parameter blocks that an error block is connected to.
+ *  @param blocks The blocks of the offsets, as returned by the error block Create().
+ *  @param parameters The pointer to each block, within free_params.
+ *  @returns False if the error block does not depend on any free parameters.
+ */
+static bool getParameterBlocks(const OptimizationOffsets& offsets,
+                               double* free_params,
+                               const std::vector<int>& blocks,
+                               std::vector<double*>& parameters)
+{
+  parameters.clear();
+  for (size_t i = 0; i < blocks.size(); ++i)
+  {
+    parameters.push_back(free_params + offsets.getBlockStart(blocks[i]));
+  }
+
+  // Residuals would be constant, ceres requires at least one parameter block
+  return !parameters.empty();
+}
+
+/**
+ *  @brief Create the loss function for an error block.
+ *  @returns The loss function, or NULL for squared loss.
+ */
+static ceres::LossFunction* createLossFunction(const OptimizationParams::ParamsPtr& params)
+{
+  auto p = std::dynamic_pointer_cast<OptimizationParams::ErrorBlockParams>(params);
+  if (!p)
+    return NULL;
+  if (p->loss == "huber")
+    return new ceres::HuberLoss(p->loss_scale);
+  if (p->loss == "soft_l1")
+    return new ceres::SoftLOneLoss(p->loss_scale);
+  if (p->loss == "cauchy")
+    return new ceres::CauchyLoss(p->loss_scale);
+  if (p->loss == "arctan")
+    return new ceres::ArctanLoss(p->loss_scale);
+  return NULL;  // squared loss
+}
+
+/**
+ *  @brief Get a key describing the layout of the free parameters, cost
+ *         functions can only be reused by steps with the same layout.
+ */
+static std::string getLayoutKey(const OptimizationParams& params,
+                                const OptimizationOffsets& offsets)
+{
+  std::stringstream key;
+  key << offsets.getRevision();
+  for (size_t i = 0; i < params.free_params.size(); ++i)
+  {
+    key << " " << params.free_params[i];
+  }
+  for (size_t i = 0; i < params.free_frames.size(); ++i)
+  {
+    const OptimizationParams::FreeFrameParams& f = params.free_frames[i];
+    key << " " << f.name << ":" << f.x << f.y << f.z << f.roll << f.pitch << f.yaw;
+  }
+  return key.str();
+}
+
+// Sample index of the cached cost functions which do not depend on a sample
+static const size_t SAMPLE_INDEPENDENT = std::numeric_limits<size_t>::max();
+
+/**
+ *  @brief Does an error block type add the same residuals for every
+ *         sample? If so, it is only added once.
+ */
+static bool isSampleIndependent(const std::string& type)
+{
+  return type == "outrageous";
+}
+
+/**
+ *  @brief Get a key describing everything an error block passes to the
+ *         Create() of its cost function. The loss function is not included,
+ *         since it is created for each step.
+ */
+static std::string getCostKey(const OptimizationParams::ParamsPtr& params)
+{
+  std::stringstream key;
+  key << std::setprecision(17) << params->type << " " << params->name;
+  if (auto p = std::dynamic_pointer_cast<OptimizationParams::ErrorBlockParams>(params))
+  {
+    key << " " << p->numeric_diff;
+  }
+  if (auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToChain3dParams>(params))
+  {
+    key << " " << p->model_a << " " << p->model_b << " " << p->analytic_diff;
+  }
+  else if (auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToCamera2dParams>(params))
+  {
+    key << " " << p->model_3d << " " << p->model_2d << " " << p->scale;
+  }
+  else if (auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToPlaneParams>(params))
+  {
+    key << " " << p->model << " " << p->a << " " << p->b << " " << p->c << " " << p->d <<
+           " " << p->scale << " " << p->analytic_diff;
+  }
+  else if (auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToMeshParams>(params))
+  {
+    key << " " << p->model << " " << p->link_name << " " << p->point_to_triangle;
+  }
+  else if (auto p = std::dynamic_pointer_cast<OptimizationParams::PlaneToPlaneParams>(params))
+  {
+    key << " " << p->model_a << " " << p->model_b << " " << p->normal_scale <<
+           " " << p->offset_scale;
+  }
+  else if (auto p = std::dynamic_pointer_cast<OptimizationParams::OutrageousParams>(params))
+  {
+    key << " " << p->param << " " << p->joint_scale << " " << p->position_scale <<
+           " " << p->rotation_scale;
+  }
+  return key.str();
+}
+
+/** @brief Copy the summary of one iteration of the solver into a progress message. */
+static void makeProgress(const ceres::IterationSummary& summary,
+                         robot_calibration_msgs::msg::OptimizationProgress& progress)
+{
+  progress.iteration = summary.iteration;
+  progress.step_is_successful = summary.step_is_successful;
+  progress.cost = summary.cost;
+  progress.cost_change = summary.cost_change;
+  progress.gradient_max_norm = summary.gradient_max_norm;
+  progress.gradient_norm = summary.gradient_norm;
+  progress.step_norm = summary.step_norm;
+  progress.relative_decrease = summary.relative_decrease;
+  progress.trust_region_radius = summary.trust_region_radius;
+  progress.linear_solver_iterations = summary.linear_solver_iterations;
+  progress.iteration_time = summary.iteration_time_in_seconds;
+  progress.step_solver_time = summary.step_solver_time_in_seconds;
+  progress.cumulative_time = summary.cumulative_time_in_seconds;
+}
+
+/** @brief Copy the totals of a finished solve into the final progress message. */
+static void makeDoneProgress(const ceres::Solver::Summary& summary,
+                             robot_calibration_msgs::msg::OptimizationProgress& progress)
+{
+  if (!summary.iterations.empty())
+  {
+    makeProgress(summary.iterations.back(), progress);
+  }
+  progress.cumulative_time = summary.total_time_in_seconds;
+  progress.done = true;
+  progress.residual_evaluation_time = summary.residual_evaluation_time_in_seconds;
+  progress.jacobian_evaluation_time = summary.jacobian_evaluation_time_in_seconds;
+  progress.linear_solver_time = summary.linear_solver_time_in_seconds;
+}
+
+/** @brief Print and/or write the residual report of a step, as configured. */
+static void outputResidualReport(const OptimizationParams& params,
+                                 const std::vector<SampleResiduals>& residuals,
+                                 bool progress_to_stdout,
+                                 rclcpp::Logger& logger)
+{
+  if (progress_to_stdout)
+  {
+    printResidualSummary(std::cout, residuals);
+  }
+  if (!params.residual_report.empty())
+  {
+    if (writeResidualReport(params.residual_report, residuals))
+    {
+      RCLCPP_INFO(logger, "Wrote residual report to %s", params.residual_report.c_str());
+    }
+    else
+    {
+      RCLCPP_ERROR(logger, "Unable to write residual report to %s", params.residual_report.c_str());
+    }
+  }
+}
+
+/** @brief Forwards each iteration of the solver to a progress callback. */
+class ProgressIterationCallback : public ceres::IterationCallback
+{
+public:
+  explicit ProgressIterationCallback(const Optimizer::ProgressCallback& callback) :
+    callback_(callback)
+  {
+  }
+
+  ceres::CallbackReturnType operator()(const ceres::IterationSummary& summary) override
+  {
+    robot_calibration_msgs::msg::OptimizationProgress progress;
+    makeProgress(summary, progress);
+    if (!callback_(progress))
+    {
+      return ceres::SOLVER_ABORT;
+    }
+    return ceres::SOLVER_CONTINUE;
+  }
+
+private:
+  const Optimizer::ProgressCallback& callback_;
+};
+
+Optimizer::Optimizer(const std::string& robot_description,
+                     const MeshLoader::Params& mesh_params) :
+  tree_valid_(false),
+  samples_source_(NULL),
+  keep_residuals_(false),
   num_params_(0),
   num_residuals_(0)
 {
@@ -56,66 +285,45 @@ Optimizer::Optimizer(const std::string& robot_description) :
   offsets_.reset(new OptimizationOffsets());
 
   // Create a mesh loader
-  mesh_loader_.reset(new MeshLoader(model_));
+  mesh_loader_.reset(new MeshLoader(model_, mesh_params));
+}
+
+Optimizer::Optimizer(std::shared_ptr<urdf::Model> model,
+                     const KDL::Tree& tree,
+                     std::shared_ptr<MeshLoader> mesh_loader) :
+  model_(model),
+  tree_(tree),
+  tree_valid_(true),
+  mesh_loader_(mesh_loader),
+  samples_source_(NULL),
+  keep_residuals_(false),
+  num_params_(0),
+  num_residuals_(0)
+{
+  offsets_.reset(new OptimizationOffsets());
 }
 
 Optimizer::~Optimizer()
 {
 }
 
-int Optimizer::optimize(OptimizationParams& params,
-                        std::vector<robot_calibration_msgs::msg::CalibrationData> data,
-                        rclcpp::Logger& logger,
-                        bool progress_to_stdout)
+bool Optimizer::setupOffsets(OptimizationParams& params, rclcpp::Logger& logger)
 {
-  // Load KDL from URDF
-  if (!kdl_parser::treeFromUrdfModel(*model_, tree_))
+  // Load KDL from URDF, this is only done for the first step
+  if (!tree_valid_)
   {
-    std::cerr << "Failed to construct KDL tree" << std::endl;
-    return -1;
+    if (!kdl_parser::treeFromUrdfModel(*model_, tree_))
+    {
+      std::cerr << "Failed to construct KDL tree" << std::endl;
+      return false;
+    }
+    tree_valid_ = true;
   }
 
-  // Create models
-  for (size_t i = 0; i < params.models.size(); ++i)
+  // Create models, cost functions hold pointers to the models
+  if (!updateModels(params, logger))
   {
-    if (params.models[i].type == "chain3d")
-    {
-      RCLCPP_INFO_STREAM(logger, "Creating chain '" << params.models[i].name << "' from " <<
-                                                       params.base_link << " to " <<
-                                                       params.models[i].frame);
-      Chain3dModel* model = new Chain3dModel(params.models[i].name, tree_, params.base_link, params.models[i].frame);
-      models_[params.models[i].name] = model;
-    }
-    else if (params.models[i].type == "camera3d")
-    {
-      RCLCPP_INFO_STREAM(logger, "Creating camera3d '" << params.models[i].name << "' in frame " <<
-                                                          params.models[i].frame);
-      std::string param_name = params.models[i].param_name;
-      if (param_name == "")
-      {
-        // Default to same name as sensor
-        param_name = params.models[i].name;
-      }
-      Camera3dModel* model = new Camera3dModel(params.models[i].name, param_name, tree_, params.base_link, params.models[i].frame);
-      models_[params.models[i].name] = model;
-    }
-    else if (params.models[i].type == "camera2d")
-    {
-      RCLCPP_INFO_STREAM(logger, "Creating camera2d '" << params.models[i].name << "' in frame " <<
-                                                          params.models[i].frame);
-      std::string param_name = params.models[i].param_name;
-      if (param_name == "")
-      {
-        // Default to same name as sensor
-        param_name = params.models[i].name;
-      }
-      Camera2dModel* model = new Camera2dModel(params.models[i].name, param_name, tree_, params.base_link, params.models[i].frame);
-      models_[params.models[i].name] = model;
-    }
-    else
-    {
-      RCLCPP_ERROR(logger, "Unknown model type: %s", params.models[i].type.c_str());
-    }
+    costs_.clear();
   }
 
   // Reset which parameters are free (offset values are retained)
@@ -151,306 +359,556 @@ int Optimizer::optimize(OptimizationParams& params,
     }
   }
 
-  // Allocate space
-  double* free_params = new double[offsets_->size()];
-  offsets_->initialize(free_params);
+  // Cost functions depend on the layout of the free parameters
+  std::string layout = getLayoutKey(params, *offsets_);
+  if (layout != costs_layout_)
+  {
+    costs_.clear();
+    costs_layout_ = layout;
+  }
 
-  // Houston, we have a problem...
-  ceres::Problem* problem = new ceres::Problem();
+  return true;
+}
 
-  // For each sample of data:
-  for (size_t i = 0; i < data.size(); ++i)
+bool Optimizer::evaluateSampleResiduals(ceres::Problem* problem,
+                                        int num_threads,
+                                        const std::vector<std::vector<SampleBlock>>& sample_blocks,
+                                        std::vector<double>& residuals)
+{
+  // Batched residual blocks are shared by several samples, evaluate each once
+  ceres::Problem::EvaluateOptions options;
+  options.apply_loss_function = false;
+  options.num_threads = std::max(1, num_threads);
+  std::map<ceres::ResidualBlockId, int> block_starts;
+  int num_residuals = 0;
+  for (const auto& blocks : sample_blocks)
   {
-    for (size_t j = 0; j < params.error_blocks.size(); ++j)
+    for (const auto& block : blocks)
     {
-      if (params.error_blocks[j]->type == "chain3d_to_chain3d")
+      if (block_starts.insert(std::make_pair(block.id, num_residuals)).second)
       {
-        // This error block can process data generated by the LedFinder,
-        // CheckboardFinder, or any other finder that can sample the pose
-        // of one or more data points that are connected at a constant offset
-        // from a link a kinematic chain (the "arm").
-        auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToChain3dParams>(params.error_blocks[j]);
-        std::string a_name = p->model_a;
-        std::string b_name = p->model_b;
+        options.residual_blocks.push_back(block.id);
+        num_residuals += problem->GetCostFunctionForResidualBlock(block.id)->num_residuals();
+      }
+    }
+  }
 
-        // Do some basic error checking for bad params
-        if (a_name == "" || b_name == "" || a_name == b_name)
-        {
-          RCLCPP_ERROR(logger, "chain3d_to_chain3d improperly configured: model_a and model_b params must be set!");
-          return 0;
-        }
+  // An empty list of residual blocks would evaluate all of them
+  residuals.clear();
+  if (options.residual_blocks.empty())
+  {
+    return true;
+  }
+  std::vector<double> block_residuals;
+  if (!problem->Evaluate(options, NULL, &block_residuals, NULL, NULL))
+  {
+    return false;
+  }
 
-        // Check that this sample has the required features/observations
-        if (!hasSensor(data[i], a_name) || !hasSensor(data[i], b_name))
-          continue;
+  for (const auto& blocks : sample_blocks)
+  {
+    for (const auto& block : blocks)
+    {
+      auto begin = block_residuals.begin() + block_starts[block.id] + block.start;
+      residuals.insert(residuals.end(), begin, begin + block.num_residuals);
+    }
+  }
+  return true;
+}
 
-        // Create the block
-        ceres::CostFunction * cost = Chain3dToChain3d::Create(models_[a_name],
-                                                              models_[b_name],
-                                                              offsets_.get(),
-                                                              data[i]);
+bool Optimizer::addResidualBlocks(OptimizationParams& params,
+                                  const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                                  rclcpp::Logger& logger,
+                                  ceres::Problem* problem,
+                                  double* free_params,
+                                  int batch_samples,
+                                  std::vector<std::vector<ProfiledCostFunctionPtr>>& profiled,
+                                  std::vector<std::vector<SampleBlock>>& sample_blocks)
+{
+  // Error blocks share a single copy of each sample, without debugging data,
+  // which is kept for later steps with the same data. Samples may have been
+  // appended to the data since the last step.
+  if (samples_source_ != &data || samples_.size() > data.size())
+  {
+    samples_.clear();
+    samples_source_ = &data;
+    costs_.clear();
+  }
+  for (size_t i = samples_.size(); i < data.size(); ++i)
+  {
+    samples_.push_back(makeSample(data[i]));
+  }
 
-        // Output initial error
-        if (progress_to_stdout)
-        {
-          double ** params = new double*[1];
-          params[0] = free_params;
-          double * residuals = new double[cost->num_residuals()];
-
-          cost->Evaluate(params, residuals, NULL);
-
-          std::cout << "INITIAL COST (" << i << ")" << std::endl << "  x: ";
-          for (size_t k = 0; k < static_cast<size_t>(cost->num_residuals() / 3); ++k)
-            std::cout << "  " << std::setw(10) << std::fixed << residuals[(3*k + 0)];
-          std::cout << std::endl << "  y: ";
-          for (size_t k = 0; k < static_cast<size_t>(cost->num_residuals() / 3); ++k)
-            std::cout << "  " << std::setw(10) << std::fixed << residuals[(3*k + 1)];
-          std::cout << std::endl << "  z: ";
-          for (size_t k = 0; k < static_cast<size_t>(cost->num_residuals() / 3); ++k)
-            std::cout << "  " << std::setw(10) << std::fixed << residuals[(3*k + 2)];
-          std::cout << std::endl << std::endl;
-        }
+  // Cost functions are cached by the configuration of their error block
+  std::vector<std::string> cost_keys;
+  for (size_t j = 0; j < params.error_blocks.size(); ++j)
+  {
+    cost_keys.push_back(getCostKey(params.error_blocks[j]));
+  }
 
-        problem->AddResidualBlock(cost,
-                                  NULL,  // squared loss
-                                  free_params);
-      }
-      else if (params.error_blocks[j]->type == "chain3d_to_plane")
-      {
-        // This error block can process data generated by the PlaneFinder
-        auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToPlaneParams>(params.error_blocks[j]);
-        std::string chain_name = p->model;
+  sample_blocks.assign(samples_.size(), std::vector<SampleBlock>());
+  batched_costs_.clear();
 
-        // Do some basic error checking for bad params
-        if (chain_name == "")
-        {
-          RCLCPP_ERROR(logger, "chain3d_to_plane improperly configured: model param must be set!");
-          return 0;
-        }
+  // Samples of an error block connected to the same parameter blocks can be
+  // batched, unless the error block has a loss function, which would then
+  // apply to the whole batch rather than to each sample
+  std::vector<bool> batched(params.error_blocks.size(), false);
+  for (size_t j = 0; j < params.error_blocks.size(); ++j)
+  {
+    std::unique_ptr<ceres::LossFunction> loss(createLossFunction(params.error_blocks[j]));
+    batched[j] = (batch_samples > 1) && !loss;
+  }
+  using BatchKey = std::pair<size_t, std::vector<double*>>;
+  std::map<BatchKey, std::vector<std::pair<size_t, ceres::CostFunction*>>> batches;
 
-        // Check that this sample has the required features/observations
-        if (!hasSensor(data[i], chain_name))
-          continue;
+  // Add the residual block of one sample, or defer it to a batch
+  auto addSampleBlock = [&](size_t i, size_t j,
+                            ceres::CostFunction* cost,
+                            const std::vector<double*>& parameters)
+  {
+    if (batched[j])
+    {
+      batches[std::make_pair(j, parameters)].push_back(std::make_pair(i, cost));
+      return;
+    }
+    SampleBlock block;
+    block.id = problem->AddResidualBlock(profileCost(cost, params.profile, profiled[j]),
+                                         createLossFunction(params.error_blocks[j]),
+                                         parameters);
+    block.error_block = j;
+    block.start = 0;
+    block.num_residuals = cost->num_residuals();
+    sample_blocks[i].push_back(block);
+  };
 
-        // Create the block
-        ceres::CostFunction * cost =
-          Chain3dToPlane::Create(models_[chain_name],
-                                 offsets_.get(),
-                                 data[i],
-                                 p->a,
-                                 p->b,
-                                 p->c,
-                                 p->d,
-                                 p->scale);
-
-        // Output initial error
-        if (progress_to_stdout)
-        {
-          double ** params = new double*[1];
-          params[0] = free_params;
-          double * residuals = new double[cost->num_residuals()];
+  // Validate each error block once, rather than for each sample
+  std::vector<Camera2dModel*> cameras(params.error_blocks.size(), NULL);
+  for (size_t j = 0; j < params.error_blocks.size(); ++j)
+  {
+    const std::string& type = params.error_blocks[j]->type;
+    if (type == "chain3d_to_chain3d")
+    {
+      auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToChain3dParams>(params.error_blocks[j]);
+      if (p->model_a == "" || p->model_b == "" || p->model_a == p->model_b)
+      {
+        RCLCPP_ERROR(logger, "chain3d_to_chain3d improperly configured: model_a and model_b params must be set!");
+        return false;
+      }
+    }
+    else if (type == "chain3d_to_plane")
+    {
+      auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToPlaneParams>(params.error_blocks[j]);
+      if (p->model == "")
+      {
+        RCLCPP_ERROR(logger, "chain3d_to_plane improperly configured: model param must be set!");
+        return false;
+      }
+    }
+    else if (type == "chain3d_to_mesh")
+    {
+      auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToMeshParams>(params.error_blocks[j]);
+      if (p->model == "")
+      {
+        RCLCPP_ERROR(logger, "chain3d_to_mesh improperly configured: model param must be set!");
+        return false;
+      }
+    }
+    else if (type == "chain3d_to_camera2d")
+    {
+      auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToCamera2dParams>(params.error_blocks[j]);
+      if (p->model_3d == "" || p->model_2d == "")
+      {
+        RCLCPP_ERROR(logger, "chain3d_to_camera2d improperly configured: model_3d and model_2d params must be set!");
+        return false;
+      }
 
-          cost->Evaluate(params, residuals, NULL);
+      // Have to cast our Camera2d model
+      cameras[j] = dynamic_cast<Camera2dModel*>(getModel(p->model_2d));
+      if (!cameras[j])
+      {
+        RCLCPP_ERROR(logger, "camera2d model is improperly specified");
+        return false;
+      }
+    }
+    else if (type == "plane_to_plane")
+    {
+      auto p = std::dynamic_pointer_cast<OptimizationParams::PlaneToPlaneParams>(params.error_blocks[j]);
+      if (p->model_a == "" || p->model_b == "" || p->model_a == p->model_b)
+      {
+        RCLCPP_ERROR(logger, "plane_to_plane improperly configured: model_a and model_a params must be set!");
+        return false;
+      }
+    }
+    else if (!isSampleIndependent(type))
+    {
+      RCLCPP_ERROR(logger, "Unknown error block: %s", type.c_str());
+      return false;
+    }
+  }
 
-          std::cout << "INITIAL COST (" << i << ")" << std::endl << "  d: ";
-          for (size_t k = 0; k < static_cast<size_t>(cost->num_residuals()); ++k)
-            std::cout << "  " << std::setw(10) << std::fixed << residuals[(k)];
-          std::cout << std::endl << std::endl;
-        }
+  // Find the error blocks of each sample, meshes are loaded once they are needed
+  struct SampleCost
+  {
+    size_t sample;
+    size_t error_block;
+    CachedCost* cached;
+  };
+  std::vector<SampleCost> sample_costs;
+  std::vector<MeshTreePtr> meshes(params.error_blocks.size());
+  for (size_t i = 0; i < samples_.size(); ++i)
+  {
+    for (size_t j = 0; j < params.error_blocks.size(); ++j)
+    {
+      const std::string& type = params.error_blocks[j]->type;
+      if (isSampleIndependent(type))
+      {
+        continue;
+      }
 
-        problem->AddResidualBlock(cost,
-                                  NULL /* squared loss */,
-                                  free_params);
+      // Check that this sample has the required features/observations
+      if (type == "chain3d_to_chain3d")
+      {
+        auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToChain3dParams>(params.error_blocks[j]);
+        if (!hasSensor(*samples_[i], p->model_a) || !hasSensor(*samples_[i], p->model_b))
+          continue;
+      }
+      else if (type == "chain3d_to_plane")
+      {
+        auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToPlaneParams>(params.error_blocks[j]);
+        if (!hasSensor(*samples_[i], p->model))
+          continue;
       }
-      else if (params.error_blocks[j]->type == "chain3d_to_mesh")
+      else if (type == "chain3d_to_mesh")
       {
-        // This error block can process data generated by the RobotFinder
         auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToMeshParams>(params.error_blocks[j]);
-        std::string chain_name = p->model;
-
-        // Do some basic error checking for bad params
-        if (chain_name == "")
-        {
-          RCLCPP_ERROR(logger, "chain3d_to_mesh improperly configured: model param must be set!");
-          return 0;
-        }
-
-        // Check that this sample has the required features/observations
-        if (!hasSensor(data[i], chain_name))
+        if (!hasSensor(*samples_[i], p->model))
           continue;
 
-        // Get the mesh
-        MeshPtr mesh = mesh_loader_->getCollisionMesh(p->link_name);
-        if (!mesh)
-        {
-          RCLCPP_ERROR(logger, "chain3d_to_mesh improperly configured: cannot load mesh for %s", p->link_name.c_str());
-          return 0;
-        }
-
-        // Create the block
-        ceres::CostFunction * cost =
-          Chain3dToMesh::Create(models_[chain_name],
-                                offsets_.get(),
-                                data[i],
-                                mesh);
-
-        // Output initial error
-        if (progress_to_stdout)
+        if (!meshes[j])
         {
-          double ** params = new double*[1];
-          params[0] = free_params;
-          double * residuals = new double[cost->num_residuals()];
-
-          cost->Evaluate(params, residuals, NULL);
-
-          std::cout << "INITIAL COST (" << i << ")" << std::endl << "  d: ";
-          for (size_t k = 0; k < static_cast<size_t>(cost->num_residuals()); ++k)
-            std::cout << "  " << std::setw(10) << std::fixed << residuals[(k)];
-          std::cout << std::endl << std::endl;
+          meshes[j] = mesh_loader_->getCollisionMeshTree(p->link_name);
+          if (!meshes[j])
+          {
+            RCLCPP_ERROR(logger, "chain3d_to_mesh improperly configured: cannot load mesh for %s", p->link_name.c_str());
+            return false;
+          }
         }
-
-        problem->AddResidualBlock(cost,
-                                  NULL /* squared loss */,
-                                  free_params);
-
-
       }
-      else if (params.error_blocks[j]->type == "chain3d_to_camera2d")
+      else if (type == "chain3d_to_camera2d")
       {
-        // This error block can process data generated by the CheckerboardFinder2d,
         auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToCamera2dParams>(params.error_blocks[j]);
+        if (!hasSensor(*samples_[i], p->model_3d) || !hasSensor(*samples_[i], p->model_2d))
+          continue;
+      }
+      else if (type == "plane_to_plane")
+      {
+        auto p = std::dynamic_pointer_cast<OptimizationParams::PlaneToPlaneParams>(params.error_blocks[j]);
+        if (!hasSensor(*samples_[i], p->model_a) || !hasSensor(*samples_[i], p->model_b))
+          continue;
+      }
 
-        // Do some basic error checking for bad params
-        if (p->model_3d == "" || p->model_2d == "")
-        {
-          RCLCPP_ERROR(logger, "chain3d_to_camera2d improperly configured: model_3d and model_2d params must be set!");
-          return 0;
-        }
+      // Cost function from a previous step, if any
+      SampleCost sample_cost;
+      sample_cost.sample = i;
+      sample_cost.error_block = j;
+      sample_cost.cached = &costs_[std::make_pair(cost_keys[j], i)];
+      sample_costs.push_back(sample_cost);
+    }
+  }
 
-        // Check that this sample has the required features/observations
-        if (!hasSensor(data[i], p->model_3d) || !hasSensor(data[i], p->model_2d))
-        {
-          continue;
-        }
+  // Create the cost function of a sample, this only reads the models,
+  // offsets and sample, so cost functions can be created in parallel
+  auto createCost = [&](const SampleCost& sample_cost)
+  {
+    size_t i = sample_cost.sample;
+    size_t j = sample_cost.error_block;
+    CachedCost& cached = *sample_cost.cached;
+    const std::string& type = params.error_blocks[j]->type;
+    if (type == "chain3d_to_chain3d")
+    {
+      // This error block can process data generated by the LedFinder,
+      // CheckboardFinder, or any other finder that can sample the pose
+      // of one or more data points that are connected at a constant offset
+      // from a link a kinematic chain (the "arm").
+      auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToChain3dParams>(params.error_blocks[j]);
+      cached.cost.reset(Chain3dToChain3d::Create(getModel(p->model_a),
+                                                 getModel(p->model_b),
+                                                 offsets_.get(),
+                                                 samples_[i],
+                                                 cached.blocks,
+                                                 p->numeric_diff,
+                                                 p->analytic_diff));
+    }
+    else if (type == "chain3d_to_plane")
+    {
+      // This error block can process data generated by the PlaneFinder
+      auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToPlaneParams>(params.error_blocks[j]);
+      cached.cost.reset(Chain3dToPlane::Create(getModel(p->model),
+                                               offsets_.get(),
+                                               samples_[i],
+                                               p->a,
+                                               p->b,
+                                               p->c,
+                                               p->d,
+                                               p->scale,
+                                               cached.blocks,
+                                               p->numeric_diff,
+                                               p->analytic_diff));
+    }
+    else if (type == "chain3d_to_mesh")
+    {
+      // This error block can process data generated by the RobotFinder
+      auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToMeshParams>(params.error_blocks[j]);
+      cached.cost.reset(Chain3dToMesh::Create(getModel(p->model),
+                                              offsets_.get(),
+                                              samples_[i],
+                                              meshes[j],
+                                              p->point_to_triangle,
+                                              cached.blocks,
+                                              p->numeric_diff));
+    }
+    else if (type == "chain3d_to_camera2d")
+    {
+      // This error block can process data generated by the CheckerboardFinder2d,
+      auto p = std::dynamic_pointer_cast<OptimizationParams::Chain3dToCamera2dParams>(params.error_blocks[j]);
+      cached.cost.reset(Chain3dToCamera2d::Create(getModel(p->model_3d),
+                                                  cameras[j],
+                                                  p->scale,
+                                                  offsets_.get(),
+                                                  samples_[i],
+                                                  cached.blocks,
+                                                  p->numeric_diff));
+    }
+    else if (type == "plane_to_plane")
+    {
+      // This error block can process data generated by the PlaneFinder,
+      // CheckerboardFinder, or any other finder that returns a series of
+      // planar points.
+      auto p = std::dynamic_pointer_cast<OptimizationParams::PlaneToPlaneParams>(params.error_blocks[j]);
+      cached.cost.reset(PlaneToPlaneError::Create(getModel(p->model_a),
+                                                  getModel(p->model_b),
+                                                  offsets_.get(),
+                                                  samples_[i],
+                                                  p->normal_scale,
+                                                  p->offset_scale,
+                                                  cached.blocks));
+    }
+  };
 
-        // Have to cast our Camera2d model
-        auto camera_model = dynamic_cast<Camera2dModel*>(models_[p->model_2d]);
-        if (!camera_model)
-        {
-          RCLCPP_ERROR(logger, "camera2d model is improperly specified");
-          return 0;
-        }
+  // Create the cost functions which were not created by a previous step
+  std::vector<const SampleCost*> missing;
+  for (const auto& sample_cost : sample_costs)
+  {
+    if (!sample_cost.cached->cost)
+    {
+      missing.push_back(&sample_cost);
+    }
+  }
+  std::atomic<size_t> next(0);
+  auto worker = [&]()
+  {
+    for (size_t k = next++; k < missing.size(); k = next++)
+    {
+      createCost(*missing[k]);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < std::min(static_cast<size_t>(std::max(1, params.num_threads)), missing.size()); ++t)
+  {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
 
-        // Create the block
-        ceres::CostFunction * cost = Chain3dToCamera2d::Create(models_[p->model_3d],
-                                                               camera_model,
-                                                               p->scale,
-                                                               offsets_.get(),
-                                                               data[i]);
+  // Add to the problem in order, so that the problem does not depend on the threads
+  std::vector<size_t> skipped(params.error_blocks.size(), 0);
+  for (const auto& sample_cost : sample_costs)
+  {
+    // Connect only to the parameter blocks this error block depends on
+    std::vector<double*> parameters;
+    if (!getParameterBlocks(*offsets_, free_params, sample_cost.cached->blocks, parameters))
+    {
+      ++skipped[sample_cost.error_block];
+      continue;
+    }
 
-        // Output initial error
-        if (progress_to_stdout)
-        {
-          double ** params = new double*[1];
-          params[0] = free_params;
-          double * residuals = new double[cost->num_residuals()];
-
-          cost->Evaluate(params, residuals, NULL);
-
-          std::cout << "INITIAL COST (" << i << ")" << std::endl << "  x: ";
-          for (size_t k = 0; k < static_cast<size_t>(cost->num_residuals() / 2); ++k)
-            std::cout << "  " << std::setw(10) << std::fixed << residuals[(2*k + 0)];
-          std::cout << std::endl << "  y: ";
-          for (size_t k = 0; k < static_cast<size_t>(cost->num_residuals() / 2); ++k)
-            std::cout << "  " << std::setw(10) << std::fixed << residuals[(2*k + 1)];
-          std::cout << std::endl << std::endl;
-        }
+    addSampleBlock(sample_cost.sample, sample_cost.error_block, sample_cost.cached->cost.get(), parameters);
+  }
 
-        problem->AddResidualBlock(cost,
-                                  NULL,  // squared loss
-                                  free_params);
-      }
-      else if (params.error_blocks[j]->type == "plane_to_plane")
+  // Error blocks which do not depend on the samples are added once, their
+  // loss is scaled by the number of samples so that the cost is the same as
+  // adding them for every sample
+  for (size_t j = 0; j < params.error_blocks.size() && !samples_.empty(); ++j)
+  {
+    if (params.error_blocks[j]->type == "outrageous")
+    {
+      // Outrageous error block requires no particular sensors
+      auto p = std::dynamic_pointer_cast<OptimizationParams::OutrageousParams>(params.error_blocks[j]);
+      // Create the block, unless it was created by a previous step
+      CachedCost& cached = costs_[std::make_pair(cost_keys[j], SAMPLE_INDEPENDENT)];
+      if (!cached.cost)
       {
-        // This error block can process data generated by the PlaneFinder,
-        // CheckerboardFinder, or any other finder that returns a series of
-        // planar points.
-        auto p = std::dynamic_pointer_cast<OptimizationParams::PlaneToPlaneParams>(params.error_blocks[j]);
-        std::string a_name = p->model_a;
-        std::string b_name = p->model_b;
+        cached.cost.reset(OutrageousError::Create(offsets_.get(),
+                                                  p->param,
+                                                  p->joint_scale,
+                                                  p->position_scale,
+                                                  p->rotation_scale,
+                                                  cached.blocks,
+                                                  p->numeric_diff));
+      }
 
-        // Do some basic error checking for bad params
-        if (a_name == "" || b_name == "" || a_name == b_name)
-        {
-          RCLCPP_ERROR(logger, "plane_to_plane improperly configured: model_a and model_a params must be set!");
-          return 0;
-        }
+      std::vector<double*> parameters;
+      if (!getParameterBlocks(*offsets_, free_params, cached.blocks, parameters))
+      {
+        ++skipped[j];
+        continue;
+      }
 
-        // Check that this sample has the required features/observations
-        if (!hasSensor(data[i], a_name) || !hasSensor(data[i], b_name))
-          continue;
+      problem->AddResidualBlock(profileCost(cached.cost.get(), params.profile, profiled[j]),
+                                new ceres::ScaledLoss(createLossFunction(params.error_blocks[j]),
+                                                      static_cast<double>(samples_.size()),
+                                                      ceres::TAKE_OWNERSHIP),
+                                parameters);
+    }
+  }
 
-        // Create the block
-        ceres::CostFunction * cost =
-          PlaneToPlaneError::Create(models_[a_name],
-                                    models_[b_name],
-                                    offsets_.get(),
-                                    data[i],
-                                    p->normal_scale,
-                                    p->offset_scale);
-
-        // Output initial error
-        if (progress_to_stdout)
-        {
-          double ** params = new double*[1];
-          params[0] = free_params;
-          double * residuals = new double[cost->num_residuals()];
-
-          cost->Evaluate(params, residuals, NULL);
-          std::cout << "INITIAL COST (" << i << ")" << std::endl << "  a: ";
-          std::cout << "  " << std::setw(10) << std::fixed << residuals[0];
-          std::cout << std::endl << "  b: ";
-          std::cout << "  " << std::setw(10) << std::fixed << residuals[1];
-          std::cout << std::endl << "  c: ";
-          std::cout << "  " << std::setw(10) << std::fixed << residuals[2];
-          std::cout << std::endl << "  d: ";
-          std::cout << "  " << std::setw(10) << std::fixed << residuals[3];
-          std::cout << std::endl << std::endl;
-        }
+  for (size_t j = 0; j < params.error_blocks.size(); ++j)
+  {
+    if (skipped[j] > 0)
+    {
+      RCLCPP_WARN(logger, "Skipped %lu residual blocks of %s, which depend on no free parameters",
+                  skipped[j], params.error_blocks[j]->name.c_str());
+    }
+  }
 
-        problem->AddResidualBlock(cost,
-                                  NULL,  // squared loss
-                                  free_params);
-      }
-      else if (params.error_blocks[j]->type == "outrageous")
+  // Samples are batched in order, each batch is one residual block
+  for (const auto& batch : batches)
+  {
+    size_t j = batch.first.first;
+    const std::vector<double*>& parameters = batch.first.second;
+    for (size_t start = 0; start < batch.second.size(); start += batch_samples)
+    {
+      size_t end = std::min(batch.second.size(), start + batch_samples);
+      std::vector<ceres::CostFunction*> costs;
+      for (size_t k = start; k < end; ++k)
       {
-        // Outrageous error block requires no particular sensors, add to every sample
-        auto p = std::dynamic_pointer_cast<OptimizationParams::OutrageousParams>(params.error_blocks[j]);
-        problem->AddResidualBlock(
-          OutrageousError::Create(offsets_.get(),
-                                  p->param,
-                                  p->joint_scale,
-                                  p->position_scale,
-                                  p->rotation_scale),
-          NULL, // squared loss
-          free_params);
+        costs.push_back(batch.second[k].second);
       }
-      else
+      auto cost = std::make_shared<BatchedCostFunction>(costs);
+      batched_costs_.push_back(cost);
+
+      SampleBlock block;
+      block.id = problem->AddResidualBlock(profileCost(cost.get(), params.profile, profiled[j]),
+                                           NULL,
+                                           parameters);
+      block.error_block = j;
+      for (size_t k = start; k < end; ++k)
       {
-        RCLCPP_ERROR(logger, "Unknown error block: %s", params.error_blocks[j]->type.c_str());
-        return 0;
+        block.start = cost->getResidualStarts()[k - start];
+        block.num_residuals = costs[k - start]->num_residuals();
+        sample_blocks[batch.second[k].first].push_back(block);
       }
     }
   }
 
+  return true;
+}
+
+int Optimizer::optimize(OptimizationParams& params,
+                        const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                        rclcpp::Logger& logger,
+                        bool progress_to_stdout)
+{
+  std::vector<OptimizationParams::InitialValues> hypotheses = params.getMultiStartHypotheses();
+  if (hypotheses.size() > 1)
+  {
+    return optimizeMultiStart(params, hypotheses, data, logger, progress_to_stdout);
+  }
+  if (params.coarse_features > 0)
+  {
+    return optimizeCoarseToFine(params, data, logger, progress_to_stdout);
+  }
+
+  if (!setupOffsets(params, logger))
+  {
+    return -1;
+  }
+
+  // Allocate space, this starts from the result of any previous step
+  double* free_params = new double[offsets_->size()];
+  offsets_->initialize(free_params);
+
+  // Houston, we have a problem...
+  //  cost functions are owned by costs_ so later steps can reuse them
+  ceres::Problem::Options problem_options;
+  problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+  ceres::Problem* problem = new ceres::Problem(problem_options);
+
+  // Each free joint and free frame is a separate parameter block, add them
+  // all so that they are part of the problem even if no error block uses them
+  for (size_t b = 0; b < offsets_->getNumBlocks(); ++b)
+  {
+    problem->AddParameterBlock(free_params + offsets_->getBlockStart(b),
+                               offsets_->getBlockSize(b));
+  }
+
+  // When profiling, each cost function is wrapped, the wrappers are
+  // kept for the statistics and must outlive the problem
+  std::vector<std::vector<ProfiledCostFunctionPtr>> profiled(params.error_blocks.size());
+
+  std::vector<std::vector<SampleBlock>> sample_blocks;
+  if (!addResidualBlocks(params, data, logger, problem, free_params,
+                         params.batch_samples, profiled, sample_blocks))
+  {
+    delete[] free_params;
+    delete problem;
+    return 0;
+  }
+
+  // Residuals before the solve, for the residual report
+  bool report = progress_to_stdout || keep_residuals_ || !params.residual_report.empty();
+  std::vector<double> initial_residuals;
+  if (report && !evaluateSampleResiduals(problem, params.num_threads, sample_blocks, initial_residuals))
+  {
+    RCLCPP_ERROR(logger, "Unable to evaluate initial residuals");
+    report = false;
+  }
+
   // Setup the actual optimization
   ceres::Solver::Options options;
-  options.use_nonmonotonic_steps = true;
-  options.function_tolerance = 1e-10;
-  options.linear_solver_type = ceres::DENSE_QR;
+  options.use_nonmonotonic_steps = params.use_nonmonotonic_steps;
+  options.function_tolerance = params.function_tolerance;
+  options.gradient_tolerance = params.gradient_tolerance;
+  options.parameter_tolerance = params.parameter_tolerance;
+  options.jacobi_scaling = params.jacobi_scaling;
+  if (!ceres::StringToLinearSolverType(params.linear_solver, &options.linear_solver_type))
+  {
+    RCLCPP_ERROR(logger, "Unknown linear_solver '%s', using DENSE_QR", params.linear_solver.c_str());
+    options.linear_solver_type = ceres::DENSE_QR;
+  }
+  if (!ceres::StringToTrustRegionStrategyType(params.trust_region_strategy,
+                                              &options.trust_region_strategy_type))
+  {
+    RCLCPP_ERROR(logger, "Unknown trust_region_strategy '%s', using LEVENBERG_MARQUARDT",
+                 params.trust_region_strategy.c_str());
+    options.trust_region_strategy_type = ceres::LEVENBERG_MARQUARDT;
+  }
   options.max_num_iterations = params.max_num_iterations;
+  // Error blocks only read the offsets, so they can be evaluated in parallel
+  options.num_threads = std::max(1, params.num_threads);
   options.minimizer_progress_to_stdout = progress_to_stdout;
 
+  // Report progress of each iteration
+  std::unique_ptr<ProgressIterationCallback> progress_callback;
+  if (progress_callback_)
+  {
+    progress_callback.reset(new ProgressIterationCallback(progress_callback_));
+    options.callbacks.push_back(progress_callback.get());
+  }
+
   if (progress_to_stdout)
     std::cout << "\nSolver output:" << std::endl;
   summary_.reset(new ceres::Solver::Summary());
@@ -458,13 +916,89 @@ int Optimizer::optimize(OptimizationParams& params,
   if (progress_to_stdout)
     std::cout << "\n" << summary_->BriefReport() << std::endl;
 
+  if (summary_->termination_type == ceres::USER_FAILURE)
+  {
+    RCLCPP_WARN(logger, "Step aborted by progress callback, offsets are unchanged");
+  }
+
+  if (progress_callback_)
+  {
+    robot_calibration_msgs::msg::OptimizationProgress progress;
+    makeDoneProgress(*summary_, progress);
+    progress_callback_(progress);
+  }
+
+  profile_.clear();
+  if (params.profile)
+  {
+    for (size_t j = 0; j < params.error_blocks.size(); ++j)
+    {
+      ErrorBlockProfile p = summarizeProfile(params.error_blocks[j]->name,
+                                             params.error_blocks[j]->type,
+                                             profiled[j]);
+      RCLCPP_INFO(logger, "Error block %s (%s): %lu blocks, %lu residuals, %lu evaluations "
+                          "(%lu with jacobians), total %f s, median %f ms, p90 %f ms, "
+                          "p99 %f ms, max %f ms",
+                  p.name.c_str(), p.type.c_str(), p.num_blocks, p.num_residuals,
+                  p.evaluations, p.jacobian_evaluations, p.total_time,
+                  p.median_time * 1000.0, p.p90_time * 1000.0,
+                  p.p99_time * 1000.0, p.max_time * 1000.0);
+      profile_.push_back(p);
+    }
+  }
+
+  residuals_.clear();
+  std::vector<double> final_residuals;
+  if (report && !evaluateSampleResiduals(problem, params.num_threads, sample_blocks, final_residuals))
+  {
+    RCLCPP_ERROR(logger, "Unable to evaluate final residuals");
+    report = false;
+  }
+  if (report)
+  {
+    // Residuals are in the order of the residual blocks of each sample
+    size_t start = 0;
+    for (size_t i = 0; i < sample_blocks.size(); ++i)
+    {
+      for (size_t k = 0; k < sample_blocks[i].size(); ++k)
+      {
+        const auto& error_block = params.error_blocks[sample_blocks[i][k].error_block];
+        SampleResiduals r;
+        r.sample = i;
+        r.name = error_block->name;
+        r.type = error_block->type;
+        r.num_residuals = sample_blocks[i][k].num_residuals;
+
+        size_t num_axes = getResidualAxes(r.type).size();
+        computeResidualStatistics(&initial_residuals[start], r.num_residuals, num_axes,
+                                  r.initial_rms, r.initial_max, r.initial_axis_rms);
+        computeResidualStatistics(&final_residuals[start], r.num_residuals, num_axes,
+                                  r.final_rms, r.final_max, r.final_axis_rms);
+        start += r.num_residuals;
+        residuals_.push_back(r);
+      }
+    }
+
+    outputResidualReport(params, residuals_, progress_to_stdout, logger);
+  }
+
+  // Estimate uncertainty of the solution
+  covariance_names_.clear();
+  covariance_.resize(0, 0);
+  standard_deviations_.resize(0);
+  correlations_.resize(0, 0);
+  if (params.covariance && summary_->IsSolutionUsable())
+  {
+    computeCovariance(problem, free_params, params.num_threads, logger);
+  }
+
+  // Save the result, later steps start from it
+  offsets_->update(free_params);
+
   // Save some status
   num_params_ = problem->NumParameters();
   num_residuals_ = problem->NumResiduals();
 
-  // Note: the error blocks will be managed by scoped_ptr in cost functor
-  //       which takes ownership, and so we do not need to delete them here
-
   // Done with our free params
   delete[] free_params;
   delete problem;
@@ -472,6 +1006,400 @@ int Optimizer::optimize(OptimizationParams& params,
   return 0;
 }
 
+int Optimizer::optimizeMultiStart(OptimizationParams& params,
+                                  const std::vector<OptimizationParams::InitialValues>& hypotheses,
+                                  const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                                  rclcpp::Logger& logger,
+                                  bool progress_to_stdout)
+{
+  // This loads the KDL tree, which is shared with each hypothesis
+  if (!setupOffsets(params, logger))
+  {
+    return -1;
+  }
+  RCLCPP_INFO(logger, "Solving from %lu hypotheses of the initial values", hypotheses.size());
+
+  // Each hypothesis has its own optimizer, models and cost functions,
+  // starting from the offsets found by previous steps
+  std::vector<std::unique_ptr<Optimizer>> optimizers;
+  std::vector<OptimizationParams> hypothesis_params(hypotheses.size(), params);
+  for (size_t h = 0; h < hypotheses.size(); ++h)
+  {
+    hypothesis_params[h].free_frames_initial_values = hypotheses[h];
+    hypothesis_params[h].multi_start.clear();
+    hypothesis_params[h].multi_start_grid.clear();
+    // Only the solution which is kept is reported
+    hypothesis_params[h].residual_report.clear();
+    optimizers.emplace_back(new Optimizer(model_, tree_, mesh_loader_));
+    optimizers.back()->offsets_->copy(*offsets_);
+    optimizers.back()->keep_residuals_ = progress_to_stdout || !params.residual_report.empty();
+  }
+
+  // Solve the hypotheses on a pool of threads
+  int num_threads = params.multi_start_threads;
+  if (num_threads < 1)
+  {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::vector<int> results(hypotheses.size(), -1);
+  std::atomic<size_t> next(0);
+  auto worker = [&]()
+  {
+    for (size_t h = next++; h < hypotheses.size(); h = next++)
+    {
+      results[h] = optimizers[h]->optimize(hypothesis_params[h], data, logger, false);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < std::min(static_cast<size_t>(num_threads), hypotheses.size()); ++t)
+  {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  // Keep the lowest final cost, ties go to the first hypothesis
+  int best = -1;
+  for (size_t h = 0; h < hypotheses.size(); ++h)
+  {
+    std::shared_ptr<ceres::Solver::Summary> summary = optimizers[h]->summary();
+    if (results[h] != 0 || !summary || !summary->IsSolutionUsable())
+    {
+      RCLCPP_WARN(logger, "Hypothesis %lu could not be solved", h);
+      continue;
+    }
+    RCLCPP_INFO(logger, "Hypothesis %lu: initial cost %f, final cost %f",
+                h, summary->initial_cost, summary->final_cost);
+    if (best < 0 || summary->final_cost < optimizers[best]->summary()->final_cost)
+    {
+      best = h;
+    }
+  }
+  if (best < 0)
+  {
+    RCLCPP_ERROR(logger, "No hypothesis of the initial values could be solved");
+    return -1;
+  }
+  RCLCPP_INFO(logger, "Keeping hypothesis %d", best);
+
+  // Take the results of the best hypothesis, later steps start from it
+  const Optimizer& result = *optimizers[best];
+  offsets_->copy(*result.offsets_);
+  summary_ = result.summary_;
+  profile_ = result.profile_;
+  residuals_ = result.residuals_;
+  covariance_names_ = result.covariance_names_;
+  covariance_ = result.covariance_;
+  standard_deviations_ = result.standard_deviations_;
+  correlations_ = result.correlations_;
+  num_params_ = result.num_params_;
+  num_residuals_ = result.num_residuals_;
+
+  if (progress_to_stdout)
+    std::cout << "\n" << summary_->BriefReport() << std::endl;
+  if (!residuals_.empty())
+  {
+    outputResidualReport(params, residuals_, progress_to_stdout, logger);
+  }
+  if (progress_callback_)
+  {
+    robot_calibration_msgs::msg::OptimizationProgress progress;
+    makeDoneProgress(*summary_, progress);
+    progress_callback_(progress);
+  }
+
+  return 0;
+}
+
+int Optimizer::optimizeCoarseToFine(OptimizationParams& params,
+                                    const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                                    rclcpp::Logger& logger,
+                                    bool progress_to_stdout)
+{
+  // This loads the KDL tree, and applies the initial values
+  if (!setupOffsets(params, logger))
+  {
+    return -1;
+  }
+
+  bool farthest_point = (params.coarse_sampling == "farthest_point");
+  if (!farthest_point && params.coarse_sampling != "stride")
+  {
+    RCLCPP_ERROR(logger, "Unknown coarse_sampling '%s', using stride", params.coarse_sampling.c_str());
+  }
+  std::vector<robot_calibration_msgs::msg::CalibrationData> coarse_data;
+  decimateFeatures(data, params.coarse_features, farthest_point, coarse_data);
+
+  // The coarse solve has its own optimizer, so that the cost functions of
+  // the full data are still cached for later steps
+  OptimizationParams coarse_params = params;
+  coarse_params.coarse_features = 0;
+  coarse_params.residual_report.clear();
+  coarse_params.covariance = false;
+  coarse_params.profile = false;
+  Optimizer coarse(model_, tree_, mesh_loader_);
+  coarse.offsets_->copy(*offsets_);
+  if (progress_callback_)
+  {
+    // Only the full solve reports that the step is done
+    ProgressCallback callback = progress_callback_;
+    coarse.setProgressCallback(
+      [callback](const robot_calibration_msgs::msg::OptimizationProgress& progress)
+      {
+        return progress.done || callback(progress);
+      });
+  }
+
+  int result = coarse.optimize(coarse_params, coarse_data, logger, false);
+  std::shared_ptr<ceres::Solver::Summary> summary = coarse.summary();
+  if (result == 0 && summary && summary->termination_type == ceres::USER_FAILURE)
+  {
+    // Aborted, the offsets are unchanged and there is no full solve
+    summary_ = summary;
+    if (progress_callback_)
+    {
+      robot_calibration_msgs::msg::OptimizationProgress progress;
+      makeDoneProgress(*summary_, progress);
+      progress_callback_(progress);
+    }
+    return 0;
+  }
+  if (result != 0 || !summary || !summary->IsSolutionUsable())
+  {
+    RCLCPP_WARN(logger, "Coarse solve failed, solving on all features from the initial values");
+  }
+  else
+  {
+    RCLCPP_INFO(logger, "Coarse solve on %d residuals: initial cost %f, final cost %f, %lu iterations",
+                coarse.getNumResiduals(), summary->initial_cost, summary->final_cost,
+                summary->iterations.size());
+    offsets_->copy(*coarse.offsets_);
+  }
+
+  // Refine on all features, starting from the coarse solution rather than
+  // the initial values
+  OptimizationParams fine_params = params;
+  fine_params.coarse_features = 0;
+  if (result == 0 && summary && summary->IsSolutionUsable())
+  {
+    fine_params.free_frames_initial_values.clear();
+  }
+  return optimize(fine_params, data, logger, progress_to_stdout);
+}
+
+bool Optimizer::computeCovariance(ceres::Problem* problem,
+                                  double* free_params,
+                                  int num_threads,
+                                  rclcpp::Logger& logger)
+{
+  size_t num_params = offsets_->size();
+  if (num_params == 0)
+  {
+    return true;
+  }
+
+  // Each free joint and frame is a separate block, so the jacobian is
+  // sparse and the sparse QR factorization can be used
+  ceres::Covariance::Options options;
+  options.algorithm_type = ceres::SPARSE_QR;
+  options.num_threads = std::max(1, num_threads);
+  ceres::Covariance covariance(options);
+
+  std::vector<const double*> blocks;
+  for (size_t b = 0; b < offsets_->getNumBlocks(); ++b)
+  {
+    blocks.push_back(free_params + offsets_->getBlockStart(b));
+  }
+
+  std::vector<std::pair<const double*, const double*>> pairs;
+  for (size_t b1 = 0; b1 < blocks.size(); ++b1)
+  {
+    for (size_t b2 = b1; b2 < blocks.size(); ++b2)
+    {
+      pairs.push_back(std::make_pair(blocks[b1], blocks[b2]));
+    }
+  }
+
+  if (!covariance.Compute(pairs, problem))
+  {
+    RCLCPP_ERROR(logger, "Unable to compute covariance, some free parameters may not be constrained");
+    return false;
+  }
+
+  // Blocks are contiguous, so the full matrix is in the order of free_params
+  Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> matrix(num_params, num_params);
+  if (!covariance.GetCovarianceMatrix(blocks, matrix.data()))
+  {
+    RCLCPP_ERROR(logger, "Unable to get covariance matrix");
+    return false;
+  }
+
+  // Covariance of the jacobian alone assumes unit variance residuals, scale
+  // by the variance of the residuals at the solution
+  double dof = static_cast<double>(problem->NumResiduals()) - static_cast<double>(num_params);
+  if (dof > 0)
+  {
+    matrix *= 2.0 * summary_->final_cost / dof;
+  }
+
+  covariance_ = matrix;
+  standard_deviations_ = covariance_.diagonal().cwiseMax(0.0).cwiseSqrt();
+  correlations_ = Eigen::MatrixXd::Identity(num_params, num_params);
+  for (size_t i = 0; i < num_params; ++i)
+  {
+    covariance_names_.push_back(offsets_->getFreeParamName(i));
+    for (size_t j = 0; j < num_params; ++j)
+    {
+      double d = standard_deviations_(i) * standard_deviations_(j);
+      if (i != j && d > 0.0)
+      {
+        correlations_(i, j) = covariance_(i, j) / d;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool Optimizer::computeInformation(OptimizationParams& params,
+                                   const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                                   rclcpp::Logger& logger,
+                                   std::vector<Eigen::MatrixXd>& information)
+{
+  information.clear();
+  if (!setupOffsets(params, logger))
+  {
+    return false;
+  }
+
+  // Same problem as optimize() would solve, starting from the current offsets
+  double* free_params = new double[offsets_->size()];
+  offsets_->initialize(free_params);
+
+  ceres::Problem::Options problem_options;
+  problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+  ceres::Problem* problem = new ceres::Problem(problem_options);
+
+  ceres::Problem::EvaluateOptions evaluate_options;
+  for (size_t b = 0; b < offsets_->getNumBlocks(); ++b)
+  {
+    problem->AddParameterBlock(free_params + offsets_->getBlockStart(b),
+                               offsets_->getBlockSize(b));
+    evaluate_options.parameter_blocks.push_back(free_params + offsets_->getBlockStart(b));
+  }
+
+  std::vector<std::vector<ProfiledCostFunctionPtr>> profiled(params.error_blocks.size());
+  // Residual blocks are not batched, so that each sample can be evaluated
+  std::vector<std::vector<SampleBlock>> sample_blocks;
+  bool success = addResidualBlocks(params, data, logger, problem, free_params,
+                                   0, profiled, sample_blocks);
+
+  // Information of each sample is J^T * J, without any loss function
+  evaluate_options.apply_loss_function = false;
+  for (size_t i = 0; success && i < sample_blocks.size(); ++i)
+  {
+    Eigen::MatrixXd sample_information = Eigen::MatrixXd::Zero(offsets_->size(), offsets_->size());
+    if (!sample_blocks[i].empty())
+    {
+      evaluate_options.residual_blocks.clear();
+      for (const auto& block : sample_blocks[i])
+      {
+        evaluate_options.residual_blocks.push_back(block.id);
+      }
+      ceres::CRSMatrix crs;
+      if (!problem->Evaluate(evaluate_options, NULL, NULL, NULL, &crs))
+      {
+        RCLCPP_ERROR(logger, "Unable to evaluate jacobian of sample %lu", i);
+        success = false;
+        break;
+      }
+
+      Eigen::MatrixXd jacobian = Eigen::MatrixXd::Zero(crs.num_rows, crs.num_cols);
+      for (int r = 0; r < crs.num_rows; ++r)
+      {
+        for (int k = crs.rows[r]; k < crs.rows[r + 1]; ++k)
+        {
+          jacobian(r, crs.cols[k]) = crs.values[k];
+        }
+      }
+      sample_information = jacobian.transpose() * jacobian;
+    }
+    information.push_back(sample_information);
+  }
+
+  delete[] free_params;
+  delete problem;
+  return success;
+}
+
+bool Optimizer::updateModels(const OptimizationParams& params, rclcpp::Logger& logger)
+{
+  bool unchanged = true;
+  for (size_t i = 0; i < params.models.size(); ++i)
+  {
+    const std::string& name = params.models[i].name;
+    std::string param_name = params.models[i].param_name;
+    if (param_name == "")
+    {
+      // Default to same name as sensor
+      param_name = name;
+    }
+
+    // Reuse the model if it was created the same way by a previous step
+    std::string config = params.models[i].type + " " + params.base_link + " " +
+                         params.models[i].frame + " " + param_name;
+    auto existing = model_configs_.find(name);
+    if (existing != model_configs_.end())
+    {
+      if (existing->second == config)
+      {
+        continue;
+      }
+      unchanged = false;
+    }
+
+    if (params.models[i].type == "chain3d")
+    {
+      RCLCPP_INFO_STREAM(logger, "Creating chain '" << params.models[i].name << "' from " <<
+                                                       params.base_link << " to " <<
+                                                       params.models[i].frame);
+      models_[name] = std::make_shared<Chain3dModel>(name, tree_, params.base_link, params.models[i].frame);
+    }
+    else if (params.models[i].type == "camera3d")
+    {
+      RCLCPP_INFO_STREAM(logger, "Creating camera3d '" << params.models[i].name << "' in frame " <<
+                                                          params.models[i].frame);
+      models_[name] = std::make_shared<Camera3dModel>(name, param_name, tree_, params.base_link, params.models[i].frame);
+    }
+    else if (params.models[i].type == "camera2d")
+    {
+      RCLCPP_INFO_STREAM(logger, "Creating camera2d '" << params.models[i].name << "' in frame " <<
+                                                          params.models[i].frame);
+      models_[name] = std::make_shared<Camera2dModel>(name, param_name, tree_, params.base_link, params.models[i].frame);
+    }
+    else
+    {
+      RCLCPP_ERROR(logger, "Unknown model type: %s", params.models[i].type.c_str());
+      continue;
+    }
+    model_configs_[name] = config;
+  }
+  return unchanged;
+}
+
+Chain3dModel* Optimizer::getModel(const std::string& name) const
+{
+  auto model = models_.find(name);
+  if (model == models_.end())
+  {
+    return NULL;
+  }
+  return model->second.get();
+}
+
 std::vector<std::string> Optimizer::getCameraNames()
 {
   std::vector<std::string> camera_names;
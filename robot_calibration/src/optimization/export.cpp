@@ -26,20 +26,24 @@
 namespace robot_calibration
 {
 bool exportResults(Optimizer& optimizer, const std::string& initial_urdf,
-                   const std::vector<robot_calibration_msgs::msg::CalibrationData>& data)
+                   const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                   const std::string& directory)
 {
   // Generate datecode
   char datecode[80];
   {
+    // localtime_r, since results for several bags may be exported in parallel
     std::time_t t = std::time(NULL);
-    std::strftime(datecode, 80, "%Y_%m_%d_%H_%M_%S", std::localtime(&t));
+    std::tm local;
+    localtime_r(&t, &local);
+    std::strftime(datecode, 80, "%Y_%m_%d_%H_%M_%S", &local);
   }
 
   // Save updated URDF
   {
     std::string s = optimizer.getOffsets()->updateURDF(initial_urdf);
     std::stringstream urdf_name;
-    urdf_name << "/tmp/calibrated_" << datecode << ".urdf";
+    urdf_name << directory << "/calibrated_" << datecode << ".urdf";
     std::ofstream file;
     file.open(urdf_name.str().c_str());
     file << s;
@@ -71,7 +75,7 @@ bool exportResults(Optimizer& optimizer, const std::string& initial_urdf,
     }
 
     std::stringstream depth_name;
-    depth_name << "/tmp/depth_";
+    depth_name << directory << "/depth_";
     if (*it != "camera")
     {
       // We include the name if the name is not "camera" for backwards compatability
@@ -87,7 +91,7 @@ bool exportResults(Optimizer& optimizer, const std::string& initial_urdf,
                          camera_info));
 
     std::stringstream rgb_name;
-    rgb_name << "/tmp/rgb_";
+    rgb_name << directory << "/rgb_";
     if (*it != "camera")
     {
       // We include the name if the name is not "camera" for backwards compatability
@@ -106,13 +110,44 @@ bool exportResults(Optimizer& optimizer, const std::string& initial_urdf,
   // Output the calibration yaml
   {
     std::stringstream yaml_name;
-    yaml_name << "/tmp/calibration_" << datecode << ".yaml";
+    yaml_name << directory << "/calibration_" << datecode << ".yaml";
     std::ofstream file;
     file.open(yaml_name.str().c_str());
     file << optimizer.getOffsets()->getOffsetYAML();
     file << "depth_info: depth_" << datecode << ".yaml" << std::endl;
     file << "rgb_info: rgb_" << datecode << ".yaml" << std::endl;
     file << "urdf: calibrated_" << datecode << ".urdf" << std::endl;
+
+    // Uncertainty of the last step, as flow style so that
+    // loadOffsetYAML() does not read these as offsets
+    const std::vector<std::string>& names = optimizer.getCovarianceNames();
+    if (!names.empty())
+    {
+      const Eigen::VectorXd& stddev = optimizer.getStandardDeviations();
+      const Eigen::MatrixXd& correlations = optimizer.getCorrelations();
+      file << "standard_deviations: {";
+      for (size_t i = 0; i < names.size(); ++i)
+      {
+        file << (i > 0 ? ", " : "") << names[i] << ": " << stddev(i);
+      }
+      file << "}" << std::endl;
+      file << "correlation_names: [";
+      for (size_t i = 0; i < names.size(); ++i)
+      {
+        file << (i > 0 ? ", " : "") << names[i];
+      }
+      file << "]" << std::endl;
+      file << "correlations:" << std::endl;
+      for (size_t i = 0; i < names.size(); ++i)
+      {
+        file << "  - [";
+        for (size_t j = 0; j < names.size(); ++j)
+        {
+          file << (j > 0 ? ", " : "") << correlations(i, j);
+        }
+        file << "]" << std::endl;
+      }
+    }
     file.close();
   }
 
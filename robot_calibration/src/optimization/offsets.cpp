@@ -17,10 +17,10 @@
 
 // Author: Michael Ferguson
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <string>
-#include <map>
 #include <tinyxml2.h>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
@@ -30,37 +30,62 @@
 namespace robot_calibration
 {
 
+// Suffixes of the six parameters of a frame, in the order of FrameHandle
+static const char* const FRAME_SUFFIXES[6] = {"_x", "_y", "_z", "_a", "_b", "_c"};
+
 OptimizationOffsets::OptimizationOffsets()
 {
   num_free_params_ = 0;
+  revision_ = 0;
 }
 
 bool OptimizationOffsets::add(const std::string name)
 {
-  double value = 0.0;
+  return addParameter(name, true);
+}
 
-  // Check against parameters
-  for (size_t i = 0; i < parameter_names_.size(); ++i)
+bool OptimizationOffsets::addParameter(const std::string& name, bool new_block)
+{
+  int slot = getSlot(name);
+  if (slot < 0)
+  {
+    // New parameter
+    slot = slot_names_.size();
+    slot_names_.push_back(name);
+    slot_values_.push_back(0.0);
+    slot_free_index_.push_back(-1);
+    slot_block_.push_back(-1);
+    slot_block_offset_.push_back(-1);
+    slots_[name] = slot;
+    ++revision_;
+  }
+  else
   {
-    if (parameter_names_[i] == name)
+    // Check against parameters
+    for (size_t i = 0; i < order_.size(); ++i)
     {
-      if (i < num_free_params_)
+      if (order_[i] == slot)
       {
-        // This is already a free param, don't re-add
-        return false;
+        if (i < num_free_params_)
+        {
+          // This is already a free param, don't re-add
+          return false;
+        }
+        // Remove the non-free-param version
+        order_.erase(order_.begin() + i);
+        break;
       }
-      // Get the current value
-      value = parameter_offsets_[i];
-      // Remove the non-free-param version
-      parameter_names_.erase(parameter_names_.begin() + i);
-      parameter_offsets_.erase(parameter_offsets_.begin() + i);
     }
   }
 
   // Add the parameter at end of current free params
-  parameter_names_.insert(parameter_names_.begin() + num_free_params_, name);
-  parameter_offsets_.insert(parameter_offsets_.begin() + num_free_params_, value);
+  order_.insert(order_.begin() + num_free_params_, slot);
   ++num_free_params_;
+  if (new_block || block_sizes_.empty())
+    block_sizes_.push_back(1);
+  else
+    ++block_sizes_.back();
+  updateSlots();
   return true;
 }
 
@@ -69,37 +94,44 @@ bool OptimizationOffsets::addFrame(
     bool calibrate_x, bool calibrate_y, bool calibrate_z,
     bool calibrate_roll, bool calibrate_pitch, bool calibrate_yaw)
 {
-  frame_names_.push_back(name);
-  if (calibrate_x)
-    add(std::string(name).append("_x"));
-  if (calibrate_y)
-    add(std::string(name).append("_y"));
-  if (calibrate_z)
-    add(std::string(name).append("_z"));
+  if (frames_.find(name) == frames_.end())
+  {
+    frames_[name].valid = true;
+    ++revision_;
+  }
+
+  // All free parameters of the frame are in a single block
+  bool new_block = true;
+  if (calibrate_x && addParameter(std::string(name).append("_x"), new_block))
+    new_block = false;
+  if (calibrate_y && addParameter(std::string(name).append("_y"), new_block))
+    new_block = false;
+  if (calibrate_z && addParameter(std::string(name).append("_z"), new_block))
+    new_block = false;
 
   // These don't really correspond to rpy unless only one is set 
   // TODO: check that we do either roll, pitch or yaw, or all 3 (never just 2)   
-  if (calibrate_roll)
-    add(std::string(name).append("_a"));
-  if (calibrate_pitch)
-    add(std::string(name).append("_b"));
+  if (calibrate_roll && addParameter(std::string(name).append("_a"), new_block))
+    new_block = false;
+  if (calibrate_pitch && addParameter(std::string(name).append("_b"), new_block))
+    new_block = false;
   if (calibrate_yaw)
-    add(std::string(name).append("_c"));
+    addParameter(std::string(name).append("_c"), new_block);
 
+  updateSlots();
   return true;
 }
 
 bool OptimizationOffsets::set(const std::string name, double value)
 {
-  for (size_t i = 0; i < num_free_params_; ++i)
+  int slot = getSlot(name);
+  if (slot < 0 || slot_free_index_[slot] < 0)
   {
-    if (parameter_names_[i] == name)
-    {
-      parameter_offsets_[i] = value;
-      return true;
-    }
+    // Only free parameters can be set
+    return false;
   }
-  return false;
+  slot_values_[slot] = value;
+  return true;
 }
 
 bool OptimizationOffsets::setFrame(
@@ -126,54 +158,43 @@ bool OptimizationOffsets::setFrame(
 bool OptimizationOffsets::initialize(double* free_params)
 {
   for (size_t i = 0; i < num_free_params_; ++i)
-    free_params[i] = parameter_offsets_[i];
+    free_params[i] = slot_values_[order_[i]];
   return true;
 }
 
 bool OptimizationOffsets::update(const double* const free_params)
 {
   for (size_t i = 0; i < num_free_params_; ++i)
-    parameter_offsets_[i] = free_params[i];
+    slot_values_[order_[i]] = free_params[i];
   return true;
 }
 
 double OptimizationOffsets::get(const std::string name) const
 {
-  for (size_t i = 0; i < parameter_names_.size(); ++i)
-  {
-    if (parameter_names_[i] == name)
-      return parameter_offsets_[i];
-  }
-  // Not calibrating this
-  return 0.0;
+  return OffsetsView(*this).get(name);
 }
 
 bool OptimizationOffsets::getFrame(const std::string name, KDL::Frame& offset) const
 {
-  // Don't bother with following computation if this isn't a calibrated frame.
-  bool has_offset = false;
-  for (size_t i = 0; i < frame_names_.size(); ++i)
-  {
-    if (frame_names_[i] == name)
-    {
-      has_offset = true;
-      break;
-    }
-  }
-
-  if (!has_offset)
-    return false;
+  return OffsetsView(*this).getFrame(name, offset);
+}
 
-  offset.p.x(get(std::string(name).append("_x")));
-  offset.p.y(get(std::string(name).append("_y")));
-  offset.p.z(get(std::string(name).append("_z")));
+ParamHandle OptimizationOffsets::getParamHandle(const std::string& name) const
+{
+  return ParamHandle(getSlot(name));
+}
 
-  offset.M = rotation_from_axis_magnitude(
-                 get(std::string(name).append("_a")),
-                 get(std::string(name).append("_b")),
-                 get(std::string(name).append("_c")));
+FrameHandle OptimizationOffsets::getFrameHandle(const std::string& name) const
+{
+  auto frame = frames_.find(name);
+  if (frame == frames_.end())
+    return FrameHandle();
+  return frame->second;
+}
 
-  return true;
+size_t OptimizationOffsets::getRevision() const
+{
+  return revision_;
 }
 
 size_t OptimizationOffsets::size()
@@ -181,12 +202,71 @@ size_t OptimizationOffsets::size()
   return num_free_params_;
 }
 
+std::string OptimizationOffsets::getFreeParamName(size_t index) const
+{
+  if (index >= num_free_params_)
+    return "";
+  return slot_names_[order_[index]];
+}
+
+size_t OptimizationOffsets::getNumBlocks() const
+{
+  return block_sizes_.size();
+}
+
+size_t OptimizationOffsets::getBlockSize(size_t block) const
+{
+  return block_sizes_[block];
+}
+
+size_t OptimizationOffsets::getBlockStart(size_t block) const
+{
+  return block_starts_[block];
+}
+
+int OptimizationOffsets::getBlock(const ParamHandle& param) const
+{
+  if (!param.valid())
+    return -1;
+  return slot_block_[param.slot];
+}
+
+int OptimizationOffsets::getBlockOffset(const ParamHandle& param) const
+{
+  if (!param.valid())
+    return -1;
+  return slot_block_offset_[param.slot];
+}
+
 bool OptimizationOffsets::reset()
 {
   num_free_params_ = 0;
+  block_sizes_.clear();
+  updateSlots();
   return true;
 }
 
+void OptimizationOffsets::copy(const OptimizationOffsets& other)
+{
+  // Handles resolved against this parser remain valid if the parameters
+  // are the same, otherwise this is a change of layout
+  bool same_layout = (slot_names_ == other.slot_names_ && frames_.size() == other.frames_.size());
+
+  slot_names_ = other.slot_names_;
+  slot_values_ = other.slot_values_;
+  slot_free_index_ = other.slot_free_index_;
+  slot_block_ = other.slot_block_;
+  slot_block_offset_ = other.slot_block_offset_;
+  block_sizes_ = other.block_sizes_;
+  block_starts_ = other.block_starts_;
+  slots_ = other.slots_;
+  order_ = other.order_;
+  frames_ = other.frames_;
+  num_free_params_ = other.num_free_params_;
+  if (!same_layout)
+    revision_ = std::max(revision_, other.revision_) + 1;
+}
+
 bool OptimizationOffsets::loadOffsetYAML(const std::string& filename)
 {
   std::string line;
@@ -211,13 +291,52 @@ bool OptimizationOffsets::loadOffsetYAML(const std::string& filename)
 std::string OptimizationOffsets::getOffsetYAML()
 {
   std::stringstream ss;
-  for (size_t i = 0; i < parameter_names_.size(); ++i)
+  for (size_t i = 0; i < order_.size(); ++i)
   {
-    ss << parameter_names_[i] << ": " << parameter_offsets_[i] << std::endl;
+    ss << slot_names_[order_[i]] << ": " << slot_values_[order_[i]] << std::endl;
   }
   return ss.str();
 }
 
+int OptimizationOffsets::getSlot(const std::string& name) const
+{
+  auto slot = slots_.find(name);
+  if (slot == slots_.end())
+    return -1;
+  return slot->second;
+}
+
+void OptimizationOffsets::updateSlots()
+{
+  for (size_t i = 0; i < order_.size(); ++i)
+  {
+    slot_free_index_[order_[i]] = (i < num_free_params_) ? i : -1;
+    slot_block_[order_[i]] = -1;
+    slot_block_offset_[order_[i]] = -1;
+  }
+
+  // Blocks are contiguous within the free params
+  block_starts_.resize(block_sizes_.size());
+  size_t start = 0;
+  for (size_t block = 0; block < block_sizes_.size(); ++block)
+  {
+    block_starts_[block] = start;
+    for (size_t i = 0; i < block_sizes_[block]; ++i)
+    {
+      slot_block_[order_[start + i]] = block;
+      slot_block_offset_[order_[start + i]] = i;
+    }
+    start += block_sizes_[block];
+  }
+
+  // Parameters of a frame may be added after the frame itself
+  for (auto& frame : frames_)
+  {
+    for (int i = 0; i < 6; ++i)
+      frame.second.params[i] = ParamHandle(getSlot(frame.first + FRAME_SUFFIXES[i]));
+  }
+}
+
 std::string OptimizationOffsets::updateURDF(const std::string &urdf)
 {
   const double precision = 8;
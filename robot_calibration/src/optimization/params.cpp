@@ -23,10 +23,118 @@ namespace robot_calibration
 {
 
 OptimizationParams::OptimizationParams() :
-  base_link("base_link")
+  base_link("base_link"),
+  max_num_iterations(1000),
+  num_threads(1),
+  linear_solver("DENSE_QR"),
+  trust_region_strategy("LEVENBERG_MARQUARDT"),
+  function_tolerance(1e-10),
+  gradient_tolerance(1e-10),
+  parameter_tolerance(1e-8),
+  jacobi_scaling(true),
+  use_nonmonotonic_steps(true),
+  profile(false),
+  covariance(false),
+  multi_start_threads(0),
+  coarse_features(0),
+  coarse_sampling("stride"),
+  batch_samples(0)
 {
 }
 
+// Load the initial values of the frames listed in parameter_ns.free_frames_initial_values
+static void loadInitialValues(rclcpp::Node::SharedPtr node,
+                              const std::string& parameter_ns,
+                              OptimizationParams::InitialValues& values)
+{
+  rclcpp::Logger logger = node->get_logger();
+
+  values.clear();
+  auto free_frame_names = node->declare_parameter<std::vector<std::string>>(
+    parameter_ns + ".free_frames_initial_values", std::vector<std::string>());
+  for (auto name : free_frame_names)
+  {
+    RCLCPP_INFO(logger, "Adding initial values for: %s", name.c_str());
+    std::string prefix = parameter_ns + "." + name + "_initial_values";
+    OptimizationParams::FreeFrameInitialValue params;
+    params.name = name;
+    params.x = node->declare_parameter<double>(prefix + ".x", 0.0);
+    params.y = node->declare_parameter<double>(prefix + ".y", 0.0);
+    params.z = node->declare_parameter<double>(prefix + ".z", 0.0);
+    params.roll = node->declare_parameter<double>(prefix + ".roll", 0.0);
+    params.pitch = node->declare_parameter<double>(prefix + ".pitch", 0.0);
+    params.yaw = node->declare_parameter<double>(prefix + ".yaw", 0.0);
+    values.push_back(params);
+  }
+}
+
+// Get the initial value of a frame, adding one (of zero) if there is none
+static OptimizationParams::FreeFrameInitialValue& getInitialValue(
+  OptimizationParams::InitialValues& values, const std::string& name)
+{
+  for (auto& value : values)
+  {
+    if (value.name == name)
+    {
+      return value;
+    }
+  }
+  OptimizationParams::FreeFrameInitialValue value;
+  value.name = name;
+  value.x = value.y = value.z = value.roll = value.pitch = value.yaw = 0.0;
+  values.push_back(value);
+  return values.back();
+}
+
+// Replace each hypothesis by every combination of perturbations of one component
+static void applyGrid(std::vector<OptimizationParams::InitialValues>& hypotheses,
+                      const std::string& name,
+                      double OptimizationParams::FreeFrameInitialValue::* component,
+                      const std::vector<double>& perturbations)
+{
+  if (perturbations.empty())
+  {
+    return;
+  }
+
+  std::vector<OptimizationParams::InitialValues> perturbed;
+  for (const auto& hypothesis : hypotheses)
+  {
+    for (double perturbation : perturbations)
+    {
+      perturbed.push_back(hypothesis);
+      getInitialValue(perturbed.back(), name).*component += perturbation;
+    }
+  }
+  hypotheses.swap(perturbed);
+}
+
+std::vector<OptimizationParams::InitialValues> OptimizationParams::getMultiStartHypotheses() const
+{
+  std::vector<InitialValues> hypotheses;
+  hypotheses.push_back(free_frames_initial_values);
+  for (const auto& start : multi_start)
+  {
+    InitialValues values = free_frames_initial_values;
+    for (const auto& value : start)
+    {
+      getInitialValue(values, value.name) = value;
+    }
+    hypotheses.push_back(values);
+  }
+
+  for (const auto& grid : multi_start_grid)
+  {
+    applyGrid(hypotheses, grid.name, &FreeFrameInitialValue::x, grid.x);
+    applyGrid(hypotheses, grid.name, &FreeFrameInitialValue::y, grid.y);
+    applyGrid(hypotheses, grid.name, &FreeFrameInitialValue::z, grid.z);
+    applyGrid(hypotheses, grid.name, &FreeFrameInitialValue::roll, grid.roll);
+    applyGrid(hypotheses, grid.name, &FreeFrameInitialValue::pitch, grid.pitch);
+    applyGrid(hypotheses, grid.name, &FreeFrameInitialValue::yaw, grid.yaw);
+  }
+  return hypotheses;
+}
+
 bool OptimizationParams::LoadFromROS(rclcpp::Node::SharedPtr node,
                                      const std::string& parameter_ns)
 {
@@ -38,6 +146,39 @@ bool OptimizationParams::LoadFromROS(rclcpp::Node::SharedPtr node,
   max_num_iterations = node->declare_parameter<int>(
     parameter_ns + ".max_num_iterations", 1000);
 
+  num_threads = node->declare_parameter<int>(
+    parameter_ns + ".num_threads", 1);
+
+  linear_solver = node->declare_parameter<std::string>(
+    parameter_ns + ".linear_solver", "DENSE_QR");
+
+  trust_region_strategy = node->declare_parameter<std::string>(
+    parameter_ns + ".trust_region_strategy", "LEVENBERG_MARQUARDT");
+
+  function_tolerance = node->declare_parameter<double>(
+    parameter_ns + ".function_tolerance", 1e-10);
+
+  gradient_tolerance = node->declare_parameter<double>(
+    parameter_ns + ".gradient_tolerance", 1e-10);
+
+  parameter_tolerance = node->declare_parameter<double>(
+    parameter_ns + ".parameter_tolerance", 1e-8);
+
+  jacobi_scaling = node->declare_parameter<bool>(
+    parameter_ns + ".jacobi_scaling", true);
+
+  use_nonmonotonic_steps = node->declare_parameter<bool>(
+    parameter_ns + ".use_nonmonotonic_steps", true);
+
+  profile = node->declare_parameter<bool>(
+    parameter_ns + ".profile", false);
+
+  residual_report = node->declare_parameter<std::string>(
+    parameter_ns + ".residual_report", "");
+
+  covariance = node->declare_parameter<bool>(
+    parameter_ns + ".covariance", false);
+
   free_params = node->declare_parameter<std::vector<std::string>>(
     parameter_ns + ".free_params", std::vector<std::string>());
 
@@ -59,24 +200,50 @@ bool OptimizationParams::LoadFromROS(rclcpp::Node::SharedPtr node,
     free_frames.push_back(params);
   }
 
-  free_frames_initial_values.clear();
-  free_frame_names = node->declare_parameter<std::vector<std::string>>(
-    parameter_ns + ".free_frames_initial_values", std::vector<std::string>());
-  for (auto name : free_frame_names)
+  loadInitialValues(node, parameter_ns, free_frames_initial_values);
+
+  // Each hypothesis has its own free_frames_initial_values
+  multi_start.clear();
+  auto hypothesis_names = node->declare_parameter<std::vector<std::string>>(
+    parameter_ns + ".multi_start", std::vector<std::string>());
+  for (auto name : hypothesis_names)
   {
-    RCLCPP_INFO(logger, "Adding initial values for: %s", name.c_str());
-    std::string prefix = parameter_ns + "." + name + "_initial_values";
-    FreeFrameInitialValue params;
+    RCLCPP_INFO(logger, "Adding multi-start hypothesis: %s", name.c_str());
+    InitialValues values;
+    loadInitialValues(node, parameter_ns + "." + name, values);
+    multi_start.push_back(values);
+  }
+
+  multi_start_grid.clear();
+  auto grid_names = node->declare_parameter<std::vector<std::string>>(
+    parameter_ns + ".multi_start_grid", std::vector<std::string>());
+  for (auto name : grid_names)
+  {
+    RCLCPP_INFO(logger, "Adding multi-start grid for: %s", name.c_str());
+    std::string prefix = parameter_ns + "." + name + "_grid";
+    MultiStartGrid params;
     params.name = name;
-    params.x = node->declare_parameter<double>(prefix + ".x", 0.0);
-    params.y = node->declare_parameter<double>(prefix + ".y", 0.0);
-    params.z = node->declare_parameter<double>(prefix + ".z", 0.0);
-    params.roll = node->declare_parameter<double>(prefix + ".roll", 0.0);
-    params.pitch = node->declare_parameter<double>(prefix + ".pitch", 0.0);
-    params.yaw = node->declare_parameter<double>(prefix + ".yaw", 0.0);
-    free_frames_initial_values.push_back(params);
+    params.x = node->declare_parameter<std::vector<double>>(prefix + ".x", std::vector<double>());
+    params.y = node->declare_parameter<std::vector<double>>(prefix + ".y", std::vector<double>());
+    params.z = node->declare_parameter<std::vector<double>>(prefix + ".z", std::vector<double>());
+    params.roll = node->declare_parameter<std::vector<double>>(prefix + ".roll", std::vector<double>());
+    params.pitch = node->declare_parameter<std::vector<double>>(prefix + ".pitch", std::vector<double>());
+    params.yaw = node->declare_parameter<std::vector<double>>(prefix + ".yaw", std::vector<double>());
+    multi_start_grid.push_back(params);
   }
 
+  multi_start_threads = node->declare_parameter<int>(
+    parameter_ns + ".multi_start_threads", 0);
+
+  coarse_features = node->declare_parameter<int>(
+    parameter_ns + ".coarse_features", 0);
+
+  coarse_sampling = node->declare_parameter<std::string>(
+    parameter_ns + ".coarse_sampling", "stride");
+
+  batch_samples = node->declare_parameter<int>(
+    parameter_ns + ".batch_samples", 0);
+
   models.clear();
   auto model_names = node->declare_parameter<std::vector<std::string>>(
     parameter_ns + ".models", std::vector<std::string>());
@@ -105,8 +272,10 @@ bool OptimizationParams::LoadFromROS(rclcpp::Node::SharedPtr node,
       std::shared_ptr<Chain3dToChain3dParams> params = std::make_shared<Chain3dToChain3dParams>();
       params->name = name;
       params->type = type;
+      params->numeric_diff = node->declare_parameter<bool>(prefix + ".numeric_diff", false);
       params->model_a = node->declare_parameter<std::string>(prefix + ".model_a", std::string());
       params->model_b = node->declare_parameter<std::string>(prefix + ".model_b", std::string());
+      params->analytic_diff = node->declare_parameter<bool>(prefix + ".analytic_diff", false);
       error_blocks.push_back(params);
     }
     else if (type == "chain3d_to_camera2d")
@@ -114,6 +283,7 @@ bool OptimizationParams::LoadFromROS(rclcpp::Node::SharedPtr node,
       std::shared_ptr<Chain3dToCamera2dParams> params = std::make_shared<Chain3dToCamera2dParams>();
       params->name = name;
       params->type = type;
+      params->numeric_diff = node->declare_parameter<bool>(prefix + ".numeric_diff", false);
       params->model_2d = node->declare_parameter<std::string>(prefix + ".model_2d", std::string());
       params->model_3d = node->declare_parameter<std::string>(prefix + ".model_3d", std::string());
       params->scale = node->declare_parameter<double>(prefix + ".scale", 1.0);
@@ -124,12 +294,14 @@ bool OptimizationParams::LoadFromROS(rclcpp::Node::SharedPtr node,
       std::shared_ptr<Chain3dToPlaneParams> params = std::make_shared<Chain3dToPlaneParams>();
       params->name = name;
       params->type = type;
+      params->numeric_diff = node->declare_parameter<bool>(prefix + ".numeric_diff", false);
       params->model = node->declare_parameter<std::string>(prefix + ".model", std::string());
       params->a = node->declare_parameter<double>(prefix + ".a", 0.0);
       params->b = node->declare_parameter<double>(prefix + ".b", 0.0);
       params->c = node->declare_parameter<double>(prefix + ".c", 1.0);
       params->d = node->declare_parameter<double>(prefix + ".d", 0.0);
       params->scale = node->declare_parameter<double>(prefix + ".scale", 1.0);
+      params->analytic_diff = node->declare_parameter<bool>(prefix + ".analytic_diff", false);
       error_blocks.push_back(params);
     }
     else if (type == "chain3d_to_mesh")
@@ -137,8 +309,10 @@ bool OptimizationParams::LoadFromROS(rclcpp::Node::SharedPtr node,
       std::shared_ptr<Chain3dToMeshParams> params = std::make_shared<Chain3dToMeshParams>();
       params->name = name;
       params->type = type;
+      params->numeric_diff = node->declare_parameter<bool>(prefix + ".numeric_diff", false);
       params->model = node->declare_parameter<std::string>(prefix + ".model", std::string());
       params->link_name = node->declare_parameter<std::string>(prefix + ".link_name", std::string());
+      params->point_to_triangle = node->declare_parameter<bool>(prefix + ".point_to_triangle", false);
       error_blocks.push_back(params);
     }
     else if (type == "plane_to_plane")
@@ -146,6 +320,7 @@ bool OptimizationParams::LoadFromROS(rclcpp::Node::SharedPtr node,
       std::shared_ptr<PlaneToPlaneParams> params = std::make_shared<PlaneToPlaneParams>();
       params->name = name;
       params->type = type;
+      params->numeric_diff = true;  // SVD plane fit does not support Jets
       params->model_a = node->declare_parameter<std::string>(prefix + ".model_a", std::string());
       params->model_b = node->declare_parameter<std::string>(prefix + ".model_b", std::string());
       params->normal_scale = node->declare_parameter<double>(prefix + ".normal_scale", 1.0);
@@ -157,6 +332,7 @@ bool OptimizationParams::LoadFromROS(rclcpp::Node::SharedPtr node,
       std::shared_ptr<OutrageousParams> params = std::make_shared<OutrageousParams>();
       params->name = name;
       params->type = type;
+      params->numeric_diff = node->declare_parameter<bool>(prefix + ".numeric_diff", false);
       params->param = node->declare_parameter<std::string>(prefix + ".param", std::string());
       params->joint_scale = node->declare_parameter<double>(prefix + ".joint_scale", 1.0);
       params->position_scale = node->declare_parameter<double>(prefix + ".position_scale", 1.0);
@@ -166,6 +342,19 @@ bool OptimizationParams::LoadFromROS(rclcpp::Node::SharedPtr node,
     else
     {
       RCLCPP_ERROR(logger, "Error block %s of type '%s' is unrecognized", name.c_str(), type.c_str());
+      continue;
+    }
+
+    // Parameters common to all error blocks
+    auto params = std::dynamic_pointer_cast<ErrorBlockParams>(error_blocks.back());
+    params->loss = node->declare_parameter<std::string>(prefix + ".loss", std::string());
+    params->loss_scale = node->declare_parameter<double>(prefix + ".loss_scale", 1.0);
+    if (params->loss != "" && params->loss != "huber" && params->loss != "soft_l1" &&
+        params->loss != "cauchy" && params->loss != "arctan")
+    {
+      RCLCPP_ERROR(logger, "Error block %s has unknown loss '%s', using squared loss",
+                   name.c_str(), params->loss.c_str());
+      params->loss = "";
     }
   }
 
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <Eigen/Cholesky>
+#include <Eigen/Eigenvalues>
+#include <robot_calibration/optimization/pose_selection.hpp>
+
+namespace robot_calibration
+{
+
+bool getSelectionCriterion(const std::string& name, SelectionCriterion& criterion)
+{
+  if (name == "d_optimal")
+  {
+    criterion = SelectionCriterion::D_OPTIMAL;
+    return true;
+  }
+  if (name == "min_eigenvalue")
+  {
+    criterion = SelectionCriterion::MIN_EIGENVALUE;
+    return true;
+  }
+  return false;
+}
+
+double scoreInformation(const Eigen::MatrixXd& information, SelectionCriterion criterion)
+{
+  if (information.rows() == 0)
+  {
+    return 0.0;
+  }
+
+  if (criterion == SelectionCriterion::D_OPTIMAL)
+  {
+    Eigen::LLT<Eigen::MatrixXd> llt(information);
+    if (llt.info() != Eigen::Success)
+    {
+      // Not positive definite
+      return -std::numeric_limits<double>::infinity();
+    }
+    // log(det(A)) = 2 * sum(log(diag(L)))
+    return 2.0 * llt.matrixLLT().diagonal().array().log().sum();
+  }
+
+  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(information, Eigen::EigenvaluesOnly);
+  return solver.eigenvalues()(0);
+}
+
+std::vector<size_t> selectSamples(const std::vector<Eigen::MatrixXd>& information,
+                                  size_t count,
+                                  SelectionCriterion criterion,
+                                  double prior)
+{
+  std::vector<size_t> selected;
+  if (information.empty())
+  {
+    return selected;
+  }
+
+  const Eigen::Index size = information.front().rows();
+  Eigen::MatrixXd total = prior * Eigen::MatrixXd::Identity(size, size);
+  std::vector<bool> used(information.size(), false);
+
+  count = std::min(count, information.size());
+  while (selected.size() < count)
+  {
+    size_t best = information.size();
+    double best_score = -std::numeric_limits<double>::infinity();
+    double best_tie = -std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < information.size(); ++i)
+    {
+      if (used[i])
+      {
+        continue;
+      }
+      Eigen::MatrixXd candidate = total + information[i];
+      double score = scoreInformation(candidate, criterion);
+
+      // The smallest eigenvalue does not change until every parameter is
+      // constrained, so ties are broken by the determinant
+      double tie = 0.0;
+      if (criterion == SelectionCriterion::MIN_EIGENVALUE)
+      {
+        tie = scoreInformation(candidate, SelectionCriterion::D_OPTIMAL);
+      }
+
+      double tolerance = 1e-9 * (1.0 + std::fabs(best_score));
+      if (best == information.size() || score > best_score + tolerance ||
+          (score > best_score - tolerance && tie > best_tie))
+      {
+        best = i;
+        best_score = score;
+        best_tie = tie;
+      }
+    }
+
+    used[best] = true;
+    total += information[best];
+    selected.push_back(best);
+  }
+
+  std::sort(selected.begin(), selected.end());
+  return selected;
+}
+
+}  // namespace robot_calibration
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <chrono>
+#include <robot_calibration/optimization/profiler.hpp>
+
+namespace robot_calibration
+{
+
+ProfiledCostFunction::ProfiledCostFunction(ceres::CostFunction* cost) :
+  cost_(cost),
+  jacobian_evaluations_(0)
+{
+  set_num_residuals(cost->num_residuals());
+  *mutable_parameter_block_sizes() = cost->parameter_block_sizes();
+}
+
+bool ProfiledCostFunction::Evaluate(double const * const * parameters,
+                                    double* residuals,
+                                    double** jacobians) const
+{
+  auto start = std::chrono::steady_clock::now();
+  bool success = cost_->Evaluate(parameters, residuals, jacobians);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  times_.push_back(elapsed.count());
+  if (jacobians)
+  {
+    ++jacobian_evaluations_;
+  }
+  return success;
+}
+
+// Get the value at some fraction in [0, 1] of the sorted times
+static double getPercentile(std::vector<double>& times, double fraction)
+{
+  size_t n = static_cast<size_t>(fraction * (times.size() - 1) + 0.5);
+  std::nth_element(times.begin(), times.begin() + n, times.end());
+  return times[n];
+}
+
+ErrorBlockProfile summarizeProfile(const std::string& name,
+                                   const std::string& type,
+                                   const std::vector<ProfiledCostFunctionPtr>& costs)
+{
+  ErrorBlockProfile profile;
+  profile.name = name;
+  profile.type = type;
+  profile.num_blocks = costs.size();
+  profile.num_residuals = 0;
+  profile.jacobian_evaluations = 0;
+
+  std::vector<double> times;
+  for (const auto& cost : costs)
+  {
+    profile.num_residuals += cost->num_residuals();
+    profile.jacobian_evaluations += cost->getJacobianEvaluations();
+    times.insert(times.end(), cost->getTimes().begin(), cost->getTimes().end());
+  }
+  profile.evaluations = times.size();
+
+  profile.total_time = 0.0;
+  for (double t : times)
+  {
+    profile.total_time += t;
+  }
+
+  if (times.empty())
+  {
+    profile.median_time = profile.p90_time = profile.p99_time = profile.max_time = 0.0;
+    return profile;
+  }
+  profile.median_time = getPercentile(times, 0.5);
+  profile.p90_time = getPercentile(times, 0.9);
+  profile.p99_time = getPercentile(times, 0.99);
+  profile.max_time = *std::max_element(times.begin(), times.end());
+  return profile;
+}
+
+}  // namespace robot_calibration
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <robot_calibration/optimization/residual_report.hpp>
+
+namespace robot_calibration
+{
+
+std::vector<std::string> getResidualAxes(const std::string& type)
+{
+  if (type == "chain3d_to_chain3d")
+  {
+    return {"x", "y", "z"};
+  }
+  if (type == "chain3d_to_camera2d")
+  {
+    return {"x", "y"};
+  }
+  if (type == "plane_to_plane")
+  {
+    return {"a", "b", "c", "d"};
+  }
+  // chain3d_to_plane, chain3d_to_mesh: one distance per point
+  return {"d"};
+}
+
+void computeResidualStatistics(const double* residuals,
+                               size_t num_residuals,
+                               size_t num_axes,
+                               double& rms,
+                               double& max,
+                               std::vector<double>& axis_rms)
+{
+  num_axes = std::max<size_t>(num_axes, 1);
+  std::vector<double> sum(num_axes, 0.0);
+  std::vector<size_t> count(num_axes, 0);
+  double total = 0.0;
+  max = 0.0;
+  for (size_t k = 0; k < num_residuals; ++k)
+  {
+    double r2 = residuals[k] * residuals[k];
+    sum[k % num_axes] += r2;
+    ++count[k % num_axes];
+    total += r2;
+    max = std::max(max, std::fabs(residuals[k]));
+  }
+
+  rms = (num_residuals > 0) ? std::sqrt(total / num_residuals) : 0.0;
+  axis_rms.resize(num_axes);
+  for (size_t a = 0; a < num_axes; ++a)
+  {
+    axis_rms[a] = (count[a] > 0) ? std::sqrt(sum[a] / count[a]) : 0.0;
+  }
+}
+
+bool writeResidualReport(const std::string& filename,
+                         const std::vector<SampleResiduals>& report)
+{
+  std::ofstream file(filename);
+  if (!file.is_open())
+  {
+    return false;
+  }
+
+  // Axis columns are the union over all error block types in the report
+  std::vector<std::string> types;
+  std::vector<std::string> axes;
+  for (const auto& r : report)
+  {
+    if (std::find(types.begin(), types.end(), r.type) != types.end())
+    {
+      continue;
+    }
+    types.push_back(r.type);
+    for (const auto& axis : getResidualAxes(r.type))
+    {
+      if (std::find(axes.begin(), axes.end(), axis) == axes.end())
+      {
+        axes.push_back(axis);
+      }
+    }
+  }
+
+  file << "sample,name,type,num_residuals,initial_rms,initial_max,final_rms,final_max";
+  for (const auto& axis : axes)
+  {
+    file << "," << axis << "_initial_rms," << axis << "_final_rms";
+  }
+  file << "\n";
+
+  file << std::setprecision(9);
+  for (const auto& r : report)
+  {
+    file << r.sample << "," << r.name << "," << r.type << "," << r.num_residuals << ","
+         << r.initial_rms << "," << r.initial_max << ","
+         << r.final_rms << "," << r.final_max;
+
+    std::vector<std::string> block_axes = getResidualAxes(r.type);
+    for (const auto& axis : axes)
+    {
+      size_t a = std::find(block_axes.begin(), block_axes.end(), axis) - block_axes.begin();
+      if (a < r.initial_axis_rms.size() && a < r.final_axis_rms.size())
+      {
+        file << "," << r.initial_axis_rms[a] << "," << r.final_axis_rms[a];
+      }
+      else
+      {
+        file << ",,";
+      }
+    }
+    file << "\n";
+  }
+
+  return file.good();
+}
+
+void printResidualSummary(std::ostream& out,
+                          const std::vector<SampleResiduals>& report)
+{
+  struct Summary
+  {
+    std::string name;
+    size_t num_samples;
+    size_t num_residuals;
+    double initial_sum;
+    double final_sum;
+    const SampleResiduals* worst;
+  };
+
+  // Error blocks in the order they first appear
+  std::vector<Summary> summaries;
+  for (const auto& r : report)
+  {
+    auto s = std::find_if(summaries.begin(), summaries.end(),
+                          [&r](const Summary& x) { return x.name == r.name; });
+    if (s == summaries.end())
+    {
+      summaries.push_back(Summary{r.name, 0, 0, 0.0, 0.0, &r});
+      s = summaries.end() - 1;
+    }
+    ++s->num_samples;
+    s->num_residuals += r.num_residuals;
+    s->initial_sum += r.initial_rms * r.initial_rms * r.num_residuals;
+    s->final_sum += r.final_rms * r.final_rms * r.num_residuals;
+    if (r.final_rms > s->worst->final_rms)
+    {
+      s->worst = &r;
+    }
+  }
+
+  out << "Residuals:" << std::endl;
+  for (const auto& s : summaries)
+  {
+    double n = std::max<size_t>(s.num_residuals, 1);
+    out << "  " << s.name << ": " << s.num_samples << " samples, RMS "
+        << std::sqrt(s.initial_sum / n) << " -> " << std::sqrt(s.final_sum / n)
+        << ", worst sample " << s.worst->sample << " (RMS " << s.worst->final_rms
+        << ", max " << s.worst->final_max << ")" << std::endl;
+  }
+}
+
+}  // namespace robot_calibration
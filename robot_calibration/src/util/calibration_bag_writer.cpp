@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <rosbag2_compression/compression_options.hpp>
+#include <rosbag2_compression/sequential_compression_writer.hpp>
+#include <rosbag2_cpp/converter_options.hpp>
+#include <rosbag2_storage/storage_options.hpp>
+#include <robot_calibration/util/calibration_bag_writer.hpp>
+
+static const rclcpp::Logger LOGGER = rclcpp::get_logger("robot_calibration");
+
+namespace robot_calibration
+{
+
+CalibrationBagWriter::CalibrationBagWriter() :
+  stop_(false)
+{
+}
+
+CalibrationBagWriter::~CalibrationBagWriter()
+{
+  close();
+}
+
+bool CalibrationBagWriter::open(const std::string& uri, const std::string& compression)
+{
+  close();
+
+  std::unique_ptr<rosbag2_cpp::Writer> writer;
+  if (compression.empty())
+  {
+    writer = std::make_unique<rosbag2_cpp::Writer>();
+  }
+  else
+  {
+    rosbag2_compression::CompressionOptions compression_options;
+    compression_options.compression_format = compression;
+    compression_options.compression_mode = rosbag2_compression::CompressionMode::MESSAGE;
+    writer = std::make_unique<rosbag2_cpp::Writer>(
+      std::make_unique<rosbag2_compression::SequentialCompressionWriter>(compression_options));
+  }
+
+  rosbag2_storage::StorageOptions storage_options;
+  storage_options.uri = uri;
+  storage_options.storage_id = "sqlite3";
+  rosbag2_cpp::ConverterOptions converter_options;
+  converter_options.input_serialization_format = "cdr";
+  converter_options.output_serialization_format = "cdr";
+  try
+  {
+    writer->open(storage_options, converter_options);
+  }
+  catch (const std::exception& e)
+  {
+    RCLCPP_ERROR(LOGGER, "Unable to create %s: %s", uri.c_str(), e.what());
+    return false;
+  }
+
+  writer_ = std::move(writer);
+  stop_ = false;
+  thread_ = std::thread(&CalibrationBagWriter::run, this);
+  return true;
+}
+
+void CalibrationBagWriter::write(const std_msgs::msg::String& msg, const rclcpp::Time& stamp)
+{
+  queue(msg, "/robot_description", stamp);
+}
+
+void CalibrationBagWriter::write(const robot_calibration_msgs::msg::CalibrationData& msg,
+                                 const rclcpp::Time& stamp)
+{
+  queue(msg, "/calibration_data", stamp);
+}
+
+void CalibrationBagWriter::write(const robot_calibration_msgs::msg::ObservationDebug& msg,
+                                 const rclcpp::Time& stamp)
+{
+  queue(msg, "/calibration_debug", stamp);
+}
+
+void CalibrationBagWriter::write(const robot_calibration_msgs::msg::CalibrationRaw& msg,
+                                 const rclcpp::Time& stamp)
+{
+  queue(msg, "/calibration_raw", stamp);
+}
+
+void CalibrationBagWriter::close()
+{
+  if (thread_.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    condition_.notify_one();
+    thread_.join();
+  }
+
+  // Destroying the writer closes the bag
+  std::lock_guard<std::mutex> lock(mutex_);
+  writer_.reset();
+}
+
+void CalibrationBagWriter::run()
+{
+  while (true)
+  {
+    std::function<void(rosbag2_cpp::Writer&)> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty())
+      {
+        // Stopped, and everything has been written
+        return;
+      }
+      job = std::move(queue_.front());
+      queue_.pop_front();
+    }
+
+    try
+    {
+      job(*writer_);
+    }
+    catch (const std::exception& e)
+    {
+      RCLCPP_ERROR(LOGGER, "Unable to write calibration data: %s", e.what());
+    }
+  }
+}
+
+}  // namespace robot_calibration
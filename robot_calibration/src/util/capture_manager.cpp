@@ -18,9 +18,15 @@
 
 // Author: Michael Ferguson
 
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <limits>
+#include <thread>
 #include <rclcpp/rclcpp.hpp>
 #include <std_msgs/msg/string.hpp>
 #include <robot_calibration/util/capture_manager.hpp>
+#include <robot_calibration/util/trace.hpp>
 
 static const rclcpp::Logger LOGGER = rclcpp::get_logger("capture_manager");
 
@@ -30,6 +36,30 @@ namespace robot_calibration
 CaptureManager::CaptureManager()
 {
   description_valid_ = false;
+  parallel_finders_ = false;
+  pipeline_depth_ = 0;
+  extracting_ = false;
+  stop_ = false;
+  separate_debug_ = false;
+  num_samples_ = 0;
+  record_raw_ = false;
+  continuous_capture_ = false;
+  continuous_max_velocity_ = 0.05;
+  continuous_interval_ = 0.5;
+  continuous_max_skew_ = 0.02;
+}
+
+CaptureManager::~CaptureManager()
+{
+  if (extract_thread_.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      stop_ = true;
+    }
+    queue_condition_.notify_all();
+    extract_thread_.join();
+  }
 }
 
 bool CaptureManager::init(rclcpp::Node::SharedPtr node)
@@ -37,26 +67,92 @@ bool CaptureManager::init(rclcpp::Node::SharedPtr node)
   // Publish calibration data (to be recorded by rosbag)
   data_pub_ = node->create_publisher<robot_calibration_msgs::msg::CalibrationData>("/calibration_data", 10);
 
+  // Publish debugging clouds and images on a separate topic, the observations
+  //   only keep the id of their ObservationDebug message
+  separate_debug_ = node->declare_parameter<bool>("separate_debug", false);
+  if (separate_debug_)
+  {
+    debug_pub_ = node->create_publisher<robot_calibration_msgs::msg::ObservationDebug>(
+      "/calibration_debug", 10);
+  }
+
+  // Publish the raw sensor data of each sample, so that the feature finders
+  //   can be run again offline by replay_finders
+  record_raw_ = node->declare_parameter<bool>("record_raw", false);
+  if (record_raw_)
+  {
+    raw_pub_ = node->create_publisher<robot_calibration_msgs::msg::CalibrationRaw>(
+      "/calibration_raw", 10);
+  }
+
+  // Record the calibration data directly, so that it does not have to be
+  //   recorded from the topics. Compression may be empty, or a rosbag2
+  //   compression format such as zstd
+  clock_ = node->get_clock();
+  std::string record_bag = node->declare_parameter<std::string>("record_bag", "");
+  std::string record_compression = node->declare_parameter<std::string>("record_compression", "");
+  if (!record_bag.empty())
+  {
+    recorder_ = std::make_shared<CalibrationBagWriter>();
+    if (!recorder_->open(record_bag, record_compression))
+    {
+      // Error will be printed in function
+      return false;
+    }
+    RCLCPP_INFO(LOGGER, "Recording calibration data to %s", record_bag.c_str());
+  }
+
   // Subscribe to robot_description
   urdf_sub_ = node->create_subscription<std_msgs::msg::String>("/robot_description",
     rclcpp::QoS(1).transient_local(),
     std::bind(&CaptureManager::callback, this, std::placeholders::_1));
 
-  // Create chain manager
-  chain_manager_ = new ChainManager(node);
+  // Create chain manager, it waits for its servers while the feature
+  //   finders are loaded
+  std::thread chain_thread([this, node]() { chain_manager_ = new ChainManager(node); });
 
   // Load feature finders
-  if (!feature_finder_loader_.load(node, finders_))
+  bool loaded = feature_finder_loader_.load(node, finders_);
+  chain_thread.join();
+  if (!loaded)
   {
     RCLCPP_FATAL(LOGGER, "Unable to load feature finders!");
     return false;
   }
 
+  // Run the feature finders concurrently, each on its own thread, this
+  //   requires that they do not share sensors
+  parallel_finders_ = node->declare_parameter<bool>("parallel_finders", false);
+
+  // Number of samples whose features can be waiting for extraction while
+  //   the robot moves to the next pose, if zero, capture is not pipelined
+  pipeline_depth_ = node->declare_parameter<int>("pipeline_depth", 0);
+  if (pipeline_depth_ > 0)
+  {
+    extract_thread_ = std::thread(&CaptureManager::extractSamples, this);
+  }
+
+  // Capture samples while moving between poses, rather than stopping at
+  //   each. Samples are captured at most every continuous_interval seconds,
+  //   and only while every joint of the chains is slower than
+  //   continuous_max_velocity. The finders of a sample must capture within
+  //   continuous_max_skew seconds of each other
+  continuous_capture_ = node->declare_parameter<bool>("continuous_capture", false);
+  continuous_max_velocity_ = node->declare_parameter<double>("continuous_max_velocity", 0.05);
+  continuous_interval_ = node->declare_parameter<double>("continuous_interval", 0.5);
+  continuous_max_skew_ = node->declare_parameter<double>("continuous_max_skew", 0.02);
+  if (continuous_capture_)
+  {
+    // Joint states are kept long enough to cover the slowest finder
+    chain_manager_->bufferStates(node->declare_parameter<double>("continuous_buffer_duration", 2.0));
+  }
+
   return true;
 }
 
 bool CaptureManager::moveToState(const sensor_msgs::msg::JointState& state)
 {
+  TraceSpan span("move");
   if (!chain_manager_->moveToState(state))
   {
     return false;
@@ -67,15 +163,82 @@ bool CaptureManager::moveToState(const sensor_msgs::msg::JointState& state)
   return true;
 }
 
-bool CaptureManager::captureFeatures(const std::vector<std::string>& feature_names,
-                                     robot_calibration_msgs::msg::CalibrationData& msg)
+bool CaptureManager::planAhead(const sensor_msgs::msg::JointState& state)
 {
+  return chain_manager_->planAhead(state);
+}
+
+std::vector<FeatureFinderMap::iterator> CaptureManager::selectFinders(
+  const std::vector<std::string>& feature_names)
+{
+  std::vector<FeatureFinderMap::iterator> selected;
   for (auto it = finders_.begin(); it != finders_.end(); ++it)
   {
     if (feature_names.empty() ||
         std::find(feature_names.begin(), feature_names.end(), it->first) != feature_names.end())
+    {
+      selected.push_back(it);
+    }
+  }
+  return selected;
+}
+
+bool CaptureManager::captureFeatures(const std::vector<std::string>& feature_names,
+                                     robot_calibration_msgs::msg::CalibrationData& msg)
+{
+  TraceSpan span("capture");
+
+  std::vector<FeatureFinderMap::iterator> selected = selectFinders(feature_names);
+
+  if (parallel_finders_ && selected.size() > 1)
+  {
+    // Each finder fills in its own partial message
+    std::vector<robot_calibration_msgs::msg::CalibrationData> partials(selected.size());
+    std::vector<char> success(selected.size(), false);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < selected.size(); ++i)
+    {
+      RCLCPP_INFO(LOGGER, "Capturing features from %s", selected[i]->first.c_str());
+      threads.emplace_back([&, i]()
+      {
+        TraceSpan find_span("find", selected[i]->first);
+        try
+        {
+          success[i] = selected[i]->second->find(&partials[i]);
+        }
+        catch (const std::exception& e)
+        {
+          // An exception can not leave the thread, count it as a failure
+          RCLCPP_ERROR(LOGGER, "%s threw while capturing features: %s",
+                       selected[i]->first.c_str(), e.what());
+          success[i] = false;
+        }
+      });
+    }
+    for (auto& thread : threads)
+    {
+      thread.join();
+    }
+
+    // Merge in order, so the message is the same as when run in series
+    for (size_t i = 0; i < selected.size(); ++i)
+    {
+      if (!success[i])
+      {
+        RCLCPP_WARN(LOGGER, "%s failed to capture features.", selected[i]->first.c_str());
+        return false;
+      }
+      msg.observations.insert(msg.observations.end(),
+                              partials[i].observations.begin(),
+                              partials[i].observations.end());
+    }
+  }
+  else
+  {
+    for (auto it : selected)
     {
       RCLCPP_INFO(LOGGER, "Capturing features from %s", it->first.c_str());
+      TraceSpan find_span("find", it->first);
       if (!it->second->find(&msg))
       {
         RCLCPP_WARN(LOGGER, "%s failed to capture features.", it->first.c_str());
@@ -84,8 +247,300 @@ bool CaptureManager::captureFeatures(const std::vector<std::string>& feature_nam
     }
   }
   chain_manager_->getState(&msg.joint_states);
+
+  robot_calibration_msgs::msg::CalibrationRaw raw;
+  for (auto it : selected)
+  {
+    addRawData(it->first, *it->second, raw);
+  }
+  raw.joint_states = msg.joint_states;
+  publishRaw(raw);
+
   // Publish calibration data message.
+  publish(msg);
+  return true;
+}
+
+bool CaptureManager::queueFeatures(const std::vector<std::string>& feature_names)
+{
+  // Capture raw data, while the robot is still at this pose
+  TraceSpan span("capture");
+  QueuedSample sample;
+  sample.pose = Tracer::get().getPose();
+  for (auto it : selectFinders(feature_names))
+  {
+    RCLCPP_INFO(LOGGER, "Capturing data for %s", it->first.c_str());
+    TraceSpan snapshot_span("snapshot", it->first);
+    FeatureFinder::Extractor extractor = it->second->snapshot();
+    if (!extractor)
+    {
+      RCLCPP_WARN(LOGGER, "%s failed to capture data.", it->first.c_str());
+      return false;
+    }
+    sample.extractors.emplace_back(it->first, extractor);
+    addRawData(it->first, *it->second, sample.raw);
+  }
+  chain_manager_->getState(&sample.msg.joint_states);
+  sample.raw.joint_states = sample.msg.joint_states;
+
+  enqueue(std::move(sample));
+  return true;
+}
+
+bool CaptureManager::captureWhileMoving(const sensor_msgs::msg::JointState& state,
+                                        const std::vector<std::string>& feature_names,
+                                        std::vector<robot_calibration_msgs::msg::CalibrationData>& samples)
+{
+  TraceSpan span("move");
+  if (!chain_manager_->startMove(state))
+  {
+    return false;
+  }
+
+  // Joints which must be slow enough for a sample to be kept
+  std::vector<std::string> joints;
+  for (const auto& chain : chain_manager_->getChains())
+  {
+    std::vector<std::string> names = chain_manager_->getChainJointNames(chain);
+    joints.insert(joints.end(), names.begin(), names.end());
+  }
+
+  std::vector<FeatureFinderMap::iterator> selected = selectFinders(feature_names);
+  rclcpp::Time last_capture(0, 0, clock_->get_clock_type());
+  while (chain_manager_->isMoving())
+  {
+    if ((clock_->now() - last_capture).seconds() < continuous_interval_)
+    {
+      rclcpp::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    last_capture = clock_->now();
+
+    // Capture raw data, and when each finder captured it
+    TraceSpan capture_span("capture");
+    QueuedSample sample;
+    sample.pose = Tracer::get().getPose();
+    double first = std::numeric_limits<double>::infinity();
+    double last = -std::numeric_limits<double>::infinity();
+    bool captured = true;
+    for (auto it : selected)
+    {
+      TraceSpan snapshot_span("snapshot", it->first);
+      FeatureFinder::Extractor extractor = it->second->snapshot();
+      if (!extractor)
+      {
+        captured = false;
+        break;
+      }
+      builtin_interfaces::msg::Time stamp;
+      if (!it->second->getCaptureStamp(stamp))
+      {
+        RCLCPP_ERROR(LOGGER, "%s does not report when its data was captured, "
+                             "it cannot be used for continuous capture.", it->first.c_str());
+        chain_manager_->waitForMove();
+        return false;
+      }
+      first = std::min(first, rclcpp::Time(stamp).seconds());
+      last = std::max(last, rclcpp::Time(stamp).seconds());
+      sample.extractors.emplace_back(it->first, extractor);
+      addRawData(it->first, *it->second, sample.raw);
+    }
+    if (!captured || selected.empty())
+    {
+      continue;
+    }
+    if (last - first > continuous_max_skew_)
+    {
+      RCLCPP_WARN(LOGGER, "Dropping sample, the finders captured %f seconds apart.", last - first);
+      continue;
+    }
+
+    // Joint states at the time the data was captured
+    double capture_time = (first + last) / 2.0;
+    builtin_interfaces::msg::Time capture_stamp =
+      rclcpp::Time(static_cast<int64_t>(capture_time * 1e9), clock_->get_clock_type());
+    if (!chain_manager_->getStateAt(capture_stamp, 0.1, 0.5, &sample.msg.joint_states))
+    {
+      RCLCPP_WARN(LOGGER, "Dropping sample, no joint states around the time it was captured.");
+      continue;
+    }
+    bool too_fast = false;
+    for (const auto& joint : joints)
+    {
+      auto it = std::find(sample.msg.joint_states.name.begin(), sample.msg.joint_states.name.end(), joint);
+      size_t j = it - sample.msg.joint_states.name.begin();
+      if (it != sample.msg.joint_states.name.end() &&
+          std::fabs(sample.msg.joint_states.velocity[j]) > continuous_max_velocity_)
+      {
+        too_fast = true;
+        break;
+      }
+    }
+    if (too_fast)
+    {
+      continue;
+    }
+    sample.raw.joint_states = sample.msg.joint_states;
+
+    if (isPipelined())
+    {
+      enqueue(std::move(sample));
+    }
+    else if (extractSample(sample))
+    {
+      samples.push_back(sample.msg);
+    }
+  }
+
+  return chain_manager_->waitForMove();
+}
+
+void CaptureManager::enqueue(QueuedSample&& sample)
+{
+  // Wait for room in the queue
+  TraceSpan wait_span("wait_for_queue");
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  queue_condition_.wait(lock, [this]()
+  {
+    return queued_.size() + (extracting_ ? 1 : 0) < static_cast<size_t>(pipeline_depth_);
+  });
+  queued_.push_back(std::move(sample));
+  queue_condition_.notify_all();
+}
+
+void CaptureManager::getFinishedSamples(std::vector<robot_calibration_msgs::msg::CalibrationData>& samples,
+                                        bool wait)
+{
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  if (wait)
+  {
+    queue_condition_.wait(lock, [this]() { return queued_.empty() && !extracting_; });
+  }
+  samples.insert(samples.end(), finished_.begin(), finished_.end());
+  finished_.clear();
+}
+
+void CaptureManager::publish(robot_calibration_msgs::msg::CalibrationData& msg)
+{
+  TraceSpan span("publish");
+  if (separate_debug_)
+  {
+    for (size_t i = 0; i < msg.observations.size(); ++i)
+    {
+      auto& observation = msg.observations[i];
+      if (observation.cloud.data.empty() && observation.image.data.empty())
+      {
+        continue;
+      }
+
+      // Published before the sample, so readers can attach it as the sample arrives
+      robot_calibration_msgs::msg::ObservationDebug debug;
+      debug.id = std::to_string(num_samples_) + "/" + std::to_string(i);
+      debug.cloud = std::move(observation.cloud);
+      debug.image = std::move(observation.image);
+      debug_pub_->publish(debug);
+      if (recorder_)
+      {
+        recorder_->write(debug, clock_->now());
+      }
+
+      observation.cloud = sensor_msgs::msg::PointCloud2();
+      observation.image = sensor_msgs::msg::Image();
+      observation.debug_id = debug.id;
+    }
+  }
+  ++num_samples_;
   data_pub_->publish(msg);
+  if (recorder_)
+  {
+    recorder_->write(msg, clock_->now());
+  }
+}
+
+void CaptureManager::addRawData(const std::string& name, FeatureFinder& finder,
+                                robot_calibration_msgs::msg::CalibrationRaw& raw)
+{
+  if (!record_raw_)
+  {
+    return;
+  }
+
+  robot_calibration_msgs::msg::RawObservation observation;
+  if (!finder.getRawData(observation))
+  {
+    if (no_raw_data_.insert(name).second)
+    {
+      RCLCPP_WARN(LOGGER, "%s does not support recording raw data, it cannot be replayed.", name.c_str());
+    }
+    return;
+  }
+  observation.finder_name = name;
+  raw.observations.push_back(std::move(observation));
+}
+
+void CaptureManager::publishRaw(const robot_calibration_msgs::msg::CalibrationRaw& raw)
+{
+  if (!record_raw_)
+  {
+    return;
+  }
+
+  // Published before the sample, like the debugging data
+  raw_pub_->publish(raw);
+  if (recorder_)
+  {
+    recorder_->write(raw, clock_->now());
+  }
+}
+
+void CaptureManager::extractSamples()
+{
+  while (true)
+  {
+    QueuedSample sample;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex_);
+      queue_condition_.wait(lock, [this]() { return stop_ || !queued_.empty(); });
+      if (stop_)
+      {
+        return;
+      }
+      sample = std::move(queued_.front());
+      queued_.pop_front();
+      extracting_ = true;
+    }
+
+    bool success = extractSample(sample);
+
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      if (success)
+      {
+        finished_.push_back(sample.msg);
+      }
+      extracting_ = false;
+    }
+    queue_condition_.notify_all();
+  }
+}
+
+bool CaptureManager::extractSample(QueuedSample& sample)
+{
+  // The robot has moved on, attribute the work to the pose of the sample
+  Tracer::PoseScope scope(sample.pose);
+  for (auto& extractor : sample.extractors)
+  {
+    TraceSpan span("extract", extractor.first);
+    if (!extractor.second(&sample.msg))
+    {
+      RCLCPP_WARN(LOGGER, "%s failed to capture features.", extractor.first.c_str());
+      return false;
+    }
+  }
+
+  // Publish calibration data message.
+  publishRaw(sample.raw);
+  publish(sample.msg);
   return true;
 }
 
@@ -93,6 +548,10 @@ void CaptureManager::callback(std_msgs::msg::String::ConstSharedPtr msg)
 {
   description_ = msg->data;
   description_valid_ = true;
+  if (recorder_)
+  {
+    recorder_->write(*msg, clock_->now());
+  }
 }
 
 std::string CaptureManager::getUrdf()
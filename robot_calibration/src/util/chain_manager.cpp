@@ -18,15 +18,143 @@
 
 // Author: Michael Ferguson
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <utility>
 #include <robot_calibration/util/chain_manager.hpp>
+#include <robot_calibration/util/trace.hpp>
 
 static const rclcpp::Logger LOGGER = rclcpp::get_logger("robot_calibration");
 
 namespace robot_calibration
 {
 
+SettleDetector::SettleDetector(double velocity_threshold, double position_threshold, double window) :
+  velocity_threshold_(velocity_threshold),
+  position_threshold_(position_threshold),
+  window_(window),
+  window_start_(0.0),
+  window_started_(false)
+{
+}
+
+void SettleDetector::reset(const std::vector<std::string>& joint_names)
+{
+  joint_names_ = joint_names;
+  window_positions_.assign(joint_names_.size(), std::numeric_limits<double>::quiet_NaN());
+  window_started_ = false;
+}
+
+bool SettleDetector::update(const sensor_msgs::msg::JointState& state, double time)
+{
+  // Find the position of each joint, and whether any joint is moving
+  bool moving = false;
+  std::vector<double> positions(joint_names_.size(), std::numeric_limits<double>::quiet_NaN());
+  for (size_t k = 0; k < joint_names_.size(); ++k)
+  {
+    for (size_t j = 0; j < state.name.size(); ++j)
+    {
+      if (state.name[j] != joint_names_[k])
+      {
+        continue;
+      }
+      positions[k] = state.position[j];
+      if (std::fabs(state.velocity[j]) >= velocity_threshold_ ||
+          std::fabs(positions[k] - window_positions_[k]) > position_threshold_)
+      {
+        moving = true;
+      }
+      break;
+    }
+  }
+
+  if (moving || !window_started_)
+  {
+    // Restart the window from this state
+    window_positions_ = positions;
+    window_start_ = time;
+    window_started_ = true;
+    return !moving && window_ <= 0.0;
+  }
+
+  return (time - window_start_) >= window_;
+}
+
+JointStateBuffer::JointStateBuffer(double duration) :
+  duration_(duration)
+{
+}
+
+void JointStateBuffer::setDuration(double duration)
+{
+  duration_ = duration;
+}
+
+void JointStateBuffer::add(const sensor_msgs::msg::JointState& state)
+{
+  states_.push_back(state);
+
+  // Drop states which are older than the duration
+  double latest = getLatestTime();
+  while (states_.size() > 2 && latest - rclcpp::Time(states_.front().header.stamp).seconds() > duration_)
+  {
+    states_.pop_front();
+  }
+}
+
+bool JointStateBuffer::interpolate(double time, double max_interval,
+                                   sensor_msgs::msg::JointState& state) const
+{
+  // Find the first state at or after the time
+  auto after = std::lower_bound(states_.begin(), states_.end(), time,
+    [](const sensor_msgs::msg::JointState& s, double t)
+    {
+      return rclcpp::Time(s.header.stamp).seconds() < t;
+    });
+  if (after == states_.end() || after == states_.begin())
+  {
+    return false;
+  }
+  auto before = after - 1;
+
+  double t0 = rclcpp::Time(before->header.stamp).seconds();
+  double t1 = rclcpp::Time(after->header.stamp).seconds();
+  if (t1 - t0 > max_interval)
+  {
+    return false;
+  }
+  double alpha = (t1 > t0) ? (time - t0) / (t1 - t0) : 1.0;
+
+  state = *after;
+  state.header.stamp = rclcpp::Time(static_cast<int64_t>(time * 1e9), RCL_ROS_TIME);
+  for (size_t j = 0; j < before->name.size() && j < state.name.size(); ++j)
+  {
+    state.position[j] = before->position[j] + alpha * (after->position[j] - before->position[j]);
+    state.velocity[j] = before->velocity[j] + alpha * (after->velocity[j] - before->velocity[j]);
+  }
+  return true;
+}
+
+double JointStateBuffer::getLatestTime() const
+{
+  if (states_.empty())
+  {
+    return -std::numeric_limits<double>::infinity();
+  }
+  return rclcpp::Time(states_.back().header.stamp).seconds();
+}
+
 ChainManager::ChainManager(rclcpp::Node::SharedPtr node, long int wait_time) :
-  state_is_valid_(false)
+  state_is_valid_(false),
+  buffer_states_(false),
+  plan_ahead_(false),
+  plan_ahead_tolerance_(0.01),
+  plan_pending_(false),
+  plan_controller_(0),
+  last_state_is_valid_(false),
+  move_timeout_(0.0)
 {
   // Store weak pointer to node
   node_ptr_ = node;
@@ -41,6 +169,7 @@ ChainManager::ChainManager(rclcpp::Node::SharedPtr node, long int wait_time) :
   }
 
   // Construct each chain to manage
+  std::vector<std::pair<std::string, std::function<bool()>>> servers;
   for (auto name : chain_names)
   {
     std::string topic, group;
@@ -53,36 +182,58 @@ ChainManager::ChainManager(rclcpp::Node::SharedPtr node, long int wait_time) :
     controller->joint_names =
       node->declare_parameter<std::vector<std::string>>(name + ".joints", std::vector<std::string>());
 
-    if (!controller->client.waitForServer(wait_time))
-    {
-      RCLCPP_WARN(LOGGER, "Failed to connect to %s", topic.c_str());
-    }
+    servers.push_back(std::make_pair(topic, [controller]() { return controller->client.isServerReady(); }));
 
     if (controller->shouldPlan() && (!move_group_))
     {
       move_group_ = std::make_shared<ActionClient<MoveGroupAction>>();
       move_group_->init(node, "move_action");
-      if (!move_group_->waitForServer(wait_time))
-      {
-        RCLCPP_WARN(LOGGER, "Failed to connect to move_group");
-      }
+      auto move_group = move_group_;
+      servers.push_back(std::make_pair("move_group", [move_group]() { return move_group->isServerReady(); }));
     }
 
     controllers_.push_back(controller);
   }
 
+  // Wait for all of the servers at once
+  RCLCPP_INFO(LOGGER, "Waiting for %lu action servers...", servers.size());
+  std::vector<std::string> waiting = waitForServers(servers, wait_time);
+  for (const auto& name : waiting)
+  {
+    RCLCPP_WARN(LOGGER, "Failed to connect to %s", name.c_str());
+  }
+  if (waiting.empty())
+  {
+    RCLCPP_INFO(LOGGER, "Connected to all action servers");
+  }
+
   // Parameter to set movement time
   duration_ = node->declare_parameter<double>("duration", 5.0);
 
   // Parameter to set velocity scaling factor for move_group
   velocity_factor_ = node->declare_parameter<double>("velocity_factor", 1.0);
 
+  // Parameters to plan the move to the next pose while capturing the current
+  // one. The plan is discarded if the joints drift by more than the tolerance
+  // from where the plan starts
+  plan_ahead_ = node->declare_parameter<bool>("plan_ahead", false);
+  plan_ahead_tolerance_ = node->declare_parameter<double>("plan_ahead_tolerance", 0.01);
+
   // Parameter to limit settling timeout
   // <= 0.0 disables timeout
   settling_timeout_ = node->declare_parameter<double>("settling_timeout", 0.0);
 
+  // Joints are settled once their velocity stays under settling_velocity,
+  // and their position changes by less than settling_position, for
+  // settling_window seconds. If the window is zero, the first joint state
+  // with velocities under the threshold is considered settled
+  settling_velocity_ = node->declare_parameter<double>("settling_velocity", 0.001);
+  settling_position_ = node->declare_parameter<double>("settling_position", 0.001);
+  settling_window_ = node->declare_parameter<double>("settling_window", 0.0);
+
+  // Deep enough to keep the states which arrive while a capture blocks
   subscriber_ = node->create_subscription<sensor_msgs::msg::JointState>(
-    "/joint_states", 10, std::bind(&ChainManager::stateCallback, this, std::placeholders::_1));
+    "/joint_states", 100, std::bind(&ChainManager::stateCallback, this, std::placeholders::_1));
 }
 
 void ChainManager::stateCallback(sensor_msgs::msg::JointState::ConstSharedPtr msg)
@@ -99,35 +250,71 @@ void ChainManager::stateCallback(sensor_msgs::msg::JointState::ConstSharedPtr ms
     return;
   }
 
-  std::lock_guard<std::mutex> lock(state_mutex_);
-  // Update each joint based on message
-  for (size_t msg_j = 0; msg_j < msg->name.size(); msg_j++)
+  // Publishers rarely change the joints in their messages, so the index
+  // of each joint in state_ is only looked up when the names change
+  if (msg->name != message_names_)
   {
-    size_t state_j;
-    for (state_j = 0; state_j < state_.name.size(); state_j++)
+    message_names_ = msg->name;
+    message_indices_.resize(msg->name.size());
+    for (size_t msg_j = 0; msg_j < msg->name.size(); msg_j++)
     {
-      if (state_.name[state_j] == msg->name[msg_j])
+      auto it = state_index_.find(msg->name[msg_j]);
+      if (it == state_index_.end())
       {
-        state_.position[state_j] = msg->position[msg_j];
-        state_.velocity[state_j] = msg->velocity[msg_j];
-        break;
+        // New joint
+        it = state_index_.emplace(msg->name[msg_j], state_.name.size()).first;
+        state_.name.push_back(msg->name[msg_j]);
+        state_.position.push_back(0.0);
+        state_.velocity.push_back(0.0);
       }
-    }
-    if (state_j == state_.name.size())
-    {
-      // New joint
-      state_.name.push_back(msg->name[msg_j]);
-      state_.position.push_back(msg->position[msg_j]);
-      state_.velocity.push_back(msg->velocity[msg_j]);
+      message_indices_[msg_j] = it->second;
     }
   }
+
+  // Update each joint based on message
+  for (size_t msg_j = 0; msg_j < msg->name.size(); msg_j++)
+  {
+    state_.position[message_indices_[msg_j]] = msg->position[msg_j];
+    state_.velocity[message_indices_[msg_j]] = msg->velocity[msg_j];
+  }
+
+  publishState();
   state_is_valid_ = true;
+
+  std::lock_guard<std::mutex> lock(buffer_mutex_);
+  if (buffer_states_)
+  {
+    state_.header.stamp = msg->header.stamp;
+    state_buffer_.add(state_);
+  }
+}
+
+void ChainManager::publishState()
+{
+  if (spare_snapshot_ && spare_snapshot_.use_count() == 1)
+  {
+    // Pairs with the release when the last reader dropped the snapshot
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+  else
+  {
+    // A reader may still be copying the spare, allocate a new one
+    spare_snapshot_ = std::make_shared<sensor_msgs::msg::JointState>();
+  }
+
+  // Assignment reuses the storage of the spare, so this usually does not allocate
+  *spare_snapshot_ = state_;
+  spare_snapshot_ = std::atomic_exchange(&snapshot_, spare_snapshot_);
 }
 
 bool ChainManager::getState(sensor_msgs::msg::JointState* state)
 {
-  std::lock_guard<std::mutex> lock(state_mutex_);
-  *state = state_;
+  std::shared_ptr<sensor_msgs::msg::JointState> snapshot = std::atomic_load(&snapshot_);
+  if (!snapshot)
+  {
+    return false;
+  }
+  *state = *snapshot;
   return state_is_valid_;
 }
 
@@ -156,7 +343,50 @@ ChainManager::makePoint(const sensor_msgs::msg::JointState& state, const std::ve
   return p;
 }
 
+void ChainManager::bufferStates(double duration)
+{
+  std::lock_guard<std::mutex> lock(buffer_mutex_);
+  state_buffer_.setDuration(duration);
+  buffer_states_ = true;
+}
+
+bool ChainManager::getStateAt(const builtin_interfaces::msg::Time& stamp, double max_interval,
+                              double timeout, sensor_msgs::msg::JointState* state)
+{
+  auto node = node_ptr_.lock();
+  if (!node)
+  {
+    RCLCPP_ERROR(LOGGER, "Unable to get rclcpp::Node lock");
+    return false;
+  }
+
+  // Wait for a joint state after the stamp
+  double time = rclcpp::Time(stamp).seconds();
+  rclcpp::Time start = node->now();
+  while (true)
+  {
+    {
+      std::lock_guard<std::mutex> lock(buffer_mutex_);
+      if (state_buffer_.getLatestTime() >= time)
+      {
+        return state_buffer_.interpolate(time, max_interval, *state);
+      }
+    }
+    if ((node->now() - start).seconds() > timeout)
+    {
+      return false;
+    }
+    rclcpp::spin_some(node);
+    rclcpp::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
 bool ChainManager::moveToState(const sensor_msgs::msg::JointState& state)
+{
+  return startMove(state) && waitForMove();
+}
+
+bool ChainManager::startMove(const sensor_msgs::msg::JointState& state)
 {
   double max_duration = duration_;
 
@@ -169,45 +399,32 @@ bool ChainManager::moveToState(const sensor_msgs::msg::JointState& state)
     trajectory_msgs::msg::JointTrajectoryPoint p = makePoint(state, controllers_[i]->joint_names);
     if (controllers_[i]->shouldPlan())
     {
-      // Call MoveIt
-      auto moveit_goal = MoveGroupAction::Goal();
-      moveit_goal.request.group_name = controllers_[i]->chain_planning_group;
-      moveit_goal.request.num_planning_attempts = 1;
-      moveit_goal.request.allowed_planning_time = 5.0;
-
-      moveit_msgs::msg::Constraints c1;
-      c1.joint_constraints.resize(controllers_[i]->joint_names.size());
-      for (size_t c = 0; c < controllers_[i]->joint_names.size(); c++)
+      bool planned = false;
+      if (plan_pending_ && plan_controller_ == i)
       {
-        c1.joint_constraints[c].joint_name = controllers_[i]->joint_names[c];
-        c1.joint_constraints[c].position = p.positions[c];
-        c1.joint_constraints[c].tolerance_above = 0.01;
-        c1.joint_constraints[c].tolerance_below = 0.01;
-        c1.joint_constraints[c].weight = 1.0;
+        // Always collect the result, so it cannot be mistaken for the next one
+        plan_pending_ = false;
+        planned = waitForPlan(goal.trajectory) &&
+                  plan_goal_.positions == p.positions &&
+                  isNear(controllers_[i]->joint_names, plan_start_, plan_ahead_tolerance_);
+        if (!planned)
+        {
+          RCLCPP_WARN(LOGGER, "Unable to use plan for %s, replanning",
+                      controllers_[i]->chain_name.c_str());
+        }
       }
-      moveit_goal.request.goal_constraints.push_back(c1);
-
-      // Reduce speed
-      moveit_goal.request.max_velocity_scaling_factor = velocity_factor_;
-
-      // All diffs
-      moveit_goal.request.start_state.is_diff = true;
-      moveit_goal.planning_options.planning_scene_diff.is_diff = true;
-      moveit_goal.planning_options.planning_scene_diff.robot_state.is_diff = true;
 
-      // Just make the plan, we will execute it
-      moveit_goal.planning_options.plan_only = true;
-
-      move_group_->sendGoal(moveit_goal);
-      move_group_->waitForResult(rclcpp::Duration::from_seconds(60.0));
-      auto result = move_group_->getResult();
-      if (result->error_code.val != moveit_msgs::msg::MoveItErrorCodes::SUCCESS)
+      if (!planned)
       {
-        // Unable to plan, return error
-        return false;
+        // Call MoveIt, from the current state
+        sendPlanRequest(*controllers_[i], p, nullptr);
+        if (!waitForPlan(goal.trajectory))
+        {
+          // Unable to plan, return error
+          return false;
+        }
       }
 
-      goal.trajectory = result->planned_trajectory.joint_trajectory;
       rclcpp::Duration d(goal.trajectory.points[goal.trajectory.points.size()-1].time_from_start);
       max_duration = std::max(max_duration, d.seconds());
     }
@@ -224,18 +441,160 @@ bool ChainManager::moveToState(const sensor_msgs::msg::JointState& state)
     controllers_[i]->client.sendGoal(goal);
   }
 
+  move_state_ = state;
+  move_timeout_ = max_duration * 1.5;
+  auto node = node_ptr_.lock();
+  if (node)
+  {
+    move_start_ = node->now();
+  }
+  return true;
+}
+
+bool ChainManager::isMoving()
+{
+  auto node = node_ptr_.lock();
+  if (!node)
+  {
+    return false;
+  }
+
+  rclcpp::spin_some(node);
+  if ((node->now() - move_start_).seconds() > move_timeout_)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < controllers_.size(); ++i)
+  {
+    if (controllers_[i]->client.getState() == ActionClientState::ACTIVE)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ChainManager::waitForMove()
+{
   // Wait for results
+  TraceSpan span("execute");
   for (size_t i = 0; i < controllers_.size(); ++i)
   {
-    controllers_[i]->client.waitForResult(rclcpp::Duration::from_seconds(max_duration * 1.5));
+    controllers_[i]->client.waitForResult(rclcpp::Duration::from_seconds(move_timeout_));
     // TODO: catch errors with clients
   }
 
+  last_state_ = move_state_;
+  last_state_is_valid_ = true;
+  return true;
+}
+
+bool ChainManager::planAhead(const sensor_msgs::msg::JointState& state)
+{
+  if (!plan_ahead_ || !last_state_is_valid_ || plan_pending_)
+  {
+    return false;
+  }
+
+  // Only a single plan can be requested from move_group at a time, so
+  // plan ahead for the first chain which plans
+  for (size_t i = 0; i < controllers_.size(); ++i)
+  {
+    if (controllers_[i]->shouldPlan())
+    {
+      plan_start_ = makePoint(last_state_, controllers_[i]->joint_names);
+      plan_goal_ = makePoint(state, controllers_[i]->joint_names);
+      sendPlanRequest(*controllers_[i], plan_goal_, &plan_start_);
+      plan_controller_ = i;
+      plan_pending_ = true;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ChainManager::sendPlanRequest(const ChainController& controller,
+                                   const trajectory_msgs::msg::JointTrajectoryPoint& goal,
+                                   const trajectory_msgs::msg::JointTrajectoryPoint* start)
+{
+  auto moveit_goal = MoveGroupAction::Goal();
+  moveit_goal.request.group_name = controller.chain_planning_group;
+  moveit_goal.request.num_planning_attempts = 1;
+  moveit_goal.request.allowed_planning_time = 5.0;
+
+  moveit_msgs::msg::Constraints c1;
+  c1.joint_constraints.resize(controller.joint_names.size());
+  for (size_t c = 0; c < controller.joint_names.size(); c++)
+  {
+    c1.joint_constraints[c].joint_name = controller.joint_names[c];
+    c1.joint_constraints[c].position = goal.positions[c];
+    c1.joint_constraints[c].tolerance_above = 0.01;
+    c1.joint_constraints[c].tolerance_below = 0.01;
+    c1.joint_constraints[c].weight = 1.0;
+  }
+  moveit_goal.request.goal_constraints.push_back(c1);
+
+  // Reduce speed
+  moveit_goal.request.max_velocity_scaling_factor = velocity_factor_;
+
+  // All diffs
+  moveit_goal.request.start_state.is_diff = true;
+  moveit_goal.planning_options.planning_scene_diff.is_diff = true;
+  moveit_goal.planning_options.planning_scene_diff.robot_state.is_diff = true;
+
+  // Start from a future state, rather than the current one
+  if (start)
+  {
+    moveit_goal.request.start_state.joint_state.name = controller.joint_names;
+    moveit_goal.request.start_state.joint_state.position = start->positions;
+  }
+
+  // Just make the plan, we will execute it
+  moveit_goal.planning_options.plan_only = true;
+
+  move_group_->sendGoal(moveit_goal);
+}
+
+bool ChainManager::waitForPlan(trajectory_msgs::msg::JointTrajectory& trajectory)
+{
+  TraceSpan span("plan");
+  move_group_->waitForResult(rclcpp::Duration::from_seconds(60.0));
+  auto result = move_group_->getResult();
+  if (!result || result->error_code.val != moveit_msgs::msg::MoveItErrorCodes::SUCCESS ||
+      result->planned_trajectory.joint_trajectory.points.empty())
+  {
+    return false;
+  }
+
+  trajectory = result->planned_trajectory.joint_trajectory;
+  return true;
+}
+
+bool ChainManager::isNear(const std::vector<std::string>& joints,
+                          const trajectory_msgs::msg::JointTrajectoryPoint& point,
+                          double tolerance)
+{
+  sensor_msgs::msg::JointState state;
+  if (!getState(&state))
+  {
+    return false;
+  }
+
+  for (size_t i = 0; i < joints.size(); ++i)
+  {
+    size_t j = std::find(state.name.begin(), state.name.end(), joints[i]) - state.name.begin();
+    if (j == state.name.size() || std::fabs(state.position[j] - point.positions[i]) > tolerance)
+    {
+      return false;
+    }
+  }
   return true;
 }
 
 bool ChainManager::waitToSettle()
 {
+  TraceSpan span("settle");
   sensor_msgs::msg::JointState state;
 
   if (controllers_.empty())
@@ -253,53 +612,24 @@ bool ChainManager::waitToSettle()
   }
 
   // Reset to invalid so we know state is not stale
+  state_is_valid_ = false;
+
+  // Watch all of the joints that we control
+  std::vector<std::string> joint_names;
+  for (size_t i = 0; i < controllers_.size(); ++i)
   {
-    std::lock_guard<std::mutex> lock(state_mutex_);
-    state_is_valid_ = false;
+    joint_names.insert(joint_names.end(),
+                       controllers_[i]->joint_names.begin(),
+                       controllers_[i]->joint_names.end());
   }
+  SettleDetector detector(settling_velocity_, settling_position_, settling_window_);
+  detector.reset(joint_names);
 
   rclcpp::Time start = node->now();
   while (true)
   {
-    bool settled = true;
-
-    if (getState(&state))
-    {
-
-      // For each joint in state message
-      for (size_t j = 0; j < state.name.size(); ++j)
-      {
-        // Is this joint even a concern?
-        if (fabs(state.velocity[j]) < 0.001)
-          continue;
-
-        for (size_t i = 0; i < controllers_.size(); ++i)
-        {
-          for (size_t k = 0; k < controllers_[i]->joint_names.size(); ++k)
-          {
-            if (controllers_[i]->joint_names[k] == state.name[j])
-            {
-              settled = false;
-              break;
-            }
-          }
-        }
-
-        // If at least one joint is not settled, break out of this for loop
-        if (!settled)
-        {
-          break;
-        }
-      }
-    }
-    else
-    {
-      // State is not yet valid, can't determine if settled
-      settled = false;
-    }
-
-    // If all joints are settled, break out of while loop
-    if (settled)
+    // State is not valid until a message arrives, can't determine if settled
+    if (getState(&state) && detector.update(state, node->now().seconds()))
     {
       break;
     }
@@ -0,0 +1,560 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <rclcpp/serialization.hpp>
+#include <robot_calibration/util/dataset.hpp>
+
+namespace robot_calibration
+{
+
+/*
+ * The file is a header followed by tables, each aligned to 8 bytes.
+ * All offsets are in bytes from the start of the file, and all strings
+ * are indices into a single deduplicated string table.
+ */
+static const char DATASET_MAGIC[8] = {'R', 'C', 'A', 'L', 'D', 'A', 'T', 'A'};
+static const uint64_t DATASET_VERSION = 1;
+
+struct DatasetHeader
+{
+  char magic[8];
+  uint64_t version;
+  uint64_t file_size;
+  // String index of the URDF
+  uint64_t description;
+  // uint64_t[num_strings + 1] offsets into the characters
+  uint64_t num_strings;
+  uint64_t string_offsets;
+  uint64_t string_chars;
+  // SampleRecord[num_samples]
+  uint64_t num_samples;
+  uint64_t samples;
+  // uint64_t[num_joints] string index of names, double[num_joints] positions
+  uint64_t num_joints;
+  uint64_t joint_names;
+  uint64_t joint_positions;
+  // ObservationRecord[num_observations]
+  uint64_t num_observations;
+  uint64_t observations;
+  // uint64_t[num_features] string index of frames, double[3 * num_features] points
+  uint64_t num_features;
+  uint64_t feature_frames;
+  uint64_t feature_points;
+  // BlobRecord[num_camera_infos] of serialized ExtendedCameraInfo
+  uint64_t num_camera_infos;
+  uint64_t camera_infos;
+  uint64_t blobs;
+  uint64_t blobs_size;
+};
+
+namespace
+{
+
+struct SampleRecord
+{
+  uint64_t joint_begin;
+  uint64_t joint_count;
+  uint64_t observation_begin;
+  uint64_t observation_count;
+};
+
+struct ObservationRecord
+{
+  uint64_t sensor_name;
+  uint64_t feature_begin;
+  uint64_t feature_count;
+  uint64_t camera_info;
+};
+
+struct BlobRecord
+{
+  uint64_t offset;
+  uint64_t size;
+};
+
+class StringTable
+{
+public:
+  uint64_t add(const std::string& s)
+  {
+    auto it = index_.find(s);
+    if (it != index_.end())
+    {
+      return it->second;
+    }
+    uint64_t index = offsets_.size();
+    index_[s] = index;
+    offsets_.push_back(chars_.size());
+    chars_.insert(chars_.end(), s.begin(), s.end());
+    return index;
+  }
+
+  std::vector<uint64_t> offsets() const
+  {
+    std::vector<uint64_t> offsets = offsets_;
+    offsets.push_back(chars_.size());
+    return offsets;
+  }
+
+  const std::vector<char>& chars() const
+  {
+    return chars_;
+  }
+
+private:
+  std::unordered_map<std::string, uint64_t> index_;
+  std::vector<uint64_t> offsets_;
+  std::vector<char> chars_;
+};
+
+uint64_t align(uint64_t offset)
+{
+  return (offset + 7) & ~static_cast<uint64_t>(7);
+}
+
+/** @brief Reserve space for a table after the current end of file. */
+template <typename T>
+uint64_t layout(uint64_t& end, size_t count)
+{
+  uint64_t offset = align(end);
+  end = offset + sizeof(T) * count;
+  return offset;
+}
+
+/** @brief Write a table at its offset, padding from the current position. */
+template <typename T>
+void writeTable(std::ofstream& file, uint64_t offset, const T* table, size_t count)
+{
+  static const char padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  uint64_t position = file.tellp();
+  file.write(padding, offset - position);
+  if (count > 0)
+  {
+    file.write(reinterpret_cast<const char*>(table), sizeof(T) * count);
+  }
+}
+
+}  // namespace
+
+bool writeDataset(const std::string& file_name,
+                  const std::string& description,
+                  const std::vector<robot_calibration_msgs::msg::CalibrationData>& data)
+{
+  StringTable strings;
+  std::vector<SampleRecord> samples;
+  std::vector<uint64_t> joint_names;
+  std::vector<double> joint_positions;
+  std::vector<ObservationRecord> observations;
+  std::vector<uint64_t> feature_frames;
+  std::vector<double> feature_points;
+  std::vector<BlobRecord> camera_infos;
+  std::vector<char> blobs;
+
+  // Camera info is usually the same for every sample, so store each unique
+  // serialized message only once
+  std::map<std::string, uint64_t> camera_info_index;
+  rclcpp::Serialization<robot_calibration_msgs::msg::ExtendedCameraInfo> serialization;
+
+  uint64_t description_index = strings.add(description);
+  for (const auto& msg : data)
+  {
+    if (msg.joint_states.name.size() != msg.joint_states.position.size())
+    {
+      std::cerr << "Joint names and positions are not the same size" << std::endl;
+      return false;
+    }
+
+    SampleRecord sample;
+    sample.joint_begin = joint_names.size();
+    sample.joint_count = msg.joint_states.name.size();
+    sample.observation_begin = observations.size();
+    sample.observation_count = msg.observations.size();
+    samples.push_back(sample);
+
+    for (size_t i = 0; i < msg.joint_states.name.size(); ++i)
+    {
+      joint_names.push_back(strings.add(msg.joint_states.name[i]));
+      joint_positions.push_back(msg.joint_states.position[i]);
+    }
+
+    for (const auto& obs : msg.observations)
+    {
+      ObservationRecord observation;
+      observation.sensor_name = strings.add(obs.sensor_name);
+      observation.feature_begin = feature_frames.size();
+      observation.feature_count = obs.features.size();
+
+      for (const auto& feature : obs.features)
+      {
+        feature_frames.push_back(strings.add(feature.header.frame_id));
+        feature_points.push_back(feature.point.x);
+        feature_points.push_back(feature.point.y);
+        feature_points.push_back(feature.point.z);
+      }
+
+      rclcpp::SerializedMessage serialized;
+      serialization.serialize_message(&obs.ext_camera_info, &serialized);
+      const auto& buffer = serialized.get_rcl_serialized_message();
+      std::string blob(reinterpret_cast<const char*>(buffer.buffer), buffer.buffer_length);
+      auto it = camera_info_index.find(blob);
+      if (it == camera_info_index.end())
+      {
+        BlobRecord record;
+        record.offset = blobs.size();
+        record.size = blob.size();
+        blobs.insert(blobs.end(), blob.begin(), blob.end());
+        it = camera_info_index.insert(std::make_pair(blob, camera_infos.size())).first;
+        camera_infos.push_back(record);
+      }
+      observation.camera_info = it->second;
+
+      observations.push_back(observation);
+    }
+  }
+
+  std::vector<uint64_t> string_offsets = strings.offsets();
+
+  // Lay out the file
+  DatasetHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC));
+  header.version = DATASET_VERSION;
+  header.description = description_index;
+  header.num_strings = string_offsets.size() - 1;
+  header.num_samples = samples.size();
+  header.num_joints = joint_names.size();
+  header.num_observations = observations.size();
+  header.num_features = feature_frames.size();
+  header.num_camera_infos = camera_infos.size();
+  header.blobs_size = blobs.size();
+
+  uint64_t end = sizeof(header);
+  header.string_offsets = layout<uint64_t>(end, string_offsets.size());
+  header.string_chars = layout<char>(end, strings.chars().size());
+  header.samples = layout<SampleRecord>(end, samples.size());
+  header.joint_names = layout<uint64_t>(end, joint_names.size());
+  header.joint_positions = layout<double>(end, joint_positions.size());
+  header.observations = layout<ObservationRecord>(end, observations.size());
+  header.feature_frames = layout<uint64_t>(end, feature_frames.size());
+  header.feature_points = layout<double>(end, feature_points.size());
+  header.camera_infos = layout<BlobRecord>(end, camera_infos.size());
+  header.blobs = layout<char>(end, blobs.size());
+  header.file_size = end;
+
+  // Write to a temporary file, so that a partial dataset is never loaded
+  std::string temp_name = file_name + ".tmp";
+  std::ofstream file(temp_name, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+  {
+    std::cerr << "Unable to write dataset " << file_name << std::endl;
+    return false;
+  }
+  writeTable(file, 0, &header, 1);
+  writeTable(file, header.string_offsets, string_offsets.data(), string_offsets.size());
+  writeTable(file, header.string_chars, strings.chars().data(), strings.chars().size());
+  writeTable(file, header.samples, samples.data(), samples.size());
+  writeTable(file, header.joint_names, joint_names.data(), joint_names.size());
+  writeTable(file, header.joint_positions, joint_positions.data(), joint_positions.size());
+  writeTable(file, header.observations, observations.data(), observations.size());
+  writeTable(file, header.feature_frames, feature_frames.data(), feature_frames.size());
+  writeTable(file, header.feature_points, feature_points.data(), feature_points.size());
+  writeTable(file, header.camera_infos, camera_infos.data(), camera_infos.size());
+  writeTable(file, header.blobs, blobs.data(), blobs.size());
+  file.close();
+
+  if (!file || std::rename(temp_name.c_str(), file_name.c_str()) != 0)
+  {
+    std::cerr << "Unable to write dataset " << file_name << std::endl;
+    std::remove(temp_name.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+Dataset::Dataset() :
+  data_(nullptr),
+  size_(0),
+  header_(nullptr)
+{
+}
+
+Dataset::~Dataset()
+{
+  close();
+}
+
+bool Dataset::open(const std::string& file_name)
+{
+  close();
+
+  int fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(DatasetHeader)))
+  {
+    ::close(fd);
+    return false;
+  }
+
+  void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    return false;
+  }
+  data_ = static_cast<const char*>(mapped);
+  size_ = st.st_size;
+  header_ = reinterpret_cast<const DatasetHeader*>(data_);
+
+  // Validate the header, and that every table is inside the file
+  const DatasetHeader& h = *header_;
+  if (std::memcmp(h.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC)) != 0 ||
+      h.version != DATASET_VERSION ||
+      h.file_size != size_ ||
+      h.num_strings == 0 ||
+      !getTable<uint64_t>(h.string_offsets, h.num_strings + 1) ||
+      !getTable<SampleRecord>(h.samples, h.num_samples) ||
+      !getTable<uint64_t>(h.joint_names, h.num_joints) ||
+      !getTable<double>(h.joint_positions, h.num_joints) ||
+      !getTable<ObservationRecord>(h.observations, h.num_observations) ||
+      !getTable<uint64_t>(h.feature_frames, h.num_features) ||
+      !getTable<double>(h.feature_points, 3 * h.num_features) ||
+      !getTable<BlobRecord>(h.camera_infos, h.num_camera_infos) ||
+      !getTable<char>(h.blobs, h.blobs_size))
+  {
+    std::cerr << file_name << " is not a valid dataset" << std::endl;
+    close();
+    return false;
+  }
+
+  const uint64_t* string_offsets = getTable<uint64_t>(h.string_offsets, h.num_strings + 1);
+  if (!getTable<char>(h.string_chars, string_offsets[h.num_strings]))
+  {
+    std::cerr << file_name << " is not a valid dataset" << std::endl;
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+void Dataset::close()
+{
+  if (data_)
+  {
+    munmap(const_cast<char*>(data_), size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+  header_ = nullptr;
+}
+
+std::string Dataset::getDescription() const
+{
+  std::string description;
+  if (header_)
+  {
+    getString(header_->description, description);
+  }
+  return description;
+}
+
+size_t Dataset::size() const
+{
+  if (!header_)
+  {
+    return 0;
+  }
+  return header_->num_samples;
+}
+
+const double* Dataset::getJointPositions(size_t sample, size_t& joint_count) const
+{
+  joint_count = 0;
+  if (sample >= size())
+  {
+    return nullptr;
+  }
+  const SampleRecord& record = getTable<SampleRecord>(header_->samples, header_->num_samples)[sample];
+  if (record.joint_begin > header_->num_joints ||
+      record.joint_count > header_->num_joints - record.joint_begin)
+  {
+    return nullptr;
+  }
+  joint_count = record.joint_count;
+  return getTable<double>(header_->joint_positions, header_->num_joints) + record.joint_begin;
+}
+
+bool Dataset::getSample(size_t sample, robot_calibration_msgs::msg::CalibrationData& msg) const
+{
+  size_t joint_count = 0;
+  const double* positions = getJointPositions(sample, joint_count);
+  if (!positions)
+  {
+    return false;
+  }
+
+  const DatasetHeader& h = *header_;
+  const SampleRecord& record = getTable<SampleRecord>(h.samples, h.num_samples)[sample];
+  const uint64_t* joint_names = getTable<uint64_t>(h.joint_names, h.num_joints) + record.joint_begin;
+  msg.joint_states.name.resize(joint_count);
+  msg.joint_states.position.assign(positions, positions + joint_count);
+  for (size_t i = 0; i < joint_count; ++i)
+  {
+    if (!getString(joint_names[i], msg.joint_states.name[i]))
+    {
+      return false;
+    }
+  }
+
+  if (record.observation_begin > h.num_observations ||
+      record.observation_count > h.num_observations - record.observation_begin)
+  {
+    return false;
+  }
+  const ObservationRecord* observations =
+    getTable<ObservationRecord>(h.observations, h.num_observations) + record.observation_begin;
+  const uint64_t* frames = getTable<uint64_t>(h.feature_frames, h.num_features);
+  const double* points = getTable<double>(h.feature_points, 3 * h.num_features);
+  const BlobRecord* camera_infos = getTable<BlobRecord>(h.camera_infos, h.num_camera_infos);
+  rclcpp::Serialization<robot_calibration_msgs::msg::ExtendedCameraInfo> serialization;
+
+  msg.observations.resize(record.observation_count);
+  for (size_t i = 0; i < record.observation_count; ++i)
+  {
+    const ObservationRecord& observation = observations[i];
+    auto& obs = msg.observations[i];
+    if (!getString(observation.sensor_name, obs.sensor_name) ||
+        observation.feature_begin > h.num_features ||
+        observation.feature_count > h.num_features - observation.feature_begin ||
+        observation.camera_info >= h.num_camera_infos)
+    {
+      return false;
+    }
+
+    obs.features.resize(observation.feature_count);
+    for (size_t f = 0; f < observation.feature_count; ++f)
+    {
+      size_t index = observation.feature_begin + f;
+      if (!getString(frames[index], obs.features[f].header.frame_id))
+      {
+        return false;
+      }
+      obs.features[f].point.x = points[3 * index];
+      obs.features[f].point.y = points[(3 * index) + 1];
+      obs.features[f].point.z = points[(3 * index) + 2];
+    }
+
+    const BlobRecord& blob = camera_infos[observation.camera_info];
+    if (blob.offset > h.blobs_size || blob.size > h.blobs_size - blob.offset)
+    {
+      return false;
+    }
+    rclcpp::SerializedMessage serialized(blob.size);
+    auto& buffer = serialized.get_rcl_serialized_message();
+    if (blob.size > 0)
+    {
+      std::memcpy(buffer.buffer, data_ + h.blobs + blob.offset, blob.size);
+    }
+    buffer.buffer_length = blob.size;
+    try
+    {
+      serialization.deserialize_message(&serialized, &obs.ext_camera_info);
+    }
+    catch (const std::exception&)
+    {
+      // Corrupt blob, the dataset is rebuilt from the bag
+      return false;
+    }
+  }
+
+  return true;
+}
+
+template <typename T>
+const T* Dataset::getTable(uint64_t offset, uint64_t count) const
+{
+  if (offset % alignof(T) != 0 || offset > size_ ||
+      count > (size_ - offset) / sizeof(T))
+  {
+    return nullptr;
+  }
+  return reinterpret_cast<const T*>(data_ + offset);
+}
+
+bool Dataset::getString(uint64_t index, std::string& s) const
+{
+  if (index >= header_->num_strings)
+  {
+    return false;
+  }
+  const uint64_t* offsets = getTable<uint64_t>(header_->string_offsets, header_->num_strings + 1);
+  uint64_t begin = offsets[index];
+  uint64_t end = offsets[index + 1];
+  if (begin > end || end > offsets[header_->num_strings])
+  {
+    return false;
+  }
+  s.assign(data_ + header_->string_chars + begin, end - begin);
+  return true;
+}
+
+bool loadDataset(const std::string& file_name,
+                 std_msgs::msg::String& description_msg,
+                 std::vector<robot_calibration_msgs::msg::CalibrationData>& data)
+{
+  Dataset dataset;
+  if (!dataset.open(file_name))
+  {
+    return false;
+  }
+
+  description_msg.data = dataset.getDescription();
+  data.resize(dataset.size());
+  for (size_t i = 0; i < dataset.size(); ++i)
+  {
+    if (!dataset.getSample(i, data[i]))
+    {
+      std::cerr << file_name << " is not a valid dataset" << std::endl;
+      data.clear();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+}  // namespace robot_calibration
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <limits>
+#include <map>
+
+#include <robot_calibration/util/feature_sampling.hpp>
+
+namespace robot_calibration
+{
+
+static double squaredDistance(const geometry_msgs::msg::Point& a,
+                              const geometry_msgs::msg::Point& b)
+{
+  double dx = a.x - b.x;
+  double dy = a.y - b.y;
+  double dz = a.z - b.z;
+  return dx * dx + dy * dy + dz * dz;
+}
+
+std::vector<size_t> selectFeatures(const std::vector<geometry_msgs::msg::PointStamped>& features,
+                                   size_t max_features,
+                                   bool farthest_point)
+{
+  size_t n = features.size();
+  std::vector<size_t> indices;
+  if (n <= max_features)
+  {
+    for (size_t i = 0; i < n; ++i)
+    {
+      indices.push_back(i);
+    }
+    return indices;
+  }
+  if (max_features == 0)
+  {
+    return indices;
+  }
+
+  if (!farthest_point)
+  {
+    for (size_t i = 0; i < max_features; ++i)
+    {
+      indices.push_back(i * n / max_features);
+    }
+    return indices;
+  }
+
+  // Each step adds the feature farthest from those already selected,
+  // ties go to the lowest index
+  std::vector<double> distances(n, std::numeric_limits<double>::max());
+  size_t next = 0;
+  for (size_t k = 0; k < max_features; ++k)
+  {
+    indices.push_back(next);
+    distances[next] = -1.0;
+    size_t farthest = next;
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (distances[i] < 0.0)
+      {
+        continue;
+      }
+      distances[i] = std::min(distances[i], squaredDistance(features[i].point, features[next].point));
+      if (distances[farthest] < 0.0 || distances[i] > distances[farthest])
+      {
+        farthest = i;
+      }
+    }
+    next = farthest;
+  }
+  std::sort(indices.begin(), indices.end());
+  return indices;
+}
+
+void decimateFeatures(const std::vector<robot_calibration_msgs::msg::CalibrationData>& data,
+                      size_t max_features,
+                      bool farthest_point,
+                      std::vector<robot_calibration_msgs::msg::CalibrationData>& decimated)
+{
+  decimated.resize(data.size());
+  for (size_t s = 0; s < data.size(); ++s)
+  {
+    const auto& msg = data[s];
+    auto& sample = decimated[s];
+    sample.joint_states = msg.joint_states;
+    sample.observations.resize(msg.observations.size());
+
+    // Selected indices by number of features
+    std::map<size_t, std::vector<size_t>> selections;
+    for (size_t i = 0; i < msg.observations.size(); ++i)
+    {
+      const auto& features = msg.observations[i].features;
+      auto selection = selections.find(features.size());
+      if (selection == selections.end())
+      {
+        selection = selections.emplace(features.size(),
+                                       selectFeatures(features, max_features, farthest_point)).first;
+      }
+
+      sample.observations[i].sensor_name = msg.observations[i].sensor_name;
+      sample.observations[i].ext_camera_info = msg.observations[i].ext_camera_info;
+      sample.observations[i].features.clear();
+      for (size_t index : selection->second)
+      {
+        sample.observations[i].features.push_back(features[index]);
+      }
+    }
+  }
+}
+
+}  // namespace robot_calibration
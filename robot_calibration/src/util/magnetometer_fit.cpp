@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <cmath>
+#include <Eigen/Dense>
+
+#include <robot_calibration/util/magnetometer_fit.hpp>
+
+namespace robot_calibration
+{
+
+/**
+ * @brief Center the samples on their mean and scale them to unit RMS
+ *        radius, so the fits are well conditioned whatever the units are.
+ * @returns False if all samples are the same.
+ */
+static bool normalizeSamples(const Eigen::Matrix3Xd& samples,
+                             Eigen::Matrix3Xd& normalized,
+                             Eigen::Vector3d& mean,
+                             double& scale)
+{
+  if (samples.cols() == 0)
+  {
+    return false;
+  }
+  mean = samples.rowwise().mean();
+  normalized = samples.colwise() - mean;
+  scale = std::sqrt(normalized.squaredNorm() / samples.cols());
+  if (!(scale > 0.0))
+  {
+    return false;
+  }
+  normalized /= scale;
+  return true;
+}
+
+bool fitSphere(const Eigen::Matrix3Xd& samples,
+               Eigen::Vector3d& offset,
+               double& field)
+{
+  Eigen::Matrix3Xd normalized;
+  Eigen::Vector3d mean;
+  double scale;
+  if (!normalizeSamples(samples, normalized, mean, scale))
+  {
+    return false;
+  }
+
+  // |m|^2 = 2 offset.m + (field^2 - |offset|^2) is linear in offset and
+  // the constant, accumulate the normal equations
+  Eigen::Matrix4d ata = Eigen::Matrix4d::Zero();
+  Eigen::Vector4d atb = Eigen::Vector4d::Zero();
+  for (Eigen::Index i = 0; i < normalized.cols(); ++i)
+  {
+    Eigen::Vector4d row(2.0 * normalized(0, i), 2.0 * normalized(1, i), 2.0 * normalized(2, i), 1.0);
+    ata += row * row.transpose();
+    atb += row * normalized.col(i).squaredNorm();
+  }
+
+  Eigen::ColPivHouseholderQR<Eigen::Matrix4d> qr(ata);
+  if (qr.rank() < 4)
+  {
+    return false;
+  }
+  Eigen::Vector4d x = qr.solve(atb);
+
+  double field_squared = x(3) + x.head<3>().squaredNorm();
+  if (!(field_squared > 0.0))
+  {
+    return false;
+  }
+  offset = mean + scale * x.head<3>();
+  field = scale * std::sqrt(field_squared);
+  return true;
+}
+
+bool fitEllipsoid(const Eigen::Matrix3Xd& samples,
+                  Eigen::Vector3d& offset,
+                  Eigen::Matrix3d& soft_iron,
+                  double& field)
+{
+  Eigen::Matrix3Xd normalized;
+  Eigen::Vector3d mean;
+  double scale;
+  if (!normalizeSamples(samples, normalized, mean, scale))
+  {
+    return false;
+  }
+
+  // Fit the quadric m^T M m + 2 v.m = 1, where M is symmetric, which is
+  // linear in the 6 unique values of M and the 3 of v
+  using Vector9d = Eigen::Matrix<double, 9, 1>;
+  using Matrix9d = Eigen::Matrix<double, 9, 9>;
+  Matrix9d ata = Matrix9d::Zero();
+  Vector9d atb = Vector9d::Zero();
+  for (Eigen::Index i = 0; i < normalized.cols(); ++i)
+  {
+    double x = normalized(0, i), y = normalized(1, i), z = normalized(2, i);
+    Vector9d row;
+    row << x * x, y * y, z * z, 2.0 * x * y, 2.0 * x * z, 2.0 * y * z, 2.0 * x, 2.0 * y, 2.0 * z;
+    ata += row * row.transpose();
+    atb += row;
+  }
+
+  Eigen::ColPivHouseholderQR<Matrix9d> qr(ata);
+  if (qr.rank() < 9)
+  {
+    return false;
+  }
+  Vector9d p = qr.solve(atb);
+
+  Eigen::Matrix3d M;
+  M << p(0), p(3), p(4),
+       p(3), p(1), p(5),
+       p(4), p(5), p(2);
+  Eigen::Vector3d v(p(6), p(7), p(8));
+
+  // Complete the square, (m - c)^T M (m - c) = 1 + c^T M c with c = -M^-1 v
+  Eigen::FullPivLU<Eigen::Matrix3d> lu(M);
+  if (!lu.isInvertible())
+  {
+    return false;
+  }
+  Eigen::Vector3d center = -lu.solve(v);
+  double k = 1.0 + center.dot(M * center);
+
+  // The quadric must be an ellipsoid, so M / k must be positive definite
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen(M / k);
+  if (eigen.info() != Eigen::Success || !(eigen.eigenvalues().minCoeff() > 0.0))
+  {
+    return false;
+  }
+
+  // soft_iron = sqrt(M / k) maps the ellipsoid to the unit sphere, rescale
+  // it to unit determinant and the radius of the sphere becomes the field
+  // (which is then scaled back to the units of the samples)
+  Eigen::Vector3d root = eigen.eigenvalues().cwiseSqrt();
+  double det_root = std::cbrt(root.prod());
+  soft_iron = eigen.eigenvectors() * (root / det_root).asDiagonal() * eigen.eigenvectors().transpose();
+  offset = mean + scale * center;
+  field = scale / det_root;
+  return true;
+}
+
+}  // namespace robot_calibration
@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ament_index_cpp/get_package_share_directory.hpp>
+#include <robot_calibration/util/mesh_cache.hpp>
+
+namespace robot_calibration
+{
+
+/*
+ * The file is a header followed by tables, each aligned to 8 bytes, as in
+ * the dataset. All offsets are in bytes from the start of the file.
+ */
+static const char MESH_CACHE_MAGIC[8] = {'R', 'C', 'A', 'L', 'M', 'E', 'S', 'H'};
+static const uint64_t MESH_CACHE_VERSION = 1;
+
+struct MeshCacheHeader
+{
+  char magic[8];
+  uint64_t version;
+  uint64_t file_size;
+  // char[key_size], used to detect collisions of the file name hash
+  uint64_t key_size;
+  uint64_t key;
+  // double[3 * num_vertices]
+  uint64_t num_vertices;
+  uint64_t vertices;
+  // uint32_t[3 * num_triangles]
+  uint64_t num_triangles;
+  uint64_t triangles;
+  // NodeRecord[num_nodes]
+  uint64_t num_nodes;
+  uint64_t nodes;
+  // double[9 * num_corners], the x, y and z of each corner of the tree
+  uint64_t num_corners;
+  uint64_t corners;
+};
+
+namespace
+{
+
+struct NodeRecord
+{
+  double min[3];
+  double max[3];
+  int32_t left;
+  int32_t right;
+  int32_t begin;
+  int32_t end;
+};
+
+uint64_t align(uint64_t offset)
+{
+  return (offset + 7) & ~static_cast<uint64_t>(7);
+}
+
+/** @brief Reserve space for a table after the current end of file. */
+template <typename T>
+uint64_t layout(uint64_t& end, size_t count)
+{
+  uint64_t offset = align(end);
+  end = offset + sizeof(T) * count;
+  return offset;
+}
+
+/** @brief Write a table at its offset, padding from the current position. */
+template <typename T>
+void writeTable(std::ofstream& file, uint64_t offset, const T* table, size_t count)
+{
+  static const char padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  uint64_t position = file.tellp();
+  file.write(padding, offset - position);
+  if (count > 0)
+  {
+    file.write(reinterpret_cast<const char*>(table), sizeof(T) * count);
+  }
+}
+
+/** @brief Get a table of the mapped file, or NULL if it is not inside the file. */
+template <typename T>
+const T* getTable(const char* data, uint64_t size, uint64_t offset, uint64_t count)
+{
+  if (offset % 8 != 0 || offset > size || count > (size - offset) / sizeof(T))
+  {
+    return nullptr;
+  }
+  return reinterpret_cast<const T*>(data + offset);
+}
+
+/** @brief Get the file a resource path refers to, or an empty string. */
+std::string getResourceFile(const std::string& resource)
+{
+  static const std::string package_prefix = "package://";
+  static const std::string file_prefix = "file://";
+  if (resource.compare(0, file_prefix.size(), file_prefix) == 0)
+  {
+    return resource.substr(file_prefix.size());
+  }
+  if (resource.compare(0, package_prefix.size(), package_prefix) == 0)
+  {
+    size_t slash = resource.find('/', package_prefix.size());
+    if (slash == std::string::npos)
+    {
+      return std::string();
+    }
+    std::string package = resource.substr(package_prefix.size(), slash - package_prefix.size());
+    try
+    {
+      return ament_index_cpp::get_package_share_directory(package) + resource.substr(slash);
+    }
+    catch (const std::exception&)
+    {
+      return std::string();
+    }
+  }
+  return std::string();
+}
+
+}  // namespace
+
+MeshCache::MeshCache(const std::string& directory) : directory_(directory)
+{
+}
+
+std::string MeshCache::getKey(const std::string& resource,
+                              const Eigen::Vector3d& scale,
+                              const Eigen::Isometry3d& origin,
+                              size_t target_triangles)
+{
+  std::stringstream key;
+  key << std::setprecision(17) << resource;
+  for (int i = 0; i < 3; ++i)
+  {
+    key << " " << scale(i);
+  }
+  for (int i = 0; i < 3; ++i)
+  {
+    for (int j = 0; j < 4; ++j)
+    {
+      key << " " << origin.matrix()(i, j);
+    }
+  }
+  key << " " << target_triangles;
+
+  struct stat st;
+  std::string file_name = getResourceFile(resource);
+  if (!file_name.empty() && stat(file_name.c_str(), &st) == 0)
+  {
+    key << " " << st.st_size << " " << st.st_mtime;
+  }
+  return key.str();
+}
+
+bool MeshCache::load(const std::string& key,
+                     std::shared_ptr<shapes::Mesh>& mesh,
+                     MeshTreePtr& tree) const
+{
+  std::string file_name = getFileName(key);
+  int fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(MeshCacheHeader)))
+  {
+    ::close(fd);
+    return false;
+  }
+
+  void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    return false;
+  }
+  const char* data = static_cast<const char*>(mapped);
+  uint64_t size = st.st_size;
+
+  // Validate the header, and that every table is inside the file
+  const MeshCacheHeader& h = *reinterpret_cast<const MeshCacheHeader*>(data);
+  const char* key_chars = nullptr;
+  const double* vertices = nullptr;
+  const uint32_t* triangles = nullptr;
+  const NodeRecord* nodes = nullptr;
+  const double* corners = nullptr;
+  bool valid =
+    std::memcmp(h.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) == 0 &&
+    h.version == MESH_CACHE_VERSION &&
+    h.file_size == size &&
+    (key_chars = getTable<char>(data, size, h.key, h.key_size)) != nullptr &&
+    h.num_vertices <= size && h.num_triangles <= size && h.num_corners <= size &&
+    (vertices = getTable<double>(data, size, h.vertices, 3 * h.num_vertices)) != nullptr &&
+    (triangles = getTable<uint32_t>(data, size, h.triangles, 3 * h.num_triangles)) != nullptr &&
+    (nodes = getTable<NodeRecord>(data, size, h.nodes, h.num_nodes)) != nullptr &&
+    (corners = getTable<double>(data, size, h.corners, 9 * h.num_corners)) != nullptr &&
+    std::string(key_chars, h.key_size) == key;
+
+  if (valid)
+  {
+    mesh = std::make_shared<shapes::Mesh>(h.num_vertices, h.num_triangles);
+    std::memcpy(mesh->vertices, vertices, sizeof(double) * 3 * h.num_vertices);
+    for (size_t i = 0; i < 3 * h.num_triangles; ++i)
+    {
+      valid &= triangles[i] < h.num_vertices;
+      mesh->triangles[i] = triangles[i];
+    }
+
+    tree.reset(new MeshTree());
+    tree->nodes_.resize(h.num_nodes);
+    for (size_t i = 0; i < h.num_nodes; ++i)
+    {
+      MeshTree::Node& node = tree->nodes_[i];
+      node.min = Eigen::Vector3d(nodes[i].min[0], nodes[i].min[1], nodes[i].min[2]);
+      node.max = Eigen::Vector3d(nodes[i].max[0], nodes[i].max[1], nodes[i].max[2]);
+      node.left = nodes[i].left;
+      node.right = nodes[i].right;
+      node.begin = nodes[i].begin;
+      node.end = nodes[i].end;
+    }
+    std::vector<double>* arrays[9] = {&tree->x_[0], &tree->x_[1], &tree->x_[2],
+                                      &tree->y_[0], &tree->y_[1], &tree->y_[2],
+                                      &tree->z_[0], &tree->z_[1], &tree->z_[2]};
+    for (size_t i = 0; i < 9; ++i)
+    {
+      const double* begin = corners + (i * h.num_corners);
+      arrays[i]->assign(begin, begin + h.num_corners);
+    }
+    valid &= tree->isValid();
+  }
+  munmap(mapped, size);
+
+  if (!valid)
+  {
+    std::cerr << file_name << " is not a valid mesh cache entry" << std::endl;
+    mesh.reset();
+    tree.reset();
+    return false;
+  }
+  return true;
+}
+
+bool MeshCache::save(const std::string& key,
+                     const shapes::Mesh& mesh,
+                     const MeshTree& tree) const
+{
+  std::vector<uint32_t> triangles(mesh.triangles, mesh.triangles + 3 * mesh.triangle_count);
+
+  std::vector<NodeRecord> nodes(tree.nodes_.size());
+  for (size_t i = 0; i < nodes.size(); ++i)
+  {
+    const MeshTree::Node& node = tree.nodes_[i];
+    for (size_t j = 0; j < 3; ++j)
+    {
+      nodes[i].min[j] = node.min(j);
+      nodes[i].max[j] = node.max(j);
+    }
+    nodes[i].left = node.left;
+    nodes[i].right = node.right;
+    nodes[i].begin = node.begin;
+    nodes[i].end = node.end;
+  }
+
+  size_t num_corners = tree.x_[0].size();
+  std::vector<double> corners;
+  corners.reserve(9 * num_corners);
+  const std::vector<double>* arrays[9] = {&tree.x_[0], &tree.x_[1], &tree.x_[2],
+                                          &tree.y_[0], &tree.y_[1], &tree.y_[2],
+                                          &tree.z_[0], &tree.z_[1], &tree.z_[2]};
+  for (size_t i = 0; i < 9; ++i)
+  {
+    corners.insert(corners.end(), arrays[i]->begin(), arrays[i]->end());
+  }
+
+  // Lay out the file
+  MeshCacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+  header.version = MESH_CACHE_VERSION;
+  header.key_size = key.size();
+  header.num_vertices = mesh.vertex_count;
+  header.num_triangles = mesh.triangle_count;
+  header.num_nodes = nodes.size();
+  header.num_corners = num_corners;
+
+  uint64_t end = sizeof(header);
+  header.key = layout<char>(end, key.size());
+  header.vertices = layout<double>(end, 3 * mesh.vertex_count);
+  header.triangles = layout<uint32_t>(end, triangles.size());
+  header.nodes = layout<NodeRecord>(end, nodes.size());
+  header.corners = layout<double>(end, corners.size());
+  header.file_size = end;
+
+  // Write to a temporary file, so that a partial entry is never loaded,
+  // even if several processes share the cache
+  mkdir(directory_.c_str(), 0755);
+  std::string file_name = getFileName(key);
+  std::string temp_name = file_name + ".tmp" + std::to_string(getpid());
+  std::ofstream file(temp_name, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+  {
+    std::cerr << "Unable to write mesh cache entry " << file_name << std::endl;
+    return false;
+  }
+  writeTable(file, 0, &header, 1);
+  writeTable(file, header.key, key.data(), key.size());
+  writeTable(file, header.vertices, mesh.vertices, 3 * mesh.vertex_count);
+  writeTable(file, header.triangles, triangles.data(), triangles.size());
+  writeTable(file, header.nodes, nodes.data(), nodes.size());
+  writeTable(file, header.corners, corners.data(), corners.size());
+  file.close();
+
+  if (!file || std::rename(temp_name.c_str(), file_name.c_str()) != 0)
+  {
+    std::cerr << "Unable to write mesh cache entry " << file_name << std::endl;
+    std::remove(temp_name.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+std::string MeshCache::getFileName(const std::string& key) const
+{
+  std::stringstream name;
+  name << directory_ << "/" << std::hex << std::setw(16) << std::setfill('0')
+       << std::hash<std::string>()(key) << ".mesh";
+  return name.str();
+}
+
+}  // namespace robot_calibration
@@ -16,6 +16,11 @@
 
 // Author: Michael Ferguson
 
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <set>
+#include <unordered_map>
 #include <Eigen/Geometry>
 
 #include <geometry_msgs/msg/point.hpp>
@@ -24,39 +29,188 @@
 namespace robot_calibration
 {
 
-MeshLoader::MeshLoader(std::shared_ptr<urdf::Model> model) : model_(model)
+/**
+ * @brief Cluster the vertices of a mesh on a grid with some number of cells
+ *        along the longest side of the bounding box.
+ * @param triangles Returns the triangles which remain, as vertex indices of
+ *        the clustered mesh.
+ * @param vertices If not NULL, returns the clustered vertices.
+ */
+static void clusterVertices(const shapes::Mesh& mesh,
+                            const Eigen::Vector3d& min,
+                            double size,
+                            int cells,
+                            std::vector<std::array<unsigned int, 3>>& triangles,
+                            std::vector<Eigen::Vector3d>* vertices)
 {
+  double cell_size = size / cells;
+  std::unordered_map<uint64_t, unsigned int> cluster_index;
+  std::vector<unsigned int> vertex_cluster(mesh.vertex_count);
+  std::vector<Eigen::Vector3d> sums;
+  std::vector<int> counts;
+  for (size_t v = 0; v < mesh.vertex_count; ++v)
+  {
+    Eigen::Vector3d p(mesh.vertices[(3 * v) + 0],
+                      mesh.vertices[(3 * v) + 1],
+                      mesh.vertices[(3 * v) + 2]);
+    uint64_t key = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+      int cell = std::min(static_cast<int>((p(i) - min(i)) / cell_size), cells - 1);
+      key = (key << 21) | static_cast<uint64_t>(std::max(cell, 0));
+    }
+    auto it = cluster_index.find(key);
+    if (it == cluster_index.end())
+    {
+      it = cluster_index.insert(std::make_pair(key, sums.size())).first;
+      sums.push_back(Eigen::Vector3d::Zero());
+      counts.push_back(0);
+    }
+    vertex_cluster[v] = it->second;
+    sums[it->second] += p;
+    ++counts[it->second];
+  }
+
+  // Collapsed and duplicate triangles are removed
+  triangles.clear();
+  std::set<std::array<unsigned int, 3>> unique;
+  for (size_t t = 0; t < mesh.triangle_count; ++t)
+  {
+    std::array<unsigned int, 3> triangle;
+    for (size_t c = 0; c < 3; ++c)
+    {
+      triangle[c] = vertex_cluster[mesh.triangles[(3 * t) + c]];
+    }
+    if (triangle[0] == triangle[1] || triangle[1] == triangle[2] || triangle[2] == triangle[0])
+    {
+      continue;
+    }
+    std::array<unsigned int, 3> sorted = triangle;
+    std::sort(sorted.begin(), sorted.end());
+    if (unique.insert(sorted).second)
+    {
+      triangles.push_back(triangle);
+    }
+  }
+
+  if (vertices)
+  {
+    vertices->resize(sums.size());
+    for (size_t i = 0; i < sums.size(); ++i)
+    {
+      (*vertices)[i] = sums[i] / counts[i];
+    }
+  }
+}
+
+MeshPtr decimateMesh(const shapes::Mesh& mesh, size_t max_triangles)
+{
+  Eigen::Vector3d min = Eigen::Vector3d::Constant(std::numeric_limits<double>::max());
+  Eigen::Vector3d max = -min;
+  for (size_t v = 0; v < mesh.vertex_count; ++v)
+  {
+    Eigen::Vector3d p(mesh.vertices[(3 * v) + 0],
+                      mesh.vertices[(3 * v) + 1],
+                      mesh.vertices[(3 * v) + 2]);
+    min = min.cwiseMin(p);
+    max = max.cwiseMax(p);
+  }
+  double size = (max - min).maxCoeff();
+
+  std::vector<std::array<unsigned int, 3>> triangles;
+  std::vector<Eigen::Vector3d> vertices;
+  if (mesh.triangle_count <= max_triangles || !(size > 0.0))
+  {
+    // Nothing to decimate, copy the mesh
+    MeshPtr copy = std::make_shared<shapes::Mesh>(mesh.vertex_count, mesh.triangle_count);
+    std::copy(mesh.vertices, mesh.vertices + 3 * mesh.vertex_count, copy->vertices);
+    std::copy(mesh.triangles, mesh.triangles + 3 * mesh.triangle_count, copy->triangles);
+    return copy;
+  }
+
+  // Binary search for the finest grid, the number of triangles which remain
+  // grows with the number of cells
+  int low = 1;
+  int high = 1 << 20;
+  while (low < high)
+  {
+    int cells = low + (high - low + 1) / 2;
+    clusterVertices(mesh, min, size, cells, triangles, nullptr);
+    if (triangles.size() <= max_triangles)
+      low = cells;
+    else
+      high = cells - 1;
+  }
+  clusterVertices(mesh, min, size, low, triangles, &vertices);
+
+  MeshPtr decimated = std::make_shared<shapes::Mesh>(vertices.size(), triangles.size());
+  for (size_t v = 0; v < vertices.size(); ++v)
+  {
+    for (size_t i = 0; i < 3; ++i)
+      decimated->vertices[(3 * v) + i] = vertices[v](i);
+  }
+  for (size_t t = 0; t < triangles.size(); ++t)
+  {
+    for (size_t c = 0; c < 3; ++c)
+      decimated->triangles[(3 * t) + c] = triangles[t][c];
+  }
+  return decimated;
+}
+
+MeshLoader::Params::Params() :
+  target_triangles(0)
+{
+}
+
+MeshLoader::MeshLoader(std::shared_ptr<urdf::Model> model, const Params& params) :
+  model_(model),
+  params_(params)
+{
+  if (!params_.cache_directory.empty())
+  {
+    cache_.reset(new MeshCache(params_.cache_directory));
+  }
 }
 
 MeshPtr MeshLoader::getCollisionMesh(const std::string& link_name)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  int index = load(link_name);
+  if (index < 0)
+  {
+    return MeshPtr();
+  }
+  return meshes_[index];
+}
+
+int MeshLoader::load(const std::string& link_name)
 {
   // See if we have already loaded the mesh
-  for (size_t i = 0; i < link_names_.size(); ++i)
+  auto it = link_index_.find(link_name);
+  if (it != link_index_.end())
   {
-    if (link_names_[i] == link_name)
-    {
-      return meshes_[i];
-    }
+    return it->second;
   }
+  link_index_[link_name] = -1;
 
   // Find the mesh resource path
   urdf::LinkConstSharedPtr link = model_->getLink(link_name);
   if (!link)
   {
     //ROS_ERROR("Cannot find %s in URDF", link_name.c_str());
-    return MeshPtr();
+    return -1;
   }
 
-  if (!link->collision->geometry)
+  if (!link->collision || !link->collision->geometry)
   {
     //ROS_ERROR("%s does not have collision geometry description.", link_name.c_str());
-    return MeshPtr();
+    return -1;
   }
 
   if (link->collision->geometry->type != urdf::Geometry::MESH)
   {
     //ROS_ERROR("%s does not have mesh geometry", link_name.c_str());
-    return MeshPtr();
+    return -1;
   }
 
   // This is the resource path (package://path/x.mesh)
@@ -67,21 +221,40 @@ MeshPtr MeshLoader::getCollisionMesh(const std::string& link_name)
                         (dynamic_cast<urdf::Mesh*>(link->collision->geometry.get()))->scale.y,
                         (dynamic_cast<urdf::Mesh*>(link->collision->geometry.get()))->scale.z);
 
+  Eigen::Isometry3d origin = Eigen::Isometry3d::Identity();
+  origin.linear() = Eigen::Quaterniond(link->collision->origin.rotation.w,
+                                       link->collision->origin.rotation.x,
+                                       link->collision->origin.rotation.y,
+                                       link->collision->origin.rotation.z).toRotationMatrix();
+  origin.translation() = Eigen::Vector3d(link->collision->origin.position.x,
+                                         link->collision->origin.position.y,
+                                         link->collision->origin.position.z);
+
+  // Preprocessed meshes come with their tree already built
+  std::string key;
+  if (cache_)
+  {
+    key = MeshCache::getKey(mesh_path, scale, origin, params_.target_triangles);
+    MeshPtr mesh;
+    MeshTreePtr tree;
+    if (cache_->load(key, mesh, tree))
+    {
+      link_index_[link_name] = meshes_.size();
+      meshes_.push_back(mesh);
+      trees_.push_back(tree);
+      return meshes_.size() - 1;
+    }
+  }
+
   MeshPtr mesh(shapes::createMeshFromResource(mesh_path, scale));
-  link_names_.push_back(link_name);
-  meshes_.push_back(mesh);
+  if (!mesh)
+  {
+    //ROS_ERROR("Unable to load %s", mesh_path.c_str());
+    return -1;
+  }
 
   //ROS_INFO("Loaded %s with %u vertices", mesh_path.c_str(), mesh->vertex_count);
 
-  //Eigen::Quaterniond quat();
-  Eigen::Matrix3d rotation = Eigen::Quaterniond(link->collision->origin.rotation.w,
-                                                link->collision->origin.rotation.x,
-                                                link->collision->origin.rotation.y,
-                                                link->collision->origin.rotation.z).toRotationMatrix();
-  Eigen::Vector3d translation(link->collision->origin.position.x,
-                              link->collision->origin.position.y,
-                              link->collision->origin.position.z);
-
   // Transform to proper location
   for (size_t v = 0; v < mesh->vertex_count; ++v)
   {
@@ -89,14 +262,46 @@ MeshPtr MeshLoader::getCollisionMesh(const std::string& link_name)
                       mesh->vertices[(3 * v) + 1],
                       mesh->vertices[(3 * v) + 2]);
 
-    p = (rotation * p) + translation;
+    p = origin * p;
 
     mesh->vertices[(3 * v) + 0] = p(0);
     mesh->vertices[(3 * v) + 1] = p(1);
     mesh->vertices[(3 * v) + 2] = p(2);
   }
 
-  return mesh;
+  if (params_.target_triangles > 0 && mesh->triangle_count > params_.target_triangles)
+  {
+    mesh = decimateMesh(*mesh, params_.target_triangles);
+  }
+
+  MeshTreePtr tree;
+  if (cache_)
+  {
+    tree = std::make_shared<MeshTree>(*mesh);
+    cache_->save(key, *mesh, *tree);
+  }
+
+  link_index_[link_name] = meshes_.size();
+  meshes_.push_back(mesh);
+  trees_.push_back(tree);
+  return meshes_.size() - 1;
+}
+
+MeshTreePtr MeshLoader::getCollisionMeshTree(const std::string& link_name)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  int index = load(link_name);
+  if (index < 0)
+  {
+    return MeshTreePtr();
+  }
+
+  // Build the tree once, now that the mesh has been transformed
+  if (!trees_[index])
+  {
+    trees_[index] = std::make_shared<MeshTree>(*meshes_[index]);
+  }
+  return trees_[index];
 }
 
 }  // namespace robot_calibration
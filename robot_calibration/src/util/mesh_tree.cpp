@@ -0,0 +1,454 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include <robot_calibration/util/mesh_tree.hpp>
+
+namespace robot_calibration
+{
+
+// Maximum number of triangles in a leaf node, large enough to make good
+// use of the vectorized leaf tests
+static const int LEAF_SIZE = 8;
+
+// Maximum number of nodes waiting to be searched, one more than the tree depth
+static const int MAX_STACK = 64;
+
+Eigen::Vector3d closestPointOnSegment(const Eigen::Vector3d& a,
+                                      const Eigen::Vector3d& b,
+                                      const Eigen::Vector3d& p)
+{
+  Eigen::Vector3d ab = b - a;
+  double e = (p - a).dot(ab);
+  if (e <= 0.0)
+  {
+    // Point A is closest to P
+    return a;
+  }
+  double f = ab.dot(ab);
+  if (e >= f)
+  {
+    // Point B is closest to P
+    return b;
+  }
+  // P actually projects between
+  return a + (e / f) * ab;
+}
+
+Eigen::Vector3d closestPointOnTriangle(const Eigen::Vector3d& a,
+                                       const Eigen::Vector3d& b,
+                                       const Eigen::Vector3d& c,
+                                       const Eigen::Vector3d& p)
+{
+  Eigen::Vector3d ab = b - a;
+  Eigen::Vector3d ac = c - a;
+
+  // Check if P in vertex region outside A
+  Eigen::Vector3d ap = p - a;
+  double d1 = ab.dot(ap);
+  double d2 = ac.dot(ap);
+  if (d1 <= 0.0 && d2 <= 0.0)
+    return a;
+
+  // Check if P in vertex region outside B
+  Eigen::Vector3d bp = p - b;
+  double d3 = ab.dot(bp);
+  double d4 = ac.dot(bp);
+  if (d3 >= 0.0 && d4 <= d3)
+    return b;
+
+  // Check if P in edge region of AB
+  double vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0)
+    return a + (d1 / (d1 - d3)) * ab;
+
+  // Check if P in vertex region outside C
+  Eigen::Vector3d cp = p - c;
+  double d5 = ab.dot(cp);
+  double d6 = ac.dot(cp);
+  if (d6 >= 0.0 && d5 <= d6)
+    return c;
+
+  // Check if P in edge region of AC
+  double vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0)
+    return a + (d2 / (d2 - d6)) * ac;
+
+  // Check if P in edge region of BC
+  double va = d3 * d6 - d5 * d4;
+  if (va <= 0.0 && (d4 - d3) >= 0.0 && (d5 - d6) >= 0.0)
+    return b + ((d4 - d3) / ((d4 - d3) + (d5 - d6))) * (c - b);
+
+  double denom = va + vb + vc;
+  if (denom <= 0.0)
+  {
+    // Degenerate triangle, use the closest edge
+    Eigen::Vector3d closest = closestPointOnSegment(a, b, p);
+    Eigen::Vector3d q = closestPointOnSegment(b, c, p);
+    if ((q - p).squaredNorm() < (closest - p).squaredNorm())
+      closest = q;
+    q = closestPointOnSegment(c, a, p);
+    if ((q - p).squaredNorm() < (closest - p).squaredNorm())
+      closest = q;
+    return closest;
+  }
+
+  // P inside face region
+  return a + ab * (vb / denom) + ac * (vc / denom);
+}
+
+MeshTree::MeshTree(const shapes::Mesh& mesh)
+{
+  std::vector<Eigen::Vector3d> vertices(3 * mesh.triangle_count);
+  std::vector<Eigen::Vector3d> centroids(mesh.triangle_count);
+  std::vector<int> triangles(mesh.triangle_count);
+  for (size_t t = 0; t < mesh.triangle_count; ++t)
+  {
+    for (size_t v = 0; v < 3; ++v)
+    {
+      unsigned int idx = mesh.triangles[(3 * t) + v];
+      vertices[(3 * t) + v] = Eigen::Vector3d(mesh.vertices[(3 * idx) + 0],
+                                              mesh.vertices[(3 * idx) + 1],
+                                              mesh.vertices[(3 * idx) + 2]);
+    }
+    centroids[t] = (vertices[(3 * t) + 0] + vertices[(3 * t) + 1] + vertices[(3 * t) + 2]) / 3.0;
+    triangles[t] = t;
+  }
+
+  if (triangles.empty())
+    return;
+
+  build(triangles, centroids, vertices, 0, triangles.size());
+
+  // Store vertices in the order of the leaf nodes. Leaf tests always process
+  // LEAF_SIZE triangles so that the loops have a fixed length, so pad the
+  // end so the last leaf does not read past the end of the arrays.
+  for (size_t v = 0; v < 3; ++v)
+  {
+    x_[v].resize(triangles.size() + LEAF_SIZE, 0.0);
+    y_[v].resize(triangles.size() + LEAF_SIZE, 0.0);
+    z_[v].resize(triangles.size() + LEAF_SIZE, 0.0);
+    for (size_t t = 0; t < triangles.size(); ++t)
+    {
+      const Eigen::Vector3d& vertex = vertices[(3 * triangles[t]) + v];
+      x_[v][t] = vertex(0);
+      y_[v][t] = vertex(1);
+      z_[v][t] = vertex(2);
+    }
+  }
+}
+
+int MeshTree::build(std::vector<int>& triangles, std::vector<Eigen::Vector3d>& centroids,
+                    const std::vector<Eigen::Vector3d>& vertices, int begin, int end)
+{
+  // Bound the triangles, and their centroids for choosing a split
+  Eigen::Vector3d min = vertices[3 * triangles[begin]];
+  Eigen::Vector3d max = min;
+  Eigen::Vector3d centroid_min = centroids[triangles[begin]];
+  Eigen::Vector3d centroid_max = centroid_min;
+  for (int t = begin; t < end; ++t)
+  {
+    for (size_t v = 0; v < 3; ++v)
+    {
+      min = min.cwiseMin(vertices[(3 * triangles[t]) + v]);
+      max = max.cwiseMax(vertices[(3 * triangles[t]) + v]);
+    }
+    centroid_min = centroid_min.cwiseMin(centroids[triangles[t]]);
+    centroid_max = centroid_max.cwiseMax(centroids[triangles[t]]);
+  }
+  Node node;
+  node.min = min;
+  node.max = max;
+  node.left = -1;
+  node.right = -1;
+  node.begin = begin;
+  node.end = end;
+  int index = nodes_.size();
+  nodes_.push_back(node);
+
+  if (end - begin <= LEAF_SIZE)
+    return index;
+
+  // Split at the median along the longest axis
+  int axis;
+  (centroid_max - centroid_min).maxCoeff(&axis);
+  int middle = begin + (end - begin) / 2;
+  std::nth_element(triangles.begin() + begin,
+                   triangles.begin() + middle,
+                   triangles.begin() + end,
+                   [&centroids, axis](int a, int b)
+                   {
+                     return centroids[a](axis) < centroids[b](axis);
+                   });
+
+  // Note: nodes_ may be reallocated, so do not hold references across build()
+  int left = build(triangles, centroids, vertices, begin, middle);
+  int right = build(triangles, centroids, vertices, middle, end);
+  nodes_[index].left = left;
+  nodes_[index].right = right;
+  return index;
+}
+
+double MeshTree::closestEdge(const Eigen::Vector3d& p,
+                             Eigen::Vector3d& a,
+                             Eigen::Vector3d& b) const
+{
+  return search(p, true, a, b);
+}
+
+double MeshTree::closestPoint(const Eigen::Vector3d& p,
+                              Eigen::Vector3d& closest) const
+{
+  Eigen::Vector3d unused;
+  return search(p, false, closest, unused);
+}
+
+size_t MeshTree::size() const
+{
+  if (x_[0].empty())
+    return 0;
+  return x_[0].size() - LEAF_SIZE;
+}
+
+bool MeshTree::isValid() const
+{
+  size_t corners = x_[0].size();
+  for (size_t v = 0; v < 3; ++v)
+  {
+    if (x_[v].size() != corners || y_[v].size() != corners || z_[v].size() != corners)
+      return false;
+  }
+  if (nodes_.empty())
+    return corners == 0;
+  if (corners < static_cast<size_t>(LEAF_SIZE))
+    return false;
+
+  // build() always adds children after their parent, so depth can be found
+  // in a single pass and there can be no cycles
+  std::vector<int> depth(nodes_.size(), -1);
+  depth[0] = 0;
+  for (size_t i = 0; i < nodes_.size(); ++i)
+  {
+    const Node& node = nodes_[i];
+    if (depth[i] < 0 || depth[i] >= MAX_STACK - 1)
+      return false;
+    if (node.left < 0)
+    {
+      if (node.right >= 0 || node.begin < 0 || node.end < node.begin ||
+          node.end - node.begin > LEAF_SIZE ||
+          static_cast<size_t>(node.begin + LEAF_SIZE) > corners)
+        return false;
+      continue;
+    }
+    if (node.left <= static_cast<int>(i) || node.right <= static_cast<int>(i) ||
+        node.left >= static_cast<int>(nodes_.size()) ||
+        node.right >= static_cast<int>(nodes_.size()))
+      return false;
+    depth[node.left] = depth[i] + 1;
+    depth[node.right] = depth[i] + 1;
+  }
+  return true;
+}
+
+Eigen::Vector3d MeshTree::vertex(int triangle, int corner) const
+{
+  return Eigen::Vector3d(x_[corner][triangle], y_[corner][triangle], z_[corner][triangle]);
+}
+
+/**
+ * @brief Squared distance from P to the line segment A-B. This is branch free
+ *        (the conditionals compile to selects), so that loops over a leaf
+ *        vectorize.
+ */
+static inline double segmentDistance(double ax, double ay, double az,
+                                     double bx, double by, double bz,
+                                     double px, double py, double pz)
+{
+  double abx = bx - ax, aby = by - ay, abz = bz - az;
+  double apx = px - ax, apy = py - ay, apz = pz - az;
+  double e = apx * abx + apy * aby + apz * abz;
+  double f = abx * abx + aby * aby + abz * abz;
+  // If A and B are the same point then e = 0, and so t = 0
+  double t = std::min(std::max(e / std::max(f, std::numeric_limits<double>::min()), 0.0), 1.0);
+  double dx = apx - t * abx, dy = apy - t * aby, dz = apz - t * abz;
+  return dx * dx + dy * dy + dz * dz;
+}
+
+/**
+ * @brief Squared distance from P to the triangle A-B-C, branch free like
+ *        segmentDistance(). If P projects inside the triangle, the distance
+ *        is to the plane, otherwise it is to the closest edge.
+ */
+static inline double triangleDistance(double ax, double ay, double az,
+                                      double bx, double by, double bz,
+                                      double cx, double cy, double cz,
+                                      double px, double py, double pz)
+{
+  double abx = bx - ax, aby = by - ay, abz = bz - az;
+  double acx = cx - ax, acy = cy - ay, acz = cz - az;
+  double bcx = cx - bx, bcy = cy - by, bcz = cz - bz;
+  double apx = px - ax, apy = py - ay, apz = pz - az;
+  double bpx = px - bx, bpy = py - by, bpz = pz - bz;
+  double cpx = px - cx, cpy = py - cy, cpz = pz - cz;
+
+  // Normal of the triangle
+  double nx = aby * acz - abz * acy;
+  double ny = abz * acx - abx * acz;
+  double nz = abx * acy - aby * acx;
+  double nn = nx * nx + ny * ny + nz * nz;
+
+  // P projects inside if it is on the inner side of each edge
+  double sa = (aby * apz - abz * apy) * nx + (abz * apx - abx * apz) * ny + (abx * apy - aby * apx) * nz;
+  double sb = (bcy * bpz - bcz * bpy) * nx + (bcz * bpx - bcx * bpz) * ny + (bcx * bpy - bcy * bpx) * nz;
+  double sc = (acz * cpy - acy * cpz) * nx + (acx * cpz - acz * cpx) * ny + (acy * cpx - acx * cpy) * nz;
+  bool inside = (nn > 0.0) & (std::min(sa, std::min(sb, sc)) >= 0.0);
+
+  double plane = apx * nx + apy * ny + apz * nz;
+  plane = plane * plane / std::max(nn, std::numeric_limits<double>::min());
+  double edges = std::min(segmentDistance(ax, ay, az, bx, by, bz, px, py, pz),
+                          std::min(segmentDistance(bx, by, bz, cx, cy, cz, px, py, pz),
+                                   segmentDistance(cx, cy, cz, ax, ay, az, px, py, pz)));
+  return inside ? plane : edges;
+}
+
+/** @brief Squared distance from a point to an axis aligned box. */
+static double distToBox(const Eigen::Vector3d& min,
+                        const Eigen::Vector3d& max,
+                        const Eigen::Vector3d& p)
+{
+  return (min - p).cwiseMax(p - max).cwiseMax(0.0).squaredNorm();
+}
+
+double MeshTree::search(const Eigen::Vector3d& p, bool edges,
+                        Eigen::Vector3d& a, Eigen::Vector3d& b) const
+{
+  double best = std::numeric_limits<double>::max();
+  if (nodes_.empty())
+    return best;
+
+  // Distance to a triangle (or its edges) is never less than to its box,
+  // so nodes further than the best distance found so far can be skipped
+  // Median splits keep the tree depth near log2(size), so a fixed size
+  // stack is sufficient and queries do not allocate
+  std::pair<double, int> stack[MAX_STACK];
+  int stack_size = 0;
+  stack[stack_size++] = std::make_pair(distToBox(nodes_[0].min, nodes_[0].max, p), 0);
+  while (stack_size > 0)
+  {
+    std::pair<double, int> entry = stack[--stack_size];
+    if (entry.first >= best)
+      continue;
+
+    const Node& node = nodes_[entry.second];
+    if (node.left < 0)
+    {
+      // Test all triangles of the leaf at once, into d[edge][triangle].
+      // Results past the end of the leaf are ignored.
+      const int begin = node.begin;
+      const int count = node.end - node.begin;
+      double d[3][LEAF_SIZE];
+      if (edges)
+      {
+        for (size_t e = 0; e < 3; ++e)
+        {
+          const double* ax = &x_[e][begin];
+          const double* ay = &y_[e][begin];
+          const double* az = &z_[e][begin];
+          const double* bx = &x_[(e + 1) % 3][begin];
+          const double* by = &y_[(e + 1) % 3][begin];
+          const double* bz = &z_[(e + 1) % 3][begin];
+          for (int t = 0; t < LEAF_SIZE; ++t)
+            d[e][t] = segmentDistance(ax[t], ay[t], az[t], bx[t], by[t], bz[t], p(0), p(1), p(2));
+        }
+      }
+      else
+      {
+        const double* ax = &x_[0][begin];
+        const double* ay = &y_[0][begin];
+        const double* az = &z_[0][begin];
+        const double* bx = &x_[1][begin];
+        const double* by = &y_[1][begin];
+        const double* bz = &z_[1][begin];
+        const double* cx = &x_[2][begin];
+        const double* cy = &y_[2][begin];
+        const double* cz = &z_[2][begin];
+        for (int t = 0; t < LEAF_SIZE; ++t)
+          d[0][t] = triangleDistance(ax[t], ay[t], az[t], bx[t], by[t], bz[t],
+                                     cx[t], cy[t], cz[t], p(0), p(1), p(2));
+      }
+
+      // Find the closest feature in the leaf
+      int features = edges ? 3 : 1;
+      int closest_edge = -1;
+      int closest_triangle = -1;
+      double leaf_best = best;
+      for (int e = 0; e < features; ++e)
+      {
+        for (int t = 0; t < count; ++t)
+        {
+          if (d[e][t] < leaf_best)
+          {
+            leaf_best = d[e][t];
+            closest_edge = e;
+            closest_triangle = begin + t;
+          }
+        }
+      }
+      if (closest_triangle < 0)
+        continue;
+
+      // Compute the closest point for only the closest triangle, and use
+      // the distance to it so results match closestPointOnTriangle()
+      if (edges)
+      {
+        a = vertex(closest_triangle, closest_edge);
+        b = vertex(closest_triangle, (closest_edge + 1) % 3);
+        best = (closestPointOnSegment(a, b, p) - p).squaredNorm();
+      }
+      else
+      {
+        a = closestPointOnTriangle(vertex(closest_triangle, 0),
+                                   vertex(closest_triangle, 1),
+                                   vertex(closest_triangle, 2), p);
+        best = (a - p).squaredNorm();
+      }
+      continue;
+    }
+
+    // Push the closer child last, so that it is searched first
+    double left = distToBox(nodes_[node.left].min, nodes_[node.left].max, p);
+    double right = distToBox(nodes_[node.right].min, nodes_[node.right].max, p);
+    if (left < right)
+    {
+      stack[stack_size++] = std::make_pair(right, node.right);
+      stack[stack_size++] = std::make_pair(left, node.left);
+    }
+    else
+    {
+      stack[stack_size++] = std::make_pair(left, node.left);
+      stack[stack_size++] = std::make_pair(right, node.right);
+    }
+  }
+
+  return best;
+}
+
+}  // namespace robot_calibration
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <cmath>
+#include <robot_calibration/util/pose_ordering.hpp>
+
+namespace robot_calibration
+{
+
+// 2-opt stops after this many passes, even if still improving
+static const int MAX_PASSES = 100;
+
+PoseMotionTime::PoseMotionTime(const std::map<std::string, double>& velocity_limits,
+                               double default_velocity) :
+  velocity_limits_(velocity_limits),
+  default_velocity_(default_velocity)
+{
+}
+
+double PoseMotionTime::getTime(const sensor_msgs::msg::JointState& from,
+                               const sensor_msgs::msg::JointState& to) const
+{
+  double time = 0.0;
+  for (size_t i = 0; i < to.name.size(); ++i)
+  {
+    for (size_t j = 0; j < from.name.size(); ++j)
+    {
+      if (from.name[j] == to.name[i])
+      {
+        double distance = std::fabs(to.position[i] - from.position[j]);
+        time = std::max(time, distance / getVelocity(to.name[i]));
+        break;
+      }
+    }
+  }
+  return time;
+}
+
+double PoseMotionTime::getTime(
+  const std::vector<robot_calibration_msgs::msg::CaptureConfig>& poses) const
+{
+  double time = 0.0;
+  for (size_t i = 1; i < poses.size(); ++i)
+  {
+    time += getTime(poses[i - 1].joint_states, poses[i].joint_states);
+  }
+  return time;
+}
+
+double PoseMotionTime::getVelocity(const std::string& joint) const
+{
+  auto it = velocity_limits_.find(joint);
+  if (it != velocity_limits_.end() && it->second > 0.0)
+  {
+    return it->second;
+  }
+  return default_velocity_;
+}
+
+std::vector<size_t> orderPoses(std::vector<robot_calibration_msgs::msg::CaptureConfig>& poses,
+                               const PoseMotionTime& motion_time)
+{
+  const size_t n = poses.size();
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; ++i)
+  {
+    order[i] = i;
+  }
+  if (n < 3)
+  {
+    return order;
+  }
+
+  // Time between each pair of poses
+  std::vector<double> times(n * n, 0.0);
+  for (size_t i = 0; i < n; ++i)
+  {
+    for (size_t j = i + 1; j < n; ++j)
+    {
+      times[i * n + j] = times[j * n + i] =
+        motion_time.getTime(poses[i].joint_states, poses[j].joint_states);
+    }
+  }
+  auto time = [&](size_t a, size_t b)
+  {
+    return times[order[a] * n + order[b]];
+  };
+
+  // Nearest neighbor, starting from the first pose
+  for (size_t i = 1; i < n; ++i)
+  {
+    size_t best = i;
+    for (size_t j = i + 1; j < n; ++j)
+    {
+      if (time(i - 1, j) < time(i - 1, best))
+      {
+        best = j;
+      }
+    }
+    std::swap(order[i], order[best]);
+  }
+
+  // 2-opt: reverse the path between i and j whenever that is faster
+  for (int pass = 0; pass < MAX_PASSES; ++pass)
+  {
+    bool improved = false;
+    for (size_t i = 1; i < n - 1; ++i)
+    {
+      for (size_t j = i + 1; j < n; ++j)
+      {
+        double before = time(i - 1, i);
+        double after = time(i - 1, j);
+        if (j + 1 < n)
+        {
+          before += time(j, j + 1);
+          after += time(i, j + 1);
+        }
+        if (after < before - 1e-9)
+        {
+          std::reverse(order.begin() + i, order.begin() + j + 1);
+          improved = true;
+        }
+      }
+    }
+    if (!improved)
+    {
+      break;
+    }
+  }
+
+  std::vector<robot_calibration_msgs::msg::CaptureConfig> ordered;
+  ordered.reserve(n);
+  for (size_t i = 0; i < n; ++i)
+  {
+    ordered.push_back(poses[order[i]]);
+  }
+  poses.swap(ordered);
+  return order;
+}
+
+}  // namespace robot_calibration
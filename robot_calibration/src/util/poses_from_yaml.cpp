@@ -18,6 +18,7 @@
 
 // Author: Michael Ferguson
 
+#include <fstream>
 #include <rclcpp/rclcpp.hpp>
 #include <robot_calibration/util/poses_from_yaml.hpp>
 #include <yaml-cpp/yaml.h>
@@ -79,4 +80,33 @@ bool getPosesFromYaml(const std::string& filename,
   return true;
 }
 
+// Save a set of calibration poses
+bool savePosesToYaml(const std::string& filename,
+                     const std::vector<robot_calibration_msgs::msg::CaptureConfig>& poses)
+{
+  YAML::Emitter out;
+  out << YAML::BeginSeq;
+  for (const auto& pose : poses)
+  {
+    out << YAML::BeginMap;
+    out << YAML::Key << "joints" << YAML::Value << YAML::Flow << pose.joint_states.name;
+    out << YAML::Key << "positions" << YAML::Value << YAML::Flow << pose.joint_states.position;
+    if (!pose.features.empty())
+    {
+      out << YAML::Key << "features" << YAML::Value << YAML::Flow << pose.features;
+    }
+    out << YAML::EndMap;
+  }
+  out << YAML::EndSeq;
+
+  std::ofstream file(filename);
+  if (!file.is_open())
+  {
+    RCLCPP_ERROR(LOGGER, "Unable to open %s", filename.c_str());
+    return false;
+  }
+  file << out.c_str() << std::endl;
+  return file.good();
+}
+
 }  // namespace robot_calibration
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <robot_calibration/util/eigen_geometry.hpp>
+#include <robot_calibration/util/ransac.hpp>
+
+namespace robot_calibration
+{
+
+// Hypotheses are decided in batches of this size, early termination is
+// only checked between batches so that the result does not depend on timing
+static const int BATCH_SIZE = 16;
+
+PlaneRansac::Params::Params() :
+  iterations(100),
+  sample_size(35),
+  tolerance(0.02),
+  desired_normal(Eigen::Vector3d::Zero()),
+  cos_normal_angle(0.0),
+  confidence(0.99),
+  num_threads(1),
+  seed(0)
+{
+}
+
+PlaneRansac::PlaneRansac(const Params& params) :
+  params_(params),
+  iterations_(0)
+{
+}
+
+bool PlaneRansac::fit(const Points& points, Eigen::Vector3d& normal, double& d) const
+{
+  iterations_ = 0;
+  if (points.rows() < 3 || params_.iterations < 1 || params_.sample_size < 3)
+  {
+    return false;
+  }
+
+  Hypothesis best;
+  best.valid = false;
+  best.inliers = 0;
+  best.normal = Eigen::Vector3d::Zero();
+  best.d = 0.0;
+
+  // Workers take hypotheses in order, and may run ahead of the batch being
+  // decided. Completed batches are folded into the best hypothesis in order,
+  // so the result and the early termination do not depend on timing.
+  std::vector<Hypothesis> hypotheses(params_.iterations);
+  std::vector<char> done(params_.iterations, 0);
+  std::mutex mutex;
+  int required = params_.iterations;  // Guarded by mutex
+  std::atomic<int> limit(required);
+  std::atomic<int> next(0);
+  auto worker = [&]()
+  {
+    for (int k = next++; k < limit; k = next++)
+    {
+      evaluate(points, k, hypotheses[k]);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      done[k] = 1;
+      while (iterations_ < required)
+      {
+        int count = std::min(BATCH_SIZE, required - iterations_);
+        auto batch = done.begin() + iterations_;
+        if (std::find(batch, batch + count, 0) != batch + count)
+        {
+          // Batch is not complete yet
+          break;
+        }
+
+        // Lowest index wins ties, regardless of which thread finished first
+        for (int i = iterations_; i < iterations_ + count; ++i)
+        {
+          if (hypotheses[i].valid && (!best.valid || hypotheses[i].inliers > best.inliers))
+          {
+            best = hypotheses[i];
+          }
+        }
+        iterations_ += count;
+
+        if (best.valid)
+        {
+          double ratio = static_cast<double>(best.inliers) / points.rows();
+          required = std::min(required, getRequiredIterations(ratio));
+          limit = required;
+        }
+      }
+    }
+  };
+
+  // Threads are created once, and pull hypotheses until enough are decided
+  std::vector<std::thread> threads;
+  for (int t = 1; t < std::min(params_.num_threads, params_.iterations); ++t)
+  {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  if (!best.valid)
+  {
+    return false;
+  }
+  normal = best.normal;
+  d = best.d;
+  return true;
+}
+
+size_t PlaneRansac::countInliers(const Points& points,
+                                 const Eigen::Vector3d& normal,
+                                 double d,
+                                 double tolerance)
+{
+  Eigen::Vector3f n = normal.cast<float>();
+  return (((points.col(0) * n(0) + points.col(1) * n(1) + points.col(2) * n(2)).array() +
+           static_cast<float>(d)).abs() < static_cast<float>(tolerance)).count();
+}
+
+void PlaneRansac::evaluate(const Points& points, int index, Hypothesis& hypothesis) const
+{
+  hypothesis.valid = false;
+
+  // Select random points
+  std::seed_seq seq{params_.seed, static_cast<unsigned int>(index)};
+  std::mt19937 gen(seq);
+  std::uniform_int_distribution<Eigen::Index> dist(0, points.rows() - 1);
+  Eigen::MatrixXd test_points(3, params_.sample_size);
+  for (int p = 0; p < params_.sample_size; ++p)
+  {
+    test_points.col(p) = points.row(dist(gen)).transpose().cast<double>();
+  }
+
+  // Get plane for this test set
+  getPlane(test_points, hypothesis.normal, hypothesis.d);
+
+  // If we have desired normal, check if plane is well enough aligned
+  double desired_norm = params_.desired_normal.norm();
+  if (desired_norm > 0.1)
+  {
+    // a.dot(b) = norm(a) * norm(b) * cos(angle between a & b)
+    double angle = hypothesis.normal.dot(params_.desired_normal) / desired_norm / hypothesis.normal.norm();
+    if (std::fabs(angle) < params_.cos_normal_angle)
+    {
+      return;
+    }
+  }
+
+  // Test how many fit
+  hypothesis.inliers = countInliers(points, hypothesis.normal, hypothesis.d, params_.tolerance);
+  hypothesis.valid = true;
+}
+
+int PlaneRansac::getRequiredIterations(double inlier_ratio) const
+{
+  if (params_.confidence <= 0.0 || params_.confidence >= 1.0)
+  {
+    return params_.iterations;
+  }
+
+  // Probability that one hypothesis samples only inliers
+  double p = std::pow(inlier_ratio, params_.sample_size);
+  if (p >= 1.0)
+  {
+    return 1;
+  }
+  if (p <= 0.0)
+  {
+    return params_.iterations;
+  }
+  double n = std::ceil(std::log(1.0 - params_.confidence) / std::log1p(-p));
+  return static_cast<int>(std::min(n, static_cast<double>(params_.iterations)));
+}
+
+}  // namespace robot_calibration
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <robot_calibration/util/trace.hpp>
+
+namespace robot_calibration
+{
+
+// Pose set by PoseScope on this thread, negative if not set
+static thread_local int scoped_pose = -1;
+
+// Small ids are easier to read in the trace than hashed thread ids
+static int getThreadIndex()
+{
+  static std::atomic<int> next(0);
+  static thread_local int index = next++;
+  return index;
+}
+
+// Names are plain identifiers, but quote anything JSON needs quoted
+static std::string escapeJson(const std::string& s)
+{
+  std::string escaped;
+  for (char c : s)
+  {
+    if (c == '"' || c == '\\')
+    {
+      escaped += '\\';
+      escaped += c;
+    }
+    else if (static_cast<unsigned char>(c) < 0x20)
+    {
+      escaped += ' ';
+    }
+    else
+    {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+static double toSeconds(Tracer::Clock::duration d)
+{
+  return std::chrono::duration<double>(d).count();
+}
+
+Tracer::Tracer() :
+  enabled_(false),
+  pose_(-1)
+{
+}
+
+Tracer& Tracer::get()
+{
+  static Tracer tracer;
+  return tracer;
+}
+
+void Tracer::open(const std::string& file_name)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  file_name_ = file_name;
+  start_ = Clock::now();
+  spans_.clear();
+  enabled_ = true;
+}
+
+bool Tracer::close()
+{
+  enabled_ = false;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_name_.empty())
+  {
+    return true;
+  }
+
+  std::ofstream file(file_name_);
+  if (!file)
+  {
+    std::cerr << "Unable to open " << file_name_ << " to write trace" << std::endl;
+    return false;
+  }
+
+  // Complete events, with times in microseconds since open()
+  file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+  file << std::fixed << std::setprecision(1);
+  for (size_t i = 0; i < spans_.size(); ++i)
+  {
+    const Span& span = spans_[i];
+    file << "{\"name\": \"" << escapeJson(span.name) << "\", \"ph\": \"X\", \"pid\": 0"
+         << ", \"tid\": " << span.thread
+         << ", \"ts\": " << 1e6 * toSeconds(span.start - start_)
+         << ", \"dur\": " << 1e6 * toSeconds(span.end - span.start)
+         << ", \"args\": {\"pose\": " << span.pose << "}}"
+         << (i + 1 < spans_.size() ? "," : "") << std::endl;
+  }
+  file << "]}" << std::endl;
+  return static_cast<bool>(file);
+}
+
+void Tracer::setPose(int pose)
+{
+  pose_ = pose;
+}
+
+int Tracer::getPose() const
+{
+  if (scoped_pose >= 0)
+  {
+    return scoped_pose;
+  }
+  return pose_;
+}
+
+void Tracer::record(std::string name, Clock::time_point start, Clock::time_point end, int pose)
+{
+  // Spans which end after close() are dropped
+  if (!isEnabled())
+  {
+    return;
+  }
+
+  Span span;
+  span.name = std::move(name);
+  span.start = start;
+  span.end = end;
+  span.pose = pose;
+  span.thread = getThreadIndex();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  spans_.push_back(std::move(span));
+}
+
+size_t Tracer::getNumSpans() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return spans_.size();
+}
+
+std::string Tracer::getSummary() const
+{
+  struct Stats
+  {
+    size_t count = 0;
+    double total = 0.0;
+    double max = 0.0;
+  };
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Span names in the order first recorded, spans end in nesting order so
+  // sort by start instead
+  std::vector<const Span*> sorted;
+  for (const auto& span : spans_)
+  {
+    sorted.push_back(&span);
+  }
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const Span* a, const Span* b) { return a->start < b->start; });
+  std::vector<std::string> names;
+  std::map<std::string, Stats> stats;
+  std::map<int, std::map<std::string, double>> poses;
+  for (const Span* span : sorted)
+  {
+    double duration = toSeconds(span->end - span->start);
+    auto it = stats.find(span->name);
+    if (it == stats.end())
+    {
+      names.push_back(span->name);
+      it = stats.emplace(span->name, Stats()).first;
+    }
+    it->second.count += 1;
+    it->second.total += duration;
+    it->second.max = std::max(it->second.max, duration);
+    if (span->pose >= 0)
+    {
+      poses[span->pose][span->name] += duration;
+    }
+  }
+
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(3);
+  ss << std::left << std::setw(32) << "span" << std::right
+     << std::setw(8) << "count" << std::setw(12) << "total (s)"
+     << std::setw(12) << "mean (s)" << std::setw(12) << "max (s)" << std::endl;
+  for (const auto& name : names)
+  {
+    const Stats& s = stats.at(name);
+    ss << std::left << std::setw(32) << name << std::right
+       << std::setw(8) << s.count << std::setw(12) << s.total
+       << std::setw(12) << s.total / s.count << std::setw(12) << s.max << std::endl;
+  }
+  for (const auto& pose : poses)
+  {
+    ss << "pose " << pose.first << ":";
+    for (const auto& name : names)
+    {
+      auto it = pose.second.find(name);
+      if (it != pose.second.end())
+      {
+        ss << " " << name << " " << it->second;
+      }
+    }
+    ss << std::endl;
+  }
+  return ss.str();
+}
+
+Tracer::PoseScope::PoseScope(int pose) :
+  previous_(scoped_pose)
+{
+  scoped_pose = pose;
+}
+
+Tracer::PoseScope::~PoseScope()
+{
+  scoped_pose = previous_;
+}
+
+void TraceSpan::begin()
+{
+  pose_ = Tracer::get().getPose();
+  start_ = Tracer::Clock::now();
+}
+
+void TraceSpan::end()
+{
+  Tracer::Clock::time_point end = Tracer::Clock::now();
+  std::string name(name_);
+  if (!detail_.empty())
+  {
+    name += "/" + detail_;
+  }
+  Tracer::get().record(std::move(name), start_, end, pose_);
+}
+
+}  // namespace robot_calibration
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <cmath>
+#include <gtest/gtest.h>
+#include <robot_calibration/optimization/base_calibration.hpp>
+
+/** @brief Scan of a flat wall at some distance, rotated by some angle. */
+static sensor_msgs::msg::LaserScan makeWallScan(double distance, double rotation)
+{
+  sensor_msgs::msg::LaserScan scan;
+  scan.angle_min = -1.0;
+  scan.angle_increment = 0.01;
+  for (int i = 0; i < 200; ++i)
+  {
+    // Points are x = sin(angle) * range, y = cos(angle) * range, and the
+    // wall is y = distance + tan(rotation) * x
+    double angle = scan.angle_min + i * scan.angle_increment;
+    scan.ranges.push_back(distance / (std::cos(angle) - std::tan(rotation) * std::sin(angle)));
+  }
+  return scan;
+}
+
+TEST(BaseCalibrationTests, test_fit_line)
+{
+  sensor_msgs::msg::LaserScan scan = makeWallScan(2.0, 0.1);
+  scan.ranges[50] = std::nan("");
+
+  double angle, r2, dist;
+  ASSERT_TRUE(robot_calibration::BaseCalibration::fitLine(scan, -0.5, 0.5, angle, r2, dist));
+  EXPECT_NEAR(0.1, angle, 1e-5);
+  EXPECT_NEAR(2.0, dist, 0.01);
+
+  scan = makeWallScan(2.0, -0.2);
+  ASSERT_TRUE(robot_calibration::BaseCalibration::fitLine(scan, -0.5, 0.5, angle, r2, dist));
+  EXPECT_NEAR(-0.2, angle, 1e-5);
+
+  // No points between the angles
+  EXPECT_FALSE(robot_calibration::BaseCalibration::fitLine(scan, 1.5, 2.0, angle, r2, dist));
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <memory>
+#include <vector>
+#include <gtest/gtest.h>
+#include <robot_calibration/optimization/batched_cost_function.hpp>
+
+using robot_calibration::BatchedCostFunction;
+
+// Residuals are scale * (x, y) and scale * z, over blocks (x, y) and (z)
+class ScaledCost : public ceres::CostFunction
+{
+public:
+  ScaledCost(double scale, int num_residuals) :
+    scale_(scale)
+  {
+    set_num_residuals(num_residuals);
+    mutable_parameter_block_sizes()->push_back(2);
+    mutable_parameter_block_sizes()->push_back(1);
+  }
+
+  bool Evaluate(double const * const * parameters,
+                double* residuals,
+                double** jacobians) const override
+  {
+    for (int r = 0; r < num_residuals(); ++r)
+    {
+      int p = r % 3;
+      residuals[r] = scale_ * ((p < 2) ? parameters[0][p] : parameters[1][0]);
+      if (jacobians && jacobians[0])
+      {
+        jacobians[0][r * 2 + 0] = (p == 0) ? scale_ : 0.0;
+        jacobians[0][r * 2 + 1] = (p == 1) ? scale_ : 0.0;
+      }
+      if (jacobians && jacobians[1])
+      {
+        jacobians[1][r] = (p == 2) ? scale_ : 0.0;
+      }
+    }
+    return true;
+  }
+
+private:
+  double scale_;
+};
+
+TEST(BatchedCostFunctionTests, test_matches_separate_costs)
+{
+  std::vector<std::unique_ptr<ceres::CostFunction>> owned;
+  std::vector<ceres::CostFunction*> costs;
+  for (int c = 0; c < 3; ++c)
+  {
+    owned.emplace_back(new ScaledCost(c + 1.0, 3 * (c + 1)));
+    costs.push_back(owned.back().get());
+  }
+  BatchedCostFunction batch(costs);
+  ASSERT_EQ(18, batch.num_residuals());
+  EXPECT_EQ(costs[0]->parameter_block_sizes(), batch.parameter_block_sizes());
+  ASSERT_EQ(3u, batch.getResidualStarts().size());
+  EXPECT_EQ(3, batch.getResidualStarts()[1]);
+  EXPECT_EQ(9, batch.getResidualStarts()[2]);
+
+  double xy[2] = {0.5, -2.0};
+  double z[1] = {3.0};
+  double* parameters[2] = {xy, z};
+  std::vector<double> residuals(18), jacobian_xy(36), jacobian_z(18);
+  double* jacobians[2] = {jacobian_xy.data(), jacobian_z.data()};
+  ASSERT_TRUE(batch.Evaluate(parameters, residuals.data(), jacobians));
+
+  // Each cost function fills its own rows
+  for (int c = 0; c < 3; ++c)
+  {
+    int start = batch.getResidualStarts()[c];
+    int n = costs[c]->num_residuals();
+    std::vector<double> expected(n), expected_xy(n * 2), expected_z(n);
+    double* expected_jacobians[2] = {expected_xy.data(), expected_z.data()};
+    ASSERT_TRUE(costs[c]->Evaluate(parameters, expected.data(), expected_jacobians));
+    for (int r = 0; r < n; ++r)
+    {
+      EXPECT_EQ(expected[r], residuals[start + r]);
+      EXPECT_EQ(expected_xy[r * 2], jacobian_xy[(start + r) * 2]);
+      EXPECT_EQ(expected_xy[r * 2 + 1], jacobian_xy[(start + r) * 2 + 1]);
+      EXPECT_EQ(expected_z[r], jacobian_z[start + r]);
+    }
+  }
+
+  // Jacobians of constant blocks are not requested
+  jacobians[1] = NULL;
+  ASSERT_TRUE(batch.Evaluate(parameters, residuals.data(), jacobians));
+  ASSERT_TRUE(batch.Evaluate(parameters, residuals.data(), NULL));
+  EXPECT_EQ(9.0, residuals[17]);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
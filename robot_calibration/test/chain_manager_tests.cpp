@@ -51,6 +51,84 @@ TEST(ChainManagerTests, test_rosparam_loading)
   EXPECT_EQ("", group_name);
 }
 
+sensor_msgs::msg::JointState makeState(double position, double velocity)
+{
+  sensor_msgs::msg::JointState state;
+  state.name.push_back("first_joint");
+  state.position.push_back(position);
+  state.velocity.push_back(velocity);
+  state.name.push_back("ignored_joint");
+  state.position.push_back(position * 10.0);
+  state.velocity.push_back(1.0);
+  return state;
+}
+
+TEST(ChainManagerTests, test_settle_detector)
+{
+  std::vector<std::string> joints = {"first_joint", "other_joint"};
+
+  // Without a window, any state under the velocity threshold is settled
+  robot_calibration::SettleDetector instant(0.001, 0.001, 0.0);
+  instant.reset(joints);
+  EXPECT_FALSE(instant.update(makeState(0.0, 0.01), 0.0));
+  EXPECT_TRUE(instant.update(makeState(0.1, 0.0), 0.1));
+
+  robot_calibration::SettleDetector detector(0.001, 0.001, 0.2);
+  detector.reset(joints);
+  EXPECT_FALSE(detector.update(makeState(0.0, 0.0), 0.0));
+  EXPECT_FALSE(detector.update(makeState(0.0, 0.0), 0.1));
+  // Position drifts, even though velocity is reported as zero
+  EXPECT_FALSE(detector.update(makeState(0.01, 0.0), 0.15));
+  EXPECT_FALSE(detector.update(makeState(0.01, 0.0), 0.3));
+  // Velocity spikes
+  EXPECT_FALSE(detector.update(makeState(0.01, 0.01), 0.36));
+  EXPECT_FALSE(detector.update(makeState(0.01, 0.0), 0.4));
+  EXPECT_FALSE(detector.update(makeState(0.0105, 0.0), 0.5));
+  EXPECT_TRUE(detector.update(makeState(0.0105, 0.0), 0.6));
+
+  // Reset restarts the window
+  detector.reset(joints);
+  EXPECT_FALSE(detector.update(makeState(0.0105, 0.0), 0.7));
+}
+
+sensor_msgs::msg::JointState makeStampedState(double time, double position, double velocity)
+{
+  sensor_msgs::msg::JointState state = makeState(position, velocity);
+  state.header.stamp = rclcpp::Time(static_cast<int64_t>(time * 1e9), RCL_ROS_TIME);
+  return state;
+}
+
+TEST(ChainManagerTests, test_joint_state_buffer)
+{
+  robot_calibration::JointStateBuffer buffer(1.0);
+  sensor_msgs::msg::JointState state;
+  EXPECT_FALSE(buffer.interpolate(10.0, 0.1, state));
+
+  buffer.add(makeStampedState(10.0, 0.0, 1.0));
+  buffer.add(makeStampedState(10.1, 0.1, 0.0));
+  EXPECT_DOUBLE_EQ(10.1, buffer.getLatestTime());
+
+  // Between two states
+  ASSERT_TRUE(buffer.interpolate(10.025, 0.2, state));
+  EXPECT_NEAR(10.025, rclcpp::Time(state.header.stamp).seconds(), 1e-6);
+  ASSERT_EQ(2u, state.position.size());
+  EXPECT_NEAR(0.025, state.position[0], 1e-6);
+  EXPECT_NEAR(0.25, state.position[1], 1e-6);
+  EXPECT_NEAR(0.75, state.velocity[0], 1e-6);
+
+  // Outside of the buffer, or states too far apart
+  EXPECT_FALSE(buffer.interpolate(9.9, 0.2, state));
+  EXPECT_FALSE(buffer.interpolate(10.2, 0.2, state));
+  EXPECT_FALSE(buffer.interpolate(10.05, 0.05, state));
+
+  // Old states are dropped
+  buffer.add(makeStampedState(11.0, 1.0, 0.0));
+  buffer.add(makeStampedState(11.5, 1.5, 0.0));
+  EXPECT_FALSE(buffer.interpolate(10.05, 1.0, state));
+  ASSERT_TRUE(buffer.interpolate(11.25, 1.0, state));
+  EXPECT_NEAR(1.25, state.position[0], 1e-6);
+}
+
 int main(int argc, char** argv)
 {
   rclcpp::init(argc, argv);
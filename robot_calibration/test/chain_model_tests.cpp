@@ -86,6 +86,236 @@ TEST(Camera3dModelTests, BadChainThrows)
                std::runtime_error);
 }
 
+TEST(Chain3dModelTests, CompiledPlanMatchesNames)
+{
+  KDL::Tree tree;
+  ASSERT_TRUE(kdl_parser::treeFromString(robot_description, tree));
+  Chain3dModel model("uut", tree, "link_0", "link_3");
+
+  robot_calibration_msgs::msg::CalibrationData data;
+  data.joint_states.name.push_back("second_joint");
+  data.joint_states.position.push_back(0.5);
+  data.observations.resize(1);
+  data.observations[0].sensor_name = "uut";
+  data.observations[0].features.resize(2);
+  data.observations[0].features[0].header.frame_id = "link_3";
+  data.observations[0].features[0].point.x = 0.1;
+  data.observations[0].features[1].header.frame_id = "checkerboard";
+  data.observations[0].features[1].point.y = 0.2;
+
+  robot_calibration::OptimizationOffsets offsets;
+  offsets.add("second_joint");
+  offsets.addFrame("checkerboard", true, true, true, true, true, true);
+  offsets.addFrame("first_joint", false, false, true, false, false, false);
+  double params[8] = {0.1, 0.3, 0.2, 0.1, 0.4, 0.0, 0.0, 0.05};
+  robot_calibration::OffsetsView view(offsets, params);
+
+  robot_calibration::ChainPlan plan;
+  ASSERT_TRUE(model.compile(data, offsets, plan));
+  // Features are extracted, and grouped by frame
+  ASSERT_EQ(2, plan.features.cols());
+  EXPECT_EQ(0.1, plan.features(0, 0));
+  EXPECT_EQ(0.2, plan.features(1, 1));
+  ASSERT_EQ(static_cast<size_t>(2), plan.feature_groups.size());
+  EXPECT_FALSE(plan.feature_groups[0].frame.valid);
+  EXPECT_TRUE(plan.feature_groups[1].frame.valid);
+  EXPECT_EQ(1, plan.feature_groups[1].begin);
+  EXPECT_EQ(2, plan.feature_groups[1].end);
+
+  robot_calibration::Matrix3X<double> by_name, by_plan;
+  ASSERT_TRUE(model.project(data, view, by_name));
+  ASSERT_TRUE(model.project(data, plan, view, by_plan));
+  ASSERT_EQ(2, by_plan.cols());
+  EXPECT_TRUE(by_name.isApprox(by_plan));
+
+  // Changing the layout of offsets falls back to resolving names
+  offsets.add("third_joint");
+  double more_params[9] = {0.1, 0.3, 0.2, 0.1, 0.4, 0.0, 0.0, 0.05, 0.0};
+  robot_calibration::OffsetsView more_view(offsets, more_params);
+  ASSERT_TRUE(model.project(data, plan, more_view, by_plan));
+  EXPECT_TRUE(by_name.isApprox(by_plan));
+
+  // Missing sensor
+  data.observations[0].sensor_name = "not_uut";
+  EXPECT_FALSE(model.compile(data, offsets, plan));
+  EXPECT_FALSE(model.project(data, plan, more_view, by_plan));
+}
+
+TEST(Chain3dModelTests, ConstantSegmentsAreFolded)
+{
+  KDL::Tree tree;
+  ASSERT_TRUE(kdl_parser::treeFromString(robot_description, tree));
+  Chain3dModel model("uut", tree, "link_0", "link_3");
+
+  robot_calibration_msgs::msg::CalibrationData data;
+  data.joint_states.name.push_back("second_joint");
+  data.joint_states.position.push_back(0.5);
+  data.observations.resize(1);
+  data.observations[0].sensor_name = "uut";
+  data.observations[0].features.resize(1);
+  data.observations[0].features[0].header.frame_id = "link_3";
+  data.observations[0].features[0].point.x = 0.1;
+
+  robot_calibration::OptimizationOffsets offsets;
+  offsets.add("second_joint");
+  double params[1] = {0.1};
+  robot_calibration::OffsetsView view(offsets, params);
+
+  // Only the calibrated joint is evaluated, the fixed joints are folded
+  robot_calibration::ChainPlan plan;
+  ASSERT_TRUE(model.compile(data, offsets, plan));
+  ASSERT_EQ(static_cast<size_t>(3), plan.segments.size());
+  EXPECT_EQ(static_cast<size_t>(1), plan.segments[0].run_end);
+  EXPECT_EQ(static_cast<size_t>(0), plan.segments[1].run_end);
+  EXPECT_EQ(static_cast<size_t>(3), plan.segments[2].run_end);
+
+  // Folding does not change the FK
+  robot_calibration::ChainPlan unfolded = plan;
+  for (auto& segment : unfolded.segments)
+  {
+    segment.run_end = 0;
+  }
+  robot_calibration::Transform<double> folded_fk = model.getChainFK(plan, view, data.joint_states);
+  robot_calibration::Transform<double> unfolded_fk = model.getChainFK(unfolded, view, data.joint_states);
+  EXPECT_TRUE(folded_fk.isApprox(unfolded_fk));
+
+  // A free frame on a fixed joint is not folded either
+  offsets.addFrame("third_joint", true, false, false, false, false, false);
+  double more_params[2] = {0.1, 0.02};
+  robot_calibration::OffsetsView more_view(offsets, more_params);
+  ASSERT_TRUE(model.compile(data, offsets, plan));
+  EXPECT_EQ(static_cast<size_t>(1), plan.segments[0].run_end);
+  EXPECT_EQ(static_cast<size_t>(0), plan.segments[2].run_end);
+  unfolded = plan;
+  for (auto& segment : unfolded.segments)
+  {
+    segment.run_end = 0;
+  }
+  folded_fk = model.getChainFK(plan, more_view, data.joint_states);
+  unfolded_fk = model.getChainFK(unfolded, more_view, data.joint_states);
+  EXPECT_TRUE(folded_fk.isApprox(unfolded_fk));
+}
+
+TEST(Chain3dModelTests, AnalyticJacobianMatchesNumeric)
+{
+  KDL::Tree tree;
+  ASSERT_TRUE(kdl_parser::treeFromString(robot_description, tree));
+  Chain3dModel model("uut", tree, "link_0", "link_3");
+
+  robot_calibration_msgs::msg::CalibrationData data;
+  data.joint_states.name.push_back("second_joint");
+  data.joint_states.position.push_back(-0.5);
+  data.observations.resize(1);
+  data.observations[0].sensor_name = "uut";
+  data.observations[0].features.resize(2);
+  data.observations[0].features[0].header.frame_id = "link_3";
+  data.observations[0].features[0].point.x = 0.1;
+  data.observations[0].features[0].point.z = -0.2;
+  data.observations[0].features[1].header.frame_id = "checkerboard";
+  data.observations[0].features[1].point.y = 0.2;
+
+  robot_calibration::OptimizationOffsets offsets;
+  offsets.add("second_joint");
+  offsets.addFrame("checkerboard", true, true, true, true, true, true);
+  offsets.addFrame("first_joint", false, false, true, false, true, false);
+  offsets.addFrame("third_joint", true, false, false, false, false, true);
+  std::vector<double> params = {0.1, 0.3, 0.2, 0.1, 0.4, 0.2, -0.3, 0.05, 0.1, -0.05, 0.2};
+  ASSERT_EQ(offsets.size(), params.size());
+  robot_calibration::OffsetsView view(offsets, params.data());
+
+  robot_calibration::ChainPlan plan;
+  ASSERT_TRUE(model.compile(data, offsets, plan));
+  ASSERT_TRUE(model.hasAnalyticJacobian(plan, offsets));
+
+  robot_calibration::Matrix3X<double> points, projected;
+  robot_calibration::ProjectionJacobian jacobian;
+  ASSERT_TRUE(model.projectWithJacobian(data, plan, view, points, jacobian));
+  ASSERT_TRUE(model.project(data, plan, view, projected));
+  EXPECT_TRUE(points.isApprox(projected));
+  // Every free parameter affects the points
+  ASSERT_EQ(params.size(), jacobian.params.size());
+
+  // Compare each column with central differences
+  const double h = 1e-6;
+  for (size_t c = 0; c < jacobian.params.size(); ++c)
+  {
+    const robot_calibration::ParamHandle& param = jacobian.params[c];
+    size_t index = offsets.getBlockStart(offsets.getBlock(param)) + offsets.getBlockOffset(param);
+    std::vector<double> plus = params, minus = params;
+    plus[index] += h;
+    minus[index] -= h;
+    robot_calibration::Matrix3X<double> points_plus, points_minus;
+    ASSERT_TRUE(model.project(data, plan, robot_calibration::OffsetsView(offsets, plus.data()), points_plus));
+    ASSERT_TRUE(model.project(data, plan, robot_calibration::OffsetsView(offsets, minus.data()), points_minus));
+    for (int i = 0; i < points.cols(); ++i)
+    {
+      for (int j = 0; j < 3; ++j)
+      {
+        double numeric = (points_plus(j, i) - points_minus(j, i)) / (2 * h);
+        EXPECT_NEAR(numeric, jacobian.jacobian(3 * i + j, c), 1e-6);
+      }
+    }
+  }
+}
+
+TEST(Chain3dModelTests, SharedChainFK)
+{
+  KDL::Tree tree;
+  ASSERT_TRUE(kdl_parser::treeFromString(robot_description, tree));
+  Chain3dModel a_model("a", tree, "link_0", "link_3");
+  Chain3dModel b_model("b", tree, "link_0", "link_2");
+  EXPECT_EQ(static_cast<size_t>(2), a_model.getSharedSegments(b_model));
+  EXPECT_EQ(static_cast<size_t>(2), b_model.getSharedSegments(a_model));
+  EXPECT_EQ(static_cast<size_t>(3), a_model.getSharedSegments(a_model));
+
+  robot_calibration_msgs::msg::CalibrationData data;
+  data.joint_states.name.push_back("second_joint");
+  data.joint_states.position.push_back(0.5);
+  data.observations.resize(2);
+  data.observations[0].sensor_name = "a";
+  data.observations[0].features.resize(1);
+  data.observations[0].features[0].header.frame_id = "link_3";
+  data.observations[0].features[0].point.x = 0.1;
+  data.observations[1].sensor_name = "b";
+  data.observations[1].features.resize(1);
+  data.observations[1].features[0].header.frame_id = "link_2";
+  data.observations[1].features[0].point.y = 0.2;
+
+  robot_calibration::OptimizationOffsets offsets;
+  offsets.add("second_joint");
+  offsets.addFrame("first_joint", false, false, true, false, false, true);
+  double params[3] = {0.1, 0.05, 0.2};
+  robot_calibration::OffsetsView view(offsets, params);
+
+  robot_calibration::ChainPlan a_plan, b_plan;
+  ASSERT_TRUE(a_model.compile(data, offsets, a_plan));
+  ASSERT_TRUE(b_model.compile(data, offsets, b_plan));
+  robot_calibration::Matrix3X<double> a_expected, b_expected;
+  ASSERT_TRUE(a_model.project(data, a_plan, view, a_expected));
+  ASSERT_TRUE(b_model.project(data, b_plan, view, b_expected));
+
+  robot_calibration::SharedChainFK fk;
+  robot_calibration::shareChainFK(a_model, a_plan, b_model, b_plan, fk);
+  EXPECT_EQ(static_cast<size_t>(2), a_plan.shared_segments);
+  EXPECT_EQ(&fk, b_plan.shared_fk);
+
+  // Sharing the FK does not change the projection
+  robot_calibration::Matrix3X<double> a_pts, b_pts;
+  ASSERT_TRUE(a_model.project(data, a_plan, view, a_pts));
+  EXPECT_TRUE(fk.get<double>().valid);
+  ASSERT_TRUE(b_model.project(data, b_plan, view, b_pts));
+  EXPECT_TRUE(a_pts.isApprox(a_expected));
+  EXPECT_TRUE(b_pts.isApprox(b_expected));
+
+  // The second model reuses the FK of the first, until it is reset
+  fk.get<double>().position.x() += 1.0;
+  ASSERT_TRUE(b_model.project(data, b_plan, view, b_pts));
+  EXPECT_NEAR(b_expected(0, 0) + 1.0, b_pts(0, 0), 1e-9);
+  fk.reset();
+  ASSERT_TRUE(b_model.project(data, b_plan, view, b_pts));
+  EXPECT_TRUE(b_pts.isApprox(b_expected));
+}
+
 };  // namespace test
 
 };  // namespace
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <cstdio>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <robot_calibration/util/dataset.hpp>
+
+TEST(DatasetTests, test_round_trip)
+{
+  std::vector<robot_calibration_msgs::msg::CalibrationData> data(2);
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    data[i].joint_states.name.push_back("first_joint");
+    data[i].joint_states.name.push_back("second_joint");
+    data[i].joint_states.position.push_back(0.1 * i);
+    data[i].joint_states.position.push_back(-0.5);
+    data[i].observations.resize(1 + i);
+    for (size_t o = 0; o < data[i].observations.size(); ++o)
+    {
+      auto& obs = data[i].observations[o];
+      obs.sensor_name = (o == 0) ? "camera" : "arm";
+      obs.features.resize(3);
+      for (size_t f = 0; f < obs.features.size(); ++f)
+      {
+        obs.features[f].header.frame_id = (f == 0) ? "camera_link" : "checkerboard";
+        obs.features[f].point.x = f;
+        obs.features[f].point.y = i + 0.25;
+        obs.features[f].point.z = -static_cast<double>(o);
+      }
+      obs.ext_camera_info.camera_info.p[0] = 525.0;
+    }
+  }
+
+  std::string file_name = "/tmp/robot_calibration_dataset_test.dataset";
+  ASSERT_TRUE(robot_calibration::writeDataset(file_name, "<robot/>", data));
+
+  std_msgs::msg::String description;
+  std::vector<robot_calibration_msgs::msg::CalibrationData> loaded;
+  ASSERT_TRUE(robot_calibration::loadDataset(file_name, description, loaded));
+  EXPECT_EQ("<robot/>", description.data);
+  ASSERT_EQ(data.size(), loaded.size());
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    EXPECT_EQ(data[i].joint_states.name, loaded[i].joint_states.name);
+    EXPECT_EQ(data[i].joint_states.position, loaded[i].joint_states.position);
+    ASSERT_EQ(data[i].observations.size(), loaded[i].observations.size());
+    for (size_t o = 0; o < data[i].observations.size(); ++o)
+    {
+      const auto& expected = data[i].observations[o];
+      const auto& obs = loaded[i].observations[o];
+      EXPECT_EQ(expected.sensor_name, obs.sensor_name);
+      ASSERT_EQ(expected.features.size(), obs.features.size());
+      for (size_t f = 0; f < obs.features.size(); ++f)
+      {
+        EXPECT_EQ(expected.features[f].header.frame_id, obs.features[f].header.frame_id);
+        EXPECT_EQ(expected.features[f].point.x, obs.features[f].point.x);
+        EXPECT_EQ(expected.features[f].point.y, obs.features[f].point.y);
+        EXPECT_EQ(expected.features[f].point.z, obs.features[f].point.z);
+      }
+      EXPECT_EQ(525.0, obs.ext_camera_info.camera_info.p[0]);
+    }
+  }
+
+  // Joint positions can be used in place
+  robot_calibration::Dataset dataset;
+  ASSERT_TRUE(dataset.open(file_name));
+  size_t joint_count = 0;
+  const double* positions = dataset.getJointPositions(1, joint_count);
+  ASSERT_EQ(static_cast<size_t>(2), joint_count);
+  EXPECT_EQ(0.1, positions[0]);
+  EXPECT_EQ(nullptr, dataset.getJointPositions(2, joint_count));
+
+  std::remove(file_name.c_str());
+}
+
+TEST(DatasetTests, test_invalid_file)
+{
+  std::string file_name = "/tmp/robot_calibration_invalid_test.dataset";
+  {
+    std::ofstream file(file_name);
+    file << "this is not a dataset";
+  }
+
+  robot_calibration::Dataset dataset;
+  EXPECT_FALSE(dataset.open(file_name));
+  EXPECT_EQ(static_cast<size_t>(0), dataset.size());
+  EXPECT_FALSE(dataset.open("/tmp/robot_calibration_missing_test.dataset"));
+
+  std::remove(file_name.c_str());
+}
+
+TEST(DatasetTests, test_corrupt_camera_info)
+{
+  std::vector<robot_calibration_msgs::msg::CalibrationData> data(1);
+  data[0].joint_states.name.push_back("first_joint");
+  data[0].joint_states.position.push_back(0.1);
+  data[0].observations.resize(1);
+  data[0].observations[0].sensor_name = "camera";
+  data[0].observations[0].ext_camera_info.camera_info.header.frame_id = "camera_link";
+
+  std::string file_name = "/tmp/robot_calibration_corrupt_test.dataset";
+  ASSERT_TRUE(robot_calibration::writeDataset(file_name, "<robot/>", data));
+
+  // Overwrite the serialized camera info, after its encapsulation header,
+  // the offset and size of the blobs are the last fields of the file header
+  {
+    std::fstream file(file_name, std::ios::in | std::ios::out | std::ios::binary);
+    uint64_t blobs = 0, blobs_size = 0;
+    file.seekg(19 * sizeof(uint64_t));
+    file.read(reinterpret_cast<char*>(&blobs), sizeof(blobs));
+    file.read(reinterpret_cast<char*>(&blobs_size), sizeof(blobs_size));
+    ASSERT_GT(blobs_size, static_cast<uint64_t>(4));
+    file.seekp(blobs + 4);
+    std::string garbage(blobs_size - 4, static_cast<char>(0xFF));
+    file.write(garbage.data(), garbage.size());
+  }
+
+  // Deserializing fails, which is reported rather than thrown
+  std_msgs::msg::String description;
+  std::vector<robot_calibration_msgs::msg::CalibrationData> loaded;
+  EXPECT_FALSE(robot_calibration::loadDataset(file_name, description, loaded));
+  EXPECT_TRUE(loaded.empty());
+
+  std::remove(file_name.c_str());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <memory>
+#include <gtest/gtest.h>
+#include <robot_calibration/cost_functions/dynamic_cost_function.hpp>
+
+namespace
+{
+
+// Four residuals, depending on two parameter blocks of size 3
+struct TestFunctor
+{
+  template <typename T>
+  bool operator()(T const * const * params, T* residuals) const
+  {
+    residuals[0] = params[0][0] * params[1][0];
+    residuals[1] = params[0][0] * params[0][1] + params[1][1];
+    residuals[2] = params[0][2] * params[0][2];
+    residuals[3] = params[1][2] - params[0][1] * params[1][0];
+    return true;
+  }
+};
+
+using FixedCost = robot_calibration::FixedResidualAutoDiffCostFunction<TestFunctor, 4>;
+
+}  // namespace
+
+TEST(DynamicCostFunctionTests, FixedResidualJacobians)
+{
+  FixedCost cost(new TestFunctor());
+  cost.AddParameterBlock(3);
+  cost.AddParameterBlock(3);
+  EXPECT_EQ(4, cost.num_residuals());
+
+  double p0[3] = {1.0, 2.0, 3.0};
+  double p1[3] = {4.0, 5.0, 6.0};
+  double* parameters[2] = {p0, p1};
+  double residuals[4];
+  double j0[12], j1[12];
+  double* jacobians[2] = {j0, j1};
+
+  ASSERT_TRUE(cost.Evaluate(parameters, residuals, NULL));
+  EXPECT_DOUBLE_EQ(4.0, residuals[0]);
+  EXPECT_DOUBLE_EQ(7.0, residuals[1]);
+  EXPECT_DOUBLE_EQ(9.0, residuals[2]);
+  EXPECT_DOUBLE_EQ(-2.0, residuals[3]);
+
+  // Six parameters takes two passes of automatic differentiation
+  ASSERT_TRUE(cost.Evaluate(parameters, residuals, jacobians));
+  EXPECT_DOUBLE_EQ(-2.0, residuals[3]);
+  double expected_j0[12] = {4, 0, 0,
+                            2, 1, 0,
+                            0, 0, 6,
+                            0, -4, 0};
+  double expected_j1[12] = {1, 0, 0,
+                            0, 1, 0,
+                            0, 0, 0,
+                            -2, 0, 1};
+  for (int i = 0; i < 12; ++i)
+  {
+    EXPECT_DOUBLE_EQ(expected_j0[i], j0[i]);
+    EXPECT_DOUBLE_EQ(expected_j1[i], j1[i]);
+  }
+
+  // No jacobian is computed for a constant block
+  for (int i = 0; i < 12; ++i)
+  {
+    j0[i] = -1.0;
+    j1[i] = -1.0;
+  }
+  jacobians[0] = NULL;
+  ASSERT_TRUE(cost.Evaluate(parameters, residuals, jacobians));
+  EXPECT_DOUBLE_EQ(7.0, residuals[1]);
+  for (int i = 0; i < 12; ++i)
+  {
+    EXPECT_DOUBLE_EQ(-1.0, j0[i]);
+    EXPECT_DOUBLE_EQ(expected_j1[i], j1[i]);
+  }
+}
+
+TEST(DynamicCostFunctionTests, FixedSizeDispatch)
+{
+  using Counts = robot_calibration::FeatureCounts<1, 2>;
+
+  // Two residuals for each of two features
+  std::unique_ptr<ceres::DynamicCostFunction> fixed(
+    robot_calibration::createFixedCostFunction<2>(new TestFunctor(), 2, Counts()));
+  ASSERT_TRUE(fixed);
+  EXPECT_EQ(4, fixed->num_residuals());
+
+  // No match, ownership of the functor is not taken
+  std::unique_ptr<TestFunctor> functor(new TestFunctor());
+  EXPECT_EQ(nullptr, robot_calibration::createFixedCostFunction<2>(functor.get(), 3, Counts()));
+
+  // The LED gripper has four features
+  fixed.reset(robot_calibration::createDynamicCostFunction<1>(new TestFunctor(), 4, false));
+  EXPECT_EQ(4, fixed->num_residuals());
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
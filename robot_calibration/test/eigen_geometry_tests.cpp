@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <gtest/gtest.h>
+#include <robot_calibration/util/eigen_geometry.hpp>
+
+TEST(EigenGeometryTests, test_get_plane)
+{
+  // Points on the plane z = 2 - x, far from the origin
+  Eigen::MatrixXd points(3, 4);
+  points << 101.0, 102.0, 101.0, 103.0,
+            50.0,  50.0,  51.0,  52.0,
+           -99.0, -100.0, -99.0, -101.0;
+
+  Eigen::Vector3d normal;
+  double d = 0.0;
+  EXPECT_TRUE(robot_calibration::getPlane(points, normal, d));
+  EXPECT_NEAR(-1.0 / std::sqrt(2.0), normal(0), 1e-9);
+  EXPECT_NEAR(0.0, normal(1), 1e-9);
+  EXPECT_NEAR(-1.0 / std::sqrt(2.0), normal(2), 1e-9);
+  EXPECT_NEAR(2.0 / std::sqrt(2.0), d, 1e-9);
+}
+
+TEST(EigenGeometryTests, test_plane_fitter)
+{
+  Eigen::MatrixXd points(3, 5);
+  points << 0.0, 1.0, 0.0, 1.0, 0.5,
+            0.0, 0.0, 1.0, 1.0, 0.5,
+            1.0, 1.0, 1.0, 1.0, 1.0;
+
+  // Adding points one at a time matches fitting the whole cloud
+  robot_calibration::PlaneFitter fitter;
+  for (int i = 0; i < points.cols(); ++i)
+  {
+    fitter.add(points.col(i));
+  }
+  EXPECT_EQ(static_cast<size_t>(5), fitter.size());
+
+  Eigen::Vector3d centroid = fitter.getCentroid();
+  Eigen::Vector3d expected = robot_calibration::getCentroid(points);
+  EXPECT_NEAR(0.0, (centroid - expected).norm(), 1e-12);
+
+  Eigen::Vector3d normal;
+  double d = 0.0;
+  EXPECT_TRUE(fitter.getPlane(normal, d));
+  // Normal is flipped so that d is positive
+  EXPECT_NEAR(0.0, (normal - Eigen::Vector3d(0, 0, -1)).norm(), 1e-12);
+  EXPECT_NEAR(1.0, d, 1e-12);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
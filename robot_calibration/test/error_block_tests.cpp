@@ -295,8 +295,9 @@ TEST(ErrorBlockTests, error_blocks_maxwell)
   EXPECT_NEAR(1.6771013673719808e-25, opt.summary()->initial_cost, 0.00001);
   // 14 joints + 6 from a free frame
   EXPECT_EQ(20, opt.getNumParameters());
-  // 3 CalibrationData, each with chain3d with a single observed point (3 residuals)
-  EXPECT_EQ(30, opt.getNumResiduals());
+  // 3 CalibrationData, each with chain3d with a single observed point (3 residuals),
+  // and the outrageous block (7 residuals) which is only added once
+  EXPECT_EQ(16, opt.getNumResiduals());
 
   // While things are setup, test our parameter parsing
   EXPECT_EQ(2, static_cast<int>(params.error_blocks.size()));
@@ -288,9 +288,31 @@ TEST(ErrorBlockTests, error_blocks_maxwell)
   EXPECT_EQ("camera", block0->model_a);
   EXPECT_EQ("arm", block0->model_b);
 
+  // Estimate uncertainty of the offsets
+  params.covariance = true;
+
+  // Count the progress reports
+  size_t progress_iterations = 0;
+  bool progress_done = false;
+  opt.setProgressCallback(
+    [&](const robot_calibration_msgs::msg::OptimizationProgress& progress)
+    {
+      if (progress.done)
+      {
+        progress_done = true;
+      }
+      else
+      {
+        ++progress_iterations;
+      }
+      return true;
+    });
+
   // Optimize
   rclcpp::Logger logger = node->get_logger();
   opt.optimize(params, data, logger, false);
+  EXPECT_EQ(opt.summary()->iterations.size(), progress_iterations);
+  EXPECT_TRUE(progress_done);
   EXPECT_GT(opt.summary()->initial_cost, 0.001);
   EXPECT_LT(opt.summary()->final_cost, 1e-18);
   EXPECT_GT(opt.summary()->iterations.size(), static_cast<size_t>(1));  // expect more than 1 iteration
@@ -300,6 +322,12 @@ TEST(ErrorBlockTests, error_blocks_maxwell)
   EXPECT_EQ(1, opt.getNumParameters());
   // 3 CalibrationData, each with chain3d with a single observed point (3 residuals)
   EXPECT_EQ(9, opt.getNumResiduals());
+
+  // The residuals are near zero at the solution, and so is the uncertainty
+  ASSERT_EQ(static_cast<size_t>(1), opt.getCovarianceNames().size());
+  EXPECT_EQ("arm_lift_joint", opt.getCovarianceNames()[0]);
+  EXPECT_LT(opt.getStandardDeviations()(0), 0.001);
+  EXPECT_DOUBLE_EQ(1.0, opt.getCorrelations()(0, 0));
 }
 
 int main(int argc, char** argv)
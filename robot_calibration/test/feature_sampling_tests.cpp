@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <gtest/gtest.h>
+#include <robot_calibration/util/feature_sampling.hpp>
+
+using robot_calibration_msgs::msg::CalibrationData;
+
+// Features along a line, with a cluster of features near the start
+std::vector<geometry_msgs::msg::PointStamped> makeFeatures()
+{
+  std::vector<geometry_msgs::msg::PointStamped> features;
+  for (int i = 0; i < 10; ++i)
+  {
+    geometry_msgs::msg::PointStamped p;
+    p.point.x = (i < 6) ? i * 0.01 : i * 1.0;
+    features.push_back(p);
+  }
+  return features;
+}
+
+TEST(FeatureSamplingTests, test_stride)
+{
+  auto features = makeFeatures();
+  std::vector<size_t> indices = robot_calibration::selectFeatures(features, 4, false);
+  ASSERT_EQ(4u, indices.size());
+  EXPECT_EQ(0u, indices[0]);
+  EXPECT_EQ(2u, indices[1]);
+  EXPECT_EQ(5u, indices[2]);
+  EXPECT_EQ(7u, indices[3]);
+
+  // Fewer features than the maximum are all kept
+  indices = robot_calibration::selectFeatures(features, 20, false);
+  EXPECT_EQ(10u, indices.size());
+}
+
+TEST(FeatureSamplingTests, test_farthest_point)
+{
+  auto features = makeFeatures();
+  std::vector<size_t> indices = robot_calibration::selectFeatures(features, 3, true);
+  ASSERT_EQ(3u, indices.size());
+  // The first feature, then the end of the line, then the feature farthest
+  // from both, rather than the rest of the cluster
+  EXPECT_EQ(0u, indices[0]);
+  EXPECT_EQ(6u, indices[1]);
+  EXPECT_EQ(9u, indices[2]);
+}
+
+TEST(FeatureSamplingTests, test_decimate)
+{
+  std::vector<CalibrationData> data(1);
+  data[0].joint_states.name.push_back("joint");
+  data[0].observations.resize(3);
+  data[0].observations[0].sensor_name = "camera";
+  data[0].observations[0].features = makeFeatures();
+  data[0].observations[1].sensor_name = "arm";
+  data[0].observations[1].features = makeFeatures();
+  // Features of the arm are in another frame, but must stay paired
+  for (auto& f : data[0].observations[1].features)
+  {
+    f.point.y = -f.point.x * f.point.x;
+  }
+  data[0].observations[2].sensor_name = "led";
+  data[0].observations[2].features.resize(2);
+
+  std::vector<CalibrationData> decimated;
+  robot_calibration::decimateFeatures(data, 3, true, decimated);
+  ASSERT_EQ(1u, decimated.size());
+  EXPECT_EQ(1u, decimated[0].joint_states.name.size());
+  ASSERT_EQ(3u, decimated[0].observations.size());
+  EXPECT_EQ("arm", decimated[0].observations[1].sensor_name);
+  ASSERT_EQ(3u, decimated[0].observations[0].features.size());
+  ASSERT_EQ(3u, decimated[0].observations[1].features.size());
+  for (size_t i = 0; i < 3; ++i)
+  {
+    EXPECT_EQ(decimated[0].observations[0].features[i].point.x,
+              decimated[0].observations[1].features[i].point.x);
+  }
+  EXPECT_EQ(2u, decimated[0].observations[2].features.size());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
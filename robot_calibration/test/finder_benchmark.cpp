@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+// Latency of each processing stage of the feature finders, on sensor data
+// recorded in a bag, without a robot. The finders are configured just as
+// for capture, by the parameters of this node, and run offline so that
+// they do not wait for their sensors. Transforms come from /tf_static in
+// the bag, and from the static_transforms parameter. Run from the build
+// directory with
+//   test/finder_benchmark sensor_data.bag --ros-args --params-file capture.yaml
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <rclcpp/rclcpp.hpp>
+#include <rclcpp/serialization.hpp>
+#include <rosbag2_cpp/reader.hpp>
+#include <sensor_msgs/msg/image.hpp>
+#include <sensor_msgs/msg/laser_scan.hpp>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2_msgs/msg/tf_message.hpp>
+#include <tf2_ros/buffer.h>
+#include <tf2_ros/buffer_interface.h>
+
+#include <robot_calibration/finders/checkerboard_finder.hpp>
+#include <robot_calibration/finders/led_finder.hpp>
+#include <robot_calibration/finders/plane_finder.hpp>
+#include <robot_calibration/finders/scan_finder.hpp>
+
+namespace
+{
+
+/** @brief Time of each run of each stage, in seconds. */
+class StageTimes
+{
+public:
+  void time(const std::string& stage, const std::function<void()>& f)
+  {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    auto it = times_.find(stage);
+    if (it == times_.end())
+    {
+      stages_.push_back(stage);
+      it = times_.emplace(stage, std::vector<double>()).first;
+    }
+    it->second.push_back(elapsed.count());
+  }
+
+  /** @brief Print the distribution of times of each stage, in milliseconds. */
+  void print(std::ostream& out)
+  {
+    out << std::left << std::setw(40) << "stage" << std::right
+        << std::setw(8) << "runs" << std::setw(10) << "median"
+        << std::setw(10) << "p90" << std::setw(10) << "p99"
+        << std::setw(10) << "max" << std::endl;
+    out << std::fixed << std::setprecision(3);
+    for (const auto& stage : stages_)
+    {
+      std::vector<double>& times = times_[stage];
+      out << std::left << std::setw(40) << stage << std::right
+          << std::setw(8) << times.size()
+          << std::setw(10) << 1000.0 * getPercentile(times, 0.5)
+          << std::setw(10) << 1000.0 * getPercentile(times, 0.9)
+          << std::setw(10) << 1000.0 * getPercentile(times, 0.99)
+          << std::setw(10) << 1000.0 * *std::max_element(times.begin(), times.end())
+          << std::endl;
+    }
+  }
+
+private:
+  // Get the value at some fraction in [0, 1] of the sorted times
+  static double getPercentile(std::vector<double>& times, double fraction)
+  {
+    size_t n = static_cast<size_t>(fraction * (times.size() - 1) + 0.5);
+    std::nth_element(times.begin(), times.begin() + n, times.end());
+    return times[n];
+  }
+
+  std::vector<std::string> stages_;  // In the order first run
+  std::map<std::string, std::vector<double>> times_;
+};
+
+/** @brief Runs the processing stages of a finder on one recorded message. */
+class FinderBenchmark
+{
+public:
+  virtual ~FinderBenchmark() {}
+  virtual void run(const std::string& name,
+                   const rclcpp::SerializedMessage& serialized,
+                   StageTimes& times) = 0;
+};
+
+class PlaneFinderBenchmark : public robot_calibration::PlaneFinder, public FinderBenchmark
+{
+public:
+  void run(const std::string& name,
+           const rclcpp::SerializedMessage& serialized,
+           StageTimes& times) override
+  {
+    sensor_msgs::msg::PointCloud2 cloud;
+    serialization_.deserialize_message(&serialized, &cloud);
+    transform_time_ = tf2_ros::fromMsg(cloud.header.stamp);
+
+    times.time(name + "/removeInvalidPoints", [&]()
+    {
+      removeInvalidPoints(cloud, cloud_, min_x_, max_x_, min_y_, max_y_, min_z_, max_z_);
+    });
+    times.time(name + "/downsampleCloud", [&]() { downsampleCloud(cloud_); });
+    sensor_msgs::msg::PointCloud2 plane;
+    times.time(name + "/extractPlane", [&]() { plane = extractPlane(cloud_); });
+    robot_calibration_msgs::msg::CalibrationData msg;
+    times.time(name + "/extractObservation", [&]()
+    {
+      extractObservation(plane_sensor_name_, plane, &msg, nullptr);
+    });
+  }
+
+private:
+  rclcpp::Serialization<sensor_msgs::msg::PointCloud2> serialization_;
+};
+
+class ScanFinderBenchmark : public robot_calibration::ScanFinder, public FinderBenchmark
+{
+public:
+  void run(const std::string& name,
+           const rclcpp::SerializedMessage& serialized,
+           StageTimes& times) override
+  {
+    auto scan = std::make_shared<sensor_msgs::msg::LaserScan>();
+    serialization_.deserialize_message(&serialized, scan.get());
+    scan_ = scan;
+
+    sensor_msgs::msg::PointCloud2 cloud;
+    times.time(name + "/extractPoints", [&]() { extractPoints(cloud); });
+    robot_calibration_msgs::msg::CalibrationData msg;
+    times.time(name + "/extractObservation", [&]() { extractObservation(cloud, &msg); });
+  }
+
+private:
+  rclcpp::Serialization<sensor_msgs::msg::LaserScan> serialization_;
+};
+
+template <typename T>
+class CheckerboardFinderBenchmark : public robot_calibration::CheckerboardFinder<T>,
+                                    public FinderBenchmark
+{
+public:
+  void run(const std::string& name,
+           const rclcpp::SerializedMessage& serialized,
+           StageTimes& times) override
+  {
+    T frame;
+    serialization_.deserialize_message(&serialized, &frame);
+
+    // Includes the conversion to a mono8 image for findCheckerboardPoints()
+    std::vector<cv::Point2f> points;
+    bool found = false;
+    times.time(name + "/detect", [&]() { found = this->detect(frame, points); });
+    if (found)
+    {
+      robot_calibration::FeatureFinder::ObservationBuffer staged;
+      times.time(name + "/fillObservation", [&]() { this->fillObservation(frame, points, staged); });
+    }
+  }
+
+private:
+  rclcpp::Serialization<T> serialization_;
+};
+
+/**
+ * Consecutive clouds are differenced as if the LEDs had been toggled
+ * between them. Camera info is not recorded, so the trackers process the
+ * full frame even if use_roi is set.
+ */
+class LedFinderBenchmark : public robot_calibration::LedFinder, public FinderBenchmark
+{
+public:
+  void run(const std::string& name,
+           const rclcpp::SerializedMessage& serialized,
+           StageTimes& times) override
+  {
+    auto cloud = std::make_shared<sensor_msgs::msg::PointCloud2>();
+    serialization_.deserialize_message(&serialized, cloud.get());
+    sensor_msgs::msg::PointCloud2::ConstSharedPtr prev = cloud_;
+    cloud_ = cloud;
+    if (!prev || prev->width * prev->height != cloud->width * cloud->height)
+    {
+      for (auto& tracker : trackers_)
+      {
+        tracker.reset(cloud->height, cloud->width);
+      }
+      return;
+    }
+
+    weight_ = -weight_;
+    for (size_t t = 0; t < trackers_.size(); ++t)
+    {
+      std::string stage = name + "/" + std::to_string(t);
+      geometry_msgs::msg::PointStamped led;
+      if (!getExpectedPose(trackers_[t], led))
+      {
+        continue;
+      }
+      times.time(stage + "/updateDifference", [&]() { updateDifference(*cloud_, *prev, trackers_[t]); });
+      times.time(stage + "/process", [&]()
+      {
+        trackers_[t].process(*cloud_, difference_, led.point, max_error_, weight_);
+      });
+    }
+  }
+
+private:
+  rclcpp::Serialization<sensor_msgs::msg::PointCloud2> serialization_;
+  double weight_ = -1.0;
+};
+
+std::shared_ptr<FinderBenchmark> createBenchmark(const std::string& type)
+{
+  if (type == "robot_calibration::PlaneFinder")
+  {
+    return std::make_shared<PlaneFinderBenchmark>();
+  }
+  else if (type == "robot_calibration::ScanFinder")
+  {
+    return std::make_shared<ScanFinderBenchmark>();
+  }
+  else if (type == "robot_calibration::CheckerboardFinder")
+  {
+    return std::make_shared<CheckerboardFinderBenchmark<sensor_msgs::msg::PointCloud2>>();
+  }
+  else if (type == "robot_calibration::CheckerboardFinder2d")
+  {
+    return std::make_shared<CheckerboardFinderBenchmark<sensor_msgs::msg::Image>>();
+  }
+  else if (type == "robot_calibration::LedFinder")
+  {
+    return std::make_shared<LedFinderBenchmark>();
+  }
+  return std::shared_ptr<FinderBenchmark>();
+}
+
+/** @brief Add the transforms named by the static_transforms parameter. */
+void addStaticTransforms(rclcpp::Node::SharedPtr node, tf2_ros::Buffer& buffer)
+{
+  std::vector<std::string> names =
+    node->declare_parameter<std::vector<std::string>>("static_transforms", std::vector<std::string>());
+  for (const auto& name : names)
+  {
+    geometry_msgs::msg::TransformStamped transform;
+    transform.header.frame_id = node->declare_parameter<std::string>(name + ".parent", "base_link");
+    transform.child_frame_id = node->declare_parameter<std::string>(name + ".child", name);
+    transform.transform.translation.x = node->declare_parameter<double>(name + ".x", 0.0);
+    transform.transform.translation.y = node->declare_parameter<double>(name + ".y", 0.0);
+    transform.transform.translation.z = node->declare_parameter<double>(name + ".z", 0.0);
+    tf2::Quaternion q;
+    q.setRPY(node->declare_parameter<double>(name + ".roll", 0.0),
+             node->declare_parameter<double>(name + ".pitch", 0.0),
+             node->declare_parameter<double>(name + ".yaw", 0.0));
+    transform.transform.rotation.x = q.x();
+    transform.transform.rotation.y = q.y();
+    transform.transform.rotation.z = q.z();
+    transform.transform.rotation.w = q.w();
+    buffer.setTransform(transform, "finder_benchmark", true);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    std::cerr << std::endl;
+    std::cerr << "usage:" << std::endl;
+    std::cerr << "  finder_benchmark sensor_data.bag" << std::endl;
+    std::cerr << std::endl;
+    return -1;
+  }
+  std::string bag_name = argv[1];
+
+  rclcpp::init(argc, argv);
+  rclcpp::Node::SharedPtr node = std::make_shared<rclcpp::Node>("robot_calibration_finder_benchmark");
+  node->declare_parameter<bool>("offline", true);
+
+  // Number of times to process each message
+  int repeat = node->declare_parameter<int>("repeat", 1);
+
+  auto buffer = std::make_shared<tf2_ros::Buffer>(node->get_clock());
+  addStaticTransforms(node, *buffer);
+
+  // Finders are configured as for capture, by topic
+  std::map<std::string, std::pair<std::string, std::shared_ptr<FinderBenchmark>>> finders;
+  std::vector<std::string> names =
+    node->declare_parameter<std::vector<std::string>>("features", std::vector<std::string>());
+  for (const auto& name : names)
+  {
+    std::string type = node->declare_parameter<std::string>(name + ".type", std::string());
+    std::shared_ptr<FinderBenchmark> benchmark = createBenchmark(type);
+    if (!benchmark)
+    {
+      std::cerr << "No benchmark of " << name << " of type " << type << std::endl;
+      continue;
+    }
+    auto finder = std::dynamic_pointer_cast<robot_calibration::FeatureFinder>(benchmark);
+    if (!finder->init(name, buffer, node))
+    {
+      std::cerr << "Unable to initialize " << name << std::endl;
+      return -1;
+    }
+    std::string topic = node->get_parameter(name + ".topic").as_string();
+    if (topic.empty() || topic[0] != '/')
+    {
+      topic = "/" + topic;
+    }
+    finders[topic] = std::make_pair(name, benchmark);
+  }
+  if (finders.empty())
+  {
+    std::cerr << "No feature finders to benchmark" << std::endl;
+    return -1;
+  }
+
+  StageTimes times;
+  size_t messages = 0;
+  try
+  {
+    rosbag2_cpp::Reader reader;
+    reader.open(bag_name);
+    rclcpp::Serialization<tf2_msgs::msg::TFMessage> tf_serialization;
+    while (reader.has_next())
+    {
+      auto bag_message = reader.read_next();
+      rclcpp::SerializedMessage serialized(*bag_message->serialized_data);
+      if (bag_message->topic_name == "/tf_static")
+      {
+        tf2_msgs::msg::TFMessage tf;
+        tf_serialization.deserialize_message(&serialized, &tf);
+        for (const auto& transform : tf.transforms)
+        {
+          buffer->setTransform(transform, "finder_benchmark", true);
+        }
+        continue;
+      }
+
+      auto finder = finders.find(bag_message->topic_name);
+      if (finder == finders.end())
+      {
+        continue;
+      }
+      for (int i = 0; i < repeat; ++i)
+      {
+        finder->second.second->run(finder->second.first, serialized, times);
+      }
+      ++messages;
+    }
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "Unable to read " << bag_name << ": " << e.what() << std::endl;
+    return -1;
+  }
+
+  std::cout << "Processed " << messages << " messages" << std::endl;
+  times.print(std::cout);
+
+  rclcpp::shutdown();
+  return 0;
+}
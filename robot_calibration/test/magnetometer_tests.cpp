@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <cmath>
+#include <memory>
+#include <random>
+#include <vector>
+#include <gtest/gtest.h>
+#include <Eigen/Geometry>
+#include <robot_calibration/cost_functions/magnetometer_error.hpp>
+#include <robot_calibration/util/magnetometer_fit.hpp>
+
+/**
+ * @brief Samples of a field of some strength in random directions, distorted
+ *        by the inverse of a soft iron matrix and then offset.
+ */
+static Eigen::Matrix3Xd makeSamples(double field,
+                                    const Eigen::Vector3d& offset,
+                                    const Eigen::Matrix3d& soft_iron,
+                                    size_t count)
+{
+  std::mt19937 gen(42);
+  std::normal_distribution<double> dist(0.0, 1.0);
+  Eigen::Matrix3d distortion = soft_iron.inverse();
+  Eigen::Matrix3Xd samples(3, count);
+  for (size_t i = 0; i < count; ++i)
+  {
+    Eigen::Vector3d direction(dist(gen), dist(gen), dist(gen));
+    samples.col(i) = distortion * (field * direction.normalized()) + offset;
+  }
+  return samples;
+}
+
+TEST(MagnetometerTests, test_fit_sphere)
+{
+  // Typical earth field, in Tesla
+  Eigen::Vector3d offset(2e-5, -1e-5, 3e-6);
+  Eigen::Matrix3Xd samples = makeSamples(4.5e-5, offset, Eigen::Matrix3d::Identity(), 500);
+
+  Eigen::Vector3d fit_offset;
+  double fit_field;
+  ASSERT_TRUE(robot_calibration::fitSphere(samples, fit_offset, fit_field));
+  EXPECT_NEAR(0.0, (fit_offset - offset).norm(), 1e-12);
+  EXPECT_NEAR(4.5e-5, fit_field, 1e-12);
+
+  // Rotating only about z does not constrain the z offset
+  for (Eigen::Index i = 0; i < samples.cols(); ++i)
+    samples(2, i) = offset(2);
+  EXPECT_FALSE(robot_calibration::fitSphere(samples, fit_offset, fit_field));
+}
+
+TEST(MagnetometerTests, test_fit_ellipsoid)
+{
+  // Symmetric, positive definite, unit determinant
+  Eigen::Matrix3d soft_iron;
+  soft_iron << 1.1, 0.05, -0.02,
+               0.05, 0.95, 0.03,
+               -0.02, 0.03, 1.0;
+  soft_iron /= std::cbrt(soft_iron.determinant());
+  Eigen::Vector3d offset(0.1, -0.2, 0.05);
+  Eigen::Matrix3Xd samples = makeSamples(0.45, offset, soft_iron, 500);
+
+  Eigen::Vector3d fit_offset;
+  Eigen::Matrix3d fit_soft_iron;
+  double fit_field;
+  ASSERT_TRUE(robot_calibration::fitEllipsoid(samples, fit_offset, fit_soft_iron, fit_field));
+  EXPECT_NEAR(0.0, (fit_offset - offset).norm(), 1e-9);
+  EXPECT_NEAR(0.0, (fit_soft_iron - soft_iron).norm(), 1e-9);
+  EXPECT_NEAR(0.45, fit_field, 1e-9);
+}
+
+TEST(MagnetometerTests, test_batch_error)
+{
+  Eigen::Matrix3Xd samples = makeSamples(0.45, Eigen::Vector3d(0.1, 0.2, 0.3),
+                                         Eigen::Matrix3d::Identity(), 20);
+  std::vector<double> x, y, z;
+  for (Eigen::Index i = 0; i < samples.cols(); ++i)
+  {
+    x.push_back(samples(0, i));
+    y.push_back(samples(1, i));
+    z.push_back(samples(2, i));
+  }
+
+  double field[1] = {0.4};
+  double offset[3] = {0.05, 0.25, 0.2};
+  double soft_iron[6] = {1.1, 0.05, -0.02, 0.95, 0.03, 1.0};
+  double* parameters[3] = {field, offset, soft_iron};
+  const size_t sizes[3] = {1, 3, 6};
+
+  // Without soft iron, the same as the single sample cost
+  std::unique_ptr<ceres::CostFunction> hard(MagnetometerBatchError::Create(x, y, z, false));
+  ASSERT_EQ(static_cast<int>(x.size()), hard->num_residuals());
+  ASSERT_EQ(static_cast<size_t>(2), hard->parameter_block_sizes().size());
+  std::vector<double> residuals(x.size());
+  ASSERT_TRUE(hard->Evaluate(parameters, residuals.data(), NULL));
+  for (size_t i = 0; i < x.size(); ++i)
+  {
+    double d = (samples.col(i) - Eigen::Vector3d(offset[0], offset[1], offset[2])).squaredNorm();
+    EXPECT_NEAR(d - field[0] * field[0], residuals[i], 1e-12);
+  }
+
+  // Analytic jacobians match central differences
+  std::unique_ptr<ceres::CostFunction> soft(MagnetometerBatchError::Create(x, y, z, true));
+  ASSERT_EQ(static_cast<size_t>(3), soft->parameter_block_sizes().size());
+  std::vector<std::vector<double>> jacobian(3);
+  double* jacobians[3];
+  for (size_t b = 0; b < 3; ++b)
+  {
+    jacobian[b].resize(x.size() * sizes[b]);
+    jacobians[b] = jacobian[b].data();
+  }
+  ASSERT_TRUE(soft->Evaluate(parameters, residuals.data(), jacobians));
+
+  const double step = 1e-6;
+  std::vector<double> plus(x.size()), minus(x.size());
+  for (size_t b = 0; b < 3; ++b)
+  {
+    for (size_t p = 0; p < sizes[b]; ++p)
+    {
+      double value = parameters[b][p];
+      parameters[b][p] = value + step;
+      ASSERT_TRUE(soft->Evaluate(parameters, plus.data(), NULL));
+      parameters[b][p] = value - step;
+      ASSERT_TRUE(soft->Evaluate(parameters, minus.data(), NULL));
+      parameters[b][p] = value;
+      for (size_t i = 0; i < x.size(); ++i)
+      {
+        EXPECT_NEAR((plus[i] - minus[i]) / (2 * step), jacobian[b][(i * sizes[b]) + p], 1e-8);
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <gtest/gtest.h>
+#include <robot_calibration/util/mesh_cache.hpp>
+#include <robot_calibration/util/mesh_loader.hpp>
+
+/** @brief Random triangle soup, as in MeshTreeTests. */
+static std::shared_ptr<shapes::Mesh> makeSoup(unsigned int triangle_count)
+{
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  auto mesh = std::make_shared<shapes::Mesh>(3 * triangle_count, triangle_count);
+  for (unsigned int t = 0; t < triangle_count; ++t)
+  {
+    Eigen::Vector3d center(dist(gen), dist(gen), dist(gen));
+    for (unsigned int v = 0; v < 3; ++v)
+    {
+      for (unsigned int i = 0; i < 3; ++i)
+        mesh->vertices[(3 * ((3 * t) + v)) + i] = center(i) + 0.1 * dist(gen);
+      mesh->triangles[(3 * t) + v] = (3 * t) + v;
+    }
+  }
+  return mesh;
+}
+
+/** @brief Make an empty directory for the cache. */
+static std::string makeCacheDirectory()
+{
+  char name[] = "/tmp/mesh_cache_testsXXXXXX";
+  return std::string(mkdtemp(name));
+}
+
+TEST(MeshCacheTests, test_round_trip)
+{
+  std::string directory = makeCacheDirectory();
+  robot_calibration::MeshCache cache(directory);
+
+  auto mesh = makeSoup(200);
+  robot_calibration::MeshTree tree(*mesh);
+  Eigen::Isometry3d origin = Eigen::Isometry3d::Identity();
+  std::string key = robot_calibration::MeshCache::getKey("package://robot/mesh.stl",
+                                                           Eigen::Vector3d::Ones(), origin, 0);
+  ASSERT_TRUE(cache.save(key, *mesh, tree));
+
+  // Any change to the mesh parameters is a different entry
+  std::shared_ptr<shapes::Mesh> loaded_mesh;
+  robot_calibration::MeshTreePtr loaded_tree;
+  origin.translation().x() = 0.1;
+  EXPECT_FALSE(cache.load(robot_calibration::MeshCache::getKey("package://robot/mesh.stl",
+                                                                Eigen::Vector3d::Ones(), origin, 0),
+                          loaded_mesh, loaded_tree));
+  EXPECT_FALSE(cache.load(robot_calibration::MeshCache::getKey("package://robot/mesh.stl",
+                                                                Eigen::Vector3d::Ones(),
+                                                                Eigen::Isometry3d::Identity(), 100),
+                          loaded_mesh, loaded_tree));
+
+  ASSERT_TRUE(cache.load(key, loaded_mesh, loaded_tree));
+  ASSERT_EQ(mesh->vertex_count, loaded_mesh->vertex_count);
+  ASSERT_EQ(mesh->triangle_count, loaded_mesh->triangle_count);
+  for (size_t i = 0; i < 3 * mesh->vertex_count; ++i)
+    EXPECT_EQ(mesh->vertices[i], loaded_mesh->vertices[i]);
+  for (size_t i = 0; i < 3 * mesh->triangle_count; ++i)
+    EXPECT_EQ(mesh->triangles[i], loaded_mesh->triangles[i]);
+  EXPECT_EQ(tree.size(), loaded_tree->size());
+
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<double> dist(-2.0, 2.0);
+  for (int i = 0; i < 100; ++i)
+  {
+    Eigen::Vector3d p(dist(gen), dist(gen), dist(gen));
+    Eigen::Vector3d a, b, c, d;
+    EXPECT_EQ(tree.closestPoint(p, a), loaded_tree->closestPoint(p, b));
+    EXPECT_EQ(a, b);
+    EXPECT_EQ(tree.closestEdge(p, a, b), loaded_tree->closestEdge(p, c, d));
+    EXPECT_EQ(a, c);
+    EXPECT_EQ(b, d);
+  }
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST(MeshCacheTests, test_corrupt_entry)
+{
+  std::string directory = makeCacheDirectory();
+  robot_calibration::MeshCache cache(directory);
+
+  auto mesh = makeSoup(50);
+  robot_calibration::MeshTree tree(*mesh);
+  std::string key = robot_calibration::MeshCache::getKey("file:///robot/mesh.stl",
+                                                           Eigen::Vector3d::Ones(),
+                                                           Eigen::Isometry3d::Identity(), 0);
+  ASSERT_TRUE(cache.save(key, *mesh, tree));
+
+  // Truncate the entry
+  for (const auto& entry : std::filesystem::directory_iterator(directory))
+  {
+    std::filesystem::resize_file(entry.path(), std::filesystem::file_size(entry.path()) / 2);
+  }
+
+  std::shared_ptr<shapes::Mesh> loaded_mesh;
+  robot_calibration::MeshTreePtr loaded_tree;
+  EXPECT_FALSE(cache.load(key, loaded_mesh, loaded_tree));
+  EXPECT_FALSE(loaded_mesh);
+  EXPECT_FALSE(loaded_tree);
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST(MeshCacheTests, test_decimate)
+{
+  // Latitude-longitude sphere of radius 1
+  const unsigned int rings = 50;
+  const unsigned int segments = 100;
+  shapes::Mesh mesh((rings + 1) * segments, 2 * rings * segments);
+  for (unsigned int r = 0; r <= rings; ++r)
+  {
+    double theta = M_PI * r / rings;
+    for (unsigned int s = 0; s < segments; ++s)
+    {
+      double phi = 2 * M_PI * s / segments;
+      unsigned int v = (r * segments) + s;
+      mesh.vertices[(3 * v) + 0] = std::sin(theta) * std::cos(phi);
+      mesh.vertices[(3 * v) + 1] = std::sin(theta) * std::sin(phi);
+      mesh.vertices[(3 * v) + 2] = std::cos(theta);
+    }
+  }
+  for (unsigned int r = 0; r < rings; ++r)
+  {
+    for (unsigned int s = 0; s < segments; ++s)
+    {
+      unsigned int a = (r * segments) + s;
+      unsigned int b = (r * segments) + ((s + 1) % segments);
+      unsigned int t = 2 * ((r * segments) + s);
+      mesh.triangles[(3 * t) + 0] = a;
+      mesh.triangles[(3 * t) + 1] = b;
+      mesh.triangles[(3 * t) + 2] = a + segments;
+      mesh.triangles[(3 * t) + 3] = b;
+      mesh.triangles[(3 * t) + 4] = b + segments;
+      mesh.triangles[(3 * t) + 5] = a + segments;
+    }
+  }
+
+  robot_calibration::MeshPtr decimated = robot_calibration::decimateMesh(mesh, 500);
+  EXPECT_LE(decimated->triangle_count, 500u);
+  EXPECT_GT(decimated->triangle_count, 100u);
+  for (size_t v = 0; v < decimated->vertex_count; ++v)
+  {
+    Eigen::Vector3d p(decimated->vertices[(3 * v) + 0],
+                      decimated->vertices[(3 * v) + 1],
+                      decimated->vertices[(3 * v) + 2]);
+    EXPECT_NEAR(1.0, p.norm(), 0.1);
+  }
+  for (size_t i = 0; i < 3 * decimated->triangle_count; ++i)
+    EXPECT_LT(decimated->triangles[i], decimated->vertex_count);
+
+  // Meshes which are small enough are unchanged
+  decimated = robot_calibration::decimateMesh(mesh, mesh.triangle_count);
+  ASSERT_EQ(mesh.triangle_count, decimated->triangle_count);
+  for (size_t i = 0; i < 3 * mesh.triangle_count; ++i)
+    EXPECT_EQ(mesh.triangles[i], decimated->triangles[i]);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
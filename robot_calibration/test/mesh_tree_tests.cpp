@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <limits>
+#include <random>
+#include <gtest/gtest.h>
+#include <robot_calibration/util/mesh_tree.hpp>
+
+TEST(MeshTreeTests, test_closest_point_on_triangle)
+{
+  Eigen::Vector3d A(0, 0, 0);
+  Eigen::Vector3d B(2, 0, 0);
+  Eigen::Vector3d C(0, 2, 0);
+
+  // Above the face
+  Eigen::Vector3d q = robot_calibration::closestPointOnTriangle(A, B, C, Eigen::Vector3d(0.5, 0.5, 1));
+  EXPECT_NEAR(0.0, (q - Eigen::Vector3d(0.5, 0.5, 0)).norm(), 1e-12);
+
+  // Outside vertex A
+  q = robot_calibration::closestPointOnTriangle(A, B, C, Eigen::Vector3d(-1, -1, 1));
+  EXPECT_NEAR(0.0, (q - A).norm(), 1e-12);
+
+  // Outside edge BC
+  q = robot_calibration::closestPointOnTriangle(A, B, C, Eigen::Vector3d(2, 2, 0));
+  EXPECT_NEAR(0.0, (q - Eigen::Vector3d(1, 1, 0)).norm(), 1e-12);
+
+  // Degenerate triangle behaves as a line segment
+  q = robot_calibration::closestPointOnTriangle(A, B, B, Eigen::Vector3d(1, 1, 0));
+  EXPECT_NEAR(0.0, (q - Eigen::Vector3d(1, 0, 0)).norm(), 1e-12);
+}
+
+TEST(MeshTreeTests, test_matches_brute_force)
+{
+  // Random triangle soup
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  const unsigned int triangle_count = 200;
+  shapes::Mesh mesh(3 * triangle_count, triangle_count);
+  for (unsigned int t = 0; t < triangle_count; ++t)
+  {
+    Eigen::Vector3d center(dist(gen), dist(gen), dist(gen));
+    for (unsigned int v = 0; v < 3; ++v)
+    {
+      for (unsigned int i = 0; i < 3; ++i)
+        mesh.vertices[(3 * ((3 * t) + v)) + i] = center(i) + 0.1 * dist(gen);
+      mesh.triangles[(3 * t) + v] = (3 * t) + v;
+    }
+  }
+
+  robot_calibration::MeshTree tree(mesh);
+  EXPECT_EQ(static_cast<size_t>(triangle_count), tree.size());
+
+  for (int i = 0; i < 100; ++i)
+  {
+    Eigen::Vector3d p(2 * dist(gen), 2 * dist(gen), 2 * dist(gen));
+
+    // Brute force search over all triangles
+    double edge_best = std::numeric_limits<double>::max();
+    double point_best = std::numeric_limits<double>::max();
+    for (unsigned int t = 0; t < triangle_count; ++t)
+    {
+      Eigen::Vector3d v[3];
+      for (unsigned int j = 0; j < 3; ++j)
+      {
+        unsigned int idx = mesh.triangles[(3 * t) + j];
+        v[j] = Eigen::Vector3d(mesh.vertices[3 * idx],
+                               mesh.vertices[(3 * idx) + 1],
+                               mesh.vertices[(3 * idx) + 2]);
+      }
+      for (unsigned int j = 0; j < 3; ++j)
+      {
+        Eigen::Vector3d q = robot_calibration::closestPointOnSegment(v[j], v[(j + 1) % 3], p);
+        edge_best = std::min(edge_best, (q - p).squaredNorm());
+      }
+      Eigen::Vector3d q = robot_calibration::closestPointOnTriangle(v[0], v[1], v[2], p);
+      point_best = std::min(point_best, (q - p).squaredNorm());
+    }
+
+    Eigen::Vector3d a, b;
+    EXPECT_DOUBLE_EQ(edge_best, tree.closestEdge(p, a, b));
+    EXPECT_DOUBLE_EQ(edge_best, (robot_calibration::closestPointOnSegment(a, b, p) - p).squaredNorm());
+
+    Eigen::Vector3d closest;
+    EXPECT_DOUBLE_EQ(point_best, tree.closestPoint(p, closest));
+    EXPECT_DOUBLE_EQ(point_best, (closest - p).squaredNorm());
+    EXPECT_LE(point_best, edge_best + 1e-12);
+  }
+}
+
+TEST(MeshTreeTests, test_empty_mesh)
+{
+  shapes::Mesh mesh(0, 0);
+  robot_calibration::MeshTree tree(mesh);
+  Eigen::Vector3d a, b;
+  EXPECT_EQ(std::numeric_limits<double>::max(), tree.closestEdge(Eigen::Vector3d::Zero(), a, b));
+  EXPECT_EQ(std::numeric_limits<double>::max(), tree.closestPoint(Eigen::Vector3d::Zero(), a));
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
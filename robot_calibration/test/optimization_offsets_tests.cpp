@@ -132,6 +132,141 @@ TEST(OptimizationOffsetsTests, test_multi_step)
   EXPECT_EQ(0.49, offsets.get("second_step_joint1"));
 }
 
+TEST(OptimizationOffsetsTests, test_view)
+{
+  robot_calibration::OptimizationOffsets offsets;
+
+  offsets.add("first_step_joint1");
+  double params[2] = {0.245, 0.0};
+  offsets.update(params);
+
+  // Second step retains first_step_joint1 as non-free param
+  offsets.reset();
+  offsets.add("second_step_joint1");
+  offsets.addFrame("second_step_frame", true, false, false, false, false, false);
+  EXPECT_EQ((size_t) 2, offsets.size());
+
+  // A view substitutes the free params without updating the offsets
+  params[0] = 0.1;
+  params[1] = 0.2;
+  robot_calibration::OffsetsView view(offsets, params);
+  EXPECT_EQ(0.1, view.get("second_step_joint1"));
+  EXPECT_EQ(0.245, view.get("first_step_joint1"));
+  EXPECT_EQ(0.0, view.get("not_a_joint"));
+  EXPECT_EQ(0.0, offsets.get("second_step_joint1"));
+
+  KDL::Frame f;
+  EXPECT_TRUE(view.getFrame("second_step_frame", f));
+  EXPECT_EQ(0.2, f.p.x());
+  EXPECT_EQ(0.0, f.p.y());
+  EXPECT_FALSE(view.getFrame("not_a_frame", f));
+
+  // Default view is of the values stored in offsets
+  offsets.update(params);
+  robot_calibration::OffsetsView stored(offsets);
+  EXPECT_EQ(0.1, stored.get("second_step_joint1"));
+  EXPECT_EQ(0.245, stored.get("first_step_joint1"));
+}
+
+TEST(OptimizationOffsetsTests, test_handles)
+{
+  robot_calibration::OptimizationOffsets offsets;
+
+  offsets.add("joint1");
+  offsets.addFrame("frame1", false, true, false, false, false, false);
+  robot_calibration::ParamHandle joint1 = offsets.getParamHandle("joint1");
+  EXPECT_TRUE(joint1.valid());
+  EXPECT_TRUE(offsets.getParamHandle("frame1_y").valid());
+  EXPECT_FALSE(offsets.getParamHandle("not_a_joint").valid());
+
+  robot_calibration::FrameHandle frame = offsets.getFrameHandle("frame1");
+  EXPECT_TRUE(frame.valid);
+  EXPECT_FALSE(frame.params[0].valid());
+  EXPECT_TRUE(frame.params[1].valid());
+  EXPECT_FALSE(offsets.getFrameHandle("not_a_frame").valid);
+
+  // Lookup by handle matches lookup by name
+  double params[2] = {0.1, 0.2};
+  robot_calibration::OffsetsView view(offsets, params);
+  EXPECT_EQ(0.1, view.get(joint1));
+  EXPECT_EQ(0.0, view.get(robot_calibration::ParamHandle()));
+  robot_calibration::Transform<double> f;
+  EXPECT_TRUE(view.getFrame(frame, f));
+  EXPECT_EQ(0.2, f.translation()(1));
+
+  // Revision changes when parameters are added, but not values
+  size_t revision = offsets.getRevision();
+  offsets.update(params);
+  EXPECT_EQ(revision, offsets.getRevision());
+  offsets.add("joint2");
+  EXPECT_NE(revision, offsets.getRevision());
+
+  // Handles remain valid across steps, even as the free params change
+  offsets.reset();
+  offsets.add("joint2");
+  offsets.add("joint1");
+  double step_params[2] = {0.3, 0.4};
+  robot_calibration::OffsetsView step_view(offsets, step_params);
+  EXPECT_EQ(0.4, step_view.get(joint1));
+  EXPECT_TRUE(step_view.getFrame(frame, f));
+  EXPECT_EQ(0.2, f.translation()(1));
+}
+
+TEST(OptimizationOffsetsTests, test_blocks)
+{
+  robot_calibration::OptimizationOffsets offsets;
+
+  // Each joint is a block, each frame is a single block of its free components
+  offsets.add("joint1");
+  offsets.addFrame("frame1", true, false, true, false, false, false);
+  offsets.add("joint2");
+  EXPECT_EQ((size_t) 4, offsets.size());
+  ASSERT_EQ((size_t) 3, offsets.getNumBlocks());
+  EXPECT_EQ((size_t) 1, offsets.getBlockSize(0));
+  EXPECT_EQ((size_t) 0, offsets.getBlockStart(0));
+  EXPECT_EQ((size_t) 2, offsets.getBlockSize(1));
+  EXPECT_EQ((size_t) 1, offsets.getBlockStart(1));
+  EXPECT_EQ((size_t) 1, offsets.getBlockSize(2));
+  EXPECT_EQ((size_t) 3, offsets.getBlockStart(2));
+
+  // Names are in the order of the free params
+  EXPECT_EQ("joint1", offsets.getFreeParamName(0));
+  EXPECT_EQ("frame1_x", offsets.getFreeParamName(1));
+  EXPECT_EQ("frame1_z", offsets.getFreeParamName(2));
+  EXPECT_EQ("joint2", offsets.getFreeParamName(3));
+  EXPECT_EQ("", offsets.getFreeParamName(4));
+
+  robot_calibration::ParamHandle joint2 = offsets.getParamHandle("joint2");
+  robot_calibration::FrameHandle frame = offsets.getFrameHandle("frame1");
+  EXPECT_EQ(0, offsets.getBlock(offsets.getParamHandle("joint1")));
+  EXPECT_EQ(1, offsets.getBlock(frame.params[0]));
+  EXPECT_EQ(1, offsets.getBlock(frame.params[2]));
+  EXPECT_EQ(2, offsets.getBlock(joint2));
+  EXPECT_EQ(-1, offsets.getBlock(frame.params[1]));
+
+  // A view of only some of the blocks uses stored values for the others
+  double frame_params[2] = {0.1, 0.2};
+  double joint2_params[1] = {0.3};
+  const double* blocks[2] = {frame_params, joint2_params};
+  std::vector<int> index = {-1, 0, 1};
+  robot_calibration::OffsetsView view(offsets, blocks, index);
+  EXPECT_EQ(0.0, view.get("joint1"));
+  EXPECT_EQ(0.3, view.get(joint2));
+  robot_calibration::Transform<double> f;
+  EXPECT_TRUE(view.getFrame(frame, f));
+  EXPECT_EQ(0.1, f.translation()(0));
+  EXPECT_EQ(0.0, f.translation()(1));
+  EXPECT_EQ(0.2, f.translation()(2));
+
+  // Blocks are rebuilt for each step
+  offsets.reset();
+  EXPECT_EQ((size_t) 0, offsets.getNumBlocks());
+  offsets.add("joint2");
+  ASSERT_EQ((size_t) 1, offsets.getNumBlocks());
+  EXPECT_EQ(0, offsets.getBlock(joint2));
+  EXPECT_EQ(-1, offsets.getBlock(frame.params[0]));
+}
+
 int main(int argc, char** argv)
 {
   testing::InitGoogleTest(&argc, argv);
@@ -55,12 +55,72 @@ TEST(OptimizationParamsTests, test_rosparam_loading)
   EXPECT_EQ(0.0, block1->joint_scale);
   EXPECT_EQ(0.1, block1->position_scale);
   EXPECT_EQ(0.1, block1->rotation_scale);
+  // Check loss values
+  EXPECT_EQ("huber", block0->loss);
+  EXPECT_EQ(0.01, block0->loss_scale);
+  EXPECT_EQ("", block1->loss);
+  EXPECT_EQ(1.0, block1->loss_scale);
 
   EXPECT_EQ(static_cast<size_t>(1), params.free_frames_initial_values.size());
   EXPECT_EQ("checkerboard", params.free_frames_initial_values[0].name);
   EXPECT_EQ(0.0, params.free_frames_initial_values[0].x);
   EXPECT_EQ(1.0, params.free_frames_initial_values[0].y);
   EXPECT_EQ(2.0, params.free_frames_initial_values[0].z);
+
+  // Multi-start, each hypothesis is perturbed by the grid
+  ASSERT_EQ(static_cast<size_t>(1), params.multi_start.size());
+  ASSERT_EQ(static_cast<size_t>(1), params.multi_start[0].size());
+  EXPECT_EQ("head_camera_rgb_joint", params.multi_start[0][0].name);
+  EXPECT_EQ(3.14, params.multi_start[0][0].yaw);
+  ASSERT_EQ(static_cast<size_t>(1), params.multi_start_grid.size());
+  EXPECT_EQ("checkerboard", params.multi_start_grid[0].name);
+  EXPECT_TRUE(params.multi_start_grid[0].x.empty());
+  EXPECT_EQ(static_cast<size_t>(2), params.multi_start_grid[0].yaw.size());
+  EXPECT_EQ(0, params.multi_start_threads);
+
+  auto hypotheses = params.getMultiStartHypotheses();
+  ASSERT_EQ(static_cast<size_t>(4), hypotheses.size());
+  ASSERT_EQ(static_cast<size_t>(1), hypotheses[0].size());
+  EXPECT_EQ(1.0, hypotheses[0][0].y);
+  EXPECT_EQ(-1.57, hypotheses[0][0].yaw);
+  EXPECT_EQ(1.57, hypotheses[1][0].yaw);
+  ASSERT_EQ(static_cast<size_t>(2), hypotheses[2].size());
+  EXPECT_EQ(-1.57, hypotheses[2][0].yaw);
+  EXPECT_EQ("head_camera_rgb_joint", hypotheses[2][1].name);
+  EXPECT_EQ(3.14, hypotheses[3][1].yaw);
+
+  // Solver options, including defaults
+  EXPECT_EQ("SPARSE_NORMAL_CHOLESKY", params.linear_solver);
+  EXPECT_EQ(1e-6, params.function_tolerance);
+  EXPECT_EQ(1e-10, params.gradient_tolerance);
+  EXPECT_EQ("LEVENBERG_MARQUARDT", params.trust_region_strategy);
+  EXPECT_TRUE(params.jacobi_scaling);
+}
+
+TEST(OptimizationParamsTests, test_multi_start_grid)
+{
+  robot_calibration::OptimizationParams params;
+  EXPECT_EQ(static_cast<size_t>(1), params.getMultiStartHypotheses().size());
+
+  // Grid of a frame without initial values starts from zero
+  robot_calibration::OptimizationParams::MultiStartGrid grid;
+  grid.name = "camera_joint";
+  grid.z = {0.0, 0.1};
+  grid.yaw = {-3.0, 0.0, 3.0};
+  params.multi_start_grid.push_back(grid);
+
+  auto hypotheses = params.getMultiStartHypotheses();
+  ASSERT_EQ(static_cast<size_t>(6), hypotheses.size());
+  for (const auto& hypothesis : hypotheses)
+  {
+    ASSERT_EQ(static_cast<size_t>(1), hypothesis.size());
+    EXPECT_EQ("camera_joint", hypothesis[0].name);
+    EXPECT_EQ(0.0, hypothesis[0].x);
+  }
+  EXPECT_EQ(0.0, hypotheses[0][0].z);
+  EXPECT_EQ(-3.0, hypotheses[0][0].yaw);
+  EXPECT_EQ(0.1, hypotheses[5][0].z);
+  EXPECT_EQ(3.0, hypotheses[5][0].yaw);
 }
 
 int main(int argc, char** argv)
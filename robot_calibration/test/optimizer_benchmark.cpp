@@ -0,0 +1,529 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+// Benchmarks of the error blocks and the optimizer, using a synthetic
+// robot: a serial chain of revolute joints with a checkerboard at the tip,
+// observed by a fixed camera below the base of the chain. Run with
+//   ros2 run robot_calibration optimizer_benchmark
+// or directly from the build directory.
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <ceres/ceres.h>
+#include <geometric_shapes/shapes.h>
+#include <kdl_parser/kdl_parser.hpp>
+#include <rclcpp/rclcpp.hpp>
+
+#include <robot_calibration/cost_functions/chain3d_to_camera2d_error.hpp>
+#include <robot_calibration/cost_functions/chain3d_to_chain3d_error.hpp>
+#include <robot_calibration/cost_functions/chain3d_to_mesh_error.hpp>
+#include <robot_calibration/cost_functions/chain3d_to_plane_error.hpp>
+#include <robot_calibration/cost_functions/plane_to_plane_error.hpp>
+#include <robot_calibration/models/camera2d.hpp>
+#include <robot_calibration/models/camera3d.hpp>
+#include <robot_calibration/models/chain3d.hpp>
+#include <robot_calibration/optimization/ceres_optimizer.hpp>
+#include <robot_calibration/optimization/offsets.hpp>
+#include <robot_calibration/optimization/params.hpp>
+#include <robot_calibration/util/calibration_data.hpp>
+#include <robot_calibration/util/mesh_tree.hpp>
+
+using robot_calibration::CalibrationDataConstPtr;
+using robot_calibration::Camera2dModel;
+using robot_calibration::Camera3dModel;
+using robot_calibration::Chain3dModel;
+using robot_calibration::OptimizationOffsets;
+using robot_calibration::OptimizationParams;
+
+namespace
+{
+
+// Length of each link of the chain
+const double LINK_LENGTH = 0.1;
+// Spacing of the checkerboard features
+const double FEATURE_SPACING = 0.02;
+// Intrinsics of the synthetic camera
+const double CAMERA_F = 525.0;
+const double CAMERA_CX = 320.0;
+const double CAMERA_CY = 240.0;
+
+std::string jointName(int i)
+{
+  return "joint_" + std::to_string(i);
+}
+
+/**
+ * @brief Create the URDF of a chain of revolute joints, alternating between
+ *        pitch and yaw, with a camera looking up at it from below.
+ */
+std::string makeRobot(int num_joints)
+{
+  std::stringstream urdf;
+  urdf << "<?xml version='1.0' ?>"
+       << "<robot name='synthetic'>"
+       << "  <link name='link_0'/>";
+  for (int i = 1; i <= num_joints; ++i)
+  {
+    urdf << "  <joint name='" << jointName(i) << "' type='revolute'>"
+         << "    <origin rpy='0 0 0' xyz='0 0 " << LINK_LENGTH << "'/>"
+         << "    <axis xyz='" << ((i % 2) ? "0 1 0" : "0 0 1") << "'/>"
+         << "    <limit effort='30' lower='-3.14' upper='3.14' velocity='1.0'/>"
+         << "    <parent link='link_" << (i - 1) << "'/>"
+         << "    <child link='link_" << i << "'/>"
+         << "  </joint>"
+         << "  <link name='link_" << i << "'/>";
+  }
+  // Camera optical axis is +z, so anything the chain reaches is in front of it
+  urdf << "  <joint name='camera_joint' type='fixed'>"
+       << "    <origin rpy='0 0 0' xyz='0 0 " << -(LINK_LENGTH * num_joints + 1.0) << "'/>"
+       << "    <parent link='link_0'/>"
+       << "    <child link='camera_link'/>"
+       << "  </joint>"
+       << "  <link name='camera_link'/>"
+       << "</robot>";
+  return urdf.str();
+}
+
+/**
+ * @brief A synthetic robot and dataset, with the models and offsets
+ *        needed to create error blocks directly.
+ */
+struct SyntheticRobot
+{
+  /**
+   * @param num_joints Number of revolute joints in the chain.
+   * @param num_samples Number of samples of calibration data.
+   * @param num_features Number of checkerboard features per sample, rounded
+   *        down to a square grid.
+   */
+  SyntheticRobot(int num_joints, int num_samples, int num_features)
+  {
+    description = makeRobot(num_joints);
+    if (!kdl_parser::treeFromString(description, tree))
+    {
+      throw std::runtime_error("Unable to parse synthetic robot");
+    }
+
+    std::string tip = "link_" + std::to_string(num_joints);
+    arm = std::make_shared<Chain3dModel>("arm", tree, "link_0", tip);
+    camera = std::make_shared<Camera3dModel>("camera", "camera", tree, "link_0", "camera_link");
+    camera2d = std::make_shared<Camera2dModel>("camera2d", "camera2d", tree, "link_0", "camera_link");
+
+    // Everything about the arm and the camera pose is free
+    for (int i = 1; i <= num_joints; ++i)
+    {
+      offsets.add(jointName(i));
+    }
+    offsets.addFrame("checkerboard", true, true, true, true, true, true);
+    offsets.addFrame("camera_joint", true, true, true, true, true, true);
+
+    // Checkerboard in the plane of the tip frame
+    int side = std::max(1, static_cast<int>(std::sqrt(num_features)));
+    std::vector<geometry_msgs::msg::PointStamped> board;
+    for (int y = 0; y < side; ++y)
+    {
+      for (int x = 0; x < side; ++x)
+      {
+        geometry_msgs::msg::PointStamped p;
+        p.header.frame_id = "checkerboard";
+        p.point.x = FEATURE_SPACING * x;
+        p.point.y = FEATURE_SPACING * y;
+        p.point.z = 0.0;
+        board.push_back(p);
+      }
+    }
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> position(-0.5, 0.5);
+    robot_calibration::OffsetsView no_offsets(offsets);
+    Eigen::Vector3d camera_origin(0.0, 0.0, -(LINK_LENGTH * num_joints + 1.0));
+
+    for (int s = 0; s < num_samples; ++s)
+    {
+      robot_calibration_msgs::msg::CalibrationData msg;
+      for (int i = 1; i <= num_joints; ++i)
+      {
+        msg.joint_states.name.push_back(jointName(i));
+        msg.joint_states.position.push_back(position(gen));
+      }
+
+      msg.observations.resize(3);
+      msg.observations[0].sensor_name = "arm";
+      msg.observations[0].features = board;
+
+      // Observe the checkerboard exactly, with the true joint positions
+      Eigen::Matrix3Xd points;
+      arm->project(msg, no_offsets, points);
+
+      msg.observations[1].sensor_name = "camera";
+      msg.observations[2].sensor_name = "camera2d";
+      for (size_t c = 1; c < 3; ++c)
+      {
+        auto& info = msg.observations[c].ext_camera_info.camera_info;
+        info.p[0] = CAMERA_F;  // fx
+        info.p[5] = CAMERA_F;  // fy
+        info.p[2] = CAMERA_CX;  // cx
+        info.p[6] = CAMERA_CY;  // cy
+      }
+      for (int i = 0; i < points.cols(); ++i)
+      {
+        Eigen::Vector3d p = points.col(i) - camera_origin;
+
+        geometry_msgs::msg::PointStamped point;
+        point.header.frame_id = "camera_link";
+        point.point.x = p(0);
+        point.point.y = p(1);
+        point.point.z = p(2);
+        msg.observations[1].features.push_back(point);
+
+        point.point.x = CAMERA_F * p(0) / p(2) + CAMERA_CX;
+        point.point.y = CAMERA_F * p(1) / p(2) + CAMERA_CY;
+        point.point.z = 0.0;
+        msg.observations[2].features.push_back(point);
+      }
+
+      // The encoders are not quite right, which is what gets calibrated
+      for (int i = 0; i < num_joints; ++i)
+      {
+        msg.joint_states.position[i] += 0.01 * (i + 1);
+      }
+
+      data.push_back(msg);
+      samples.push_back(robot_calibration::makeSample(msg));
+    }
+  }
+
+  std::string description;
+  KDL::Tree tree;
+  std::shared_ptr<Chain3dModel> arm;
+  std::shared_ptr<Camera3dModel> camera;
+  std::shared_ptr<Camera2dModel> camera2d;
+  OptimizationOffsets offsets;
+  std::vector<robot_calibration_msgs::msg::CalibrationData> data;
+  std::vector<CalibrationDataConstPtr> samples;
+};
+
+/**
+ * @brief Create a closed mesh of a sphere, centered on the chain.
+ */
+std::shared_ptr<shapes::Mesh> makeSphere(int num_joints, int num_triangles)
+{
+  // Each band of the sphere has 2 * segments triangles
+  int segments = std::max(3, static_cast<int>(std::sqrt(num_triangles / 2.0)));
+  int rings = std::max(2, num_triangles / (2 * segments));
+  double radius = 0.5 * LINK_LENGTH * num_joints;
+  Eigen::Vector3d center(0.0, 0.0, radius);
+
+  auto mesh = std::make_shared<shapes::Mesh>((rings + 1) * segments, 2 * rings * segments);
+  for (int r = 0; r <= rings; ++r)
+  {
+    double theta = M_PI * r / rings;
+    for (int s = 0; s < segments; ++s)
+    {
+      double phi = 2.0 * M_PI * s / segments;
+      int v = (r * segments) + s;
+      mesh->vertices[(3 * v) + 0] = center(0) + radius * std::sin(theta) * std::cos(phi);
+      mesh->vertices[(3 * v) + 1] = center(1) + radius * std::sin(theta) * std::sin(phi);
+      mesh->vertices[(3 * v) + 2] = center(2) + radius * std::cos(theta);
+    }
+  }
+  int t = 0;
+  for (int r = 0; r < rings; ++r)
+  {
+    for (int s = 0; s < segments; ++s)
+    {
+      unsigned int a = (r * segments) + s;
+      unsigned int b = (r * segments) + ((s + 1) % segments);
+      unsigned int c = a + segments;
+      unsigned int d = b + segments;
+      unsigned int triangles[6] = {a, c, b, b, c, d};
+      for (int i = 0; i < 6; ++i)
+      {
+        mesh->triangles[(3 * t) + i] = triangles[i];
+      }
+      t += 2;
+    }
+  }
+  return mesh;
+}
+
+/**
+ * @brief Evaluate the residuals and jacobians of a set of cost functions,
+ *        as the solver does on each iteration.
+ */
+class CostEvaluator
+{
+public:
+  explicit CostEvaluator(OptimizationOffsets& offsets) :
+    offsets_(offsets),
+    free_params_(offsets.size()),
+    num_residuals_(0)
+  {
+    offsets_.initialize(free_params_.data());
+  }
+
+  ~CostEvaluator()
+  {
+    for (auto& cost : costs_)
+    {
+      delete cost.function;
+    }
+  }
+
+  void add(ceres::CostFunction* function, const std::vector<int>& blocks)
+  {
+    Cost cost;
+    cost.function = function;
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+      cost.parameters.push_back(free_params_.data() + offsets_.getBlockStart(blocks[i]));
+      cost.jacobian_storage.push_back(
+        std::vector<double>(function->num_residuals() * offsets_.getBlockSize(blocks[i])));
+    }
+    for (auto& storage : cost.jacobian_storage)
+    {
+      cost.jacobians.push_back(storage.data());
+    }
+    cost.residuals.resize(function->num_residuals());
+    num_residuals_ += function->num_residuals();
+    costs_.push_back(std::move(cost));
+  }
+
+  bool evaluate()
+  {
+    bool success = true;
+    for (auto& cost : costs_)
+    {
+      success &= cost.function->Evaluate(cost.parameters.data(),
+                                         cost.residuals.data(),
+                                         cost.jacobians.data());
+      benchmark::DoNotOptimize(cost.residuals.data());
+    }
+    return success;
+  }
+
+  size_t size() const
+  {
+    return costs_.size();
+  }
+
+  size_t numResiduals() const
+  {
+    return num_residuals_;
+  }
+
+private:
+  struct Cost
+  {
+    ceres::CostFunction* function;
+    std::vector<double*> parameters;
+    std::vector<double> residuals;
+    std::vector<std::vector<double>> jacobian_storage;
+    std::vector<double*> jacobians;
+  };
+
+  OptimizationOffsets& offsets_;
+  std::vector<double> free_params_;
+  std::vector<Cost> costs_;
+  size_t num_residuals_;
+};
+
+void runEvaluator(benchmark::State& state, CostEvaluator& evaluator)
+{
+  for (auto _ : state)
+  {
+    if (!evaluator.evaluate())
+    {
+      state.SkipWithError("Evaluation failed");
+      break;
+    }
+  }
+  // Time per residual block evaluation, including the jacobians
+  state.SetItemsProcessed(state.iterations() * evaluator.size());
+  state.counters["residuals"] = evaluator.numResiduals();
+  state.counters["time_per_eval"] =
+    benchmark::Counter(evaluator.size(),
+                       benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+}
+
+}  // namespace
+
+// Arguments are number of joints, number of features, and for the error
+// blocks which support it, whether to use analytic derivatives
+static void BM_Chain3dToChain3d(benchmark::State& state)
+{
+  SyntheticRobot robot(state.range(0), 10, state.range(1));
+  CostEvaluator evaluator(robot.offsets);
+  for (auto& sample : robot.samples)
+  {
+    std::vector<int> blocks;
+    ceres::CostFunction* cost =
+      robot_calibration::Chain3dToChain3d::Create(robot.arm.get(), robot.camera.get(),
+                                                  &robot.offsets, sample, blocks,
+                                                  false, state.range(2));
+    evaluator.add(cost, blocks);
+  }
+  runEvaluator(state, evaluator);
+}
+BENCHMARK(BM_Chain3dToChain3d)->Args({6, 9, 0})->Args({6, 48, 0})->Args({6, 49, 0})
+                              ->Args({12, 49, 0})->Args({6, 9, 1})->Args({6, 49, 1})
+                              ->Args({12, 49, 1});
+
+static void BM_Chain3dToCamera2d(benchmark::State& state)
+{
+  SyntheticRobot robot(state.range(0), 10, state.range(1));
+  CostEvaluator evaluator(robot.offsets);
+  for (auto& sample : robot.samples)
+  {
+    std::vector<int> blocks;
+    ceres::CostFunction* cost =
+      robot_calibration::Chain3dToCamera2d::Create(robot.arm.get(), robot.camera2d.get(), 1.0,
+                                                   &robot.offsets, sample, blocks);
+    evaluator.add(cost, blocks);
+  }
+  runEvaluator(state, evaluator);
+}
+BENCHMARK(BM_Chain3dToCamera2d)->Args({6, 9})->Args({6, 48})->Args({6, 49})->Args({12, 49});
+
+static void BM_Chain3dToPlane(benchmark::State& state)
+{
+  SyntheticRobot robot(state.range(0), 10, state.range(1));
+  CostEvaluator evaluator(robot.offsets);
+  for (auto& sample : robot.samples)
+  {
+    std::vector<int> blocks;
+    ceres::CostFunction* cost =
+      robot_calibration::Chain3dToPlane::Create(robot.arm.get(), &robot.offsets, sample,
+                                                0.0, 0.0, 1.0, 0.0, 1.0, blocks,
+                                                false, state.range(2));
+    evaluator.add(cost, blocks);
+  }
+  runEvaluator(state, evaluator);
+}
+BENCHMARK(BM_Chain3dToPlane)->Args({6, 9, 0})->Args({6, 49, 0})->Args({12, 49, 0})
+                            ->Args({6, 9, 1})->Args({6, 49, 1})->Args({12, 49, 1});
+
+static void BM_PlaneToPlane(benchmark::State& state)
+{
+  SyntheticRobot robot(state.range(0), 10, state.range(1));
+  CostEvaluator evaluator(robot.offsets);
+  for (auto& sample : robot.samples)
+  {
+    std::vector<int> blocks;
+    ceres::CostFunction* cost =
+      robot_calibration::PlaneToPlaneError::Create(robot.arm.get(), robot.camera.get(),
+                                                   &robot.offsets, sample, 1.0, 1.0, blocks);
+    evaluator.add(cost, blocks);
+  }
+  runEvaluator(state, evaluator);
+}
+BENCHMARK(BM_PlaneToPlane)->Args({6, 9})->Args({6, 49})->Args({12, 49});
+
+// Arguments are number of joints, number of features, number of triangles
+static void BM_Chain3dToMesh(benchmark::State& state)
+{
+  SyntheticRobot robot(state.range(0), 10, state.range(1));
+  std::shared_ptr<shapes::Mesh> mesh = makeSphere(state.range(0), state.range(2));
+  robot_calibration::MeshTreePtr tree = std::make_shared<robot_calibration::MeshTree>(*mesh);
+  CostEvaluator evaluator(robot.offsets);
+  for (auto& sample : robot.samples)
+  {
+    std::vector<int> blocks;
+    ceres::CostFunction* cost =
+      robot_calibration::Chain3dToMesh::Create(robot.arm.get(), &robot.offsets, sample,
+                                               tree, false, blocks);
+    evaluator.add(cost, blocks);
+  }
+  runEvaluator(state, evaluator);
+}
+BENCHMARK(BM_Chain3dToMesh)->Args({6, 49, 200})->Args({6, 49, 5000})->Args({6, 49, 50000});
+
+// Arguments are number of joints, number of samples, number of features
+static void BM_Optimize(benchmark::State& state)
+{
+  SyntheticRobot robot(state.range(0), state.range(1), state.range(2));
+  rclcpp::Logger logger = rclcpp::get_logger("optimizer_benchmark");
+
+  OptimizationParams params;
+  params.base_link = "link_0";
+  for (int i = 1; i <= state.range(0); ++i)
+  {
+    params.free_params.push_back(jointName(i));
+  }
+  OptimizationParams::FreeFrameParams frame;
+  frame.name = "checkerboard";
+  frame.x = frame.y = frame.z = frame.roll = frame.pitch = frame.yaw = true;
+  params.free_frames.push_back(frame);
+
+  OptimizationParams::ModelParams arm;
+  arm.name = "arm";
+  arm.type = "chain3d";
+  arm.frame = "link_" + std::to_string(state.range(0));
+  params.models.push_back(arm);
+
+  OptimizationParams::ModelParams camera;
+  camera.name = "camera";
+  camera.type = "camera3d";
+  camera.frame = "camera_link";
+  camera.param_name = "camera";
+  params.models.push_back(camera);
+
+  auto block = std::make_shared<OptimizationParams::Chain3dToChain3dParams>();
+  block->name = "hand_eye";
+  block->type = "chain3d_to_chain3d";
+  block->model_a = "camera";
+  block->model_b = "arm";
+  block->numeric_diff = false;
+  block->loss = "";
+  block->loss_scale = 1.0;
+  params.error_blocks.push_back(block);
+
+  int num_residuals = 0;
+  for (auto _ : state)
+  {
+    // A new optimizer each time, so that nothing is cached between runs
+    robot_calibration::Optimizer opt(robot.description);
+    opt.optimize(params, robot.data, logger, false);
+    if (opt.getNumResiduals() == 0)
+    {
+      state.SkipWithError("Optimization failed");
+      break;
+    }
+    num_residuals = opt.getNumResiduals();
+  }
+  state.counters["residuals"] = num_residuals;
+}
+BENCHMARK(BM_Optimize)->Args({6, 25, 9})->Args({6, 100, 49})->Args({12, 100, 49})
+                      ->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv)
+{
+  rclcpp::init(argc, argv);
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  rclcpp::shutdown();
+  return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <gtest/gtest.h>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+#include <sensor_msgs/point_cloud2_iterator.hpp>
+#include <robot_calibration/finders/plane_finder.hpp>
+
+// Exposes the processing stages of the plane finder
+class TestPlaneFinder : public robot_calibration::PlaneFinder
+{
+public:
+  explicit TestPlaneFinder(double voxel_size)
+  {
+    voxel_size_ = voxel_size;
+  }
+
+  using robot_calibration::PlaneFinder::downsampleCloud;
+};
+
+TEST(PlaneFinderTests, test_downsample_keeps_fields)
+{
+  // Organized 4x2 cloud, with an intensity following x, y and z
+  sensor_msgs::msg::PointCloud2 cloud;
+  cloud.height = 2;
+  cloud.width = 4;
+  sensor_msgs::PointCloud2Modifier cloud_mod(cloud);
+  cloud_mod.setPointCloud2Fields(4,
+                                 "x", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                 "y", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                 "z", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                 "intensity", 1, sensor_msgs::msg::PointField::FLOAT32);
+  cloud_mod.resize(8);
+  cloud.height = 2;
+  cloud.width = 4;
+  cloud.row_step = cloud.width * cloud.point_step;
+
+  // Points 0, 1 and 3 share a voxel, point 2 is alone, points 4-7 share a voxel
+  const float x[8] = {0.1, 0.3, 2.5, 0.2, 5.1, 5.2, 5.3, 5.4};
+  sensor_msgs::PointCloud2Iterator<float> iter_x(cloud, "x");
+  sensor_msgs::PointCloud2Iterator<float> iter_intensity(cloud, "intensity");
+  for (size_t i = 0; i < 8; ++i, ++iter_x, ++iter_intensity)
+  {
+    iter_x[0] = x[i];
+    iter_x[1] = 0.5;
+    iter_x[2] = 0.5;
+    *iter_intensity = 10.0 * i;
+  }
+
+  TestPlaneFinder finder(1.0);
+  finder.downsampleCloud(cloud);
+
+  ASSERT_EQ(static_cast<uint32_t>(1), cloud.height);
+  ASSERT_EQ(static_cast<uint32_t>(3), cloud.width);
+  EXPECT_EQ(cloud.width * cloud.point_step, cloud.row_step);
+  EXPECT_EQ(static_cast<size_t>(cloud.row_step), cloud.data.size());
+
+  // Each point is the centroid of its voxel, with the other fields of the
+  // first point in the voxel
+  const float centroid_x[3] = {0.2, 2.5, 5.25};
+  const float intensity[3] = {0.0, 20.0, 40.0};
+  sensor_msgs::PointCloud2ConstIterator<float> out_x(cloud, "x");
+  sensor_msgs::PointCloud2ConstIterator<float> out_intensity(cloud, "intensity");
+  for (size_t i = 0; i < 3; ++i, ++out_x, ++out_intensity)
+  {
+    EXPECT_NEAR(centroid_x[i], out_x[0], 1e-5);
+    EXPECT_NEAR(0.5, out_x[1], 1e-5);
+    EXPECT_NEAR(0.5, out_x[2], 1e-5);
+    EXPECT_EQ(intensity[i], *out_intensity);
+  }
+}
+
+TEST(PlaneFinderTests, test_downsample_disabled)
+{
+  sensor_msgs::msg::PointCloud2 cloud;
+  sensor_msgs::PointCloud2Modifier cloud_mod(cloud);
+  cloud_mod.setPointCloud2FieldsByString(1, "xyz");
+  cloud_mod.resize(5);
+
+  TestPlaneFinder finder(0.0);
+  finder.downsampleCloud(cloud);
+  EXPECT_EQ(static_cast<uint32_t>(5), cloud.width);
+  EXPECT_EQ(static_cast<size_t>(5 * cloud.point_step), cloud.data.size());
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <robot_calibration/util/pose_ordering.hpp>
+#include <gtest/gtest.h>
+
+robot_calibration_msgs::msg::CaptureConfig makePose(double j1, double j2)
+{
+  robot_calibration_msgs::msg::CaptureConfig pose;
+  pose.joint_states.name = {"j1", "j2"};
+  pose.joint_states.position = {j1, j2};
+  return pose;
+}
+
+TEST(PoseOrderingTests, test_motion_time)
+{
+  std::map<std::string, double> limits;
+  limits["j1"] = 2.0;
+  robot_calibration::PoseMotionTime motion_time(limits, 0.5);
+
+  // Slowest joint determines the time
+  EXPECT_DOUBLE_EQ(1.0, motion_time.getTime(makePose(0.0, 0.0).joint_states,
+                                            makePose(2.0, 0.5).joint_states));
+  EXPECT_DOUBLE_EQ(2.0, motion_time.getTime(makePose(0.0, 0.0).joint_states,
+                                            makePose(2.0, -1.0).joint_states));
+
+  // Joints not in both poses are ignored
+  robot_calibration_msgs::msg::CaptureConfig partial;
+  partial.joint_states.name = {"j1", "j3"};
+  partial.joint_states.position = {1.0, 10.0};
+  EXPECT_DOUBLE_EQ(0.5, motion_time.getTime(makePose(0.0, 0.0).joint_states,
+                                            partial.joint_states));
+}
+
+TEST(PoseOrderingTests, test_order_poses)
+{
+  // Poses along a line, shuffled
+  std::vector<double> positions = {0.0, 5.0, 2.0, 7.0, 1.0, 4.0, 6.0, 3.0};
+  std::vector<robot_calibration_msgs::msg::CaptureConfig> poses;
+  for (double p : positions)
+  {
+    poses.push_back(makePose(p, -p));
+  }
+  poses[3].features.push_back("checkerboard");
+
+  std::map<std::string, double> limits;
+  robot_calibration::PoseMotionTime motion_time(limits, 1.0);
+  EXPECT_DOUBLE_EQ(27.0, motion_time.getTime(poses));
+
+  std::vector<size_t> order = robot_calibration::orderPoses(poses, motion_time);
+  ASSERT_EQ(positions.size(), order.size());
+  ASSERT_EQ(positions.size(), poses.size());
+  EXPECT_DOUBLE_EQ(7.0, motion_time.getTime(poses));
+
+  // First pose stays first, and features move with their pose
+  EXPECT_EQ(0u, order[0]);
+  for (size_t i = 0; i < poses.size(); ++i)
+  {
+    EXPECT_DOUBLE_EQ(static_cast<double>(i), poses[i].joint_states.position[0]);
+    EXPECT_DOUBLE_EQ(positions[order[i]], poses[i].joint_states.position[0]);
+  }
+  EXPECT_EQ(1u, poses[7].features.size());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
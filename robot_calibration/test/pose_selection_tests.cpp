@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <robot_calibration/optimization/pose_selection.hpp>
+#include <gtest/gtest.h>
+
+// Information of a sample with a single residual, J = row
+Eigen::MatrixXd makeInformation(double a, double b)
+{
+  Eigen::RowVector2d row(a, b);
+  return row.transpose() * row;
+}
+
+TEST(PoseSelectionTests, test_criterion)
+{
+  robot_calibration::SelectionCriterion criterion;
+  EXPECT_TRUE(robot_calibration::getSelectionCriterion("d_optimal", criterion));
+  EXPECT_EQ(robot_calibration::SelectionCriterion::D_OPTIMAL, criterion);
+  EXPECT_TRUE(robot_calibration::getSelectionCriterion("min_eigenvalue", criterion));
+  EXPECT_EQ(robot_calibration::SelectionCriterion::MIN_EIGENVALUE, criterion);
+  EXPECT_FALSE(robot_calibration::getSelectionCriterion("a_optimal", criterion));
+
+  Eigen::MatrixXd information = Eigen::Vector2d(2.0, 8.0).asDiagonal();
+  EXPECT_NEAR(std::log(16.0), robot_calibration::scoreInformation(
+    information, robot_calibration::SelectionCriterion::D_OPTIMAL), 1e-9);
+  EXPECT_NEAR(2.0, robot_calibration::scoreInformation(
+    information, robot_calibration::SelectionCriterion::MIN_EIGENVALUE), 1e-9);
+}
+
+TEST(PoseSelectionTests, test_select_samples)
+{
+  // Samples 0, 1 and 3 only constrain the first parameter
+  std::vector<Eigen::MatrixXd> information;
+  information.push_back(makeInformation(1.0, 0.0));
+  information.push_back(makeInformation(2.0, 0.0));
+  information.push_back(makeInformation(0.0, 0.5));
+  information.push_back(makeInformation(1.5, 0.0));
+  information.push_back(makeInformation(0.1, 0.1));
+
+  for (auto criterion : {robot_calibration::SelectionCriterion::D_OPTIMAL,
+                         robot_calibration::SelectionCriterion::MIN_EIGENVALUE})
+  {
+    std::vector<size_t> selected = robot_calibration::selectSamples(information, 2, criterion);
+    ASSERT_EQ(2u, selected.size());
+    EXPECT_EQ(1u, selected[0]);
+    EXPECT_EQ(2u, selected[1]);
+  }
+
+  // Cannot select more samples than there are
+  std::vector<size_t> selected = robot_calibration::selectSamples(
+    information, 10, robot_calibration::SelectionCriterion::D_OPTIMAL);
+  EXPECT_EQ(information.size(), selected.size());
+
+  EXPECT_TRUE(robot_calibration::selectSamples(
+    std::vector<Eigen::MatrixXd>(), 2, robot_calibration::SelectionCriterion::D_OPTIMAL).empty());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
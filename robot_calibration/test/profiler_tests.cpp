@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <memory>
+#include <vector>
+#include <gtest/gtest.h>
+#include <robot_calibration/cost_functions/magnetometer_error.hpp>
+#include <robot_calibration/optimization/profiler.hpp>
+
+using robot_calibration::ProfiledCostFunction;
+using robot_calibration::ProfiledCostFunctionPtr;
+
+TEST(ProfilerTests, test_profiled_cost)
+{
+  std::unique_ptr<ceres::CostFunction> cost(HardIronOffsetError::Create(1.0, 2.0, 3.0));
+  std::vector<ProfiledCostFunctionPtr> costs;
+  costs.push_back(std::make_shared<ProfiledCostFunction>(cost.get()));
+  costs.push_back(std::make_shared<ProfiledCostFunction>(cost.get()));
+
+  // Wrapper looks just like the original
+  EXPECT_EQ(cost->num_residuals(), costs[0]->num_residuals());
+  EXPECT_EQ(cost->parameter_block_sizes(), costs[0]->parameter_block_sizes());
+
+  double params[4] = {0.0, 0.0, 0.0, 1.0};
+  double* parameters[1] = {params};
+  double expected, residual;
+  double jacobian[4];
+  double* jacobians[1] = {jacobian};
+  ASSERT_TRUE(cost->Evaluate(parameters, &expected, NULL));
+
+  ASSERT_TRUE(costs[0]->Evaluate(parameters, &residual, NULL));
+  EXPECT_EQ(expected, residual);
+  ASSERT_TRUE(costs[0]->Evaluate(parameters, &residual, jacobians));
+  ASSERT_TRUE(costs[1]->Evaluate(parameters, &residual, NULL));
+  EXPECT_EQ(static_cast<size_t>(2), costs[0]->getTimes().size());
+  EXPECT_EQ(static_cast<size_t>(1), costs[0]->getJacobianEvaluations());
+
+  robot_calibration::ErrorBlockProfile profile =
+    robot_calibration::summarizeProfile("block", "magnetometer", costs);
+  EXPECT_EQ("block", profile.name);
+  EXPECT_EQ("magnetometer", profile.type);
+  EXPECT_EQ(static_cast<size_t>(2), profile.num_blocks);
+  EXPECT_EQ(static_cast<size_t>(2), profile.num_residuals);
+  EXPECT_EQ(static_cast<size_t>(3), profile.evaluations);
+  EXPECT_EQ(static_cast<size_t>(1), profile.jacobian_evaluations);
+  EXPECT_LE(profile.median_time, profile.p90_time);
+  EXPECT_LE(profile.p90_time, profile.p99_time);
+  EXPECT_LE(profile.p99_time, profile.max_time);
+  EXPECT_LE(profile.max_time, profile.total_time);
+}
+
+TEST(ProfilerTests, test_empty_profile)
+{
+  std::vector<ProfiledCostFunctionPtr> costs;
+  robot_calibration::ErrorBlockProfile profile =
+    robot_calibration::summarizeProfile("block", "magnetometer", costs);
+  EXPECT_EQ(static_cast<size_t>(0), profile.num_blocks);
+  EXPECT_EQ(static_cast<size_t>(0), profile.evaluations);
+  EXPECT_EQ(0.0, profile.total_time);
+  EXPECT_EQ(0.0, profile.max_time);
+}
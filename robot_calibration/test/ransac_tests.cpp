@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <cmath>
+#include <random>
+#include <gtest/gtest.h>
+#include <robot_calibration/util/ransac.hpp>
+
+using robot_calibration::PlaneRansac;
+
+// Points on the plane z = 1 (the ground), and on the plane x = 2 (a wall)
+PlaneRansac::Points makeCloud(int ground, int wall)
+{
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> dist(-1.0, 1.0);
+  PlaneRansac::Points points(ground + wall, 3);
+  for (int i = 0; i < ground; ++i)
+  {
+    points.row(i) << dist(gen), dist(gen), 1.0 + 0.001 * dist(gen);
+  }
+  for (int i = ground; i < ground + wall; ++i)
+  {
+    points.row(i) << 2.0 + 0.001 * dist(gen), dist(gen), dist(gen);
+  }
+  return points;
+}
+
+TEST(RansacTests, test_fit)
+{
+  PlaneRansac::Points points = makeCloud(700, 300);
+
+  PlaneRansac::Params params;
+  params.sample_size = 3;
+  params.tolerance = 0.01;
+  params.confidence = 0.0;
+
+  Eigen::Vector3d normal;
+  double d;
+  PlaneRansac ransac(params);
+  ASSERT_TRUE(ransac.fit(points, normal, d));
+  EXPECT_EQ(params.iterations, ransac.getIterations());
+  EXPECT_NEAR(1.0, std::fabs(normal(2)), 1e-3);
+  EXPECT_NEAR(1.0, std::fabs(d), 1e-3);
+  EXPECT_EQ(static_cast<size_t>(700), PlaneRansac::countInliers(points, normal, d, params.tolerance));
+
+  // Constrain the normal to find the wall instead
+  params.desired_normal = Eigen::Vector3d(1.0, 0.0, 0.0);
+  params.cos_normal_angle = std::cos(0.1);
+  PlaneRansac constrained(params);
+  ASSERT_TRUE(constrained.fit(points, normal, d));
+  EXPECT_NEAR(1.0, std::fabs(normal(0)), 1e-3);
+  EXPECT_NEAR(2.0, std::fabs(d), 1e-3);
+  EXPECT_EQ(static_cast<size_t>(300), PlaneRansac::countInliers(points, normal, d, params.tolerance));
+
+  // No plane is aligned with this
+  params.desired_normal = Eigen::Vector3d(1.0, 1.0, 1.0);
+  PlaneRansac impossible(params);
+  EXPECT_FALSE(impossible.fit(points, normal, d));
+}
+
+TEST(RansacTests, test_deterministic)
+{
+  PlaneRansac::Points points = makeCloud(500, 500);
+
+  PlaneRansac::Params params;
+  params.sample_size = 3;
+  params.tolerance = 0.01;
+  params.seed = 42;
+
+  Eigen::Vector3d expected_normal;
+  double expected_d;
+  PlaneRansac ransac(params);
+  ASSERT_TRUE(ransac.fit(points, expected_normal, expected_d));
+  int expected_iterations = ransac.getIterations();
+
+  // Same seed gives the same result on any number of threads
+  for (int threads = 1; threads <= 8; threads *= 2)
+  {
+    params.num_threads = threads;
+    PlaneRansac parallel(params);
+    Eigen::Vector3d normal;
+    double d;
+    ASSERT_TRUE(parallel.fit(points, normal, d));
+    EXPECT_EQ(expected_normal, normal);
+    EXPECT_EQ(expected_d, d);
+    EXPECT_EQ(expected_iterations, parallel.getIterations());
+  }
+}
+
+TEST(RansacTests, test_early_termination)
+{
+  // With no outliers, a single batch of hypotheses is enough
+  PlaneRansac::Points points = makeCloud(1000, 0);
+
+  PlaneRansac::Params params;
+  params.sample_size = 3;
+  params.tolerance = 0.01;
+  params.iterations = 1000;
+  params.confidence = 0.99;
+
+  Eigen::Vector3d normal;
+  double d;
+  PlaneRansac ransac(params);
+  ASSERT_TRUE(ransac.fit(points, normal, d));
+  EXPECT_LT(ransac.getIterations(), params.iterations);
+  EXPECT_NEAR(1.0, std::fabs(normal(2)), 1e-3);
+}
+
+TEST(RansacTests, test_too_few_points)
+{
+  PlaneRansac::Points points(2, 3);
+  points.setZero();
+
+  Eigen::Vector3d normal;
+  double d;
+  PlaneRansac ransac((PlaneRansac::Params()));
+  EXPECT_FALSE(ransac.fit(points, normal, d));
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include <robot_calibration/optimization/residual_report.hpp>
+
+using robot_calibration::SampleResiduals;
+
+TEST(ResidualReportTests, test_statistics)
+{
+  // Two points of chain3d_to_chain3d, interleaved x, y, z
+  double residuals[6] = {1.0, 0.0, -2.0, 3.0, 0.0, 2.0};
+  double rms, max;
+  std::vector<double> axis_rms;
+  robot_calibration::computeResidualStatistics(residuals, 6, 3, rms, max, axis_rms);
+
+  EXPECT_NEAR(std::sqrt(18.0 / 6.0), rms, 1e-12);
+  EXPECT_DOUBLE_EQ(3.0, max);
+  ASSERT_EQ(3u, axis_rms.size());
+  EXPECT_NEAR(std::sqrt(5.0), axis_rms[0], 1e-12);
+  EXPECT_DOUBLE_EQ(0.0, axis_rms[1]);
+  EXPECT_NEAR(2.0, axis_rms[2], 1e-12);
+
+  // No residuals
+  robot_calibration::computeResidualStatistics(residuals, 0, 1, rms, max, axis_rms);
+  EXPECT_DOUBLE_EQ(0.0, rms);
+  EXPECT_DOUBLE_EQ(0.0, max);
+  ASSERT_EQ(1u, axis_rms.size());
+  EXPECT_DOUBLE_EQ(0.0, axis_rms[0]);
+}
+
+TEST(ResidualReportTests, test_axes)
+{
+  EXPECT_EQ(3u, robot_calibration::getResidualAxes("chain3d_to_chain3d").size());
+  EXPECT_EQ(2u, robot_calibration::getResidualAxes("chain3d_to_camera2d").size());
+  EXPECT_EQ(4u, robot_calibration::getResidualAxes("plane_to_plane").size());
+  EXPECT_EQ(1u, robot_calibration::getResidualAxes("chain3d_to_plane").size());
+  EXPECT_EQ(1u, robot_calibration::getResidualAxes("chain3d_to_mesh").size());
+}
+
+static SampleResiduals makeResiduals(size_t sample, const std::string& name,
+                                     const std::string& type, double initial, double final)
+{
+  SampleResiduals r;
+  r.sample = sample;
+  r.name = name;
+  r.type = type;
+  r.num_residuals = 3 * robot_calibration::getResidualAxes(type).size();
+  r.initial_rms = r.initial_max = initial;
+  r.final_rms = r.final_max = final;
+  r.initial_axis_rms.assign(robot_calibration::getResidualAxes(type).size(), initial);
+  r.final_axis_rms.assign(robot_calibration::getResidualAxes(type).size(), final);
+  return r;
+}
+
+TEST(ResidualReportTests, test_write_report)
+{
+  std::vector<SampleResiduals> report;
+  report.push_back(makeResiduals(0, "led", "chain3d_to_chain3d", 0.5, 0.25));
+  report.push_back(makeResiduals(0, "ground", "chain3d_to_plane", 0.5, 0.125));
+
+  std::string filename = ::testing::TempDir() + "residual_report_tests.csv";
+  ASSERT_TRUE(robot_calibration::writeResidualReport(filename, report));
+
+  std::ifstream file(filename);
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(file, line))
+  {
+    lines.push_back(line);
+  }
+  ASSERT_EQ(3u, lines.size());
+  EXPECT_EQ("sample,name,type,num_residuals,initial_rms,initial_max,final_rms,final_max,"
+            "x_initial_rms,x_final_rms,y_initial_rms,y_final_rms,"
+            "z_initial_rms,z_final_rms,d_initial_rms,d_final_rms", lines[0]);
+  EXPECT_EQ("0,led,chain3d_to_chain3d,9,0.5,0.5,0.25,0.25,0.5,0.25,0.5,0.25,0.5,0.25,,", lines[1]);
+  EXPECT_EQ("0,ground,chain3d_to_plane,3,0.5,0.5,0.125,0.125,,,,,,,0.5,0.125", lines[2]);
+  std::remove(filename.c_str());
+
+  EXPECT_FALSE(robot_calibration::writeResidualReport("/nonexistent/report.csv", report));
+}
+
+TEST(ResidualReportTests, test_summary)
+{
+  std::vector<SampleResiduals> report;
+  report.push_back(makeResiduals(0, "led", "chain3d_to_chain3d", 1.0, 0.5));
+  report.push_back(makeResiduals(1, "led", "chain3d_to_chain3d", 1.0, 2.0));
+
+  std::stringstream out;
+  robot_calibration::printResidualSummary(out, report);
+  std::string summary = out.str();
+  EXPECT_NE(std::string::npos, summary.find("led: 2 samples"));
+  EXPECT_NE(std::string::npos, summary.find("worst sample 1"));
+}
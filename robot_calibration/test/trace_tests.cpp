@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2023 Michael Ferguson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Author: Michael Ferguson
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <gtest/gtest.h>
+#include <robot_calibration/util/trace.hpp>
+
+using robot_calibration::Tracer;
+using robot_calibration::TraceSpan;
+
+TEST(TraceTests, test_disabled)
+{
+  Tracer& tracer = Tracer::get();
+  tracer.open("");
+  tracer.close();
+  {
+    TraceSpan span("move");
+  }
+  EXPECT_EQ(0u, tracer.getNumSpans());
+}
+
+TEST(TraceTests, test_poses)
+{
+  Tracer& tracer = Tracer::get();
+  tracer.open("");
+  tracer.setPose(0);
+  {
+    TraceSpan span("move");
+  }
+  {
+    TraceSpan span("find", "plane");
+  }
+  tracer.setPose(1);
+  {
+    TraceSpan span("move");
+    // Work on the previous pose, while the robot moves
+    std::thread thread([]()
+    {
+      Tracer::PoseScope scope(0);
+      TraceSpan span("extract", "plane");
+    });
+    thread.join();
+  }
+  tracer.setPose(-1);
+  {
+    TraceSpan span("optimize");
+  }
+  tracer.close();
+  EXPECT_EQ(5u, tracer.getNumSpans());
+
+  std::string summary = tracer.getSummary();
+  EXPECT_NE(std::string::npos, summary.find("find/plane"));
+  EXPECT_NE(std::string::npos, summary.find("optimize"));
+
+  // Pose lines list the spans of each pose only
+  std::stringstream ss(summary);
+  std::string line, pose0, pose1;
+  while (std::getline(ss, line))
+  {
+    if (line.rfind("pose 0:", 0) == 0)
+      pose0 = line;
+    if (line.rfind("pose 1:", 0) == 0)
+      pose1 = line;
+  }
+  EXPECT_NE(std::string::npos, pose0.find("move"));
+  EXPECT_NE(std::string::npos, pose0.find("find/plane"));
+  EXPECT_NE(std::string::npos, pose0.find("extract/plane"));
+  EXPECT_NE(std::string::npos, pose1.find("move"));
+  EXPECT_EQ(std::string::npos, pose1.find("plane"));
+  EXPECT_EQ(std::string::npos, summary.find("pose -1"));
+}
+
+TEST(TraceTests, test_write)
+{
+  std::string file_name = testing::TempDir() + "trace_tests.json";
+  Tracer& tracer = Tracer::get();
+  tracer.open(file_name);
+  {
+    TraceSpan span("capture");
+  }
+  EXPECT_TRUE(tracer.close());
+
+  std::ifstream file(file_name);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  EXPECT_NE(std::string::npos, contents.str().find("\"traceEvents\""));
+  EXPECT_NE(std::string::npos, contents.str().find("\"name\": \"capture\""));
+  std::remove(file_name.c_str());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}